@@ -27,11 +27,71 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
+#include "qemu/coroutine-tls.h"
 #include "system/qtest.h"
 
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
 static const int qtest_latency_ns = NANOSECONDS_PER_SECOND / 1000;
 
+/* Shard of the current thread plus one, or 0 if none was assigned yet */
+QEMU_DEFINE_STATIC_CO_TLS(unsigned, acct_shard_idx)
+static unsigned acct_next_shard_idx;
+
+static BlockAcctShard *block_acct_get_shard(BlockAcctStats *stats)
+{
+    unsigned idx = get_acct_shard_idx();
+    BlockAcctShard *shard, *old;
+
+    if (unlikely(!idx)) {
+        idx = qatomic_fetch_inc(&acct_next_shard_idx) % BLOCK_ACCT_MAX_SHARDS;
+        set_acct_shard_idx(++idx);
+    }
+
+    shard = qatomic_load_acquire(&stats->shards[idx - 1]);
+    if (unlikely(!shard)) {
+        shard = g_new0(BlockAcctShard, 1);
+        old = qatomic_cmpxchg(&stats->shards[idx - 1], NULL, shard);
+        if (old) {
+            g_free(shard);
+            shard = old;
+        }
+    }
+    return shard;
+}
+
+static int block_acct_latency_bucket(int64_t latency_ns)
+{
+    uint64_t v = MAX(latency_ns, 0);
+    int e;
+
+    v = MIN(v, (1ULL << BLOCK_ACCT_HIST_MAX_BITS) - 1);
+
+    if (v < (1 << BLOCK_ACCT_HIST_SUB_BITS)) {
+        return v;
+    }
+
+    e = 63 - clz64(v);
+    return ((e - BLOCK_ACCT_HIST_SUB_BITS + 1) << BLOCK_ACCT_HIST_SUB_BITS) |
+           ((v >> (e - BLOCK_ACCT_HIST_SUB_BITS)) &
+            ((1 << BLOCK_ACCT_HIST_SUB_BITS) - 1));
+}
+
+/* Return the smallest latency that is accounted in @bucket */
+uint64_t block_acct_latency_bucket_min(int bucket)
+{
+    int e, m;
+
+    assert(bucket >= 0 && bucket < BLOCK_ACCT_HIST_BUCKETS);
+    if (bucket < (1 << BLOCK_ACCT_HIST_SUB_BITS)) {
+        return bucket;
+    }
+
+    e = (bucket >> BLOCK_ACCT_HIST_SUB_BITS) + BLOCK_ACCT_HIST_SUB_BITS - 1;
+    m = bucket & ((1 << BLOCK_ACCT_HIST_SUB_BITS) - 1);
+    return (1ULL << e) | ((uint64_t)m << (e - BLOCK_ACCT_HIST_SUB_BITS));
+}
+
 void block_acct_init(BlockAcctStats *stats)
 {
     qemu_mutex_init(&stats->lock);
@@ -68,9 +128,14 @@ void block_acct_setup(BlockAcctStats *stats, enum OnOffAuto account_invalid,
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    int i;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    for (i = 0; i < BLOCK_ACCT_MAX_SHARDS; i++) {
+        g_free(stats->shards[i]);
+    }
     qemu_mutex_destroy(&stats->lock);
 }
 
@@ -89,6 +154,7 @@ void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
         timed_average_init(&s->latency[i], clock_type,
                            (uint64_t) interval_length * NANOSECONDS_PER_SECOND);
     }
+    qatomic_set(&stats->need_lock, true);
     qemu_mutex_unlock(&stats->lock);
 }
 
@@ -173,6 +239,8 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
         prev = entry->value;
     }
 
+    QEMU_LOCK_GUARD(&stats->lock);
+
     hist->nbins = new_nbins;
     g_free(hist->boundaries);
     hist->boundaries = g_new(uint64_t, hist->nbins - 1);
@@ -184,6 +252,7 @@ int block_latency_histogram_set(BlockAcctStats *stats, enum BlockAcctType type,
 
     g_free(hist->bins);
     hist->bins = g_new0(uint64_t, hist->nbins);
+    qatomic_set(&stats->need_lock, true);
 
     return 0;
 }
@@ -192,18 +261,22 @@ void block_latency_histograms_clear(BlockAcctStats *stats)
 {
     int i;
 
+    QEMU_LOCK_GUARD(&stats->lock);
+
     for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
         BlockLatencyHistogram *hist = &stats->latency_histogram[i];
         g_free(hist->bins);
         g_free(hist->boundaries);
         memset(hist, 0, sizeof(*hist));
     }
+    qatomic_set(&stats->need_lock, !QSLIST_EMPTY(&stats->intervals));
 }
 
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
     BlockAcctTimedStats *s;
+    BlockAcctShard *shard;
     int64_t time_ns = qemu_clock_get_ns(clock_type);
     int64_t latency_ns = time_ns - cookie->start_time_ns;
 
@@ -217,23 +290,31 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
         return;
     }
 
-    WITH_QEMU_LOCK_GUARD(&stats->lock) {
-        if (failed) {
-            stats->failed_ops[cookie->type]++;
-        } else {
-            stats->nr_bytes[cookie->type] += cookie->bytes;
-            stats->nr_ops[cookie->type]++;
-        }
+    shard = block_acct_get_shard(stats);
+    if (failed) {
+        stat64_add(&shard->failed_ops[cookie->type], 1);
+    } else {
+        stat64_add(&shard->nr_bytes[cookie->type], cookie->bytes);
+        stat64_add(&shard->nr_ops[cookie->type], 1);
+    }
 
-        block_latency_histogram_account(&stats->latency_histogram[cookie->type],
-                                        latency_ns);
+    if (!failed || stats->account_failed) {
+        stat64_add(&shard->total_time_ns[cookie->type], latency_ns);
+        stat64_max(&shard->last_access_time_ns, time_ns);
+        stat64_add(&shard->latency[cookie->type]
+                                  [block_acct_latency_bucket(latency_ns)], 1);
+    }
 
-        if (!failed || stats->account_failed) {
-            stats->total_time_ns[cookie->type] += latency_ns;
-            stats->last_access_time_ns = time_ns;
+    if (qatomic_read(&stats->need_lock)) {
+        WITH_QEMU_LOCK_GUARD(&stats->lock) {
+            block_latency_histogram_account(
+                &stats->latency_histogram[cookie->type], latency_ns);
 
-            QSLIST_FOREACH(s, &stats->intervals, entries) {
-                timed_average_account(&s->latency[cookie->type], latency_ns);
+            if (!failed || stats->account_failed) {
+                QSLIST_FOREACH(s, &stats->intervals, entries) {
+                    timed_average_account(&s->latency[cookie->type],
+                                          latency_ns);
+                }
             }
         }
     }
@@ -253,19 +334,20 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
 
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type)
 {
+    BlockAcctShard *shard;
+
     assert(type < BLOCK_MAX_IOTYPE);
 
     /* block_account_one_io() updates total_time_ns[], but this one does
      * not.  The reason is that invalid requests are accounted during their
      * submission, therefore there's no actual I/O involved.
      */
-    qemu_mutex_lock(&stats->lock);
-    stats->invalid_ops[type]++;
+    shard = block_acct_get_shard(stats);
+    stat64_add(&shard->invalid_ops[type], 1);
 
     if (stats->account_invalid) {
-        stats->last_access_time_ns = qemu_clock_get_ns(clock_type);
+        stat64_max(&shard->last_access_time_ns, qemu_clock_get_ns(clock_type));
     }
-    qemu_mutex_unlock(&stats->lock);
 }
 
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
@@ -273,14 +355,68 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
 {
     assert(type < BLOCK_MAX_IOTYPE);
 
-    qemu_mutex_lock(&stats->lock);
-    stats->merged[type] += num_requests;
-    qemu_mutex_unlock(&stats->lock);
+    stat64_add(&block_acct_get_shard(stats)->merged[type], num_requests);
+}
+
+/*
+ * Sum up the counters of all shards.  Requests that are accounted
+ * concurrently may or may not be included.
+ */
+void block_acct_get_counters(BlockAcctStats *stats, BlockAcctCounters *c)
+{
+    int i, type;
+
+    memset(c, 0, sizeof(*c));
+
+    for (i = 0; i < BLOCK_ACCT_MAX_SHARDS; i++) {
+        BlockAcctShard *shard = qatomic_load_acquire(&stats->shards[i]);
+
+        if (!shard) {
+            continue;
+        }
+
+        for (type = 0; type < BLOCK_MAX_IOTYPE; type++) {
+            c->nr_bytes[type] += stat64_get(&shard->nr_bytes[type]);
+            c->nr_ops[type] += stat64_get(&shard->nr_ops[type]);
+            c->invalid_ops[type] += stat64_get(&shard->invalid_ops[type]);
+            c->failed_ops[type] += stat64_get(&shard->failed_ops[type]);
+            c->total_time_ns[type] += stat64_get(&shard->total_time_ns[type]);
+            c->merged[type] += stat64_get(&shard->merged[type]);
+        }
+        c->last_access_time_ns = MAX(c->last_access_time_ns,
+                                     stat64_get(&shard->last_access_time_ns));
+    }
+}
+
+/* Sum up the log-linear latency histogram of @type over all shards */
+void block_acct_get_latency_buckets(BlockAcctStats *stats,
+                                    enum BlockAcctType type,
+                                    uint64_t buckets[BLOCK_ACCT_HIST_BUCKETS])
+{
+    int i, j;
+
+    assert(type < BLOCK_MAX_IOTYPE);
+    memset(buckets, 0, BLOCK_ACCT_HIST_BUCKETS * sizeof(buckets[0]));
+
+    for (i = 0; i < BLOCK_ACCT_MAX_SHARDS; i++) {
+        BlockAcctShard *shard = qatomic_load_acquire(&stats->shards[i]);
+
+        if (!shard) {
+            continue;
+        }
+
+        for (j = 0; j < BLOCK_ACCT_HIST_BUCKETS; j++) {
+            buckets[j] += stat64_get(&shard->latency[type][j]);
+        }
+    }
 }
 
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
-    return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
+    BlockAcctCounters c;
+
+    block_acct_get_counters(stats, &c);
+    return qemu_clock_get_ns(clock_type) - c.last_access_time_ns;
 }
 
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
@@ -22,6 +22,8 @@
 
 #include "block/block_int.h"
 #include "block/qdict.h"
+#include "block/aio_task.h"
+#include "block/thread-pool.h"
 #include "system/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -36,10 +38,18 @@
 
 typedef struct BlockCrypto BlockCrypto;
 
+/* Number of bounce buffers kept for reuse, see block_crypto_get_bounce() */
+#define BLOCK_CRYPTO_MAX_FREE_BOUNCE 4
+
 struct BlockCrypto {
     QCryptoBlock *block;
     bool updating_keys;
     BdrvChild *header;  /* Reference to the detached LUKS header */
+
+    /* BLOCK_CRYPTO_MAX_IO_SIZE buffers, protected by bounce_lock */
+    QemuMutex bounce_lock;
+    void *free_bounce[BLOCK_CRYPTO_MAX_FREE_BOUNCE];
+    int nb_free_bounce;
 };
 
 
@@ -321,6 +331,8 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
 
     GLOBAL_STATE_CODE();
 
+    qemu_mutex_init(&crypto->bounce_lock);
+
     ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
     if (ret < 0) {
         return ret;
@@ -450,6 +462,11 @@ block_crypto_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
 static void block_crypto_close(BlockDriverState *bs)
 {
     BlockCrypto *crypto = bs->opaque;
+
+    while (crypto->nb_free_bounce) {
+        qemu_vfree(crypto->free_bounce[--crypto->nb_free_bounce]);
+    }
+    qemu_mutex_destroy(&crypto->bounce_lock);
     qcrypto_block_free(crypto->block);
 }
 
@@ -466,6 +483,143 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
+/*
+ * Encryption and decryption run in the thread pool.  Each bounce buffer is
+ * split into at most BLOCK_CRYPTO_MAX_THREADS slices that are processed in
+ * parallel; smaller slices than BLOCK_CRYPTO_MIN_SLICE are not worth the
+ * extra thread hand-off.
+ */
+#define BLOCK_CRYPTO_MAX_THREADS 4
+#define BLOCK_CRYPTO_MIN_SLICE (64 * 1024)
+
+/*
+ * Return a bounce buffer of @size bytes, which is at most
+ * BLOCK_CRYPTO_MAX_IO_SIZE because requests are processed in pieces of that
+ * size.  Buffers of this full size are recycled between requests instead of
+ * being mmap()ed and munmap()ed by the allocator each time; smaller ones are
+ * cheap to allocate from the heap.
+ */
+static void *block_crypto_get_bounce(BlockDriverState *bs, uint64_t size)
+{
+    BlockCrypto *crypto = bs->opaque;
+
+    if (size < BLOCK_CRYPTO_MAX_IO_SIZE) {
+        return qemu_try_blockalign(bs->file->bs, size);
+    }
+
+    WITH_QEMU_LOCK_GUARD(&crypto->bounce_lock) {
+        if (crypto->nb_free_bounce) {
+            return crypto->free_bounce[--crypto->nb_free_bounce];
+        }
+    }
+    return qemu_try_blockalign(bs->file->bs, BLOCK_CRYPTO_MAX_IO_SIZE);
+}
+
+static void block_crypto_put_bounce(BlockDriverState *bs, void *buf,
+                                    uint64_t size)
+{
+    BlockCrypto *crypto = bs->opaque;
+
+    if (!buf) {
+        return;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&crypto->bounce_lock) {
+        if (size == BLOCK_CRYPTO_MAX_IO_SIZE &&
+            crypto->nb_free_bounce < BLOCK_CRYPTO_MAX_FREE_BOUNCE) {
+            crypto->free_bounce[crypto->nb_free_bounce++] = buf;
+            return;
+        }
+    }
+    qemu_vfree(buf);
+}
+
+/*
+ * BlockCryptoEncDecFunc: common prototype of qcrypto_block_encrypt() and
+ * qcrypto_block_decrypt() functions.
+ */
+typedef int (*BlockCryptoEncDecFunc)(QCryptoBlock *block, uint64_t offset,
+                                     uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoEncDecTask {
+    AioTask task;
+
+    QCryptoBlock *block;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+
+    BlockCryptoEncDecFunc func;
+} BlockCryptoEncDecTask;
+
+static int block_crypto_encdec_pool_func(void *opaque)
+{
+    BlockCryptoEncDecTask *t = opaque;
+
+    return t->func(t->block, t->offset, t->buf, t->len, NULL);
+}
+
+static int coroutine_fn block_crypto_encdec_task_entry(AioTask *task)
+{
+    return thread_pool_submit_co(block_crypto_encdec_pool_func, task);
+}
+
+/*
+ * Encrypt or decrypt @len bytes of @buf, which belong to guest offset
+ * @offset, spreading the work over several threads of the thread pool.
+ */
+static int coroutine_fn
+block_crypto_co_encdec(BlockCrypto *crypto, uint64_t offset, uint8_t *buf,
+                       size_t len, BlockCryptoEncDecFunc func)
+{
+    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
+    size_t slice;
+    AioTaskPool *pool;
+    int ret;
+
+    slice = QEMU_ALIGN_UP(DIV_ROUND_UP(len, BLOCK_CRYPTO_MAX_THREADS),
+                          sector_size);
+    slice = MAX(slice, BLOCK_CRYPTO_MIN_SLICE);
+
+    if (len <= slice) {
+        BlockCryptoEncDecTask t = {
+            .block = crypto->block,
+            .offset = offset,
+            .buf = buf,
+            .len = len,
+            .func = func,
+        };
+
+        ret = thread_pool_submit_co(block_crypto_encdec_pool_func, &t);
+        return ret < 0 ? -EIO : 0;
+    }
+
+    pool = aio_task_pool_new(BLOCK_CRYPTO_MAX_THREADS);
+    while (len && aio_task_pool_status(pool) == 0) {
+        size_t cur_len = MIN(len, slice);
+        BlockCryptoEncDecTask *t = g_new(BlockCryptoEncDecTask, 1);
+
+        *t = (BlockCryptoEncDecTask) {
+            .task.func = block_crypto_encdec_task_entry,
+            .block = crypto->block,
+            .offset = offset,
+            .buf = buf,
+            .len = cur_len,
+            .func = func,
+        };
+        aio_task_pool_start_task(pool, &t->task);
+
+        offset += cur_len;
+        buf += cur_len;
+        len -= cur_len;
+    }
+    aio_task_pool_wait_all(pool);
+    ret = aio_task_pool_status(pool);
+    aio_task_pool_free(pool);
+
+    return ret < 0 ? -EIO : 0;
+}
+
 static int coroutine_fn GRAPH_RDLOCK
 block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
                        QEMUIOVector *qiov, BdrvRequestFlags flags)
@@ -473,6 +627,7 @@ block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
     BlockCrypto *crypto = bs->opaque;
     uint64_t cur_bytes; /* number of bytes in current iteration */
     uint64_t bytes_done = 0;
+    uint64_t bounce_size = MIN(bytes, BLOCK_CRYPTO_MAX_IO_SIZE);
     uint8_t *cipher_data = NULL;
     QEMUIOVector hd_qiov;
     int ret = 0;
@@ -488,9 +643,7 @@ block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
     /* Bounce buffer because we don't wish to expose cipher text
      * in qiov which points to guest memory.
      */
-    cipher_data =
-        qemu_try_blockalign(bs->file->bs, MIN(BLOCK_CRYPTO_MAX_IO_SIZE,
-                                              qiov->size));
+    cipher_data = block_crypto_get_bounce(bs, bounce_size);
     if (cipher_data == NULL) {
         ret = -ENOMEM;
         goto cleanup;
@@ -508,9 +661,10 @@ block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
             goto cleanup;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec(crypto, offset + bytes_done,
+                                     cipher_data, cur_bytes,
+                                     qcrypto_block_decrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -522,7 +676,7 @@ block_crypto_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
  cleanup:
     qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cipher_data);
+    block_crypto_put_bounce(bs, cipher_data, bounce_size);
 
     return ret;
 }
@@ -535,6 +689,7 @@ block_crypto_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
     BlockCrypto *crypto = bs->opaque;
     uint64_t cur_bytes; /* number of bytes in current iteration */
     uint64_t bytes_done = 0;
+    uint64_t bounce_size = MIN(bytes, BLOCK_CRYPTO_MAX_IO_SIZE);
     uint8_t *cipher_data = NULL;
     QEMUIOVector hd_qiov;
     int ret = 0;
@@ -552,9 +707,7 @@ block_crypto_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
     /* Bounce buffer because we're not permitted to touch
      * contents of qiov - it points to guest memory.
      */
-    cipher_data =
-        qemu_try_blockalign(bs->file->bs, MIN(BLOCK_CRYPTO_MAX_IO_SIZE,
-                                              qiov->size));
+    cipher_data = block_crypto_get_bounce(bs, bounce_size);
     if (cipher_data == NULL) {
         ret = -ENOMEM;
         goto cleanup;
@@ -565,9 +718,10 @@ block_crypto_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
         qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
 
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
+        ret = block_crypto_co_encdec(crypto, offset + bytes_done,
+                                     cipher_data, cur_bytes,
+                                     qcrypto_block_encrypt);
+        if (ret < 0) {
             goto cleanup;
         }
 
@@ -586,7 +740,7 @@ block_crypto_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
 
  cleanup:
     qemu_iovec_destroy(&hd_qiov);
-    qemu_vfree(cipher_data);
+    block_crypto_put_bounce(bs, cipher_data, bounce_size);
 
     return ret;
 }
@@ -81,6 +81,8 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
     BlockDriverState *bs;
     BlockBackend *blk = NULL;
     AioContext *ctx;
+    AioContext **multithread_ctxs = NULL;
+    size_t mt_count = 0;
     uint64_t perm;
     int ret;
 
@@ -121,14 +123,46 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         AioContext *new_ctx;
         Error **set_context_errp;
 
-        iothread = iothread_by_id(export->iothread);
-        if (!iothread) {
-            error_setg(errp, "iothread \"%s\" not found", export->iothread);
-            goto fail;
+        if (export->iothread->type == QTYPE_QLIST) {
+            strList *node;
+
+            if (!drv->supports_multithread) {
+                error_setg(errp, "The %s export type does not support "
+                           "multi-threading",
+                           BlockExportType_str(export->type));
+                goto fail;
+            }
+            if (!export->iothread->u.multi) {
+                error_setg(errp, "The set of I/O threads must not be empty");
+                goto fail;
+            }
+
+            for (node = export->iothread->u.multi; node; node = node->next) {
+                iothread = iothread_by_id(node->value);
+                if (!iothread) {
+                    error_setg(errp, "iothread \"%s\" not found",
+                               node->value);
+                    goto fail;
+                }
+                multithread_ctxs = g_renew(AioContext *, multithread_ctxs,
+                                           mt_count + 1);
+                multithread_ctxs[mt_count++] =
+                    iothread_get_aio_context(iothread);
+            }
+
+            /* The block node is moved to the first I/O thread */
+            new_ctx = multithread_ctxs[0];
+        } else {
+            iothread = iothread_by_id(export->iothread->u.single);
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found",
+                           export->iothread->u.single);
+                goto fail;
+            }
+
+            new_ctx = iothread_get_aio_context(iothread);
         }
 
-        new_ctx = iothread_get_aio_context(iothread);
-
         /* Ignore errors with fixed-iothread=false */
         set_context_errp = fixed_iothread ? errp : NULL;
         ret = bdrv_try_change_aio_context(bs, new_ctx, NULL, set_context_errp);
@@ -195,7 +229,7 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
         .blk        = blk,
     };
 
-    ret = drv->create(exp, export, errp);
+    ret = drv->create(exp, export, multithread_ctxs, mt_count, errp);
     if (ret < 0) {
         goto fail;
     }
@@ -203,9 +237,11 @@ BlockExport *blk_exp_add(BlockExportOptions *export, Error **errp)
     assert(exp->blk != NULL);
 
     QLIST_INSERT_HEAD(&block_exports, exp, next);
+    g_free(multithread_ctxs);
     return exp;
 
 fail:
+    g_free(multithread_ctxs);
     if (blk) {
         blk_set_dev_ops(blk, NULL, NULL);
         blk_unref(blk);
@@ -27,12 +27,19 @@
 #include "block/qapi.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 #include "system/block-backend.h"
 
+#include <sys/ioctl.h>
 #include <fuse.h>
 #include <fuse_lowlevel.h>
 
+#include "standard-headers/linux/fuse.h"
+
 #if defined(CONFIG_FALLOCATE_ZERO_RANGE)
 #include <linux/falloc.h>
 #endif
@@ -44,27 +51,116 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/* Largest write request we accept, announced to the kernel in FUSE_INIT */
+#define FUSE_MAX_WRITE_BYTES (1 * MiB)
+
+/* Number of asynchronous requests (reads, direct I/O) the kernel may queue */
+#define FUSE_MAX_BACKGROUND 256
+
+/*
+ * Size of a queue's request buffer: The kernel refuses to read requests into
+ * buffers that could not hold a maximum-sized write request.
+ */
+#define FUSE_REQUEST_BUF_SIZE \
+    MAX(FUSE_MIN_READ_BUFFER, \
+        sizeof(struct fuse_in_header) + sizeof(struct fuse_write_in) + \
+        FUSE_MAX_WRITE_BYTES)
+
+typedef struct FuseExport FuseExport;
+
+/*
+ * One FUSE device file descriptor and the AioContext in which requests read
+ * from it are processed.  Replies must be written to the same file
+ * descriptor that the request was read from.
+ */
+typedef struct FuseQueue {
+    FuseExport *exp;
+
+    AioContext *ctx;
+    int fuse_fd;
 
-typedef struct FuseExport {
+    /*
+     * Buffer for the request last read from fuse_fd.  Only valid until the
+     * coroutine processing it yields for the first time, so that coroutine
+     * must copy everything it needs before.
+     */
+    char *request_buf;
+    size_t request_len;
+} FuseQueue;
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     unsigned int in_flight; /* atomic */
     bool mounted, fd_handler_set_up;
 
+    /*
+     * Set when the FUSE device was found to be unusable (usually because the
+     * export was unmounted); no more requests are read then.  Atomic.
+     */
+    bool halted;
+
+    /*
+     * Queue 0 uses the FUSE session's file descriptor, all others use clones
+     * of it (FUSE_DEV_IOC_CLONE), so the kernel distributes requests among
+     * them.
+     */
+    int num_queues;
+    FuseQueue *queues;
+    /*
+     * True if the queue follows the AioContext of the block node.  False if
+     * the user explicitly configured the I/O threads to use, which are then
+     * kept.
+     */
+    bool follow_aio_context;
+
     char *mountpoint;
     bool writable;
     bool growable;
+    /*
+     * Serializes resizing the image, so that requests in different queues
+     * that grow it cannot shrink it again
+     */
+    CoMutex resize_lock;
     /* Whether allow_other was used as a mount option or not */
     bool allow_other;
 
+    /*
+     * Protects the file attributes below, which FUSE_SETATTR may change in
+     * any queue while FUSE_GETATTR reads them in the others
+     */
+    QemuMutex attr_lock;
     mode_t st_mode;
     uid_t st_uid;
     gid_t st_gid;
-} FuseExport;
+};
+
+/* Request arguments, as far as the export needs them */
+typedef union FuseInArgs {
+    struct fuse_init_in init;
+    struct fuse_setattr_in setattr;
+    struct fuse_read_in read;
+    struct fuse_write_in write;
+    struct fuse_fallocate_in fallocate;
+    struct fuse_lseek_in lseek;
+} FuseInArgs;
+
+typedef union FuseOutArgs {
+    struct fuse_init_out init;
+    struct fuse_attr_out attr;
+    struct fuse_open_out open;
+    struct fuse_write_out write;
+    struct fuse_lseek_out lseek;
+    struct fuse_statfs_out statfs;
+} FuseOutArgs;
 
 static GHashTable *exports;
+
+/*
+ * libfuse is only used for mounting and unmounting; requests are processed
+ * by the export itself, see co_fuse_process_request()
+ */
 static const struct fuse_lowlevel_ops fuse_ops;
 
 static void fuse_export_shutdown(BlockExport *exp);
@@ -74,32 +170,51 @@ static void init_exports_table(void);
 
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              bool allow_other, Error **errp);
-static void read_from_fuse_export(void *opaque);
+static void read_from_fuse_fd(void *opaque);
 
 static bool is_regular_file(const char *path, Error **errp);
 
 
+static void fuse_export_set_fd_handlers(FuseExport *exp, bool enable)
+{
+    int i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        if (q->fuse_fd < 0) {
+            continue;
+        }
+        aio_set_fd_handler(q->ctx, q->fuse_fd,
+                           enable ? read_from_fuse_fd : NULL,
+                           NULL, NULL, NULL, enable ? q : NULL);
+    }
+    exp->fd_handler_set_up = enable;
+}
+
 static void fuse_export_drained_begin(void *opaque)
 {
     FuseExport *exp = opaque;
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       NULL, NULL, NULL, NULL, NULL);
-    exp->fd_handler_set_up = false;
+    fuse_export_set_fd_handlers(exp, false);
 }
 
 static void fuse_export_drained_end(void *opaque)
 {
     FuseExport *exp = opaque;
 
+    if (qatomic_read(&exp->halted)) {
+        return;
+    }
+
     /* Refresh AioContext in case it changed */
     exp->common.ctx = blk_get_aio_context(exp->common.blk);
+    if (exp->follow_aio_context) {
+        assert(exp->num_queues == 1);
+        exp->queues[0].ctx = exp->common.ctx;
+    }
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    fuse_export_set_fd_handlers(exp, true);
 }
 
 static bool fuse_export_drained_poll(void *opaque)
@@ -117,14 +232,46 @@ static const BlockDevOps fuse_export_blk_dev_ops = {
 
 static int fuse_export_create(BlockExport *blk_exp,
                               BlockExportOptions *blk_exp_args,
+                              AioContext *const *multithread,
+                              size_t mt_count,
                               Error **errp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
     BlockExportOptionsFuse *args = &blk_exp_args->u.fuse;
+    int i;
     int ret;
 
     assert(blk_exp_args->type == BLOCK_EXPORT_TYPE_FUSE);
 
+    qemu_mutex_init(&exp->attr_lock);
+    qemu_co_mutex_init(&exp->resize_lock);
+
+    if (multithread) {
+        /* Guaranteed by common export code */
+        assert(mt_count >= 1);
+
+        exp->follow_aio_context = false;
+        exp->num_queues = mt_count;
+        exp->queues = g_new(FuseQueue, mt_count);
+        for (i = 0; i < mt_count; i++) {
+            exp->queues[i] = (FuseQueue) {
+                .exp        = exp,
+                .ctx        = multithread[i],
+                .fuse_fd    = -1,
+            };
+        }
+    } else {
+        /* Not multi-threaded, so follow the block node's AioContext */
+        exp->follow_aio_context = true;
+        exp->num_queues = 1;
+        exp->queues = g_new(FuseQueue, 1);
+        exp->queues[0] = (FuseQueue) {
+            .exp        = exp,
+            .ctx        = exp->common.ctx,
+            .fuse_fd    = -1,
+        };
+    }
+
     /* For growable and writable exports, take the RESIZE permission */
     if (args->growable || blk_exp_args->writable) {
         uint64_t blk_perm, blk_shared_perm;
@@ -134,7 +281,7 @@ static int fuse_export_create(BlockExport *blk_exp,
         ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
                            blk_shared_perm, errp);
         if (ret < 0) {
-            return ret;
+            goto fail;
         }
     }
 
@@ -226,7 +373,34 @@ static void init_exports_table(void)
 }
 
 /**
- * Create exp->fuse_session and mount it.
+ * Open a new file descriptor for the FUSE connection that @fd belongs to.
+ * The kernel hands out each request on only one of the connection's file
+ * descriptors, and expects the reply on the same one.
+ */
+static int clone_fuse_fd(int fd, Error **errp)
+{
+    uint32_t src_fd = fd;
+    int new_fd;
+    int ret;
+
+    new_fd = qemu_open("/dev/fuse", O_RDWR, errp);
+    if (new_fd < 0) {
+        return -EIO;
+    }
+
+    ret = ioctl(new_fd, FUSE_DEV_IOC_CLONE, &src_fd);
+    if (ret < 0) {
+        ret = -errno;
+        error_setg_errno(errp, errno, "Failed to clone FUSE device");
+        close(new_fd);
+        return ret;
+    }
+
+    return new_fd;
+}
+
+/**
+ * Create exp->fuse_session and mount it, then set up the queues.
  */
 static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
                              bool allow_other, Error **errp)
@@ -234,11 +408,12 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
     const char *fuse_argv[4];
     char *mount_opts;
     struct fuse_args fuse_args;
+    int i;
     int ret;
 
     /*
-     * max_read needs to match what fuse_init() sets.
-     * max_write need not be supplied.
+     * max_read can only be passed as a mount option, and the kernel limits
+     * reads to max_pages anyway.  max_write is announced in FUSE_INIT.
      */
     mount_opts = g_strdup_printf("max_read=%zu,default_permissions%s",
                                  FUSE_MAX_BOUNCE_BYTES,
@@ -269,10 +444,32 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    exp->queues[0].fuse_fd = fuse_session_fd(exp->fuse_session);
+    for (i = 1; i < exp->num_queues; i++) {
+        ret = clone_fuse_fd(exp->queues[0].fuse_fd, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+        exp->queues[i].fuse_fd = ret;
+    }
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        /*
+         * With several queues, every one of them is woken up for each new
+         * request, but only one can read it
+         */
+        if (!g_unix_set_fd_nonblocking(q->fuse_fd, true, NULL)) {
+            ret = -errno;
+            error_setg_errno(errp, errno, "Failed to make FUSE device "
+                             "non-blocking");
+            goto fail;
+        }
+        q->request_buf = g_malloc(FUSE_REQUEST_BUF_SIZE);
+    }
+
+    fuse_export_set_fd_handlers(exp, true);
 
     return 0;
 
@@ -282,207 +479,179 @@ fail:
 }
 
 /**
- * Callback to be invoked when the FUSE session FD can be read from.
- * (This is basically the FUSE event loop.)
+ * Stop reading requests from the FUSE device, e.g. because it has been
+ * unmounted.  Called in any of the queues' threads.
  */
-static void read_from_fuse_export(void *opaque)
+static void fuse_export_halt(FuseExport *exp)
 {
-    FuseExport *exp = opaque;
-    int ret;
+    int i;
 
-    blk_exp_ref(&exp->common);
-
-    qatomic_inc(&exp->in_flight);
+    qatomic_set(&exp->halted, true);
 
-    do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
-    } while (ret == -EINTR);
-    if (ret < 0) {
-        goto out;
+    for (i = 0; i < exp->num_queues; i++) {
+        aio_set_fd_handler(exp->queues[i].ctx, exp->queues[i].fuse_fd,
+                           NULL, NULL, NULL, NULL, NULL);
     }
-
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
-
-out:
-    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
-        aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
-    }
-
-    blk_exp_unref(&exp->common);
-}
-
-static void fuse_export_shutdown(BlockExport *blk_exp)
-{
-    FuseExport *exp = container_of(blk_exp, FuseExport, common);
-
-    if (exp->fuse_session) {
-        fuse_session_exit(exp->fuse_session);
-
-        if (exp->fd_handler_set_up) {
-            aio_set_fd_handler(exp->common.ctx,
-                               fuse_session_fd(exp->fuse_session),
-                               NULL, NULL, NULL, NULL, NULL);
-            exp->fd_handler_set_up = false;
-        }
-    }
-
-    if (exp->mountpoint) {
-        /*
-         * Safe to drop now, because we will not handle any requests
-         * for this export anymore anyway.
-         */
-        g_hash_table_remove(exports, exp->mountpoint);
-    }
-}
-
-static void fuse_export_delete(BlockExport *blk_exp)
-{
-    FuseExport *exp = container_of(blk_exp, FuseExport, common);
-
-    if (exp->fuse_session) {
-        if (exp->mounted) {
-            fuse_session_unmount(exp->fuse_session);
-        }
-
-        fuse_session_destroy(exp->fuse_session);
-    }
-
-    free(exp->fuse_buf.mem);
-    g_free(exp->mountpoint);
 }
 
 /**
- * Check whether @path points to a regular file.  If not, put an
- * appropriate message into *errp.
+ * Write the reply to a request to the queue's FUSE device.  @ret is either
+ * a negative errno value, or the length of the reply payload in @buf.
  */
-static bool is_regular_file(const char *path, Error **errp)
+static void fuse_write_response(FuseQueue *q, uint64_t unique, ssize_t ret,
+                                const void *buf)
 {
-    struct stat statbuf;
-    int ret;
+    struct fuse_out_header out_hdr = {
+        .unique = unique,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &out_hdr, .iov_len = sizeof(out_hdr) },
+        { .iov_base = (void *)buf, .iov_len = ret > 0 ? ret : 0 },
+    };
+    ssize_t written;
 
-    ret = stat(path, &statbuf);
     if (ret < 0) {
-        error_setg_errno(errp, errno, "Failed to stat '%s'", path);
-        return false;
+        out_hdr.error = ret;
     }
+    out_hdr.len = sizeof(out_hdr) + iov[1].iov_len;
 
-    if (!S_ISREG(statbuf.st_mode)) {
-        error_setg(errp, "'%s' is not a regular file", path);
-        return false;
-    }
+    do {
+        written = writev(q->fuse_fd, iov, iov[1].iov_len ? 2 : 1);
+    } while (written < 0 && errno == EINTR);
 
-    return true;
+    /* ENOENT means that the request has been interrupted in the meantime */
+    if (written < 0 && errno != ENOENT) {
+        error_report("Failed to write FUSE reply: %s", strerror(errno));
+    }
 }
 
 /**
- * A chance to set change some parameters supplied to FUSE_INIT.
+ * Negotiate the protocol and connection parameters with the kernel.
  */
-static void fuse_init(void *userdata, struct fuse_conn_info *conn)
+static ssize_t fuse_init(FuseExport *exp, struct fuse_init_out *out,
+                         const struct fuse_init_in *in)
 {
-    /*
-     * MIN_NON_ZERO() would not be wrong here, but what we set here
-     * must equal what has been passed to fuse_session_new().
-     * Therefore, as long as max_read must be passed as a mount option
-     * (which libfuse claims will be changed at some point), we have
-     * to set max_read to a fixed value here.
-     */
-    conn->max_read = FUSE_MAX_BOUNCE_BYTES;
+    const uint32_t supported_flags = FUSE_ASYNC_READ | FUSE_BIG_WRITES |
+                                     FUSE_AUTO_INVAL_DATA | FUSE_ASYNC_DIO |
+                                     FUSE_MAX_PAGES;
+
+    if (in->major != FUSE_KERNEL_VERSION) {
+        error_report("Unsupported FUSE protocol version %" PRIu32 ".%" PRIu32,
+                     in->major, in->minor);
+        return -EPROTO;
+    }
 
-    conn->max_write = MIN_NON_ZERO(BDRV_REQUEST_MAX_BYTES, conn->max_write);
-}
+    *out = (struct fuse_init_out) {
+        .major                  = FUSE_KERNEL_VERSION,
+        .minor                  = FUSE_KERNEL_MINOR_VERSION,
+        .max_readahead          = in->max_readahead,
+        .flags                  = in->flags & supported_flags,
+        .max_background         = FUSE_MAX_BACKGROUND,
+        .congestion_threshold   = FUSE_MAX_BACKGROUND * 3 / 4,
+        .max_write              = FUSE_MAX_WRITE_BYTES,
+        .time_gran              = 1,
+        .max_pages              = FUSE_MAX_WRITE_BYTES /
+                                  qemu_real_host_page_size(),
+    };
 
-/**
- * Let clients look up files.  Always return ENOENT because we only
- * care about the mountpoint itself.
- */
-static void fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
-{
-    fuse_reply_err(req, ENOENT);
+    return sizeof(*out);
 }
 
 /**
  * Let clients get file attributes (i.e., stat() the file).
  */
-static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
-                         struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_getattr(FuseExport *exp, struct fuse_attr_out *out, uint64_t inode)
 {
-    struct stat statbuf;
     int64_t length, allocated_blocks;
     time_t now = time(NULL);
-    FuseExport *exp = fuse_req_userdata(req);
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
 
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
-    allocated_blocks = bdrv_get_allocated_file_size(blk_bs(exp->common.blk));
+    bdrv_graph_co_rdlock();
+    allocated_blocks =
+        bdrv_co_get_allocated_file_size(blk_bs(exp->common.blk));
+    bdrv_graph_co_rdunlock();
     if (allocated_blocks <= 0) {
         allocated_blocks = DIV_ROUND_UP(length, 512);
     } else {
         allocated_blocks = DIV_ROUND_UP(allocated_blocks, 512);
     }
 
-    statbuf = (struct stat) {
-        .st_ino     = inode,
-        .st_mode    = exp->st_mode,
-        .st_nlink   = 1,
-        .st_uid     = exp->st_uid,
-        .st_gid     = exp->st_gid,
-        .st_size    = length,
-        .st_blksize = blk_bs(exp->common.blk)->bl.request_alignment,
-        .st_blocks  = allocated_blocks,
-        .st_atime   = now,
-        .st_mtime   = now,
-        .st_ctime   = now,
+    WITH_QEMU_LOCK_GUARD(&exp->attr_lock) {
+        mode = exp->st_mode;
+        uid = exp->st_uid;
+        gid = exp->st_gid;
+    }
+
+    *out = (struct fuse_attr_out) {
+        .attr_valid = 1,
+        .attr = {
+            .ino        = inode,
+            .mode       = mode,
+            .nlink      = 1,
+            .uid        = uid,
+            .gid        = gid,
+            .size       = length,
+            .blksize    = blk_bs(exp->common.blk)->bl.request_alignment,
+            .blocks     = allocated_blocks,
+            .atime      = now,
+            .mtime      = now,
+            .ctime      = now,
+        },
     };
 
-    fuse_reply_attr(req, &statbuf, 1.);
+    return sizeof(*out);
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+/*
+ * Only writable exports can be truncated, and those (just like growable
+ * ones) hold the RESIZE permission for their whole lifetime.
+ */
+static int coroutine_fn
+fuse_co_do_truncate(const FuseExport *exp, int64_t size, bool req_zero_write,
+                    PreallocMode prealloc)
 {
-    uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
-    bool add_resize_perm;
-    int ret, ret_check;
 
-    /* Growable and writable exports have a permanent RESIZE permission */
-    add_resize_perm = !exp->growable && !exp->writable;
+    assert(exp->writable);
 
     if (req_zero_write) {
         truncate_flags |= BDRV_REQ_ZERO_WRITE;
     }
 
-    if (add_resize_perm) {
+    return blk_co_truncate(exp->common.blk, size, true, prealloc,
+                           truncate_flags, NULL);
+}
 
-        if (!qemu_in_main_thread()) {
-            /* Changing permissions like below only works in the main thread */
-            return -EPERM;
-        }
+/*
+ * Grow the image to at least @size.  Other requests may grow it at the same
+ * time, so the length is checked again under the lock, and the image is
+ * never shrunk here.
+ */
+static int coroutine_fn
+fuse_co_grow(FuseExport *exp, int64_t size, bool req_zero_write,
+             PreallocMode prealloc)
+{
+    int64_t length;
 
-        blk_get_perm(exp->common.blk, &blk_perm, &blk_shared_perm);
+    QEMU_LOCK_GUARD(&exp->resize_lock);
 
-        ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
-                           blk_shared_perm, NULL);
-        if (ret < 0) {
-            return ret;
-        }
+    length = blk_co_getlength(exp->common.blk);
+    if (length < 0) {
+        return length;
     }
-
-    ret = blk_truncate(exp->common.blk, size, true, prealloc,
-                       truncate_flags, NULL);
-
-    if (add_resize_perm) {
-        /* Must succeed, because we are only giving up the RESIZE permission */
-        ret_check = blk_set_perm(exp->common.blk, blk_perm,
-                                 blk_shared_perm, &error_abort);
-        assert(ret_check == 0);
+    if (size <= length) {
+        return 0;
     }
 
-    return ret;
+    return fuse_co_do_truncate(exp, size, req_zero_write, prealloc);
 }
 
 /**
@@ -493,201 +662,194 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
  * without allow_other cannot be given a different UID or GID, and
  * they cannot be given non-owner access.
  */
-static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
-                         int to_set, struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_setattr(FuseExport *exp, struct fuse_attr_out *out, uint64_t inode,
+                const struct fuse_setattr_in *in)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-    int supported_attrs;
+    uint32_t to_set = in->valid;
+    uint32_t supported_attrs;
     int ret;
 
-    supported_attrs = FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_MODE;
+    /* These only identify the file handle and lock owner, ignore them */
+    to_set &= ~(FATTR_FH | FATTR_LOCKOWNER);
+
+    supported_attrs = FATTR_SIZE | FATTR_MODE;
     if (exp->allow_other) {
-        supported_attrs |= FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID;
+        supported_attrs |= FATTR_UID | FATTR_GID;
     }
 
     if (to_set & ~supported_attrs) {
-        fuse_reply_err(req, ENOTSUP);
-        return;
+        return -ENOTSUP;
     }
 
     /* Do some argument checks first before committing to anything */
-    if (to_set & FUSE_SET_ATTR_MODE) {
+    if (to_set & FATTR_MODE) {
         /*
          * Without allow_other, non-owners can never access the export, so do
          * not allow setting permissions for them
          */
-        if (!exp->allow_other &&
-            (statbuf->st_mode & (S_IRWXG | S_IRWXO)) != 0)
-        {
-            fuse_reply_err(req, EPERM);
-            return;
+        if (!exp->allow_other && (in->mode & (S_IRWXG | S_IRWXO)) != 0) {
+            return -EPERM;
         }
 
         /* +w for read-only exports makes no sense, disallow it */
         if (!exp->writable &&
-            (statbuf->st_mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0)
+            (in->mode & (S_IWUSR | S_IWGRP | S_IWOTH)) != 0)
         {
-            fuse_reply_err(req, EROFS);
-            return;
+            return -EROFS;
         }
     }
 
-    if (to_set & FUSE_SET_ATTR_SIZE) {
+    if (to_set & FATTR_SIZE) {
         if (!exp->writable) {
-            fuse_reply_err(req, EACCES);
-            return;
+            return -EACCES;
         }
 
-        ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+        WITH_QEMU_LOCK_GUARD(&exp->resize_lock) {
+            ret = fuse_co_do_truncate(exp, in->size, true, PREALLOC_MODE_OFF);
+        }
         if (ret < 0) {
-            fuse_reply_err(req, -ret);
-            return;
+            return ret;
         }
     }
 
-    if (to_set & FUSE_SET_ATTR_MODE) {
-        /* Ignore FUSE-supplied file type, only change the mode */
-        exp->st_mode = (statbuf->st_mode & 07777) | S_IFREG;
-    }
+    WITH_QEMU_LOCK_GUARD(&exp->attr_lock) {
+        if (to_set & FATTR_MODE) {
+            /* Ignore FUSE-supplied file type, only change the mode */
+            exp->st_mode = (in->mode & 07777) | S_IFREG;
+        }
 
-    if (to_set & FUSE_SET_ATTR_UID) {
-        exp->st_uid = statbuf->st_uid;
-    }
+        if (to_set & FATTR_UID) {
+            exp->st_uid = in->uid;
+        }
 
-    if (to_set & FUSE_SET_ATTR_GID) {
-        exp->st_gid = statbuf->st_gid;
+        if (to_set & FATTR_GID) {
+            exp->st_gid = in->gid;
+        }
     }
 
-    fuse_getattr(req, inode, fi);
+    return fuse_co_getattr(exp, out, inode);
 }
 
 /**
  * Let clients open a file (i.e., the exported image).
  */
-static void fuse_open(fuse_req_t req, fuse_ino_t inode,
-                      struct fuse_file_info *fi)
+static ssize_t fuse_open(FuseExport *exp, struct fuse_open_out *out)
 {
-    fuse_reply_open(req, fi);
+    *out = (struct fuse_open_out) {};
+    return sizeof(*out);
 }
 
 /**
- * Handle client reads from the exported image.
+ * Handle client reads from the exported image.  On success, *@bufptr points
+ * to a buffer with the data, which the caller must free with qemu_vfree().
  */
-static void fuse_read(fuse_req_t req, fuse_ino_t inode,
-                      size_t size, off_t offset, struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_read(FuseExport *exp, void **bufptr, uint64_t offset, uint32_t size)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
     void *buf;
     int ret;
 
     /* Limited by max_read, should not happen */
     if (size > FUSE_MAX_BOUNCE_BYTES) {
-        fuse_reply_err(req, EINVAL);
-        return;
+        return -EINVAL;
     }
 
     /**
      * Clients will expect short reads at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
+    if (offset >= length) {
+        return 0;
+    }
     if (offset + size > length) {
         size = length - offset;
     }
 
-    buf = qemu_try_blockalign(blk_bs(exp->common.blk), size);
+    buf = blk_try_blockalign(exp->common.blk, size);
     if (!buf) {
-        fuse_reply_err(req, ENOMEM);
-        return;
+        return -ENOMEM;
     }
 
-    ret = blk_pread(exp->common.blk, offset, size, buf, 0);
-    if (ret >= 0) {
-        fuse_reply_buf(req, buf, size);
-    } else {
-        fuse_reply_err(req, -ret);
+    ret = blk_co_pread(exp->common.blk, offset, size, buf, 0);
+    if (ret < 0) {
+        qemu_vfree(buf);
+        return ret;
     }
 
-    qemu_vfree(buf);
+    *bufptr = buf;
+    return size;
 }
 
 /**
- * Handle client writes to the exported image.
+ * Handle client writes to the exported image.  @buf has been copied out of
+ * the request buffer already.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_write(FuseExport *exp, struct fuse_write_out *out,
+              uint64_t offset, uint32_t size, const void *buf)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
     int ret;
 
-    /* Limited by max_write, should not happen */
-    if (size > BDRV_REQUEST_MAX_BYTES) {
-        fuse_reply_err(req, EINVAL);
-        return;
-    }
-
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
     /**
      * Clients will expect short writes at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
-        fuse_reply_err(req, -length);
-        return;
+        return length;
     }
 
     if (offset + size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            ret = fuse_co_grow(exp, offset + size, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         } else {
-            size = length - offset;
+            size = offset < length ? length - offset : 0;
         }
     }
 
-    ret = blk_pwrite(exp->common.blk, offset, size, buf, 0);
-    if (ret >= 0) {
-        fuse_reply_write(req, size);
-    } else {
-        fuse_reply_err(req, -ret);
+    ret = blk_co_pwrite(exp->common.blk, offset, size, buf, 0);
+    if (ret < 0) {
+        return ret;
     }
+
+    *out = (struct fuse_write_out) {
+        .size = size,
+    };
+    return sizeof(*out);
 }
 
 /**
  * Let clients perform various fallocate() operations.
  */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_fallocate(FuseExport *exp, uint64_t offset, uint64_t length,
+                  uint32_t mode)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int64_t blk_len;
     int ret;
 
     if (!exp->writable) {
-        fuse_reply_err(req, EACCES);
-        return;
+        return -EACCES;
     }
 
-    blk_len = blk_getlength(exp->common.blk);
+    blk_len = blk_co_getlength(exp->common.blk);
     if (blk_len < 0) {
-        fuse_reply_err(req, -blk_len);
-        return;
+        return blk_len;
     }
 
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
@@ -699,34 +861,31 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     if (!mode) {
         /* We can only fallocate at the EOF with a truncate */
         if (offset < blk_len) {
-            fuse_reply_err(req, EOPNOTSUPP);
-            return;
+            return -EOPNOTSUPP;
         }
 
         if (offset > blk_len) {
             /* No preallocation needed here */
-            ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
+            ret = fuse_co_grow(exp, offset, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
-        ret = fuse_do_truncate(exp, offset + length, true,
-                               PREALLOC_MODE_FALLOC);
+        ret = fuse_co_grow(exp, offset + length, true, PREALLOC_MODE_FALLOC);
     }
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
     else if (mode & FALLOC_FL_PUNCH_HOLE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE)) {
-            fuse_reply_err(req, EINVAL);
-            return;
+            return -EINVAL;
         }
 
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk, offset, size,
-                                    BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK);
+            ret = blk_co_pwrite_zeroes(exp->common.blk, offset, size,
+                                       BDRV_REQ_MAY_UNMAP |
+                                       BDRV_REQ_NO_FALLBACK);
             if (ret == -ENOTSUP) {
                 /*
                  * fallocate() specifies to return EOPNOTSUPP for unsupported
@@ -744,19 +903,17 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     else if (mode & FALLOC_FL_ZERO_RANGE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > blk_len) {
             /* No need for zeroes, we are going to write them ourselves */
-            ret = fuse_do_truncate(exp, offset + length, false,
-                                   PREALLOC_MODE_OFF);
+            ret = fuse_co_grow(exp, offset + length, false,
+                               PREALLOC_MODE_OFF);
             if (ret < 0) {
-                fuse_reply_err(req, -ret);
-                return;
+                return ret;
             }
         }
 
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk,
-                                    offset, size, 0);
+            ret = blk_co_pwrite_zeroes(exp->common.blk, offset, size, 0);
             offset += size;
             length -= size;
         } while (ret == 0 && length > 0);
@@ -766,55 +923,58 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         ret = -EOPNOTSUPP;
     }
 
-    fuse_reply_err(req, ret < 0 ? -ret : 0);
+    return ret < 0 ? ret : 0;
 }
 
 /**
- * Let clients fsync the exported image.
+ * Let clients fsync the exported image.  This is also used for FUSE_FLUSH,
+ * which is sent before an FD to the exported image is closed (libfuse notes
+ * this to be a way to return last-minute errors).
  */
-static void fuse_fsync(fuse_req_t req, fuse_ino_t inode, int datasync,
-                       struct fuse_file_info *fi)
+static ssize_t coroutine_fn fuse_co_fsync(FuseExport *exp)
 {
-    FuseExport *exp = fuse_req_userdata(req);
     int ret;
 
-    ret = blk_flush(exp->common.blk);
-    fuse_reply_err(req, ret < 0 ? -ret : 0);
+    ret = blk_co_flush(exp->common.blk);
+    return ret < 0 ? ret : 0;
 }
 
 /**
- * Called before an FD to the exported image is closed.  (libfuse
- * notes this to be a way to return last-minute errors.)
+ * Report the same file system statistics that libfuse reports by default.
  */
-static void fuse_flush(fuse_req_t req, fuse_ino_t inode,
-                        struct fuse_file_info *fi)
+static ssize_t fuse_statfs(FuseExport *exp, struct fuse_statfs_out *out)
 {
-    fuse_fsync(req, inode, 1, fi);
+    *out = (struct fuse_statfs_out) {
+        .st = {
+            .bsize      = 512,
+            .namelen    = 255,
+        },
+    };
+    return sizeof(*out);
 }
 
 #ifdef CONFIG_FUSE_LSEEK
 /**
  * Let clients inquire allocation status.
  */
-static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
-                       int whence, struct fuse_file_info *fi)
+static ssize_t coroutine_fn
+fuse_co_lseek(FuseExport *exp, struct fuse_lseek_out *out,
+              uint64_t offset, uint32_t whence)
 {
-    FuseExport *exp = fuse_req_userdata(req);
-
     if (whence != SEEK_HOLE && whence != SEEK_DATA) {
-        fuse_reply_err(req, EINVAL);
-        return;
+        return -EINVAL;
     }
 
     while (true) {
         int64_t pnum;
         int ret;
 
-        ret = bdrv_block_status_above(blk_bs(exp->common.blk), NULL,
-                                      offset, INT64_MAX, &pnum, NULL, NULL);
+        bdrv_graph_co_rdlock();
+        ret = bdrv_co_block_status_above(blk_bs(exp->common.blk), NULL,
+                                         offset, INT64_MAX, &pnum, NULL, NULL);
+        bdrv_graph_co_rdunlock();
         if (ret < 0) {
-            fuse_reply_err(req, -ret);
-            return;
+            return ret;
         }
 
         if (!pnum && (ret & BDRV_BLOCK_EOF)) {
@@ -829,63 +989,282 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
              * and @blk_len (the client-visible EOF).
              */
 
-            blk_len = blk_getlength(exp->common.blk);
+            blk_len = blk_co_getlength(exp->common.blk);
             if (blk_len < 0) {
-                fuse_reply_err(req, -blk_len);
-                return;
+                return blk_len;
             }
 
             if (offset > blk_len || whence == SEEK_DATA) {
-                fuse_reply_err(req, ENXIO);
-            } else {
-                fuse_reply_lseek(req, offset);
+                return -ENXIO;
             }
-            return;
+            break;
         }
 
         if (ret & BDRV_BLOCK_DATA) {
             if (whence == SEEK_DATA) {
-                fuse_reply_lseek(req, offset);
-                return;
+                break;
             }
         } else {
             if (whence == SEEK_HOLE) {
-                fuse_reply_lseek(req, offset);
-                return;
+                break;
             }
         }
 
         /* Safety check against infinite loops */
         if (!pnum) {
-            fuse_reply_err(req, ENXIO);
-            return;
+            return -ENXIO;
         }
 
         offset += pnum;
     }
+
+    *out = (struct fuse_lseek_out) {
+        .offset = offset,
+    };
+    return sizeof(*out);
 }
 #endif
 
-static const struct fuse_lowlevel_ops fuse_ops = {
-    .init       = fuse_init,
-    .lookup     = fuse_lookup,
-    .getattr    = fuse_getattr,
-    .setattr    = fuse_setattr,
-    .open       = fuse_open,
-    .read       = fuse_read,
-    .write      = fuse_write,
-    .fallocate  = fuse_fallocate,
-    .flush      = fuse_flush,
-    .fsync      = fuse_fsync,
+/**
+ * Process the request that has just been read into @opaque's (a FuseQueue)
+ * request buffer, and write the reply.
+ */
+static void coroutine_fn co_fuse_process_request(void *opaque)
+{
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    struct fuse_in_header in_hdr;
+    FuseInArgs in = {};
+    FuseOutArgs out;
+    size_t in_len;
+    const void *out_buf = &out;
+    void *data_buf = NULL;
+    ssize_t ret;
+
+    /* Copy everything we need before the request buffer is reused */
+    memcpy(&in_hdr, q->request_buf, sizeof(in_hdr));
+    in_len = q->request_len - sizeof(in_hdr);
+    memcpy(&in, q->request_buf + sizeof(in_hdr), MIN(in_len, sizeof(in)));
+
+    if (in_hdr.opcode == FUSE_WRITE) {
+        /*
+         * The data follows struct fuse_write_in, whose size depends on the
+         * protocol version, so take it from the end of the request
+         */
+        if (in.write.size > MIN(in_len, FUSE_MAX_WRITE_BYTES)) {
+            ret = -EINVAL;
+            goto reply;
+        }
+
+        data_buf = blk_try_blockalign(exp->common.blk, in.write.size);
+        if (!data_buf) {
+            ret = -ENOMEM;
+            goto reply;
+        }
+        memcpy(data_buf, q->request_buf + q->request_len - in.write.size,
+               in.write.size);
+    }
+
+    switch (in_hdr.opcode) {
+    case FUSE_INIT:
+        ret = fuse_init(exp, &out.init, &in.init);
+        break;
+
+    case FUSE_LOOKUP:
+        /* We only care about the mountpoint itself */
+        ret = -ENOENT;
+        break;
+
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+        /* These must not be replied to */
+        goto out;
+
+    case FUSE_GETATTR:
+        ret = fuse_co_getattr(exp, &out.attr, in_hdr.nodeid);
+        break;
+
+    case FUSE_SETATTR:
+        ret = fuse_co_setattr(exp, &out.attr, in_hdr.nodeid, &in.setattr);
+        break;
+
+    case FUSE_OPEN:
+        ret = fuse_open(exp, &out.open);
+        break;
+
+    case FUSE_RELEASE:
+        ret = 0;
+        break;
+
+    case FUSE_READ:
+        ret = fuse_co_read(exp, &data_buf, in.read.offset, in.read.size);
+        out_buf = data_buf;
+        break;
+
+    case FUSE_WRITE:
+        ret = fuse_co_write(exp, &out.write, in.write.offset, in.write.size,
+                            data_buf);
+        break;
+
+    case FUSE_FALLOCATE:
+        ret = fuse_co_fallocate(exp, in.fallocate.offset, in.fallocate.length,
+                                in.fallocate.mode);
+        break;
+
+    case FUSE_FLUSH:
+    case FUSE_FSYNC:
+        ret = fuse_co_fsync(exp);
+        break;
+
+    case FUSE_STATFS:
+        ret = fuse_statfs(exp, &out.statfs);
+        break;
+
 #ifdef CONFIG_FUSE_LSEEK
-    .lseek      = fuse_lseek,
+    case FUSE_LSEEK:
+        ret = fuse_co_lseek(exp, &out.lseek, in.lseek.offset,
+                            in.lseek.whence);
+        break;
 #endif
-};
+
+    default:
+        ret = -ENOSYS;
+        break;
+    }
+
+reply:
+    fuse_write_response(q, in_hdr.unique, ret, out_buf);
+
+out:
+    qemu_vfree(data_buf);
+
+    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
+        aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
+    }
+
+    blk_exp_unref(&exp->common);
+}
+
+/**
+ * Callback to be invoked when a queue's FUSE device FD can be read from.
+ * (This is basically the FUSE event loop.)  Every request is processed in a
+ * coroutine of its own, so many of them can be in flight at once.
+ */
+static void read_from_fuse_fd(void *opaque)
+{
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    Coroutine *co;
+    ssize_t ret;
+
+    do {
+        ret = read(q->fuse_fd, q->request_buf, FUSE_REQUEST_BUF_SIZE);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        /* EAGAIN: Another queue has taken the request */
+        if (errno != EAGAIN) {
+            /* ENODEV: The export has been unmounted */
+            if (errno != ENODEV) {
+                error_report("Failed to read from FUSE device: %s",
+                             strerror(errno));
+            }
+            fuse_export_halt(exp);
+        }
+        return;
+    }
+
+    if (ret < sizeof(struct fuse_in_header)) {
+        error_report("Short read from FUSE device (%zd bytes)", ret);
+        fuse_export_halt(exp);
+        return;
+    }
+
+    blk_exp_ref(&exp->common);
+    qatomic_inc(&exp->in_flight);
+
+    q->request_len = ret;
+    co = qemu_coroutine_create(co_fuse_process_request, q);
+    qemu_coroutine_enter(co);
+}
+
+static void fuse_export_shutdown(BlockExport *blk_exp)
+{
+    FuseExport *exp = container_of(blk_exp, FuseExport, common);
+
+    if (exp->fuse_session) {
+        fuse_session_exit(exp->fuse_session);
+
+        if (exp->fd_handler_set_up) {
+            fuse_export_set_fd_handlers(exp, false);
+        }
+    }
+
+    if (exp->mountpoint) {
+        /*
+         * Safe to drop now, because we will not handle any requests
+         * for this export anymore anyway.
+         */
+        g_hash_table_remove(exports, exp->mountpoint);
+    }
+}
+
+static void fuse_export_delete(BlockExport *blk_exp)
+{
+    FuseExport *exp = container_of(blk_exp, FuseExport, common);
+    int i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        /* Queue 0's FD belongs to the session */
+        if (i > 0 && q->fuse_fd >= 0) {
+            close(q->fuse_fd);
+        }
+        g_free(q->request_buf);
+    }
+    g_free(exp->queues);
+
+    if (exp->fuse_session) {
+        if (exp->mounted) {
+            fuse_session_unmount(exp->fuse_session);
+        }
+
+        fuse_session_destroy(exp->fuse_session);
+    }
+
+    g_free(exp->mountpoint);
+    qemu_mutex_destroy(&exp->attr_lock);
+}
+
+/**
+ * Check whether @path points to a regular file.  If not, put an
+ * appropriate message into *errp.
+ */
+static bool is_regular_file(const char *path, Error **errp)
+{
+    struct stat statbuf;
+    int ret;
+
+    ret = stat(path, &statbuf);
+    if (ret < 0) {
+        error_setg_errno(errp, errno, "Failed to stat '%s'", path);
+        return false;
+    }
+
+    if (!S_ISREG(statbuf.st_mode)) {
+        error_setg(errp, "'%s' is not a regular file", path);
+        return false;
+    }
+
+    return true;
+}
 
 const BlockExportDriver blk_exp_fuse = {
-    .type               = BLOCK_EXPORT_TYPE_FUSE,
-    .instance_size      = sizeof(FuseExport),
-    .create             = fuse_export_create,
-    .delete             = fuse_export_delete,
-    .request_shutdown   = fuse_export_shutdown,
+    .type                   = BLOCK_EXPORT_TYPE_FUSE,
+    .instance_size          = sizeof(FuseExport),
+    .supports_multithread   = true,
+    .create                 = fuse_export_create,
+    .delete                 = fuse_export_delete,
+    .request_shutdown       = fuse_export_shutdown,
 };
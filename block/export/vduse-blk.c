@@ -33,6 +33,18 @@ typedef struct VduseBlkExport {
     char *recon_file;
     unsigned int inflight; /* atomic */
     bool vqs_started;
+
+    /*
+     * With multiple iothreads, virtqueue i is processed in
+     * vq_ctxs[i % num_vq_ctxs] and device messages are handled by dev_co,
+     * which pauses all virtqueues while libvduse updates their state.
+     */
+    AioContext **vq_ctxs;
+    size_t num_vq_ctxs;
+    Coroutine *dev_co;
+    bool vqs_paused;
+    bool wait_idle; /* atomic */
+    unsigned int vqs_pausing; /* atomic */
 } VduseBlkExport;
 
 typedef struct VduseBlkReq {
@@ -51,6 +63,11 @@ static void vduse_blk_inflight_inc(VduseBlkExport *vblk_exp)
 static void vduse_blk_inflight_dec(VduseBlkExport *vblk_exp)
 {
     if (qatomic_fetch_dec(&vblk_exp->inflight) == 1) {
+        /* Wake vduse_blk_co_wait_idle() */
+        if (qatomic_xchg(&vblk_exp->wait_idle, false)) {
+            aio_co_wake(vblk_exp->dev_co);
+        }
+
         /* Wake AIO_WAIT_WHILE() */
         aio_wait_kick();
 
@@ -85,6 +102,7 @@ static void coroutine_fn vduse_blk_virtio_process_req(void *opaque)
                                     out_iov, in_num, out_num);
     if (in_len < 0) {
         free(req);
+        vduse_blk_inflight_dec(vblk_exp);
         return;
     }
 
@@ -128,6 +146,19 @@ static void on_vduse_vq_kick(void *opaque)
     vduse_blk_vq_handler(dev, vq);
 }
 
+static AioContext *vduse_blk_vq_ctx(VduseBlkExport *vblk_exp, VduseVirtq *vq)
+{
+    if (vblk_exp->num_vq_ctxs) {
+        for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
+            if (vduse_dev_get_queue(vblk_exp->dev, i) == vq) {
+                return vblk_exp->vq_ctxs[i % vblk_exp->num_vq_ctxs];
+            }
+        }
+        g_assert_not_reached();
+    }
+    return vblk_exp->export.ctx;
+}
+
 static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
 {
     VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
@@ -135,8 +166,11 @@ static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
     if (!vblk_exp->vqs_started) {
         return; /* vduse_blk_drained_end() will start vqs later */
     }
+    if (vblk_exp->vqs_paused) {
+        return; /* vduse_blk_resume_vqs() will start vqs later */
+    }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, vduse_queue_get_fd(vq),
+    aio_set_fd_handler(vduse_blk_vq_ctx(vblk_exp, vq), vduse_queue_get_fd(vq),
                        on_vduse_vq_kick, NULL, NULL, NULL, vq);
     /* Make sure we don't miss any kick after reconnecting */
     eventfd_write(vduse_queue_get_fd(vq), 1);
@@ -151,7 +185,7 @@ static void vduse_blk_disable_queue(VduseDev *dev, VduseVirtq *vq)
         return;
     }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, fd,
+    aio_set_fd_handler(vduse_blk_vq_ctx(vblk_exp, vq), fd,
                        NULL, NULL, NULL, NULL, NULL);
 }
 
@@ -160,15 +194,119 @@ static const VduseOps vduse_blk_ops = {
     .disable_queue = vduse_blk_disable_queue,
 };
 
+/* Wait for in-flight requests to complete. Called from dev_co. */
+static void coroutine_fn vduse_blk_co_wait_idle(VduseBlkExport *vblk_exp)
+{
+    qatomic_set(&vblk_exp->wait_idle, true);
+    smp_mb(); /* pairs with qatomic_fetch_dec() in vduse_blk_inflight_dec() */
+
+    /*
+     * If a request completed concurrently and already took wait_idle, the
+     * wakeup is on its way and must be consumed by yielding.
+     */
+    if (qatomic_read(&vblk_exp->inflight) > 0 ||
+        !qatomic_xchg(&vblk_exp->wait_idle, false)) {
+        qemu_coroutine_yield();
+    }
+}
+
+static void vduse_blk_pause_bh(void *opaque)
+{
+    VduseBlkExport *vblk_exp = opaque;
+
+    if (qatomic_fetch_dec(&vblk_exp->vqs_pausing) == 1) {
+        aio_co_wake(vblk_exp->dev_co);
+    }
+}
+
+/*
+ * Stop processing virtqueues in their iothreads and wait until no kick
+ * handler or request is running anymore. Called from dev_co.
+ */
+static void coroutine_fn vduse_blk_co_pause_vqs(VduseBlkExport *vblk_exp)
+{
+    vblk_exp->vqs_paused = true;
+
+    for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
+        VduseVirtq *vq = vduse_dev_get_queue(vblk_exp->dev, i);
+        vduse_blk_disable_queue(vblk_exp->dev, vq);
+    }
+
+    /*
+     * A kick handler that was already running when its fd handler was
+     * removed has returned once a BH in the same iothread runs. The last
+     * BH wakes us up; wakeups from other threads are deferred until we
+     * have yielded, and a BH in our own AioContext cannot run before that.
+     */
+    qatomic_set(&vblk_exp->vqs_pausing, vblk_exp->num_vq_ctxs);
+    for (size_t i = 0; i < vblk_exp->num_vq_ctxs; i++) {
+        aio_bh_schedule_oneshot(vblk_exp->vq_ctxs[i], vduse_blk_pause_bh,
+                                vblk_exp);
+    }
+    qemu_coroutine_yield();
+
+    vduse_blk_co_wait_idle(vblk_exp);
+}
+
+static void vduse_blk_resume_vqs(VduseBlkExport *vblk_exp)
+{
+    vblk_exp->vqs_paused = false;
+
+    for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
+        VduseVirtq *vq = vduse_dev_get_queue(vblk_exp->dev, i);
+        if (vduse_queue_get_fd(vq) >= 0) {
+            vduse_blk_enable_queue(vblk_exp->dev, vq);
+        }
+    }
+}
+
+static void vduse_blk_attach_ctx(VduseBlkExport *vblk_exp, AioContext *ctx);
+
+static void coroutine_fn vduse_blk_co_dev_handler(void *opaque)
+{
+    VduseBlkExport *vblk_exp = opaque;
+
+    vduse_blk_co_pause_vqs(vblk_exp);
+    vduse_dev_handler(vblk_exp->dev);
+    vduse_blk_resume_vqs(vblk_exp);
+
+    vblk_exp->dev_co = NULL;
+    if (vblk_exp->export.ctx) {
+        vduse_blk_attach_ctx(vblk_exp, vblk_exp->export.ctx);
+    }
+    aio_wait_kick();
+    blk_exp_unref(&vblk_exp->export);
+}
+
 static void on_vduse_dev_kick(void *opaque)
 {
     VduseDev *dev = opaque;
+    VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
+
+    if (!vblk_exp->num_vq_ctxs) {
+        vduse_dev_handler(dev);
+        return;
+    }
 
-    vduse_dev_handler(dev);
+    /*
+     * Virtqueues are processed in other threads, so they must be paused
+     * before libvduse may change their state. Stop watching the device fd
+     * until the message has been handled.
+     */
+    aio_set_fd_handler(vblk_exp->export.ctx, vduse_dev_get_fd(dev),
+                       NULL, NULL, NULL, NULL, NULL);
+    blk_exp_ref(&vblk_exp->export);
+    vblk_exp->dev_co = qemu_coroutine_create(vduse_blk_co_dev_handler,
+                                             vblk_exp);
+    qemu_coroutine_enter(vblk_exp->dev_co);
 }
 
 static void vduse_blk_attach_ctx(VduseBlkExport *vblk_exp, AioContext *ctx)
 {
+    if (vblk_exp->dev_co) {
+        return; /* vduse_blk_co_dev_handler() will attach when done */
+    }
+
     aio_set_fd_handler(vblk_exp->export.ctx, vduse_dev_get_fd(vblk_exp->dev),
                        on_vduse_dev_kick, NULL, NULL, NULL,
                        vblk_exp->dev);
@@ -227,6 +365,9 @@ static void vduse_blk_stop_virtqueues(VduseBlkExport *vblk_exp)
 static void vduse_blk_start_virtqueues(VduseBlkExport *vblk_exp)
 {
     vblk_exp->vqs_started = true;
+    if (vblk_exp->vqs_paused) {
+        return; /* vduse_blk_resume_vqs() will start vqs later */
+    }
 
     for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
         VduseVirtq *vq = vduse_dev_get_queue(vblk_exp->dev, i);
@@ -255,7 +396,7 @@ static bool vduse_blk_drained_poll(void *opaque)
     BlockExport *exp = opaque;
     VduseBlkExport *vblk_exp = container_of(exp, VduseBlkExport, export);
 
-    return qatomic_read(&vblk_exp->inflight) > 0;
+    return qatomic_read(&vblk_exp->inflight) > 0 || vblk_exp->dev_co;
 }
 
 static const BlockDevOps vduse_block_ops = {
@@ -266,7 +407,8 @@ static const BlockDevOps vduse_block_ops = {
 };
 
 static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
-                                Error **errp)
+                                AioContext *const *multithread,
+                                size_t mt_count, Error **errp)
 {
     VduseBlkExport *vblk_exp = container_of(exp, VduseBlkExport, export);
     BlockExportOptionsVduseBlk *vblk_opts = &opts->u.vduse_blk;
@@ -307,6 +449,9 @@ static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     vblk_exp->handler.logical_block_size = logical_block_size;
     vblk_exp->handler.writable = opts->writable;
     vblk_exp->vqs_started = true;
+    vblk_exp->vq_ctxs = g_memdup2(multithread,
+                                  mt_count * sizeof(multithread[0]));
+    vblk_exp->num_vq_ctxs = mt_count;
 
     config.capacity =
             cpu_to_le64(blk_getlength(exp->blk) >> VIRTIO_BLK_SECTOR_BITS);
@@ -381,6 +526,7 @@ err:
     g_free(vblk_exp->recon_file);
 err_dev:
     g_free(vblk_exp->handler.serial);
+    g_free(vblk_exp->vq_ctxs);
     return ret;
 }
 
@@ -400,6 +546,7 @@ static void vduse_blk_exp_delete(BlockExport *exp)
     }
     g_free(vblk_exp->recon_file);
     g_free(vblk_exp->handler.serial);
+    g_free(vblk_exp->vq_ctxs);
 }
 
 /* Called with exp->ctx acquired */
@@ -411,9 +558,10 @@ static void vduse_blk_exp_request_shutdown(BlockExport *exp)
 }
 
 const BlockExportDriver blk_exp_vduse_blk = {
-    .type               = BLOCK_EXPORT_TYPE_VDUSE_BLK,
-    .instance_size      = sizeof(VduseBlkExport),
-    .create             = vduse_blk_exp_create,
-    .delete             = vduse_blk_exp_delete,
-    .request_shutdown   = vduse_blk_exp_request_shutdown,
+    .type                   = BLOCK_EXPORT_TYPE_VDUSE_BLK,
+    .instance_size          = sizeof(VduseBlkExport),
+    .supports_multithread   = true,
+    .create                 = vduse_blk_exp_create,
+    .delete                 = vduse_blk_exp_delete,
+    .request_shutdown       = vduse_blk_exp_request_shutdown,
 };
@@ -315,6 +315,7 @@ static const BlockDevOps vu_blk_dev_ops = {
 };
 
 static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
+                             AioContext *const *multithread, size_t mt_count,
                              Error **errp)
 {
     VuBlkExport *vexp = container_of(exp, VuBlkExport, export);
@@ -354,7 +355,8 @@ static int vu_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
     blk_set_dev_ops(exp->blk, &vu_blk_dev_ops, vexp);
 
     if (!vhost_user_server_start(&vexp->vu_server, vu_opts->addr, exp->ctx,
-                                 num_queues, &vu_blk_iface, errp)) {
+                                 multithread, mt_count, num_queues,
+                                 &vu_blk_iface, errp)) {
         blk_remove_aio_context_notifier(exp->blk, blk_aio_attached,
                                         blk_aio_detach, vexp);
         g_free(vexp->handler.serial);
@@ -374,9 +376,10 @@ static void vu_blk_exp_delete(BlockExport *exp)
 }
 
 const BlockExportDriver blk_exp_vhost_user_blk = {
-    .type               = BLOCK_EXPORT_TYPE_VHOST_USER_BLK,
-    .instance_size      = sizeof(VuBlkExport),
-    .create             = vu_blk_exp_create,
-    .delete             = vu_blk_exp_delete,
-    .request_shutdown   = vu_blk_exp_request_shutdown,
+    .type                   = BLOCK_EXPORT_TYPE_VHOST_USER_BLK,
+    .instance_size          = sizeof(VuBlkExport),
+    .supports_multithread   = true,
+    .create                 = vu_blk_exp_create,
+    .delete                 = vu_blk_exp_delete,
+    .request_shutdown       = vu_blk_exp_request_shutdown,
 };
@@ -79,6 +79,10 @@
 #include <linux/hdreg.h>
 #include <linux/magic.h>
 #include <scsi/sg.h>
+#ifdef HAVE_IO_URING_NVME_CMD
+#include <linux/nvme_ioctl.h>
+#include "block/nvme.h"
+#endif
 #ifdef __s390__
 #include <asm/dasd.h>
 #endif
@@ -183,7 +187,9 @@ typedef struct BDRVRawState {
     bool use_linux_aio:1;
     bool has_laio_fdsync:1;
     bool use_linux_io_uring:1;
+    bool use_fixed_buffers:1;
     bool use_mpath:1;
+    int fixed_file; /* io_uring registered file slot for fd, or -1 */
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
@@ -196,6 +202,17 @@ typedef struct BDRVRawState {
         uint64_t discard_bytes_ok;
     } stats;
 
+    /* NVMe generic char device accessed with io_uring passthrough commands */
+    struct {
+        bool enabled;
+        bool supports_write_zeroes;
+        bool supports_discard;
+        uint32_t nsid;
+        int blkshift;
+        uint64_t nsze;
+        uint32_t max_transfer;
+    } nvme;
+
     PRManager *pr_mgr;
 } BDRVRawState;
 
@@ -423,6 +440,13 @@ static void raw_probe_alignment(BlockDriverState *bs, int fd, Error **errp)
     size_t max_align = MAX(MAX_BLOCKSIZE, qemu_real_host_page_size());
     size_t alignments[] = {1, 512, 1024, 2048, 4096};
 
+    /* NVMe passthrough works on whole logical blocks and dword buffers */
+    if (s->nvme.enabled) {
+        bs->bl.request_alignment = 1 << s->nvme.blkshift;
+        s->buf_align = 4;
+        return;
+    }
+
     /* For SCSI generic devices the alignment is not really used.
        With buffered I/O, we don't have any restrictions. */
     if (bdrv_is_sg(bs) || !s->needs_alignment) {
@@ -585,6 +609,13 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+#ifdef CONFIG_LINUX_IO_URING
+        {
+            .name = "aio-fixed-buffers",
+            .type = QEMU_OPT_BOOL,
+            .help = "register guest RAM with io_uring (default: off)",
+        },
+#endif
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -662,6 +693,12 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
 #ifdef CONFIG_LINUX_IO_URING
     s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+    s->use_fixed_buffers = qemu_opt_get_bool(opts, "aio-fixed-buffers", false);
+    if (s->use_fixed_buffers && !s->use_linux_io_uring) {
+        error_setg(errp, "aio-fixed-buffers requires aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
 #endif
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
@@ -712,6 +749,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     raw_parse_flags(bdrv_flags, &s->open_flags, false);
 
     s->fd = -1;
+    s->fixed_file = -1;
     fd = qemu_open(filename, s->open_flags, errp);
     ret = fd < 0 ? -errno : 0;
 
@@ -829,6 +867,17 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        s->fixed_file = luring_register_file(s->fd);
+    }
+#endif
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+    if (s->use_fixed_buffers) {
+        bs->supported_write_flags |= BDRV_REQ_REGISTERED_BUF;
+    }
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -1567,6 +1616,22 @@ static void raw_refresh_limits(BlockDriverState *bs, Error **errp)
     }
 #endif
 
+    if (s->nvme.enabled) {
+        /*
+         * Passthrough commands are not split by the host, but its queue
+         * limits are not visible through the char device.  Stay well below
+         * what NVMe PCI controllers and the kernel driver accept.
+         */
+        bs->bl.max_hw_transfer = MIN_NON_ZERO(s->nvme.max_transfer,
+                                              256 * KiB);
+        bs->bl.max_hw_iov = 64;
+        bs->bl.max_pwrite_zeroes = (int64_t)(UINT16_MAX + 1) <<
+                                   s->nvme.blkshift;
+        bs->bl.max_pdiscard = MIN((int64_t)UINT32_MAX << s->nvme.blkshift,
+                                  QEMU_ALIGN_DOWN(INT32_MAX,
+                                                  1 << s->nvme.blkshift));
+    }
+
     if (bdrv_is_sg(bs) || S_ISBLK(st.st_mode)) {
         int ret = hdev_get_max_hw_transfer(s->fd, &st);
 
@@ -1628,6 +1693,11 @@ static int hdev_probe_blocksizes(BlockDriverState *bs, BlockSizes *bsz)
     BDRVRawState *s = bs->opaque;
     int ret;
 
+    if (s->nvme.enabled) {
+        bsz->log = bsz->phys = 1 << s->nvme.blkshift;
+        return 0;
+    }
+
     /* If DASD or zoned devices, get blocksizes */
     if (check_for_dasd(s->fd) < 0) {
         /* zoned devices are not DASD */
@@ -2543,6 +2613,136 @@ static inline bool raw_check_linux_io_uring(BDRVRawState *s)
 }
 #endif
 
+#ifdef HAVE_IO_URING_NVME_CMD
+/*
+ * Unlike raw_check_linux_io_uring(), there is no fallback to the thread pool:
+ * NVMe generic char devices do not support read(2) and write(2).
+ */
+static int coroutine_fn raw_co_nvme_cmd(BlockDriverState *bs,
+                                        struct nvme_uring_cmd *cmd,
+                                        uint32_t cmd_op)
+{
+    BDRVRawState *s = bs->opaque;
+    Error *local_err = NULL;
+
+    if (unlikely(!aio_setup_linux_io_uring(qemu_get_current_aio_context(),
+                                           &local_err))) {
+        error_report_err(local_err);
+        return -EIO;
+    }
+
+    cmd->nsid = s->nvme.nsid;
+    return luring_co_submit_cmd(bs, s->fd, s->fixed_file, cmd_op, cmd,
+                                sizeof(*cmd));
+}
+
+static int coroutine_fn raw_co_nvme_rw(BlockDriverState *bs, uint64_t offset,
+                                       uint64_t bytes, QEMUIOVector *qiov,
+                                       int type, BdrvRequestFlags flags)
+{
+    BDRVRawState *s = bs->opaque;
+    uint64_t slba = offset >> s->nvme.blkshift;
+    struct nvme_uring_cmd cmd;
+    uint32_t cmd_op = NVME_URING_CMD_IO;
+
+    assert(type == QEMU_AIO_READ || type == QEMU_AIO_WRITE);
+
+    /* The number of blocks in a command cannot be zero */
+    if (bytes == 0) {
+        return 0;
+    }
+
+    cmd = (struct nvme_uring_cmd) {
+        .opcode = type == QEMU_AIO_READ ? NVME_CMD_READ : NVME_CMD_WRITE,
+        .cdw10 = slba & 0xFFFFFFFF,
+        .cdw11 = slba >> 32,
+        .cdw12 = ((bytes >> s->nvme.blkshift) - 1) & 0xFFFF,
+    };
+    assert(((cmd.cdw12 + 1) << s->nvme.blkshift) == bytes);
+
+    if (flags & BDRV_REQ_FUA) {
+        cmd.cdw12 |= NVME_RW_FUA << 16;
+    }
+
+    if (qiov->niov == 1) {
+        cmd.addr = (uintptr_t)qiov->iov[0].iov_base;
+        cmd.data_len = qiov->iov[0].iov_len;
+    } else {
+        cmd.addr = (uintptr_t)qiov->iov;
+        cmd.data_len = qiov->niov;
+        cmd_op = NVME_URING_CMD_IO_VEC;
+    }
+
+    return raw_co_nvme_cmd(bs, &cmd, cmd_op);
+}
+
+static int coroutine_fn raw_co_nvme_flush(BlockDriverState *bs)
+{
+    struct nvme_uring_cmd cmd = {
+        .opcode = NVME_CMD_FLUSH,
+    };
+
+    return raw_co_nvme_cmd(bs, &cmd, NVME_URING_CMD_IO);
+}
+
+static int coroutine_fn raw_co_nvme_write_zeroes(BlockDriverState *bs,
+                                                 int64_t offset, int64_t bytes,
+                                                 BdrvRequestFlags flags)
+{
+    BDRVRawState *s = bs->opaque;
+    uint64_t slba = offset >> s->nvme.blkshift;
+    struct nvme_uring_cmd cmd;
+
+    if (!s->nvme.supports_write_zeroes) {
+        return -ENOTSUP;
+    }
+    if (bytes == 0) {
+        return 0;
+    }
+
+    cmd = (struct nvme_uring_cmd) {
+        .opcode = NVME_CMD_WRITE_ZEROES,
+        .cdw10 = slba & 0xFFFFFFFF,
+        .cdw11 = slba >> 32,
+        .cdw12 = ((bytes >> s->nvme.blkshift) - 1) & 0xFFFF,
+    };
+    assert(((cmd.cdw12 + 1) << s->nvme.blkshift) == bytes);
+
+    if (flags & BDRV_REQ_MAY_UNMAP) {
+        cmd.cdw12 |= 1 << 25; /* Deallocate */
+    }
+    if (flags & BDRV_REQ_FUA) {
+        cmd.cdw12 |= NVME_RW_FUA << 16;
+    }
+
+    return raw_co_nvme_cmd(bs, &cmd, NVME_URING_CMD_IO);
+}
+
+static int coroutine_fn raw_co_nvme_pdiscard(BlockDriverState *bs,
+                                             int64_t offset, int64_t bytes)
+{
+    BDRVRawState *s = bs->opaque;
+    NvmeDsmRange range = {
+        .nlb = cpu_to_le32(bytes >> s->nvme.blkshift),
+        .slba = cpu_to_le64(offset >> s->nvme.blkshift),
+    };
+    struct nvme_uring_cmd cmd = {
+        .opcode = NVME_CMD_DSM,
+        .addr = (uintptr_t)&range,
+        .data_len = sizeof(range),
+        .cdw10 = 0, /* number of ranges - 1 */
+        .cdw11 = NVME_DSMGMT_AD,
+    };
+
+    if (!s->nvme.supports_discard) {
+        return -ENOTSUP;
+    }
+    assert(((uint64_t)le32_to_cpu(range.nlb) << s->nvme.blkshift) == bytes);
+
+    return raw_co_nvme_cmd(bs, &cmd, NVME_URING_CMD_IO);
+}
+#endif
+
 #ifdef CONFIG_LINUX_AIO
 static inline bool raw_check_linux_aio(BDRVRawState *s)
 {
@@ -2592,12 +2792,21 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
      * pool read/write code which emulates this for us if we
      * set QEMU_AIO_MISALIGNED.
      */
+#ifdef HAVE_IO_URING_NVME_CMD
+    if (s->nvme.enabled) {
+        assert(qiov->size == bytes);
+        ret = raw_co_nvme_rw(bs, offset, bytes, qiov, type, flags);
+        goto out;
+    }
+#endif
+
     if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (raw_check_linux_io_uring(s)) {
         assert(qiov->size == bytes);
-        ret = luring_co_submit(bs, s->fd, offset, qiov, type, flags);
+        ret = luring_co_submit(bs, s->fd, s->fixed_file, offset, qiov, type,
+                               flags);
         goto out;
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2691,9 +2900,15 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
         .aio_type       = QEMU_AIO_FLUSH,
     };
 
+#ifdef HAVE_IO_URING_NVME_CMD
+    if (s->nvme.enabled) {
+        return raw_co_nvme_flush(bs);
+    }
+#endif
 #ifdef CONFIG_LINUX_IO_URING
     if (raw_check_linux_io_uring(s)) {
-        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH, 0);
+        return luring_co_submit(bs, s->fd, s->fixed_file, 0, NULL,
+                                QEMU_AIO_FLUSH, 0);
     }
 #endif
 #ifdef CONFIG_LINUX_AIO
@@ -2711,12 +2926,40 @@ static void raw_close(BlockDriverState *bs)
     if (s->fd >= 0) {
 #if defined(CONFIG_BLKZONED)
         g_free(bs->wps);
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->fixed_file >= 0) {
+            luring_unregister_file(s->fixed_file);
+            s->fixed_file = -1;
+        }
 #endif
         qemu_close(s->fd);
         s->fd = -1;
     }
 }
 
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+static bool raw_register_buf(BlockDriverState *bs, void *host, size_t size,
+                             Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_fixed_buffers) {
+        luring_register_buffer(host, size);
+    }
+    return true;
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_fixed_buffers) {
+        luring_unregister_buffer(host, size);
+    }
+}
+#endif
+
 /**
  * Truncates the given regular file @fd to @offset and, when growing, fills the
  * new space according to @prealloc.
@@ -2945,6 +3188,10 @@ static int64_t raw_getlength(BlockDriverState *bs)
         return ret;
     }
 
+    if (s->nvme.enabled) {
+        return s->nvme.nsze << s->nvme.blkshift;
+    }
+
     size = lseek(s->fd, 0, SEEK_END);
     if (size < 0) {
         return -errno;
@@ -3903,6 +4150,13 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        /* The slot is reused, so requests queued for it use the new fd */
+        if (s->fixed_file >= 0 &&
+            !luring_replace_file(s->fixed_file, s->perm_change_fd)) {
+            s->fixed_file = -1;
+        }
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
@@ -3957,6 +4211,9 @@ raw_co_copy_range_to(BlockDriverState *bs,
     if (fd_open(src->bs) < 0 || fd_open(dst->bs) < 0) {
         return -EIO;
     }
+    if (src_s->nvme.enabled || s->nvme.enabled) {
+        return -ENOTSUP;
+    }
 
     acb = (RawPosixAIOData) {
         .bs             = bs,
@@ -4010,6 +4267,10 @@ BlockDriver bdrv_file = {
     .bdrv_check_perm = raw_check_perm,
     .bdrv_set_perm   = raw_set_perm,
     .bdrv_abort_perm_update = raw_abort_perm_update,
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
     .create_opts = &raw_create_opts,
     .mutable_opts = mutable_opts,
 };
@@ -4187,6 +4448,93 @@ static bool hdev_is_sg(BlockDriverState *bs)
     return false;
 }
 
+#ifdef HAVE_IO_URING_NVME_CMD
+/*
+ * NVMe generic char devices (/dev/ngXnY) accept NVMe commands through
+ * IORING_OP_URING_CMD.  This bypasses the host block layer while the
+ * namespace stays usable by the host, unlike the VFIO-based nvme driver.
+ *
+ * Returns 0 if @bs is not such a device or passthrough was set up, and a
+ * negative errno if the namespace cannot be used.
+ */
+static int hdev_open_nvme_passthru(BlockDriverState *bs, Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+    QEMU_AUTO_VFREE union {
+        NvmeIdCtrl ctrl;
+        NvmeIdNs ns;
+    } *id = NULL;
+    struct nvme_admin_cmd cmd = {
+        .opcode = NVME_ADM_CMD_IDENTIFY,
+        .data_len = sizeof(*id),
+        .cdw10 = NVME_ID_CNS_CTRL,
+    };
+    struct stat st;
+    NvmeLBAF *lbaf;
+    uint16_t oncs;
+    int nsid;
+
+    if (fstat(s->fd, &st) < 0 || !S_ISCHR(st.st_mode)) {
+        return 0;
+    }
+    nsid = ioctl(s->fd, NVME_IOCTL_ID);
+    if (nsid <= 0) {
+        return 0;
+    }
+
+    if (!luring_has_cmd()) {
+        error_setg(errp, "NVMe passthrough with aio=io_uring is not "
+                   "supported by the host kernel");
+        return -ENOTSUP;
+    }
+
+    id = qemu_try_memalign(qemu_real_host_page_size(), sizeof(*id));
+    if (!id) {
+        error_setg(errp, "Cannot allocate buffer for identify response");
+        return -ENOMEM;
+    }
+
+    memset(id, 0, sizeof(*id));
+    cmd.addr = (uintptr_t)id;
+    if (ioctl(s->fd, NVME_IOCTL_ADMIN_CMD, &cmd)) {
+        error_setg(errp, "Failed to identify controller");
+        return -EIO;
+    }
+
+    /* Assume the minimum memory page size of 4k for MDTS */
+    s->nvme.max_transfer = id->ctrl.mdts ? (1 << id->ctrl.mdts) * 4 * KiB : 0;
+    oncs = le16_to_cpu(id->ctrl.oncs);
+    s->nvme.supports_write_zeroes = !!(oncs & NVME_ONCS_WRITE_ZEROES);
+    s->nvme.supports_discard = !!(oncs & NVME_ONCS_DSM);
+
+    memset(id, 0, sizeof(*id));
+    cmd.nsid = nsid;
+    cmd.cdw10 = NVME_ID_CNS_NS;
+    if (ioctl(s->fd, NVME_IOCTL_ADMIN_CMD, &cmd)) {
+        error_setg(errp, "Failed to identify namespace");
+        return -EIO;
+    }
+
+    lbaf = &id->ns.lbaf[NVME_ID_NS_FLBAS_INDEX(id->ns.flbas)];
+    if (lbaf->ms) {
+        error_setg(errp, "Namespaces with metadata are not yet supported");
+        return -ENOTSUP;
+    }
+    if (lbaf->ds < BDRV_SECTOR_BITS || lbaf->ds > 12) {
+        error_setg(errp, "Namespace has unsupported block size (2^%d)",
+                   lbaf->ds);
+        return -ENOTSUP;
+    }
+
+    s->nvme.nsid = nsid;
+    s->nvme.blkshift = lbaf->ds;
+    s->nvme.nsze = le64_to_cpu(id->ns.nsze);
+    s->nvme.enabled = true;
+    trace_file_hdev_nvme_passthru(bs, nsid, 1 << lbaf->ds, s->nvme.nsze);
+    return 0;
+}
+#endif
+
 static int hdev_open(BlockDriverState *bs, QDict *options, int flags,
                      Error **errp)
 {
@@ -4275,6 +4623,17 @@ hdev_open_Mac_error:
     /* sg devices aren't even block devices and can't use dm-mpath */
     s->use_mpath = !bs->sg;
 
+#ifdef HAVE_IO_URING_NVME_CMD
+    if (s->use_linux_io_uring && !bs->sg) {
+        ret = hdev_open_nvme_passthru(bs, errp);
+        if (ret < 0) {
+            raw_close(bs);
+            return ret;
+        }
+        s->use_mpath &= !s->nvme.enabled;
+    }
+#endif
+
     return ret;
 }
 
@@ -4417,6 +4776,13 @@ hdev_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
         raw_account_discard(s, bytes, ret);
         return ret;
     }
+#ifdef HAVE_IO_URING_NVME_CMD
+    if (s->nvme.enabled) {
+        ret = raw_co_nvme_pdiscard(bs, offset, bytes);
+        raw_account_discard(s, bytes, ret);
+        return ret;
+    }
+#endif
     return raw_do_pdiscard(bs, offset, bytes, true);
 }
 
@@ -4430,6 +4796,11 @@ static coroutine_fn int hdev_co_pwrite_zeroes(BlockDriverState *bs,
         return rc;
     }
 
+#ifdef HAVE_IO_URING_NVME_CMD
+    if (((BDRVRawState *)bs->opaque)->nvme.enabled) {
+        return raw_co_nvme_write_zeroes(bs, offset, bytes, flags);
+    }
+#endif
     return raw_do_pwrite_zeroes(bs, offset, bytes, flags, true);
 }
 
@@ -4470,6 +4841,10 @@ static BlockDriver bdrv_host_device = {
     .bdrv_abort_perm_update = raw_abort_perm_update,
     .bdrv_probe_blocksizes = hdev_probe_blocksizes,
     .bdrv_probe_geometry = hdev_probe_geometry,
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+    .bdrv_register_buf      = raw_register_buf,
+    .bdrv_unregister_buf    = raw_unregister_buf,
+#endif
 
     /* generic scsi device */
 #ifdef __linux__
@@ -580,6 +580,21 @@ void bdrv_drain_all(void)
     bdrv_drain_all_end();
 }
 
+/*
+ * Index @req in bs->tracked_overlaps by its overlap region.  Zero-length
+ * requests are entered as one byte long so that the tree returns a superset
+ * of what tracked_request_overlaps() considers overlapping.
+ *
+ * Called with req->bs->reqs_lock held.
+ */
+static void tracked_request_index(BdrvTrackedRequest *req)
+{
+    req->overlap_node.start = req->overlap_offset;
+    req->overlap_node.last =
+        req->overlap_offset + MAX(req->overlap_bytes, 1) - 1;
+    interval_tree_insert(&req->overlap_node, &req->bs->tracked_overlaps);
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -593,6 +608,7 @@ static void coroutine_fn tracked_request_end(BdrvTrackedRequest *req)
 
     qemu_mutex_lock(&req->bs->reqs_lock);
     QLIST_REMOVE(req, list);
+    interval_tree_remove(&req->overlap_node, &req->bs->tracked_overlaps);
     qemu_mutex_unlock(&req->bs->reqs_lock);
 
     /*
@@ -629,6 +645,7 @@ static void coroutine_fn tracked_request_begin(BdrvTrackedRequest *req,
 
     qemu_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    tracked_request_index(req);
     qemu_mutex_unlock(&bs->reqs_lock);
 }
 
@@ -652,9 +669,18 @@ static bool tracked_request_overlaps(BdrvTrackedRequest *req,
 static coroutine_fn BdrvTrackedRequest *
 bdrv_find_conflicting_request(BdrvTrackedRequest *self)
 {
-    BdrvTrackedRequest *req;
+    IntervalTreeNode *node;
+    uint64_t start = self->overlap_offset;
+    uint64_t last = start + MAX(self->overlap_bytes, 1) - 1;
+
+    for (node = interval_tree_iter_first(&self->bs->tracked_overlaps,
+                                         start, last);
+         node != NULL;
+         node = interval_tree_iter_next(node, start, last))
+    {
+        BdrvTrackedRequest *req =
+            container_of(node, BdrvTrackedRequest, overlap_node);
 
-    QLIST_FOREACH(req, &self->bs->tracked_requests, list) {
         if (req == self || (!req->serialising && !self->serialising)) {
             continue;
         }
@@ -710,8 +736,10 @@ static void tracked_request_set_serialising(BdrvTrackedRequest *req,
         req->serialising = true;
     }
 
+    interval_tree_remove(&req->overlap_node, &req->bs->tracked_overlaps);
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+    tracked_request_index(req);
 }
 
 /**
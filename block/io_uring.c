@@ -16,6 +16,11 @@
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
 #include "qemu/defer-call.h"
+#include "qemu/error-report.h"
+#include "qemu/lockable.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
 #include "system/block-backend.h"
 #include "trace.h"
@@ -26,14 +31,32 @@
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Size of the registered file table, shared by all rings */
+#define MAX_FIXED_FILES 256
+
+/* Size of the registered buffer table, shared by all rings */
+#define MAX_FIXED_BUFFERS 1024
+
+/* The kernel refuses to register larger buffers */
+#define FIXED_BUFFER_MAX_SIZE (1 * GiB)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
-    struct io_uring_sqe sqeq;
+    union {
+        struct io_uring_sqe sqeq;
+        /* IORING_OP_URING_CMD payloads spill into the second half */
+        struct io_uring_sqe sqeq128[2];
+    };
     ssize_t ret;
     QEMUIOVector *qiov;
     bool is_read;
     QSIMPLEQ_ENTRY(LuringAIOCB) next;
 
+    /* Only for QEMU_AIO_IOCTL, see luring_co_submit_cmd() */
+    uint32_t cmd_op;
+    const void *cmd;
+    size_t cmd_len;
+
     /*
      * Buffered reads may require resubmission, see
      * luring_resubmit_short_read().
@@ -58,8 +81,117 @@ struct LuringState {
     LuringQueue io_q;
 
     QEMUBH *completion_bh;
+
+    /* Whether the ring has the registered file table installed */
+    bool fixed_files;
+
+    /* Whether the ring has the registered buffer table installed */
+    bool fixed_buffers;
+
+    /* Whether the ring was set up with 128-byte SQEs and 32-byte CQEs */
+    bool big_sqe;
+
+    /* Protected by fixed_lock */
+    QLIST_ENTRY(LuringState) next;
 };
 
+/*
+ * Registered ("fixed") files let the kernel skip the fd table lookup and
+ * file reference counting on every request.  Slots are allocated globally so
+ * that a BlockDriverState can use the same index in the ring of whichever
+ * AioContext submits its request; every ring mirrors fixed_files[].
+ */
+static QemuMutex fixed_lock;
+static int fixed_files[MAX_FIXED_FILES];
+static QLIST_HEAD(, LuringState) luring_states =
+    QLIST_HEAD_INITIALIZER(luring_states);
+
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+/*
+ * Registered ("fixed") buffers spare the kernel from pinning and mapping the
+ * pages of every request.  BlockRAMRegistrar registers guest RAM, which is
+ * split into slots of at most FIXED_BUFFER_MAX_SIZE bytes; like files, slots
+ * are global and every ring mirrors fixed_buffers[].  Buffers are reference
+ * counted because the BlockRAMRegistrar of every device registers them.
+ *
+ * Submission looks buffers up in an RCU-protected snapshot of the list so
+ * that iothreads do not take fixed_lock for every request.
+ */
+typedef struct LuringBuffer {
+    void *host;
+    size_t size;
+    int slot;               /* first slot, one per FIXED_BUFFER_MAX_SIZE */
+    unsigned int refcnt;
+} LuringBuffer;
+
+typedef struct LuringBufferMap {
+    struct rcu_head rcu;
+    unsigned int nr;
+    LuringBuffer buffers[];
+} LuringBufferMap;
+
+/* Protected by fixed_lock */
+static struct iovec fixed_buffers[MAX_FIXED_BUFFERS];
+static GArray *luring_buffers;
+
+static LuringBufferMap *luring_buffer_map;
+#endif
+
+static void __attribute__((constructor)) luring_fixed_files_init(void)
+{
+    qemu_mutex_init(&fixed_lock);
+    memset(fixed_files, -1, sizeof(fixed_files));
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+    luring_buffers = g_array_new(false, false, sizeof(LuringBuffer));
+#endif
+}
+
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+/* Return the buffer slot that contains [@base, @base + @len), or -1 */
+static int luring_find_buffer(void *base, size_t len)
+{
+    LuringBufferMap *map;
+    unsigned int i;
+
+    RCU_READ_LOCK_GUARD();
+
+    map = qatomic_rcu_read(&luring_buffer_map);
+    for (i = 0; map && i < map->nr; i++) {
+        LuringBuffer *b = &map->buffers[i];
+        size_t offset = (uintptr_t)base - (uintptr_t)b->host;
+
+        if ((uintptr_t)base < (uintptr_t)b->host || offset >= b->size) {
+            continue;
+        }
+        if (len > b->size - offset ||
+            offset / FIXED_BUFFER_MAX_SIZE !=
+            (offset + len - 1) / FIXED_BUFFER_MAX_SIZE) {
+            return -1;
+        }
+        return b->slot + offset / FIXED_BUFFER_MAX_SIZE;
+    }
+    return -1;
+}
+#endif
+
+/*
+ * Return the registered buffer slot for a request, or -1 if it has to be
+ * submitted with readv/writev.  Fixed buffer requests take a single buffer,
+ * so only requests with one I/O vector qualify.
+ */
+static int luring_fixed_buffer(LuringState *s, QEMUIOVector *qiov,
+                               BdrvRequestFlags flags)
+{
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+    if ((flags & BDRV_REQ_REGISTERED_BUF) && s->fixed_buffers &&
+        qiov->niov == 1 && qiov->iov[0].iov_len) {
+        return luring_find_buffer(qiov->iov[0].iov_base,
+                                  qiov->iov[0].iov_len);
+    }
+#endif
+    return -1;
+}
+
 /**
  * luring_resubmit:
  *
@@ -90,6 +222,14 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        luringcb->sqeq.off += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -184,6 +324,9 @@ static void luring_process_completions(LuringState *s)
                 luring_resubmit(s, luringcb);
                 continue;
             }
+        } else if (luringcb->cmd) {
+            /* Positive results are command-specific status codes */
+            ret = ret ? -EIO : 0;
         } else if (!luringcb->qiov) {
             goto end;
         } else if (total_bytes == luringcb->qiov->size) {
@@ -243,7 +386,11 @@ static int ioq_submit(LuringState *s)
                 break;
             }
             /* Prep sqe for submission */
-            *sqes = luringcb->sqeq;
+            if (luringcb->cmd) {
+                memcpy(sqes, luringcb->sqeq128, sizeof(luringcb->sqeq128));
+            } else {
+                *sqes = luringcb->sqeq;
+            }
             QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
         }
         ret = io_uring_submit(&s->ring);
@@ -326,6 +473,7 @@ static void luring_deferred_fn(void *opaque)
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
+ * @fixed_file: registered file slot for @fd, or -1
  * @luringcb: AIO control block
  * @s: AIO state
  * @offset: offset for request
@@ -334,19 +482,40 @@ static void luring_deferred_fn(void *opaque)
  * Fetches sqes from ring, adds to pending queue and preps them
  *
  */
-static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
-                            uint64_t offset, int type, BdrvRequestFlags flags)
+static int luring_do_submit(int fd, int fixed_file, LuringAIOCB *luringcb,
+                            LuringState *s, uint64_t offset, int type,
+                            BdrvRequestFlags flags)
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int buf_index = -1;
+
+    if (type == QEMU_AIO_WRITE || type == QEMU_AIO_READ) {
+        buf_index = luring_fixed_buffer(s, luringcb->qiov, flags);
+    }
+
+    if (fixed_file >= 0 && s->fixed_files) {
+        fd = fixed_file;
+    } else {
+        fixed_file = -1;
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
 #ifdef HAVE_IO_URING_PREP_WRITEV2
     {
         int luring_flags = (flags & BDRV_REQ_FUA) ? RWF_DSYNC : 0;
-        io_uring_prep_writev2(sqes, fd, luringcb->qiov->iov,
-                              luringcb->qiov->niov, offset, luring_flags);
+
+        if (buf_index >= 0) {
+            struct iovec *iov = &luringcb->qiov->iov[0];
+
+            io_uring_prep_write_fixed(sqes, fd, iov->iov_base, iov->iov_len,
+                                      offset, buf_index);
+            sqes->rw_flags = luring_flags;
+        } else {
+            io_uring_prep_writev2(sqes, fd, luringcb->qiov->iov,
+                                  luringcb->qiov->niov, offset, luring_flags);
+        }
     }
 #else
         assert(flags == 0);
@@ -359,17 +528,34 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                              luringcb->qiov->niov, offset);
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            struct iovec *iov = &luringcb->qiov->iov[0];
+
+            io_uring_prep_read_fixed(sqes, fd, iov->iov_base, iov->iov_len,
+                                     offset, buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                                luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
         break;
+#ifdef HAVE_IO_URING_NVME_CMD
+    case QEMU_AIO_IOCTL:
+        io_uring_prep_rw(IORING_OP_URING_CMD, sqes, fd, NULL, 0, 0);
+        sqes->cmd_op = luringcb->cmd_op;
+        memcpy(sqes->cmd, luringcb->cmd, luringcb->cmd_len);
+        break;
+#endif
     default:
         fprintf(stderr, "%s: invalid AIO request type, aborting 0x%x.\n",
                         __func__, type);
         abort();
     }
+    if (fixed_file >= 0) {
+        io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -388,7 +574,8 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
     return 0;
 }
 
-int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
+int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd,
+                                  int fixed_file, uint64_t offset,
                                   QEMUIOVector *qiov, int type,
                                   BdrvRequestFlags flags)
 {
@@ -403,7 +590,7 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
     };
     trace_luring_co_submit(bs, s, &luringcb, fd, offset, qiov ? qiov->size : 0,
                            type);
-    ret = luring_do_submit(fd, &luringcb, s, offset, type, flags);
+    ret = luring_do_submit(fd, fixed_file, &luringcb, s, offset, type, flags);
 
     if (ret < 0) {
         return ret;
@@ -415,6 +602,59 @@ int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
     return luringcb.ret;
 }
 
+#ifdef HAVE_IO_URING_NVME_CMD
+int coroutine_fn luring_co_submit_cmd(BlockDriverState *bs, int fd,
+                                      int fixed_file, uint32_t cmd_op,
+                                      const void *cmd, size_t cmd_len)
+{
+    int ret;
+    AioContext *ctx = qemu_get_current_aio_context();
+    LuringState *s = aio_get_linux_io_uring(ctx);
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .cmd_op     = cmd_op,
+        .cmd        = cmd,
+        .cmd_len    = cmd_len,
+    };
+
+    /* The command must fit in the 80 bytes following sqe->cmd */
+    assert(cmd_len <= sizeof(luringcb.sqeq128) -
+                      offsetof(struct io_uring_sqe, cmd));
+
+    if (!s->big_sqe) {
+        return -ENOTSUP;
+    }
+
+    trace_luring_co_submit_cmd(bs, s, &luringcb, fd, cmd_op);
+    ret = luring_do_submit(fd, fixed_file, &luringcb, s, 0, QEMU_AIO_IOCTL, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+bool luring_has_cmd(void)
+{
+    static int supported = -1;
+    struct io_uring_probe *probe;
+
+    if (supported == -1) {
+        probe = io_uring_get_probe();
+        supported = probe &&
+                    io_uring_opcode_supported(probe, IORING_OP_URING_CMD);
+        if (probe) {
+            io_uring_free_probe(probe);
+        }
+    }
+    return supported;
+}
+#endif
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context)
 {
     aio_set_fd_handler(old_context, s->ring.ring_fd,
@@ -432,7 +672,35 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+static int luring_queue_init(LuringState *s, unsigned int sqpoll_idle)
+{
+    struct io_uring_params params = {
+        .flags = sqpoll_idle ? IORING_SETUP_SQPOLL : 0,
+        .sq_thread_idle = sqpoll_idle,
+    };
+    int rc;
+
+#ifdef HAVE_IO_URING_NVME_CMD
+    /*
+     * Big entries are needed for passthrough commands.  They cost nothing for
+     * other requests beyond a larger ring, so ask for them unconditionally
+     * and only give up on them if the kernel is too old (before Linux 5.19).
+     */
+    params.flags |= IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+    rc = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &params);
+    if (rc != -EINVAL) {
+        s->big_sqe = rc == 0;
+        return rc;
+    }
+    params.flags &= ~(IORING_SETUP_SQE128 | IORING_SETUP_CQE32);
+#endif
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &params);
+    s->big_sqe = false;
+    return rc;
+}
+
+LuringState *luring_init(unsigned int sqpoll_idle, Error **errp)
 {
     int rc;
     LuringState *s = g_new0(LuringState, 1);
@@ -440,7 +708,13 @@ LuringState *luring_init(Error **errp)
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    rc = luring_queue_init(s, sqpoll_idle);
+    if (rc < 0 && sqpoll_idle) {
+        /* Needs CAP_SYS_NICE before Linux 5.11, keep going without it */
+        warn_report("failed to enable io_uring SQPOLL mode: %s",
+                    strerror(-rc));
+        rc = luring_queue_init(s, 0);
+    }
     if (rc < 0) {
         error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
@@ -448,17 +722,245 @@ LuringState *luring_init(Error **errp)
     }
 
     ioq_init(&s->io_q);
-    return s;
 
+    /*
+     * Empty slots are registered as -1 so that files can later be installed
+     * with io_uring_register_files_update().  Old kernels may refuse this;
+     * the ring then simply submits requests with plain file descriptors.
+     */
+    qemu_mutex_lock(&fixed_lock);
+    rc = io_uring_register_files(ring, fixed_files, MAX_FIXED_FILES);
+    s->fixed_files = rc == 0;
+    trace_luring_register_files(s, rc);
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+    rc = io_uring_register_buffers_sparse(ring, MAX_FIXED_BUFFERS);
+    if (rc == 0 && luring_buffers->len) {
+        rc = io_uring_register_buffers_update_tag(ring, 0, fixed_buffers, NULL,
+                                                  MAX_FIXED_BUFFERS);
+        if (rc != MAX_FIXED_BUFFERS) {
+            io_uring_unregister_buffers(ring);
+            rc = rc < 0 ? rc : -ENOMEM;
+        } else {
+            rc = 0;
+        }
+    }
+    s->fixed_buffers = rc == 0;
+    trace_luring_register_buffers(s, rc);
+#endif
+    QLIST_INSERT_HEAD(&luring_states, s, next);
+    qemu_mutex_unlock(&fixed_lock);
+
+    return s;
 }
 
 void luring_cleanup(LuringState *s)
 {
+    qemu_mutex_lock(&fixed_lock);
+    QLIST_REMOVE(s, next);
+    qemu_mutex_unlock(&fixed_lock);
+
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
     g_free(s);
 }
 
+/*
+ * Install @fd in @slot of every ring.  On failure, the slot is cleared again
+ * in all rings.  Called with fixed_lock held.
+ */
+static bool luring_set_fixed_file(int slot, int fd)
+{
+    LuringState *s;
+    int rc;
+
+    QLIST_FOREACH(s, &luring_states, next) {
+        if (!s->fixed_files) {
+            continue;
+        }
+        /*
+         * io_uring_register(2) only takes the ring's internal lock, so this
+         * is safe against concurrent submission from the home thread.
+         */
+        rc = io_uring_register_files_update(&s->ring, slot, &fd, 1);
+        trace_luring_update_file(s, slot, fd, rc);
+        if (rc < 0 && fd != -1) {
+            luring_set_fixed_file(slot, -1);
+            return false;
+        }
+    }
+
+    fixed_files[slot] = fd;
+    return true;
+}
+
+int luring_register_file(int fd)
+{
+    int slot;
+
+    QEMU_LOCK_GUARD(&fixed_lock);
+
+    for (slot = 0; slot < MAX_FIXED_FILES; slot++) {
+        if (fixed_files[slot] == -1) {
+            return luring_set_fixed_file(slot, fd) ? slot : -1;
+        }
+    }
+    return -1;
+}
+
+bool luring_replace_file(int fixed_file, int fd)
+{
+    QEMU_LOCK_GUARD(&fixed_lock);
+
+    assert(fixed_files[fixed_file] != -1);
+    return luring_set_fixed_file(fixed_file, fd);
+}
+
+void luring_unregister_file(int fixed_file)
+{
+    QEMU_LOCK_GUARD(&fixed_lock);
+
+    assert(fixed_files[fixed_file] != -1);
+    luring_set_fixed_file(fixed_file, -1);
+}
+
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+/*
+ * Install fixed_buffers[@slot, @slot + @nr) in every ring.  On failure, the
+ * slots are cleared again in all rings.  Called with fixed_lock held.
+ */
+static bool luring_set_fixed_buffers(int slot, int nr)
+{
+    LuringState *s;
+    int rc;
+
+    QLIST_FOREACH(s, &luring_states, next) {
+        if (!s->fixed_buffers) {
+            continue;
+        }
+        rc = io_uring_register_buffers_update_tag(&s->ring, slot,
+                                                  &fixed_buffers[slot], NULL,
+                                                  nr);
+        trace_luring_update_buffers(s, slot, nr, rc);
+        if (rc != nr && fixed_buffers[slot].iov_base) {
+            memset(&fixed_buffers[slot], 0, nr * sizeof(fixed_buffers[0]));
+            luring_set_fixed_buffers(slot, nr);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Publish luring_buffers for submission.  Called with fixed_lock held. */
+static void luring_publish_buffers(void)
+{
+    LuringBufferMap *old = luring_buffer_map;
+    LuringBufferMap *map;
+
+    map = g_malloc(sizeof(*map) + luring_buffers->len * sizeof(LuringBuffer));
+    map->nr = luring_buffers->len;
+    memcpy(map->buffers, luring_buffers->data,
+           luring_buffers->len * sizeof(LuringBuffer));
+
+    qatomic_rcu_set(&luring_buffer_map, map);
+    if (old) {
+        g_free_rcu(old, rcu);
+    }
+}
+
+static LuringBuffer *luring_lookup_buffer(void *host, unsigned int *index)
+{
+    unsigned int i;
+
+    for (i = 0; i < luring_buffers->len; i++) {
+        LuringBuffer *b = &g_array_index(luring_buffers, LuringBuffer, i);
+
+        if (b->host == host) {
+            *index = i;
+            return b;
+        }
+    }
+    return NULL;
+}
+
+void luring_register_buffer(void *host, size_t size)
+{
+    int nr = DIV_ROUND_UP(size, FIXED_BUFFER_MAX_SIZE);
+    LuringBuffer *b;
+    unsigned int index;
+    int slot, i;
+
+    if (!size) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&fixed_lock);
+
+    b = luring_lookup_buffer(host, &index);
+    if (b) {
+        assert(b->size == size);
+        b->refcnt++;
+        return;
+    }
+
+    /* Look for @nr consecutive free slots */
+    for (slot = 0, i = 0; slot + i < MAX_FIXED_BUFFERS && i < nr; ) {
+        if (fixed_buffers[slot + i].iov_base) {
+            slot += i + 1;
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+    if (i < nr) {
+        return;
+    }
+
+    for (i = 0; i < nr; i++) {
+        size_t offset = (size_t)i * FIXED_BUFFER_MAX_SIZE;
+
+        fixed_buffers[slot + i] = (struct iovec) {
+            .iov_base = host + offset,
+            .iov_len = MIN(size - offset, FIXED_BUFFER_MAX_SIZE),
+        };
+    }
+    if (!luring_set_fixed_buffers(slot, nr)) {
+        return;
+    }
+
+    g_array_append_val(luring_buffers, ((LuringBuffer) {
+        .host = host,
+        .size = size,
+        .slot = slot,
+        .refcnt = 1,
+    }));
+    luring_publish_buffers();
+}
+
+void luring_unregister_buffer(void *host, size_t size)
+{
+    LuringBuffer *b;
+    unsigned int index;
+    int slot, nr;
+
+    QEMU_LOCK_GUARD(&fixed_lock);
+
+    /* Not found if the buffer could not be registered */
+    b = luring_lookup_buffer(host, &index);
+    if (!b || --b->refcnt) {
+        return;
+    }
+
+    assert(b->size == size);
+    slot = b->slot;
+    nr = DIV_ROUND_UP(size, FIXED_BUFFER_MAX_SIZE);
+    g_array_remove_index_fast(luring_buffers, index);
+    luring_publish_buffers();
+
+    memset(&fixed_buffers[slot], 0, nr * sizeof(fixed_buffers[0]));
+    luring_set_fixed_buffers(slot, nr);
+}
+#endif
+
 bool luring_has_fua(void)
 {
 #ifdef HAVE_IO_URING_PREP_WRITEV2
@@ -24,11 +24,30 @@
 #include "qemu/ratelimit.h"
 #include "qemu/bitmap.h"
 #include "qemu/memalign.h"
+#include "qemu/stats64.h"
+#include "qemu/timer.h"
 
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/*
+ * If enabled, the in-flight depth and request size are adapted to the latency
+ * of the source and the target, see mirror_adapt().  A device is considered
+ * congested when the average latency exceeds MIRROR_CONGESTION_FACTOR times
+ * its baseline plus MIRROR_LATENCY_SLACK_NS.
+ */
+#define MIRROR_CONGESTION_FACTOR 2
+#define MIRROR_LATENCY_SLACK_NS (500 * SCALE_US)
+#define MIRROR_LATENCY_WINDOW_NS (10 * NANOSECONDS_PER_SECOND)
+#define MIRROR_LATENCY_MIN_SAMPLES 8
+
+/* Maximum number of dirty chunks written by the guest to skip at once */
+#define MIRROR_MAX_HOT_SKIP 256
+
+/* Interval for sampling the copy and dirty rates */
+#define MIRROR_RATE_INTERVAL_NS NANOSECONDS_PER_SECOND
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -38,6 +57,21 @@ typedef struct MirrorBuffer {
 
 typedef struct MirrorOp MirrorOp;
 
+/*
+ * Latency of the requests that the job sends to the source or the target.
+ * The baseline is the lowest latency seen in the current and the previous
+ * window and approximates the latency of an otherwise idle device; an
+ * average well above it means that requests queue up, behind our own or
+ * behind guest requests.
+ */
+typedef struct MirrorLatency {
+    int64_t avg_ns;
+    int64_t min_ns;
+    int64_t window_min_ns;
+    int64_t window_start_ns;
+    unsigned samples;
+} MirrorLatency;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     BlockBackend *target;
@@ -84,6 +118,31 @@ typedef struct MirrorBlockJob {
     unsigned long *in_flight_bitmap;
     unsigned in_flight;
     int64_t bytes_in_flight;
+    /*
+     * Current limits for background copying.  They stay at their static
+     * values unless @adaptive is set, see mirror_adapt().
+     */
+    bool adaptive;
+    unsigned max_in_flight;
+    int64_t max_io_bytes;
+    int64_t max_io_bytes_limit;
+    int64_t last_adapt_ns;
+    MirrorLatency read_latency;
+    MirrorLatency write_latency;
+    /*
+     * Chunks written by the guest since the current pass over the dirty
+     * bitmap started, and the number of bytes written by the guest in
+     * background mode.  Both are protected by the dirty bitmap lock.
+     */
+    unsigned long *hot_bitmap;
+    uint64_t bytes_dirtied;
+    /* For the convergence estimate reported by mirror_query() */
+    uint64_t bytes_copied;
+    uint64_t rate_sample_copied;
+    uint64_t rate_sample_dirtied;
+    int64_t rate_sample_ns;
+    Stat64 copy_rate;
+    Stat64 dirty_rate;
     QTAILQ_HEAD(, MirrorOp) ops_in_flight;
     int ret;
     bool unmap;
@@ -145,6 +204,88 @@ static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
     }
 }
 
+static void mirror_latency_reset(MirrorLatency *l, int64_t now)
+{
+    *l = (MirrorLatency) {
+        .min_ns             = INT64_MAX,
+        .window_min_ns      = INT64_MAX,
+        .window_start_ns    = now,
+    };
+}
+
+static void mirror_latency_add(MirrorLatency *l, int64_t start_ns,
+                               int64_t now)
+{
+    int64_t ns = now - start_ns;
+
+    l->avg_ns = l->samples ? l->avg_ns - l->avg_ns / 8 + ns / 8 : ns;
+    l->samples++;
+    l->min_ns = MIN(l->min_ns, ns);
+    l->window_min_ns = MIN(l->window_min_ns, ns);
+    if (now - l->window_start_ns > MIRROR_LATENCY_WINDOW_NS) {
+        /* Forget old minimums so that the baseline follows the device */
+        l->min_ns = l->window_min_ns;
+        l->window_min_ns = INT64_MAX;
+        l->window_start_ns = now;
+    }
+}
+
+static bool mirror_latency_congested(MirrorLatency *l)
+{
+    return l->samples >= MIRROR_LATENCY_MIN_SAMPLES &&
+           l->avg_ns > MIRROR_CONGESTION_FACTOR * l->min_ns +
+                       MIRROR_LATENCY_SLACK_NS;
+}
+
+/*
+ * Adapt the number of copy requests in flight and their size after a copy
+ * request completed, in an additive increase, multiplicative decrease
+ * fashion.  When the source or the target is congested, the depth is halved
+ * and once it is down to a single request, the request size is.  Otherwise,
+ * as long as the current limits are what holds the job back, first the
+ * request size and then the depth grow again up to the static limits.
+ *
+ * Changing the request size changes the expected latency, so the latency
+ * statistics start over in that case.  Adjustments are made at most once per
+ * round trip so that they can take effect before the next one.
+ */
+static void mirror_adapt(MirrorBlockJob *s, int64_t now)
+{
+    if (now - s->last_adapt_ns <
+        s->read_latency.avg_ns + s->write_latency.avg_ns) {
+        return;
+    }
+
+    if (mirror_latency_congested(&s->read_latency) ||
+        mirror_latency_congested(&s->write_latency)) {
+        if (s->max_in_flight > 1) {
+            s->max_in_flight /= 2;
+        } else if (s->max_io_bytes > s->granularity) {
+            s->max_io_bytes = MAX(s->max_io_bytes / 2, s->granularity);
+            mirror_latency_reset(&s->read_latency, now);
+            mirror_latency_reset(&s->write_latency, now);
+        } else {
+            return;
+        }
+    } else if (s->in_flight >= s->max_in_flight) {
+        if (s->max_io_bytes < s->max_io_bytes_limit) {
+            s->max_io_bytes = MIN(s->max_io_bytes * 2, s->max_io_bytes_limit);
+            mirror_latency_reset(&s->read_latency, now);
+            mirror_latency_reset(&s->write_latency, now);
+        } else if (s->max_in_flight < MAX_IN_FLIGHT) {
+            s->max_in_flight++;
+        } else {
+            return;
+        }
+    } else {
+        return;
+    }
+
+    s->last_adapt_ns = now;
+    trace_mirror_adapt(s, s->max_in_flight, s->max_io_bytes,
+                       s->read_latency.avg_ns, s->write_latency.avg_ns);
+}
+
 static void coroutine_fn mirror_wait_on_conflicts(MirrorOp *self,
                                                   MirrorBlockJob *s,
                                                   uint64_t offset,
@@ -227,6 +368,7 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         }
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
+            s->bytes_copied += op->bytes;
         }
     }
     qemu_iovec_destroy(&op->qiov);
@@ -255,6 +397,7 @@ static void coroutine_fn mirror_write_complete(MirrorOp *op, int ret)
 static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
 {
     MirrorBlockJob *s = op->s;
+    int64_t start_ns;
 
     if (ret < 0) {
         BlockErrorAction action;
@@ -269,7 +412,16 @@ static void coroutine_fn mirror_read_complete(MirrorOp *op, int ret)
         return;
     }
 
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     ret = blk_co_pwritev(s->target, op->offset, op->qiov.size, &op->qiov, 0);
+    if (ret >= 0) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+        mirror_latency_add(&s->write_latency, start_ns, now);
+        if (s->adaptive) {
+            mirror_adapt(s, now);
+        }
+    }
     mirror_write_complete(op, ret);
 }
 
@@ -355,6 +507,7 @@ static void coroutine_fn mirror_co_read(void *opaque)
     int nb_chunks;
     int ret = -1;
     uint64_t max_bytes;
+    int64_t start_ns;
 
     max_bytes = s->granularity * s->max_iov;
 
@@ -402,10 +555,15 @@ static void coroutine_fn mirror_co_read(void *opaque)
     op->is_in_flight = true;
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     WITH_GRAPH_RDLOCK_GUARD() {
         ret = bdrv_co_preadv(s->mirror_top_bs->backing, op->offset, op->bytes,
                              &op->qiov, 0);
     }
+    if (ret >= 0) {
+        mirror_latency_add(&s->read_latency, start_ns,
+                           qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+    }
     mirror_read_complete(op, ret);
 }
 
@@ -517,6 +675,50 @@ static unsigned mirror_perform(MirrorBlockJob *s, int64_t offset,
     return bytes_handled;
 }
 
+/*
+ * Return the next dirty offset to copy.  Chunks that the guest wrote to
+ * since the current pass over the dirty bitmap started are likely to be
+ * written again soon, so copying them now would probably be wasted; they
+ * are skipped in favour of colder dirty chunks, up to MIRROR_MAX_HOT_SKIP at
+ * a time, and copied when nothing else is left in this pass.
+ *
+ * Called with the dirty bitmap lock held.
+ */
+static int64_t mirror_next_dirty_offset(MirrorBlockJob *s)
+{
+    int64_t offset;
+    int64_t first_hot = -1;
+    int skipped = 0;
+
+    for (;;) {
+        offset = bdrv_dirty_iter_next(s->dbi);
+        if (offset < 0) {
+            break;
+        }
+        if (!test_bit(offset / s->granularity, s->hot_bitmap) ||
+            skipped == MIRROR_MAX_HOT_SKIP) {
+            return offset;
+        }
+        if (first_hot < 0) {
+            first_hot = offset;
+        }
+        skipped++;
+    }
+
+    if (first_hot >= 0) {
+        bdrv_set_dirty_iter(s->dbi, first_hot);
+        return bdrv_dirty_iter_next(s->dbi);
+    }
+
+    /* Start a new pass; hotness is relative to the pass */
+    bitmap_zero(s->hot_bitmap, DIV_ROUND_UP(s->bdev_length, s->granularity));
+    bdrv_set_dirty_iter(s->dbi, 0);
+    offset = bdrv_dirty_iter_next(s->dbi);
+    trace_mirror_restart_iter(s, bdrv_get_dirty_count(s->dirty_bitmap));
+    assert(offset >= 0);
+    return offset;
+}
+
 static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source;
@@ -525,20 +727,13 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
 
     bdrv_graph_co_rdlock();
     source = s->mirror_top_bs->backing->bs;
     bdrv_graph_co_rdunlock();
 
     bdrv_dirty_bitmap_lock(s->dirty_bitmap);
-    offset = bdrv_dirty_iter_next(s->dbi);
-    if (offset < 0) {
-        bdrv_set_dirty_iter(s->dbi, 0);
-        offset = bdrv_dirty_iter_next(s->dbi);
-        trace_mirror_restart_iter(s, bdrv_get_dirty_count(s->dirty_bitmap));
-        assert(offset >= 0);
-    }
+    offset = mirror_next_dirty_offset(s);
     bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
 
     /*
@@ -615,9 +810,9 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
                                              &io_bytes, NULL, NULL);
         }
         if (ret < 0) {
-            io_bytes = MIN(nb_chunks * s->granularity, max_io_bytes);
+            io_bytes = MIN(nb_chunks * s->granularity, s->max_io_bytes);
         } else if (ret & BDRV_BLOCK_DATA) {
-            io_bytes = MIN(io_bytes, max_io_bytes);
+            io_bytes = MIN(io_bytes, s->max_io_bytes);
         }
 
         io_bytes -= io_bytes % s->granularity;
@@ -638,7 +833,7 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -1008,6 +1203,49 @@ static int coroutine_fn mirror_flush(MirrorBlockJob *s)
     return ret;
 }
 
+static uint64_t mirror_rate_avg(uint64_t avg, uint64_t bytes,
+                                int64_t elapsed_ns)
+{
+    uint64_t rate = muldiv64(bytes, 1000,
+                             MIN(elapsed_ns / SCALE_MS, UINT32_MAX));
+
+    /* Exponential moving average, the new sample weighs a quarter */
+    return avg - avg / 4 + rate / 4;
+}
+
+/*
+ * Sample the rate at which data is copied to the target and the rate at
+ * which the guest dirties data in the source, for the convergence estimate.
+ */
+static void mirror_update_rates(MirrorBlockJob *s)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed = now - s->rate_sample_ns;
+    uint64_t dirtied;
+
+    if (elapsed < MIRROR_RATE_INTERVAL_NS) {
+        return;
+    }
+
+    bdrv_dirty_bitmap_lock(s->dirty_bitmap);
+    dirtied = s->bytes_dirtied;
+    bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
+
+    stat64_set(&s->copy_rate,
+               mirror_rate_avg(stat64_get(&s->copy_rate),
+                               s->bytes_copied - s->rate_sample_copied,
+                               elapsed));
+    stat64_set(&s->dirty_rate,
+               mirror_rate_avg(stat64_get(&s->dirty_rate),
+                               dirtied - s->rate_sample_dirtied, elapsed));
+    s->rate_sample_copied = s->bytes_copied;
+    s->rate_sample_dirtied = dirtied;
+    s->rate_sample_ns = now;
+
+    trace_mirror_update_rates(s, stat64_get(&s->copy_rate),
+                              stat64_get(&s->dirty_rate));
+}
+
 static int coroutine_fn mirror_run(Job *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
@@ -1074,6 +1312,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     length = DIV_ROUND_UP(s->bdev_length, s->granularity);
     s->in_flight_bitmap = bitmap_new(length);
+    s->hot_bitmap = bitmap_new(length);
 
     /* If we have no backing file yet in the destination, we cannot let
      * the destination do COW.  Instead, we copy sectors around the
@@ -1103,6 +1342,10 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
 
     mirror_free_init(s);
 
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->max_io_bytes_limit = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    s->max_io_bytes = s->max_io_bytes_limit;
+
     s->last_pause_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     if (s->sync_mode != MIRROR_SYNC_MODE_NONE) {
         ret = mirror_dirty_init(s);
@@ -1117,6 +1360,10 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
      */
     mirror_top_opaque->job = s;
 
+    s->rate_sample_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    mirror_latency_reset(&s->read_latency, s->rate_sample_ns);
+    mirror_latency_reset(&s->write_latency, s->rate_sample_ns);
+
     assert(!s->dbi);
     s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap);
     for (;;) {
@@ -1142,6 +1389,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         job_progress_set_remaining(&s->common.job,
                                    s->bytes_in_flight + cnt +
                                    s->active_write_bytes_in_flight);
+        mirror_update_rates(s);
 
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that bdrv_drain_all() returns.
@@ -1153,7 +1401,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         }
         if (delta < BLOCK_JOB_SLICE_TIME &&
             iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1256,6 +1504,10 @@ immediate_exit:
         bdrv_drained_begin(bs);
     }
 
+    /* The source is drained, so bdrv_mirror_top_do_write() can't access it */
+    g_free(s->hot_bitmap);
+    s->hot_bitmap = NULL;
+
     return ret;
 }
 
@@ -1380,9 +1632,23 @@ static void mirror_query(BlockJob *job, BlockJobInfo *info)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common);
 
+    uint64_t copy_rate = stat64_get(&s->copy_rate);
+    uint64_t dirty_rate = stat64_get(&s->dirty_rate);
+
     info->u.mirror = (BlockJobInfoMirror) {
         .actively_synced = qatomic_read(&s->actively_synced),
+        .copy_rate = copy_rate,
+        .dirty_rate = dirty_rate,
     };
+
+    if (info->len && info->offset >= info->len) {
+        info->u.mirror.has_convergence_estimate = true;
+        info->u.mirror.convergence_estimate = 0;
+    } else if (copy_rate > dirty_rate) {
+        info->u.mirror.has_convergence_estimate = true;
+        info->u.mirror.convergence_estimate =
+            DIV_ROUND_UP(info->len - info->offset, copy_rate - dirty_rate);
+    }
 }
 
 static const BlockJobDriver mirror_job_driver = {
@@ -1667,8 +1933,18 @@ bdrv_mirror_top_do_write(BlockDriverState *bs, MirrorMethod method,
     }
 
     if (!copy_to_target && s->job && s->job->dirty_bitmap) {
-        qatomic_set(&s->job->actively_synced, false);
-        bdrv_set_dirty_bitmap(s->job->dirty_bitmap, offset, bytes);
+        MirrorBlockJob *job = s->job;
+
+        qatomic_set(&job->actively_synced, false);
+        bdrv_dirty_bitmap_lock(job->dirty_bitmap);
+        bdrv_set_dirty_bitmap_locked(job->dirty_bitmap, offset, bytes);
+        if (job->hot_bitmap) {
+            bitmap_set(job->hot_bitmap, offset / job->granularity,
+                       DIV_ROUND_UP(offset + bytes, job->granularity) -
+                       offset / job->granularity);
+        }
+        job->bytes_dirtied += bytes;
+        bdrv_dirty_bitmap_unlock(job->dirty_bitmap);
     }
 
     if (ret < 0) {
@@ -1832,7 +2108,7 @@ static BlockJob *mirror_start_job(
                              BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
-                             bool base_ro,
+                             bool adaptive, bool base_ro,
                              Error **errp)
 {
     MirrorBlockJob *s;
@@ -1997,6 +2273,7 @@ static BlockJob *mirror_start_job(
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->adaptive = adaptive;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -2128,7 +2405,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, bool adaptive, Error **errp)
 {
     BlockDriverState *base;
 
@@ -2149,7 +2426,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, mode, backing_mode,
                      target_is_zero, on_source_error, on_target_error, unmap,
                      NULL, NULL, &mirror_job_driver, base, false,
-                     filter_node_name, true, copy_mode, false, errp);
+                     filter_node_name, true, copy_mode, adaptive, false, errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -2178,7 +2455,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     base_read_only, errp);
+                     false, base_read_only, errp);
     if (!job) {
         goto error_restore_flags;
     }
@@ -36,8 +36,12 @@
 #include "qapi/error.h"
 #include "qapi/qapi-commands-block.h"
 #include "qobject/qdict.h"
+#include "qemu/host-utils.h"
+#include "qemu/module.h"
 #include "system/block-backend.h"
 #include "system/blockdev.h"
+#include "system/stats.h"
+#include "hw/qdev-core.h"
 
 static BlockBackend *qmp_get_blk(const char *blk_name, const char *qdev_id,
                                  Error **errp)
@@ -572,3 +576,191 @@ void qmp_block_latency_histogram_set(
         }
     }
 }
+
+/*
+ * query-stats support.  Only BlockBackends that are attached to a device are
+ * reported, identified by the QOM path of the device.
+ */
+
+#define BLOCK_STATS_LOG2_BUCKETS (BLOCK_ACCT_HIST_MAX_BITS + 1)
+
+static const struct {
+    enum BlockAcctType type;
+    const char *prefix;
+    bool has_bytes;
+} block_stats_types[] = {
+    { BLOCK_ACCT_READ,          "rd",           true },
+    { BLOCK_ACCT_WRITE,         "wr",           true },
+    { BLOCK_ACCT_ZONE_APPEND,   "zone-append",  true },
+    { BLOCK_ACCT_FLUSH,         "flush",        false },
+    { BLOCK_ACCT_UNMAP,         "unmap",        true },
+};
+
+static StatsList *block_stats_add_scalar(StatsList *list, strList *names,
+                                         const char *prefix, const char *suffix,
+                                         uint64_t value)
+{
+    g_autofree char *name = g_strdup_printf("%s-%s", prefix, suffix);
+    Stats *stats;
+
+    if (!apply_str_list_filter(name, names)) {
+        return list;
+    }
+
+    stats = g_new0(Stats, 1);
+    stats->name = g_steal_pointer(&name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QNUM;
+    stats->value->u.scalar = value;
+
+    QAPI_LIST_PREPEND(list, stats);
+    return list;
+}
+
+/*
+ * Fold the log-linear latency buckets of @type into a log2 histogram as
+ * defined by query-stats: bucket 0 counts latencies of 0 ns, bucket i > 0
+ * counts latencies in [2^(i-1), 2^i) ns.  Every log-linear bucket lies within
+ * a single power of two, so this is exact.
+ */
+static StatsList *block_stats_add_latency(StatsList *list, strList *names,
+                                          BlockAcctStats *acct,
+                                          enum BlockAcctType type,
+                                          const char *prefix)
+{
+    g_autofree char *name = g_strdup_printf("%s-latency", prefix);
+    g_autofree uint64_t *buckets = NULL;
+    uint64_t log2_buckets[BLOCK_STATS_LOG2_BUCKETS] = { 0 };
+    uint64List *values = NULL;
+    Stats *stats;
+    int i;
+
+    if (!apply_str_list_filter(name, names)) {
+        return list;
+    }
+
+    buckets = g_new(uint64_t, BLOCK_ACCT_HIST_BUCKETS);
+    block_acct_get_latency_buckets(acct, type, buckets);
+    for (i = 0; i < BLOCK_ACCT_HIST_BUCKETS; i++) {
+        uint64_t min = block_acct_latency_bucket_min(i);
+
+        log2_buckets[min ? 64 - clz64(min) : 0] += buckets[i];
+    }
+
+    for (i = BLOCK_STATS_LOG2_BUCKETS - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(values, log2_buckets[i]);
+    }
+
+    stats = g_new0(Stats, 1);
+    stats->name = g_steal_pointer(&name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QLIST;
+    stats->value->u.list = values;
+
+    QAPI_LIST_PREPEND(list, stats);
+    return list;
+}
+
+static void block_stats_cb(StatsResultList **result, StatsTarget target,
+                           strList *names, strList *targets, Error **errp)
+{
+    BlockBackend *blk;
+
+    if (target != STATS_TARGET_BLOCK) {
+        return;
+    }
+
+    for (blk = blk_all_next(NULL); blk; blk = blk_all_next(blk)) {
+        DeviceState *dev = blk_get_attached_dev(blk);
+        BlockAcctStats *acct = blk_get_stats(blk);
+        StatsList *list = NULL;
+        BlockAcctCounters c;
+        StatsResult *entry;
+        int i;
+
+        if (!dev) {
+            continue;
+        }
+
+        block_acct_get_counters(acct, &c);
+        for (i = 0; i < ARRAY_SIZE(block_stats_types); i++) {
+            enum BlockAcctType type = block_stats_types[i].type;
+            const char *prefix = block_stats_types[i].prefix;
+
+            list = block_stats_add_scalar(list, names, prefix, "operations",
+                                          c.nr_ops[type]);
+            if (block_stats_types[i].has_bytes) {
+                list = block_stats_add_scalar(list, names, prefix, "bytes",
+                                              c.nr_bytes[type]);
+            }
+            list = block_stats_add_scalar(list, names, prefix, "total-time",
+                                          c.total_time_ns[type]);
+            list = block_stats_add_latency(list, names, acct, type, prefix);
+        }
+
+        if (!list) {
+            continue;
+        }
+
+        entry = g_new0(StatsResult, 1);
+        entry->provider = STATS_PROVIDER_BLOCK;
+        entry->qom_path = object_get_canonical_path(OBJECT(dev));
+        entry->stats = list;
+        QAPI_LIST_PREPEND(*result, entry);
+    }
+}
+
+static StatsSchemaValueList *
+block_stats_schema_add(StatsSchemaValueList *list, const char *prefix,
+                       const char *suffix, StatsType type, bool has_unit,
+                       StatsUnit unit, int16_t exponent)
+{
+    StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+    value->name = g_strdup_printf("%s-%s", prefix, suffix);
+    value->type = type;
+    value->has_unit = has_unit;
+    value->unit = unit;
+    value->exponent = exponent;
+    if (exponent) {
+        value->has_base = true;
+        value->base = 10;
+    }
+
+    QAPI_LIST_PREPEND(list, value);
+    return list;
+}
+
+static void block_stats_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *list = NULL;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(block_stats_types); i++) {
+        const char *prefix = block_stats_types[i].prefix;
+
+        list = block_stats_schema_add(list, prefix, "operations",
+                                      STATS_TYPE_CUMULATIVE, false, 0, 0);
+        if (block_stats_types[i].has_bytes) {
+            list = block_stats_schema_add(list, prefix, "bytes",
+                                          STATS_TYPE_CUMULATIVE,
+                                          true, STATS_UNIT_BYTES, 0);
+        }
+        list = block_stats_schema_add(list, prefix, "total-time",
+                                      STATS_TYPE_CUMULATIVE,
+                                      true, STATS_UNIT_SECONDS, -9);
+        list = block_stats_schema_add(list, prefix, "latency",
+                                      STATS_TYPE_LOG2_HISTOGRAM,
+                                      true, STATS_UNIT_SECONDS, -9);
+    }
+
+    add_stats_schema(result, STATS_PROVIDER_BLOCK, STATS_TARGET_BLOCK, list);
+}
+
+static void block_stats_init(void)
+{
+    add_stats_callbacks(STATS_PROVIDER_BLOCK, block_stats_cb,
+                        block_stats_schemas_cb);
+}
+
+block_init(block_stats_init);
@@ -492,49 +492,103 @@ bdrv_latency_histogram_stats(BlockLatencyHistogram *hist)
     return info;
 }
 
+/*
+ * Convert the log-linear latency histogram of @type into a
+ * BlockLatencyHistogramInfo.  Only the buckets that contain requests get
+ * their own bins, runs of empty buckets are merged into a single empty bin.
+ */
+static BlockLatencyHistogramInfo *
+bdrv_latency_log_histogram_stats(BlockAcctStats *stats,
+                                 enum BlockAcctType type)
+{
+    g_autofree uint64_t *buckets = g_new(uint64_t, BLOCK_ACCT_HIST_BUCKETS);
+    g_autofree uint64_t *boundaries =
+        g_new(uint64_t, 2 * BLOCK_ACCT_HIST_BUCKETS);
+    g_autofree uint64_t *bins =
+        g_new(uint64_t, 2 * BLOCK_ACCT_HIST_BUCKETS + 1);
+    BlockLatencyHistogramInfo *info;
+    uint64_t start = 0;
+    int i, n = 0;
+
+    block_acct_get_latency_buckets(stats, type, buckets);
+
+    bins[0] = 0;
+    for (i = 0; i < BLOCK_ACCT_HIST_BUCKETS; i++) {
+        uint64_t min = block_acct_latency_bucket_min(i);
+
+        if (!buckets[i]) {
+            continue;
+        }
+
+        if (min > start) {
+            boundaries[n++] = min;
+            bins[n] = 0;
+        }
+        bins[n] += buckets[i];
+
+        if (i + 1 < BLOCK_ACCT_HIST_BUCKETS) {
+            start = block_acct_latency_bucket_min(i + 1);
+            boundaries[n++] = start;
+            bins[n] = 0;
+        }
+    }
+
+    if (!n) {
+        return NULL;
+    }
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    info->boundaries = uint64_list(boundaries, n);
+    info->bins = uint64_list(bins, n + 1);
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
     BlockLatencyHistogram *hgram;
+    BlockAcctCounters c;
 
-    ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
-    ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
-    ds->zone_append_bytes = stats->nr_bytes[BLOCK_ACCT_ZONE_APPEND];
-    ds->unmap_bytes = stats->nr_bytes[BLOCK_ACCT_UNMAP];
-    ds->rd_operations = stats->nr_ops[BLOCK_ACCT_READ];
-    ds->wr_operations = stats->nr_ops[BLOCK_ACCT_WRITE];
-    ds->zone_append_operations = stats->nr_ops[BLOCK_ACCT_ZONE_APPEND];
-    ds->unmap_operations = stats->nr_ops[BLOCK_ACCT_UNMAP];
-
-    ds->failed_rd_operations = stats->failed_ops[BLOCK_ACCT_READ];
-    ds->failed_wr_operations = stats->failed_ops[BLOCK_ACCT_WRITE];
+    block_acct_get_counters(stats, &c);
+
+    ds->rd_bytes = c.nr_bytes[BLOCK_ACCT_READ];
+    ds->wr_bytes = c.nr_bytes[BLOCK_ACCT_WRITE];
+    ds->zone_append_bytes = c.nr_bytes[BLOCK_ACCT_ZONE_APPEND];
+    ds->unmap_bytes = c.nr_bytes[BLOCK_ACCT_UNMAP];
+    ds->rd_operations = c.nr_ops[BLOCK_ACCT_READ];
+    ds->wr_operations = c.nr_ops[BLOCK_ACCT_WRITE];
+    ds->zone_append_operations = c.nr_ops[BLOCK_ACCT_ZONE_APPEND];
+    ds->unmap_operations = c.nr_ops[BLOCK_ACCT_UNMAP];
+
+    ds->failed_rd_operations = c.failed_ops[BLOCK_ACCT_READ];
+    ds->failed_wr_operations = c.failed_ops[BLOCK_ACCT_WRITE];
     ds->failed_zone_append_operations =
-        stats->failed_ops[BLOCK_ACCT_ZONE_APPEND];
-    ds->failed_flush_operations = stats->failed_ops[BLOCK_ACCT_FLUSH];
-    ds->failed_unmap_operations = stats->failed_ops[BLOCK_ACCT_UNMAP];
+        c.failed_ops[BLOCK_ACCT_ZONE_APPEND];
+    ds->failed_flush_operations = c.failed_ops[BLOCK_ACCT_FLUSH];
+    ds->failed_unmap_operations = c.failed_ops[BLOCK_ACCT_UNMAP];
 
-    ds->invalid_rd_operations = stats->invalid_ops[BLOCK_ACCT_READ];
-    ds->invalid_wr_operations = stats->invalid_ops[BLOCK_ACCT_WRITE];
+    ds->invalid_rd_operations = c.invalid_ops[BLOCK_ACCT_READ];
+    ds->invalid_wr_operations = c.invalid_ops[BLOCK_ACCT_WRITE];
     ds->invalid_zone_append_operations =
-        stats->invalid_ops[BLOCK_ACCT_ZONE_APPEND];
+        c.invalid_ops[BLOCK_ACCT_ZONE_APPEND];
     ds->invalid_flush_operations =
-        stats->invalid_ops[BLOCK_ACCT_FLUSH];
-    ds->invalid_unmap_operations = stats->invalid_ops[BLOCK_ACCT_UNMAP];
-
-    ds->rd_merged = stats->merged[BLOCK_ACCT_READ];
-    ds->wr_merged = stats->merged[BLOCK_ACCT_WRITE];
-    ds->zone_append_merged = stats->merged[BLOCK_ACCT_ZONE_APPEND];
-    ds->unmap_merged = stats->merged[BLOCK_ACCT_UNMAP];
-    ds->flush_operations = stats->nr_ops[BLOCK_ACCT_FLUSH];
-    ds->wr_total_time_ns = stats->total_time_ns[BLOCK_ACCT_WRITE];
+        c.invalid_ops[BLOCK_ACCT_FLUSH];
+    ds->invalid_unmap_operations = c.invalid_ops[BLOCK_ACCT_UNMAP];
+
+    ds->rd_merged = c.merged[BLOCK_ACCT_READ];
+    ds->wr_merged = c.merged[BLOCK_ACCT_WRITE];
+    ds->zone_append_merged = c.merged[BLOCK_ACCT_ZONE_APPEND];
+    ds->unmap_merged = c.merged[BLOCK_ACCT_UNMAP];
+    ds->flush_operations = c.nr_ops[BLOCK_ACCT_FLUSH];
+    ds->wr_total_time_ns = c.total_time_ns[BLOCK_ACCT_WRITE];
     ds->zone_append_total_time_ns =
-        stats->total_time_ns[BLOCK_ACCT_ZONE_APPEND];
-    ds->rd_total_time_ns = stats->total_time_ns[BLOCK_ACCT_READ];
-    ds->flush_total_time_ns = stats->total_time_ns[BLOCK_ACCT_FLUSH];
-    ds->unmap_total_time_ns = stats->total_time_ns[BLOCK_ACCT_UNMAP];
+        c.total_time_ns[BLOCK_ACCT_ZONE_APPEND];
+    ds->rd_total_time_ns = c.total_time_ns[BLOCK_ACCT_READ];
+    ds->flush_total_time_ns = c.total_time_ns[BLOCK_ACCT_FLUSH];
+    ds->unmap_total_time_ns = c.total_time_ns[BLOCK_ACCT_UNMAP];
 
-    ds->has_idle_time_ns = stats->last_access_time_ns > 0;
+    ds->has_idle_time_ns = c.last_access_time_ns > 0;
     if (ds->has_idle_time_ns) {
         ds->idle_time_ns = block_acct_idle_time_ns(stats);
     }
@@ -587,6 +641,17 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
         = bdrv_latency_histogram_stats(&hgram[BLOCK_ACCT_ZONE_APPEND]);
     ds->flush_latency_histogram
         = bdrv_latency_histogram_stats(&hgram[BLOCK_ACCT_FLUSH]);
+
+    ds->rd_latency_log_histogram
+        = bdrv_latency_log_histogram_stats(stats, BLOCK_ACCT_READ);
+    ds->wr_latency_log_histogram
+        = bdrv_latency_log_histogram_stats(stats, BLOCK_ACCT_WRITE);
+    ds->zone_append_latency_log_histogram
+        = bdrv_latency_log_histogram_stats(stats, BLOCK_ACCT_ZONE_APPEND);
+    ds->flush_latency_log_histogram
+        = bdrv_latency_log_histogram_stats(stats, BLOCK_ACCT_FLUSH);
+    ds->unmap_latency_log_histogram
+        = bdrv_latency_log_histogram_stats(stats, BLOCK_ACCT_UNMAP);
 }
 
 static BlockStats * GRAPH_RDLOCK
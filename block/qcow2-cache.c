@@ -33,6 +33,8 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    bool     referenced;
+    bool     hot;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -44,6 +46,30 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Maps the offset of every cached table to its entry */
+    GHashTable             *index;
+    /* Next entry to consider for replacement */
+    int                     clock_hand;
+    /* Number of hot entries, and how many entries are reserved for cold ones */
+    int                     nr_hot;
+    int                     cold_target;
+
+    /*
+     * Ring of the offsets of recently evicted tables, which are still in their
+     * test period, and an index of it.  Offset 0 marks a free slot.
+     */
+    int64_t                *nonresident;
+    GHashTable             *nonresident_index;
+    int                     nonresident_hand;
+
+    /* See qcow2_cache_set_update_func() */
+    Qcow2CacheUpdateFunc   *update_func;
+    void                   *update_opaque;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -59,6 +85,49 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static void qcow2_cache_updated(Qcow2Cache *c, int64_t offset)
+{
+    if (c->update_func) {
+        c->update_func(c->update_opaque, offset);
+    }
+}
+
+/*
+ * Change the offset of entry @i, keeping the index up to date.  The key of
+ * each index entry is a pointer to the offset field of the cached table, so
+ * it must be removed from the index before the offset is modified.  The new
+ * table starts out cold and unreferenced.
+ */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, int64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    if (t->offset) {
+        g_hash_table_remove(c->index, &t->offset);
+    }
+    if (t->hot) {
+        t->hot = false;
+        c->nr_hot--;
+    }
+    t->referenced = false;
+    t->offset = offset;
+    if (offset) {
+        assert(!g_hash_table_contains(c->index, &t->offset));
+        g_hash_table_add(c->index, &t->offset);
+    }
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int64_t key = offset;
+    int64_t *found = g_hash_table_lookup(c->index, &key);
+
+    if (!found) {
+        return -1;
+    }
+    return container_of(found, Qcow2CachedTable, offset) - c->entries;
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -106,7 +175,7 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
+            qcow2_cache_set_offset(c, i, 0);
             c->entries[i].lru_counter = 0;
             i++;
             to_clean++;
@@ -142,9 +211,14 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
         qemu_vfree(c->table_array);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
     }
 
+    c->index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    c->nonresident = g_new0(int64_t, num_tables);
+    c->nonresident_index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    c->cold_target = MAX(num_tables / 2, 1);
+
     return c;
 }
 
@@ -156,6 +230,9 @@ int qcow2_cache_destroy(Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
     }
 
+    g_hash_table_destroy(c->nonresident_index);
+    g_free(c->nonresident);
+    g_hash_table_destroy(c->index);
     qemu_vfree(c->table_array);
     g_free(c->entries);
     g_free(c);
@@ -311,15 +388,131 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
         c->entries[i].lru_counter = 0;
+        c->entries[i].referenced = false;
+        c->entries[i].hot = false;
     }
+    g_hash_table_remove_all(c->index);
+    c->nr_hot = 0;
+
+    g_hash_table_remove_all(c->nonresident_index);
+    memset(c->nonresident, 0, c->size * sizeof(c->nonresident[0]));
 
     qcow2_cache_table_release(c, 0, c->size);
+    qcow2_cache_updated(c, 0);
 
     c->lru_counter = 0;
 
     return 0;
 }
 
+/*
+ * The replacement policy is a simplified CLOCK-Pro.  Tables are loaded into
+ * the cache as cold entries and only become hot when they are referenced
+ * again while in their test period, i.e. while resident or shortly after
+ * their eviction.  Only cold entries are evicted, and hot entries are demoted
+ * to cold only when there are more of them than the cache leaves room for, so
+ * that tables which are used once, as in a sequential scan of the image, can
+ * only ever replace each other and never the hot working set.
+ *
+ * Consecutive lookups of the same table, e.g. by a scan going through the
+ * entries of an L2 table, are a single reference: a hit only counts if
+ * another table was released since this one was last released.
+ */
+static bool qcow2_cache_is_new_reference(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    return t->ref == 0 && t->lru_counter != c->lru_counter;
+}
+
+/*
+ * Start the test period of the evicted table at @offset, ending the oldest
+ * one.  A test period that ends without the table being loaded again means
+ * that the cold entries suffice, so the hot entries get more room.
+ */
+static void qcow2_cache_add_nonresident(Qcow2Cache *c, int64_t offset)
+{
+    int64_t *slot = &c->nonresident[c->nonresident_hand];
+
+    if (*slot) {
+        g_hash_table_remove(c->nonresident_index, slot);
+        c->cold_target = MAX(c->cold_target - 1, 1);
+    }
+    *slot = offset;
+    assert(!g_hash_table_contains(c->nonresident_index, slot));
+    g_hash_table_add(c->nonresident_index, slot);
+
+    if (++c->nonresident_hand == c->size) {
+        c->nonresident_hand = 0;
+    }
+}
+
+/*
+ * Return whether the table at @offset is in its test period, and end it.
+ * Such a table was evicted too early, so the cold entries get more room.
+ */
+static bool qcow2_cache_take_nonresident(Qcow2Cache *c, int64_t offset)
+{
+    int64_t key = offset;
+    int64_t *slot = g_hash_table_lookup(c->nonresident_index, &key);
+
+    if (!slot) {
+        return false;
+    }
+
+    g_hash_table_remove(c->nonresident_index, slot);
+    *slot = 0;
+    c->cold_target = MIN(c->cold_target + 1, c->size);
+    return true;
+}
+
+/*
+ * Pick the entry to replace on a cache miss.  As it goes around, the hand
+ * promotes referenced cold entries, clears the referenced bit of hot ones
+ * and demotes unreferenced hot entries beyond the hot target.  If two rounds
+ * find nothing to evict because the cold entries are all in use, hot entries
+ * are demoted regardless of the target, so a victim is found within four
+ * rounds.
+ *
+ * Returns -1 if all entries are in use.
+ */
+static int qcow2_cache_find_victim(Qcow2Cache *c)
+{
+    int n;
+
+    for (n = 0; n < 4 * c->size; n++) {
+        int i = c->clock_hand;
+        Qcow2CachedTable *t = &c->entries[i];
+
+        if (++c->clock_hand == c->size) {
+            c->clock_hand = 0;
+        }
+
+        if (t->ref != 0) {
+            continue;
+        }
+        if (t->hot) {
+            if (t->referenced) {
+                t->referenced = false;
+            } else if (c->nr_hot > c->size - c->cold_target ||
+                       n >= 2 * c->size) {
+                t->hot = false;
+                c->nr_hot--;
+            }
+            continue;
+        }
+        if (t->referenced) {
+            t->referenced = false;
+            t->hot = true;
+            c->nr_hot++;
+            continue;
+        }
+        return i;
+    }
+
+    return -1;
+}
+
 static int GRAPH_RDLOCK
 qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
                    void **table, bool read_from_disk)
@@ -327,9 +520,6 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     BDRVQcow2State *s = bs->opaque;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -344,29 +534,24 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     }
 
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        c->hits++;
+        if (qcow2_cache_is_new_reference(c, i)) {
+            c->entries[i].referenced = true;
         }
-    } while (i != lookup_index);
+        goto found;
+    }
+    c->misses++;
 
-    if (min_lru_index == -1) {
+    i = qcow2_cache_find_victim(c);
+    if (i < 0) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
 
@@ -377,7 +562,11 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    if (c->entries[i].offset) {
+        c->evictions++;
+        qcow2_cache_add_nonresident(c, c->entries[i].offset);
+    }
+    qcow2_cache_set_offset(c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -390,7 +579,11 @@ qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
+    if (qcow2_cache_take_nonresident(c, offset)) {
+        c->entries[i].hot = true;
+        c->nr_hot++;
+    }
 
     /* And return the right table */
 found:
@@ -412,6 +605,7 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
+    qcow2_cache_updated(c, offset);
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
@@ -434,18 +628,14 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
     int i = qcow2_cache_get_table_idx(c, table);
     assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
+    qcow2_cache_updated(c, c->entries[i].offset);
 }
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    int i = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
-    }
-    return NULL;
+    return i >= 0 ? qcow2_cache_get_table_addr(c, i) : NULL;
 }
 
 void qcow2_cache_discard(Qcow2Cache *c, void *table)
@@ -454,9 +644,34 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
+    qcow2_cache_updated(c, c->entries[i].offset);
+    qcow2_cache_set_offset(c, i, 0);
     c->entries[i].lru_counter = 0;
     c->entries[i].dirty = false;
 
     qcow2_cache_table_release(c, i, 1);
 }
+
+/*
+ * Make the cache call @func whenever the contents of a table may change.  It
+ * gets the offset of the table, or 0 if all tables may have changed.
+ */
+void qcow2_cache_set_update_func(Qcow2Cache *c, Qcow2CacheUpdateFunc *func,
+                                 void *opaque)
+{
+    c->update_func = func;
+    c->update_opaque = opaque;
+}
+
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c)
+{
+    Qcow2CacheStats *stats = g_new(Qcow2CacheStats, 1);
+
+    *stats = (Qcow2CacheStats) {
+        .hits       = c->hits,
+        .misses     = c->misses,
+        .evictions  = c->evictions,
+    };
+
+    return stats;
+}
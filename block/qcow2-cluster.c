@@ -28,6 +28,7 @@
 #include "block/block-io.h"
 #include "qapi/error.h"
 #include "qcow2.h"
+#include "qemu/bitmap.h"
 #include "qemu/bswap.h"
 #include "qemu/memalign.h"
 #include "trace.h"
@@ -70,6 +71,7 @@ int coroutine_fn qcow2_shrink_l1_table(BlockDriverState *bs,
                             s->cluster_size, QCOW2_DISCARD_ALWAYS);
         s->l1_table[i] = 0;
     }
+    qcow2_data_extents_drop(s);
     return 0;
 
 fail:
@@ -80,6 +82,7 @@ fail:
      */
     memset(s->l1_table + new_l1_size, 0,
            (s->l1_size - new_l1_size) * L1E_SIZE);
+    qcow2_data_extents_drop(s);
     return ret;
 }
 
@@ -183,6 +186,10 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
     s->l1_table = new_l1_table;
     old_l1_size = s->l1_size;
     s->l1_size = new_l1_size;
+    if (s->snapshot_l2_pending) {
+        s->snapshot_l2_pending = bitmap_zero_extend(s->snapshot_l2_pending,
+                                                    old_l1_size, new_l1_size);
+    }
     qcow2_free_clusters(bs, old_l1_table_offset, old_l1_size * L1E_SIZE,
                         QCOW2_DISCARD_OTHER);
     return 0;
@@ -358,6 +365,10 @@ static int GRAPH_RDLOCK l2_allocate(BlockDriverState *bs, int l1_index)
     /* update the L1 entry */
     trace_qcow2_l2_allocate_write_l1(bs, l1_index);
     s->l1_table[l1_index] = l2_offset | QCOW_OFLAG_COPIED;
+    /* Updates of the new table do not affect extents found in the old one */
+    qcow2_data_extents_drop_range(s, (uint64_t)l1_index <<
+                                  (s->l2_bits + s->cluster_bits),
+                                  (uint64_t)s->l2_size << s->cluster_bits);
     ret = qcow2_write_l1_entry(bs, l1_index);
     if (ret < 0) {
         goto fail;
@@ -562,6 +573,180 @@ do_perform_cow_write(BlockDriverState *bs, uint64_t cluster_offset,
     return 0;
 }
 
+/*
+ * Sequentially written images map long runs of guest clusters to
+ * contiguous host clusters, but every lookup still needs the L2 slice that
+ * covers it, and with multi-terabyte images the slices do not all fit into
+ * the L2 cache.  s->data_extents remembers such runs as guest ranges
+ * (IntervalTreeNode) with the host offset of their start, merging adjacent
+ * runs as they are looked up, so that later lookups need neither the L2
+ * cache nor disk I/O.
+ *
+ * The extents are derived from the L2 tables.  s->data_extent_slices maps
+ * the offset of every L2 slice that extents were found in to the guest range
+ * that it covers, so that when the L2 cache modifies a slice, which it reports
+ * to qcow2_data_extents_l2_update(), only the extents in that range are
+ * dropped.  Changes to the L1 table that make a range use a different L2
+ * table must drop the extents in the range with
+ * qcow2_data_extents_drop_range(), or all of them with
+ * qcow2_data_extents_drop().  Images with subclusters do not use the extents.
+ */
+#define QCOW2_MAX_DATA_EXTENTS 65536
+
+typedef struct Qcow2DataExtent {
+    IntervalTreeNode node;
+    uint64_t host_offset;
+} Qcow2DataExtent;
+
+typedef struct Qcow2DataExtentSlice {
+    uint64_t l2_slice_offset;   /* Key in s->data_extent_slices */
+    uint64_t guest_offset;
+} Qcow2DataExtentSlice;
+
+static void data_extents_remove(BDRVQcow2State *s, IntervalTreeNode *node)
+{
+    interval_tree_remove(node, &s->data_extents);
+    g_free(container_of(node, Qcow2DataExtent, node));
+    s->nb_data_extents--;
+}
+
+void qcow2_data_extents_drop(BDRVQcow2State *s)
+{
+    IntervalTreeNode *node;
+
+    while ((node = interval_tree_iter_first(&s->data_extents, 0, UINT64_MAX))) {
+        data_extents_remove(s, node);
+    }
+    assert(s->nb_data_extents == 0);
+
+    if (s->data_extent_slices) {
+        g_hash_table_destroy(s->data_extent_slices);
+        s->data_extent_slices = NULL;
+    }
+}
+
+/* Drop the extents that overlap guest [@start, @start + @length) */
+void qcow2_data_extents_drop_range(BDRVQcow2State *s, uint64_t start,
+                                  uint64_t length)
+{
+    uint64_t last = start + length - 1;
+    IntervalTreeNode *node, *next;
+
+    for (node = interval_tree_iter_first(&s->data_extents, start, last);
+         node; node = next)
+    {
+        next = interval_tree_iter_next(node, start, last);
+        data_extents_remove(s, node);
+    }
+}
+
+/*
+ * Called by the L2 cache when the slice at @offset may change, or with
+ * @offset 0 when all slices may have changed
+ */
+void qcow2_data_extents_l2_update(void *opaque, int64_t offset)
+{
+    BDRVQcow2State *s = opaque;
+    Qcow2DataExtentSlice *slice;
+
+    if (offset == 0) {
+        qcow2_data_extents_drop(s);
+        return;
+    }
+
+    if (!s->data_extent_slices) {
+        return;
+    }
+
+    slice = g_hash_table_lookup(s->data_extent_slices, &offset);
+    if (slice) {
+        qcow2_data_extents_drop_range(s, slice->guest_offset,
+                                      (uint64_t)s->l2_slice_size <<
+                                      s->cluster_bits);
+        g_hash_table_remove(s->data_extent_slices, &offset);
+    }
+}
+
+static bool data_extents_lookup(BDRVQcow2State *s, uint64_t offset,
+                                unsigned int *bytes, uint64_t *host_offset)
+{
+    IntervalTreeNode *node;
+
+    node = interval_tree_iter_first(&s->data_extents, offset, offset);
+    if (!node) {
+        return false;
+    }
+
+    *host_offset = container_of(node, Qcow2DataExtent, node)->host_offset +
+                   (offset - node->start);
+    *bytes = MIN(*bytes, node->last - offset + 1);
+    return true;
+}
+
+/*
+ * Record that guest [@start, @start + @length) maps to @host_offset, as found
+ * in the L2 slice at @l2_slice_offset, which covers the guest range starting
+ * at @slice_guest_offset
+ */
+static void data_extents_add(BDRVQcow2State *s, uint64_t start,
+                             uint64_t length, uint64_t host_offset,
+                             uint64_t l2_slice_offset,
+                             uint64_t slice_guest_offset)
+{
+    uint64_t last = start + length - 1;
+    uint64_t query_start = start ? start - 1 : 0;
+    uint64_t query_last = last + 1;
+    IntervalTreeNode *node, *next;
+    Qcow2DataExtentSlice *slice;
+    Qcow2DataExtent *e;
+
+    if (s->nb_data_extents >= QCOW2_MAX_DATA_EXTENTS ||
+        (s->data_extent_slices &&
+         g_hash_table_size(s->data_extent_slices) >= QCOW2_MAX_DATA_EXTENTS)) {
+        qcow2_data_extents_drop(s);
+    }
+
+    if (!s->data_extent_slices) {
+        s->data_extent_slices = g_hash_table_new_full(g_int64_hash,
+                                                      g_int64_equal,
+                                                      NULL, g_free);
+    }
+    /* The slice may have been used for a different range before */
+    slice = g_hash_table_lookup(s->data_extent_slices, &l2_slice_offset);
+    if (!slice) {
+        slice = g_new(Qcow2DataExtentSlice, 1);
+        slice->l2_slice_offset = l2_slice_offset;
+        g_hash_table_insert(s->data_extent_slices, &slice->l2_slice_offset,
+                            slice);
+    }
+    slice->guest_offset = slice_guest_offset;
+
+    /* Merge with overlapping and adjacent extents that continue this one */
+    for (node = interval_tree_iter_first(&s->data_extents,
+                                         query_start, query_last);
+         node; node = next)
+    {
+        next = interval_tree_iter_next(node, query_start, query_last);
+        e = container_of(node, Qcow2DataExtent, node);
+        if (e->host_offset - node->start != host_offset - start) {
+            continue;
+        }
+
+        if (node->start < start) {
+            host_offset = e->host_offset;
+            start = node->start;
+        }
+        last = MAX(last, node->last);
+        data_extents_remove(s, node);
+    }
+
+    e = g_new0(Qcow2DataExtent, 1);
+    e->node.start = start;
+    e->node.last = last;
+    e->host_offset = host_offset;
+    interval_tree_insert(&e->node, &s->data_extents);
+    s->nb_data_extents++;
+}
 
 /*
  * get_host_offset
@@ -596,6 +781,12 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
     QCow2SubclusterType type;
     int ret;
 
+    if (!has_subclusters(s) &&
+        data_extents_lookup(s, offset, bytes, host_offset)) {
+        *subcluster_type = QCOW2_SUBCLUSTER_NORMAL;
+        return 0;
+    }
+
     offset_in_cluster = offset_into_cluster(s, offset);
     bytes_needed = (uint64_t) *bytes + offset_in_cluster;
 
@@ -722,6 +913,17 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
 
     bytes_available = ((int64_t)sc + sc_index) << s->subcluster_bits;
 
+    if (type == QCOW2_SUBCLUSTER_NORMAL && !has_subclusters(s)) {
+        int slice_index = offset_to_l2_slice_index(s, offset);
+        int start_of_slice = offset_to_l2_index(s, offset) - slice_index;
+
+        data_extents_add(s, offset - offset_in_cluster, bytes_available,
+                         *host_offset - offset_in_cluster,
+                         l2_offset + start_of_slice * l2_entry_size(s),
+                         offset - offset_in_cluster -
+                         ((uint64_t)slice_index << s->cluster_bits));
+    }
+
 out:
     if (bytes_available > bytes_needed) {
         bytes_available = bytes_needed;
@@ -781,6 +983,18 @@ get_cluster_table(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
+        /*
+         * A new snapshot may still have to take its references to the
+         * clusters of the table.  Updating the refcounts may also show that
+         * the table is not shared any more.
+         */
+        ret = qcow2_snapshot_update_l2(bs, l1_index);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
         ret = l2_allocate(bs, l1_index);
@@ -1138,7 +1352,7 @@ void coroutine_fn qcow2_alloc_cluster_abort(BlockDriverState *bs, QCowL2Meta *m)
 
 /*
  * For a given write request, create a new QCowL2Meta structure, add
- * it to @m and the BDRVQcow2State.cluster_allocs list. If the write
+ * it to @m and the BDRVQcow2State.cluster_allocs tree. If the write
  * request does not need copy-on-write or changes to the L2 metadata
  * then this function does nothing.
  *
@@ -1319,7 +1533,9 @@ calculate_l2_meta(BlockDriverState *bs, uint64_t host_cluster_offset,
     };
 
     qemu_co_queue_init(&(*m)->dependent_requests);
-    QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
+    (*m)->in_flight.start = start_of_cluster(s, l2meta_cow_start(*m));
+    (*m)->in_flight.last = ROUND_UP(l2meta_cow_end(*m), s->cluster_size) - 1;
+    interval_tree_insert(&(*m)->in_flight, &s->cluster_allocs);
 
     return 0;
 }
@@ -1406,20 +1622,21 @@ static int coroutine_fn handle_dependencies(BlockDriverState *bs,
                                             uint64_t *cur_bytes, QCowL2Meta **m)
 {
     BDRVQcow2State *s = bs->opaque;
-    QCowL2Meta *old_alloc;
-    uint64_t bytes = *cur_bytes;
-
-    QLIST_FOREACH(old_alloc, &s->cluster_allocs, next_in_flight) {
-
-        uint64_t start = guest_offset;
-        uint64_t end = start + bytes;
-        uint64_t old_start = start_of_cluster(s, l2meta_cow_start(old_alloc));
-        uint64_t old_end = ROUND_UP(l2meta_cow_end(old_alloc), s->cluster_size);
+    IntervalTreeNode *node;
+    uint64_t start = guest_offset;
+    uint64_t end = start + *cur_bytes;
 
-        if (end <= old_start || start >= old_end) {
-            /* No intersection */
-            continue;
-        }
+    /*
+     * Overlapping allocations are visited in order of their start, so the
+     * first real conflict decides: either it covers @start and we must wait
+     * for it, or the request can proceed up to its beginning.
+     */
+    for (node = interval_tree_iter_first(&s->cluster_allocs, start, end - 1);
+         node != NULL;
+         node = interval_tree_iter_next(node, start, end - 1))
+    {
+        QCowL2Meta *old_alloc = container_of(node, QCowL2Meta, in_flight);
+        uint64_t old_start = node->start;
 
         if (old_alloc->keep_old_clusters &&
             (end <= l2meta_cow_start(old_alloc) ||
@@ -1436,9 +1653,8 @@ static int coroutine_fn handle_dependencies(BlockDriverState *bs,
 
         if (start < old_start) {
             /* Stop at the start of a running allocation */
-            bytes = old_start - start;
-        } else {
-            bytes = 0;
+            end = old_start;
+            break;
         }
 
         /*
@@ -1447,24 +1663,22 @@ static int coroutine_fn handle_dependencies(BlockDriverState *bs,
          * and deal with requests depending on them before starting to
          * gather new ones. Not worth the trouble.
          */
-        if (bytes == 0 && *m) {
+        if (*m) {
             *cur_bytes = 0;
             return 0;
         }
 
-        if (bytes == 0) {
-            /*
-             * Wait for the dependency to complete. We need to recheck
-             * the free/allocated clusters when we continue.
-             */
-            qemu_co_queue_wait(&old_alloc->dependent_requests, &s->lock);
-            return -EAGAIN;
-        }
+        /*
+         * Wait for the dependency to complete. We need to recheck
+         * the free/allocated clusters when we continue.
+         */
+        qemu_co_queue_wait(&old_alloc->dependent_requests, &s->lock);
+        return -EAGAIN;
     }
 
     /* Make sure that existing clusters and new allocations are only used up to
      * the next dependency if we shortened the request above */
-    *cur_bytes = bytes;
+    *cur_bytes = end - start;
 
     return 0;
 }
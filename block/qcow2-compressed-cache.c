@@ -0,0 +1,204 @@
+/*
+ * Cache of decompressed qcow2 clusters
+ *
+ * Copyright (c) 2025 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * Guests typically read compressed clusters in pieces smaller than a
+ * cluster, and without a cache every piece means reading and inflating
+ * the whole compressed cluster again.  This cache keeps the decompressed
+ * data of recently read compressed clusters, keyed by the host offset of
+ * the compressed data, and evicts the least recently used cluster when it
+ * is full.
+ *
+ * Compressed data at a given host offset never changes as long as an L2
+ * entry refers to it.  It can only be replaced after the cluster has been
+ * freed and reallocated for a new compressed write, which therefore calls
+ * qcow2_compressed_cache_invalidate().  The generation counter prevents a
+ * request that read the old data before the invalidation from inserting it
+ * afterwards.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/memalign.h"
+#include "qemu/lockable.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2CompressedCluster {
+    uint64_t coffset;
+    int csize;
+    uint8_t *data;
+    QTAILQ_ENTRY(Qcow2CompressedCluster) next;
+} Qcow2CompressedCluster;
+
+struct Qcow2CompressedCache {
+    int cluster_size;
+    int max_clusters;
+
+    QemuMutex lock;
+
+    /* Everything below is protected by lock */
+    GHashTable *index;      /* coffset -> Qcow2CompressedCluster */
+    QTAILQ_HEAD(, Qcow2CompressedCluster) lru;  /* MRU first */
+    int nb_clusters;
+    uint64_t generation;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+Qcow2CompressedCache *qcow2_compressed_cache_create(uint64_t size,
+                                                    int cluster_size)
+{
+    Qcow2CompressedCache *c = g_new0(Qcow2CompressedCache, 1);
+
+    c->cluster_size = cluster_size;
+    /* Any non-zero size holds at least one cluster */
+    c->max_clusters = size ? MAX(MIN(size / cluster_size, INT_MAX), 1) : 0;
+    c->index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&c->lru);
+    qemu_mutex_init(&c->lock);
+
+    return c;
+}
+
+static void qcow2_compressed_cache_drop(Qcow2CompressedCache *c,
+                                        Qcow2CompressedCluster *cl)
+{
+    QTAILQ_REMOVE(&c->lru, cl, next);
+    g_hash_table_remove(c->index, &cl->coffset);
+    c->nb_clusters--;
+    qemu_vfree(cl->data);
+    g_free(cl);
+}
+
+void qcow2_compressed_cache_clear(Qcow2CompressedCache *c)
+{
+    Qcow2CompressedCluster *cl, *next;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    c->generation++;
+    QTAILQ_FOREACH_SAFE(cl, &c->lru, next, next) {
+        qcow2_compressed_cache_drop(c, cl);
+    }
+}
+
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c)
+{
+    qcow2_compressed_cache_clear(c);
+    g_hash_table_destroy(c->index);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+bool qcow2_compressed_cache_enabled(Qcow2CompressedCache *c)
+{
+    return c->max_clusters > 0;
+}
+
+bool qcow2_compressed_cache_read(Qcow2CompressedCache *c, uint64_t coffset,
+                                 int offset_in_cluster, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset)
+{
+    Qcow2CompressedCluster *cl;
+
+    if (!qcow2_compressed_cache_enabled(c)) {
+        return false;
+    }
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    cl = g_hash_table_lookup(c->index, &coffset);
+    if (!cl) {
+        c->misses++;
+        return false;
+    }
+
+    c->hits++;
+    QTAILQ_REMOVE(&c->lru, cl, next);
+    QTAILQ_INSERT_HEAD(&c->lru, cl, next);
+    qemu_iovec_from_buf(qiov, qiov_offset, cl->data + offset_in_cluster,
+                        bytes);
+    return true;
+}
+
+bool qcow2_compressed_cache_contains(Qcow2CompressedCache *c,
+                                     uint64_t coffset)
+{
+    QEMU_LOCK_GUARD(&c->lock);
+    return g_hash_table_contains(c->index, &coffset);
+}
+
+uint64_t qcow2_compressed_cache_generation(Qcow2CompressedCache *c)
+{
+    QEMU_LOCK_GUARD(&c->lock);
+    return c->generation;
+}
+
+void qcow2_compressed_cache_insert(Qcow2CompressedCache *c, uint64_t coffset,
+                                   int csize, uint8_t *data,
+                                   uint64_t generation)
+{
+    Qcow2CompressedCluster *cl;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    if (!qcow2_compressed_cache_enabled(c) || generation != c->generation ||
+        g_hash_table_contains(c->index, &coffset)) {
+        qemu_vfree(data);
+        return;
+    }
+
+    if (c->nb_clusters == c->max_clusters) {
+        qcow2_compressed_cache_drop(c, QTAILQ_LAST(&c->lru));
+        c->evictions++;
+    }
+
+    cl = g_new(Qcow2CompressedCluster, 1);
+    *cl = (Qcow2CompressedCluster) {
+        .coffset = coffset,
+        .csize = csize,
+        .data = data,
+    };
+    QTAILQ_INSERT_HEAD(&c->lru, cl, next);
+    g_hash_table_insert(c->index, &cl->coffset, cl);
+    c->nb_clusters++;
+}
+
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c,
+                                       uint64_t offset, uint64_t bytes)
+{
+    Qcow2CompressedCluster *cl, *next;
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    c->generation++;
+    QTAILQ_FOREACH_SAFE(cl, &c->lru, next, next) {
+        if (cl->coffset < offset + bytes && offset < cl->coffset + cl->csize) {
+            trace_qcow2_compressed_cache_invalidate(c, cl->coffset);
+            qcow2_compressed_cache_drop(c, cl);
+        }
+    }
+}
+
+Qcow2CacheStats *qcow2_compressed_cache_get_stats(Qcow2CompressedCache *c)
+{
+    Qcow2CacheStats *stats = g_new(Qcow2CacheStats, 1);
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    *stats = (Qcow2CacheStats) {
+        .hits       = c->hits,
+        .misses     = c->misses,
+        .evictions  = c->evictions,
+    };
+
+    return stats;
+}
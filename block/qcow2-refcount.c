@@ -30,11 +30,15 @@
 #include "qemu/bswap.h"
 #include "qemu/cutils.h"
 #include "qemu/memalign.h"
+#include "qemu/timer.h"
+#include "block/aio_task.h"
 #include "trace.h"
 
 static int64_t alloc_clusters_noref(BlockDriverState *bs, uint64_t size,
                                     uint64_t max);
 
+static int free_extents_size_cmp(gconstpointer a, gconstpointer b);
+
 G_GNUC_WARN_UNUSED_RESULT
 static int update_refcount(BlockDriverState *bs,
                            int64_t offset, int64_t length, uint64_t addend,
@@ -108,6 +112,7 @@ int coroutine_fn qcow2_refcount_init(BlockDriverState *bs)
 
     s->get_refcount = get_refcount_funcs[s->refcount_order];
     s->set_refcount = set_refcount_funcs[s->refcount_order];
+    s->free_extents_by_size = g_tree_new(free_extents_size_cmp);
 
     assert(s->refcount_table_size <= INT_MAX / REFTABLE_ENTRY_SIZE);
     refcount_table_size2 = s->refcount_table_size * REFTABLE_ENTRY_SIZE;
@@ -133,9 +138,170 @@ int coroutine_fn qcow2_refcount_init(BlockDriverState *bs)
     return ret;
 }
 
+/*
+ * Free-space index
+ *
+ * Clusters below free_cluster_index that are known to have a refcount of 0
+ * are kept as extents of cluster indices, so that freed space can be handed
+ * out again without rescanning the refcount blocks from the lowest freed
+ * cluster onwards.  Each extent is linked both into s->free_extents, which
+ * is ordered by address and is used to merge and split extents, and into
+ * s->free_extents_by_size, which is ordered by length and then address and
+ * is used to find the extent that best fits an allocation.  The index is
+ * only a hint: allocations still check the refcounts of the clusters they
+ * pick, and clusters missing from it are at worst left unused until the
+ * next scan covers them.  All extents lie below free_cluster_index.
+ *
+ * If the image is fragmented enough for the index to grow beyond
+ * QCOW2_MAX_FREE_EXTENTS entries, it is dropped and free_cluster_index is
+ * lowered to its first entry, which brings back the plain linear scan.
+ */
+#define QCOW2_MAX_FREE_EXTENTS 65536
+
+static int free_extents_size_cmp(gconstpointer a, gconstpointer b)
+{
+    const IntervalTreeNode *x = a, *y = b;
+    uint64_t x_len = x->last - x->start, y_len = y->last - y->start;
+
+    if (x_len != y_len) {
+        return x_len < y_len ? -1 : 1;
+    }
+    if (x->start != y->start) {
+        return x->start < y->start ? -1 : 1;
+    }
+    return 0;
+}
+
+static void free_extents_link(BDRVQcow2State *s, IntervalTreeNode *node)
+{
+    interval_tree_insert(node, &s->free_extents);
+    g_tree_insert(s->free_extents_by_size, node, node);
+    s->nb_free_extents++;
+}
+
+/* The caller may only change @node's range after unlinking it */
+static void free_extents_unlink(BDRVQcow2State *s, IntervalTreeNode *node)
+{
+    g_tree_remove(s->free_extents_by_size, node);
+    interval_tree_remove(node, &s->free_extents);
+    s->nb_free_extents--;
+}
+
+static void free_extents_drop(BDRVQcow2State *s)
+{
+    IntervalTreeNode *node;
+
+    while ((node = interval_tree_iter_first(&s->free_extents, 0, UINT64_MAX))) {
+        s->free_cluster_index = MIN(s->free_cluster_index, node->start);
+        free_extents_unlink(s, node);
+        g_free(node);
+    }
+}
+
+/* Record clusters [@start, @start + @nb_clusters) as free */
+static void free_extents_add(BDRVQcow2State *s, uint64_t start,
+                             uint64_t nb_clusters)
+{
+    uint64_t last = start + nb_clusters - 1;
+    IntervalTreeNode *node;
+
+    assert(nb_clusters > 0);
+
+    /* Merge with overlapping and adjacent extents */
+    while ((node = interval_tree_iter_first(&s->free_extents,
+                                            start ? start - 1 : 0,
+                                            last + 1)))
+    {
+        start = MIN(start, node->start);
+        last = MAX(last, node->last);
+        free_extents_unlink(s, node);
+        g_free(node);
+    }
+
+    if (s->nb_free_extents >= QCOW2_MAX_FREE_EXTENTS) {
+        free_extents_drop(s);
+        s->free_cluster_index = MIN(s->free_cluster_index, start);
+        return;
+    }
+
+    node = g_new0(IntervalTreeNode, 1);
+    node->start = start;
+    node->last = last;
+    free_extents_link(s, node);
+}
+
+/* Forget about clusters [@start, @start + @nb_clusters) */
+static void free_extents_remove(BDRVQcow2State *s, uint64_t start,
+                                uint64_t nb_clusters)
+{
+    uint64_t last = start + nb_clusters - 1;
+    IntervalTreeNode *node;
+
+    assert(nb_clusters > 0);
+
+    while ((node = interval_tree_iter_first(&s->free_extents, start, last))) {
+        free_extents_unlink(s, node);
+
+        if (node->last > last) {
+            IntervalTreeNode *tail = g_new0(IntervalTreeNode, 1);
+            tail->start = last + 1;
+            tail->last = node->last;
+            free_extents_link(s, tail);
+        }
+        if (node->start < start) {
+            node->last = start - 1;
+            free_extents_link(s, node);
+        } else {
+            g_free(node);
+        }
+    }
+}
+
+/*
+ * Called when the refcount update for clusters [@start, @start +
+ * @nb_clusters), which had been picked for an allocation, must be retried
+ * because new refcount metadata was allocated in the meantime.  Try the same
+ * clusters first on the retry.  If they were the last ones taken by the
+ * linear scan, the scan can simply be rewound; otherwise they came from the
+ * index (or were requested by the caller), and rewinding the scan would move
+ * it below extents that are still in the index, so put them back there.
+ */
+static void free_extents_retry(BDRVQcow2State *s, uint64_t start,
+                               uint64_t nb_clusters)
+{
+    if (start >= s->free_cluster_index) {
+        return;
+    }
+
+    if (start + nb_clusters == s->free_cluster_index) {
+        s->free_cluster_index = start;
+    } else {
+        free_extents_add(s, start,
+                         MIN(start + nb_clusters, s->free_cluster_index) -
+                         start);
+    }
+}
+
+/*
+ * Restarts the search for free clusters at the beginning of the image,
+ * e.g. after the refcount structures have been recreated.
+ */
+void qcow2_reset_free_cluster_index(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    free_extents_drop(s);
+    s->free_cluster_index = 0;
+}
+
 void qcow2_refcount_close(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
+    free_extents_drop(s);
+    if (s->free_extents_by_size) {
+        g_tree_destroy(s->free_extents_by_size);
+        s->free_extents_by_size = NULL;
+    }
     g_free(s->refcount_table);
 }
 
@@ -851,10 +1017,9 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
             ret = alloc_refcount_block(bs, cluster_index, &refcount_block);
             /* If the caller needs to restart the search for free clusters,
              * try the same ones first to see if they're still free. */
-            if (ret == -EAGAIN) {
-                if (s->free_cluster_index > (start >> s->cluster_bits)) {
-                    s->free_cluster_index = (start >> s->cluster_bits);
-                }
+            if (ret == -EAGAIN && !decrease) {
+                free_extents_retry(s, start >> s->cluster_bits,
+                                   ((last - start) >> s->cluster_bits) + 1);
             }
             if (ret < 0) {
                 goto fail;
@@ -881,7 +1046,7 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
             refcount += addend;
         }
         if (refcount == 0 && cluster_index < s->free_cluster_index) {
-            s->free_cluster_index = cluster_index;
+            free_extents_add(s, cluster_index, 1);
         }
         s->set_refcount(refcount_block, block_index, refcount);
 
@@ -964,12 +1129,106 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 
 
 
+typedef struct FreeExtentsFit {
+    uint64_t nb_clusters;
+    IntervalTreeNode *best;
+} FreeExtentsFit;
+
+/*
+ * Search function for g_tree_search() that never matches, but records the
+ * smallest extent that can hold fit->nb_clusters on its way down the tree.
+ */
+static int free_extents_fit_search(gconstpointer key, gconstpointer data)
+{
+    IntervalTreeNode *node = (IntervalTreeNode *)key;
+    FreeExtentsFit *fit = (FreeExtentsFit *)data;
+
+    if (node->last - node->start + 1 >= fit->nb_clusters) {
+        fit->best = node;
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Returns the extent of the free-space index that best fits @nb_clusters
+ * clusters none of which lie beyond @max_index, or NULL if there is none.
+ * This is the shortest extent that is long enough, the lowest one if there
+ * are several.
+ */
+static IntervalTreeNode *free_extents_find_fit(BDRVQcow2State *s,
+                                               uint64_t nb_clusters,
+                                               uint64_t max_index)
+{
+    FreeExtentsFit fit = { .nb_clusters = nb_clusters };
+    IntervalTreeNode *node;
+
+    g_tree_search(s->free_extents_by_size, free_extents_fit_search, &fit);
+    if (!fit.best || fit.best->start + nb_clusters - 1 <= max_index) {
+        return fit.best;
+    }
+
+    /*
+     * The best fit lies beyond @max_index, which can only be lower than the
+     * end of the image for compressed clusters.  Fall back to the lowest
+     * extent that is long enough.
+     */
+    for (node = interval_tree_iter_first(&s->free_extents, 0, UINT64_MAX);
+         node != NULL && node->start + nb_clusters - 1 <= max_index;
+         node = interval_tree_iter_next(node, 0, UINT64_MAX))
+    {
+        if (node->last - node->start + 1 >= nb_clusters) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Looks for @nb_clusters contiguous free clusters in the free-space index,
+ * none of which may lie beyond @max_index, taking them from the start of the
+ * extent that fits them best. The clusters are taken out of the index and
+ * the index of the first one is stored in *@cluster_index.
+ *
+ * Returns 1 if such an extent was found, 0 if not, and -errno on error.
+ */
+static int GRAPH_RDLOCK
+alloc_clusters_from_index(BlockDriverState *bs, uint64_t nb_clusters,
+                          uint64_t max_index, uint64_t *cluster_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    IntervalTreeNode *node;
+    uint64_t i, refcount;
+    int ret;
+
+retry:
+    node = free_extents_find_fit(s, nb_clusters, max_index);
+    if (!node) {
+        return 0;
+    }
+
+    /* Entries may be stale, check that the clusters are really free */
+    for (i = 0; i < nb_clusters; i++) {
+        ret = qcow2_get_refcount(bs, node->start + i, &refcount);
+        if (ret < 0) {
+            return ret;
+        } else if (refcount != 0) {
+            free_extents_remove(s, node->start + i, 1);
+            goto retry;
+        }
+    }
+
+    *cluster_index = node->start;
+    free_extents_remove(s, *cluster_index, nb_clusters);
+    return 1;
+}
+
 /* return < 0 if error */
 static int64_t GRAPH_RDLOCK
 alloc_clusters_noref(BlockDriverState *bs, uint64_t size, uint64_t max)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t i, nb_clusters, refcount;
+    uint64_t i, nb_clusters, refcount, cluster_index;
     int ret;
 
     /* We can't allocate clusters if they may still be queued for discard. */
@@ -978,6 +1237,15 @@ alloc_clusters_noref(BlockDriverState *bs, uint64_t size, uint64_t max)
     }
 
     nb_clusters = size_to_clusters(s, size);
+
+    ret = alloc_clusters_from_index(bs, nb_clusters, max >> s->cluster_bits,
+                                    &cluster_index);
+    if (ret < 0) {
+        return ret;
+    } else if (ret > 0) {
+        return cluster_index << s->cluster_bits;
+    }
+
 retry:
     for(i = 0; i < nb_clusters; i++) {
         uint64_t next_cluster_index = s->free_cluster_index++;
@@ -986,6 +1254,10 @@ retry:
         if (ret < 0) {
             return ret;
         } else if (refcount != 0) {
+            /* Remember the free clusters that were too few for this request */
+            if (i > 0) {
+                free_extents_add(s, next_cluster_index - i, i);
+            }
             goto retry;
         }
     }
@@ -1062,6 +1334,10 @@ int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offs
         return ret;
     }
 
+    if (i > 0) {
+        free_extents_remove(s, offset >> s->cluster_bits, i);
+    }
+
     return i;
 }
 
@@ -1240,25 +1516,182 @@ int qcow2_flush_caches(BlockDriverState *bs)
 
 
 
+/*
+ * Update the refcounts of the L2 table referenced by l1_table[l1_index] and
+ * of all clusters it references, and recompute the COPIED flags of the L2
+ * entries and of l1_table[l1_index].  The refcounts of the referenced
+ * clusters are changed by @addend, the one of the L2 table by @l2_addend.
+ *
+ * l1_table[l1_index] is only modified in memory, writing it is up to the
+ * caller.
+ */
+int qcow2_update_snapshot_refcount_l2(BlockDriverState *bs, uint64_t *l1_table,
+                                      int l1_index, int addend, int l2_addend)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_slice = NULL;
+    uint64_t l2_offset, old_l2_offset, entry, refcount;
+    int64_t old_entry;
+    unsigned slice, slice_size2, n_slices;
+    int j;
+    int ret;
+
+    assert(addend >= -1 && addend <= 1);
+    assert(l2_addend >= -1 && l2_addend <= 1);
+
+    l2_offset = l1_table[l1_index];
+    if (!l2_offset) {
+        return 0;
+    }
+
+    old_l2_offset = l2_offset;
+    l2_offset &= L1E_OFFSET_MASK;
+
+    if (offset_into_cluster(s, l2_offset)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#"
+                                PRIx64 " unaligned (L1 index: %#x)",
+                                l2_offset, l1_index);
+        return -EIO;
+    }
+
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
+
+    for (slice = 0; slice < n_slices; slice++) {
+        ret = qcow2_cache_get(bs, s->l2_table_cache,
+                              l2_offset + slice * slice_size2,
+                              (void **) &l2_slice);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        for (j = 0; j < s->l2_slice_size; j++) {
+            uint64_t cluster_index;
+            uint64_t offset;
+
+            entry = get_l2_entry(s, l2_slice, j);
+            old_entry = entry;
+            entry &= ~QCOW_OFLAG_COPIED;
+            offset = entry & L2E_OFFSET_MASK;
+
+            switch (qcow2_get_cluster_type(bs, entry)) {
+            case QCOW2_CLUSTER_COMPRESSED:
+                if (addend != 0) {
+                    uint64_t coffset;
+                    int csize;
+
+                    qcow2_parse_compressed_l2_entry(bs, entry,
+                                                    &coffset, &csize);
+                    ret = update_refcount(
+                        bs, coffset, csize,
+                        abs(addend), addend < 0,
+                        QCOW2_DISCARD_SNAPSHOT);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
+                /* compressed clusters are never modified */
+                refcount = 2;
+                break;
+
+            case QCOW2_CLUSTER_NORMAL:
+            case QCOW2_CLUSTER_ZERO_ALLOC:
+                if (offset_into_cluster(s, offset)) {
+                    /* Here l2_index means table (not slice) index */
+                    int l2_index = slice * s->l2_slice_size + j;
+                    qcow2_signal_corruption(
+                        bs, true, -1, -1, "Cluster "
+                        "allocation offset %#" PRIx64
+                        " unaligned (L2 offset: %#"
+                        PRIx64 ", L2 index: %#x)",
+                        offset, l2_offset, l2_index);
+                    ret = -EIO;
+                    goto fail;
+                }
+
+                cluster_index = offset >> s->cluster_bits;
+                assert(cluster_index);
+                if (addend != 0) {
+                    ret = qcow2_update_cluster_refcount(
+                        bs, cluster_index, abs(addend), addend < 0,
+                        QCOW2_DISCARD_SNAPSHOT);
+                    if (ret < 0) {
+                        goto fail;
+                    }
+                }
+
+                ret = qcow2_get_refcount(bs, cluster_index, &refcount);
+                if (ret < 0) {
+                    goto fail;
+                }
+                break;
+
+            case QCOW2_CLUSTER_ZERO_PLAIN:
+            case QCOW2_CLUSTER_UNALLOCATED:
+                refcount = 0;
+                break;
+
+            default:
+                abort();
+            }
+
+            if (refcount == 1) {
+                entry |= QCOW_OFLAG_COPIED;
+            }
+            if (entry != old_entry) {
+                if (addend > 0) {
+                    qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                               s->refcount_block_cache);
+                }
+                set_l2_entry(s, l2_slice, j, entry);
+                qcow2_cache_entry_mark_dirty(s->l2_table_cache,
+                                             l2_slice);
+            }
+        }
+
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+
+    if (l2_addend != 0) {
+        ret = qcow2_update_cluster_refcount(bs, l2_offset >> s->cluster_bits,
+                                            abs(l2_addend), l2_addend < 0,
+                                            QCOW2_DISCARD_SNAPSHOT);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits, &refcount);
+    if (ret < 0) {
+        return ret;
+    } else if (refcount == 1) {
+        l2_offset |= QCOW_OFLAG_COPIED;
+    }
+    if (l2_offset != old_l2_offset) {
+        l1_table[l1_index] = l2_offset;
+    }
+    return 0;
+
+fail:
+    if (l2_slice) {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+    }
+    return ret;
+}
+
 /* update the refcounts of snapshots and the copied flag */
 int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     int64_t l1_table_offset, int l1_size, int addend)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l1_table, *l2_slice, l2_offset, entry, l1_size2, refcount;
+    uint64_t *l1_table, l1_size2;
     bool l1_allocated = false;
-    int64_t old_entry, old_l2_offset;
-    unsigned slice, slice_size2, n_slices;
-    int i, j, l1_modified = 0;
+    int i, l1_modified = 0;
     int ret;
 
     assert(addend >= -1 && addend <= 1);
 
-    l2_slice = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * L1E_SIZE;
-    slice_size2 = s->l2_slice_size * l2_entry_size(s);
-    n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
 
@@ -1288,143 +1721,20 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     }
 
     for (i = 0; i < l1_size; i++) {
-        l2_offset = l1_table[i];
-        if (l2_offset) {
-            old_l2_offset = l2_offset;
-            l2_offset &= L1E_OFFSET_MASK;
-
-            if (offset_into_cluster(s, l2_offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset %#"
-                                        PRIx64 " unaligned (L1 index: %#x)",
-                                        l2_offset, i);
-                ret = -EIO;
-                goto fail;
-            }
-
-            for (slice = 0; slice < n_slices; slice++) {
-                ret = qcow2_cache_get(bs, s->l2_table_cache,
-                                      l2_offset + slice * slice_size2,
-                                      (void **) &l2_slice);
-                if (ret < 0) {
-                    goto fail;
-                }
-
-                for (j = 0; j < s->l2_slice_size; j++) {
-                    uint64_t cluster_index;
-                    uint64_t offset;
-
-                    entry = get_l2_entry(s, l2_slice, j);
-                    old_entry = entry;
-                    entry &= ~QCOW_OFLAG_COPIED;
-                    offset = entry & L2E_OFFSET_MASK;
-
-                    switch (qcow2_get_cluster_type(bs, entry)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        if (addend != 0) {
-                            uint64_t coffset;
-                            int csize;
-
-                            qcow2_parse_compressed_l2_entry(bs, entry,
-                                                            &coffset, &csize);
-                            ret = update_refcount(
-                                bs, coffset, csize,
-                                abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO_ALLOC:
-                        if (offset_into_cluster(s, offset)) {
-                            /* Here l2_index means table (not slice) index */
-                            int l2_index = slice * s->l2_slice_size + j;
-                            qcow2_signal_corruption(
-                                bs, true, -1, -1, "Cluster "
-                                "allocation offset %#" PRIx64
-                                " unaligned (L2 offset: %#"
-                                PRIx64 ", L2 index: %#x)",
-                                offset, l2_offset, l2_index);
-                            ret = -EIO;
-                            goto fail;
-                        }
-
-                        cluster_index = offset >> s->cluster_bits;
-                        assert(cluster_index);
-                        if (addend != 0) {
-                            ret = qcow2_update_cluster_refcount(
-                                bs, cluster_index, abs(addend), addend < 0,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
-                                goto fail;
-                            }
-                        }
-
-                        ret = qcow2_get_refcount(bs, cluster_index, &refcount);
-                        if (ret < 0) {
-                            goto fail;
-                        }
-                        break;
-
-                    case QCOW2_CLUSTER_ZERO_PLAIN:
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
-
-                    default:
-                        abort();
-                    }
-
-                    if (refcount == 1) {
-                        entry |= QCOW_OFLAG_COPIED;
-                    }
-                    if (entry != old_entry) {
-                        if (addend > 0) {
-                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                                                       s->refcount_block_cache);
-                        }
-                        set_l2_entry(s, l2_slice, j, entry);
-                        qcow2_cache_entry_mark_dirty(s->l2_table_cache,
-                                                     l2_slice);
-                    }
-                }
-
-                qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
-            }
+        uint64_t old_l1_entry = l1_table[i];
 
-            if (addend != 0) {
-                ret = qcow2_update_cluster_refcount(bs, l2_offset >>
-                                                        s->cluster_bits,
-                                                    abs(addend), addend < 0,
-                                                    QCOW2_DISCARD_SNAPSHOT);
-                if (ret < 0) {
-                    goto fail;
-                }
-            }
-            ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
-                                     &refcount);
-            if (ret < 0) {
-                goto fail;
-            } else if (refcount == 1) {
-                l2_offset |= QCOW_OFLAG_COPIED;
-            }
-            if (l2_offset != old_l2_offset) {
-                l1_table[i] = l2_offset;
-                l1_modified = 1;
-            }
+        ret = qcow2_update_snapshot_refcount_l2(bs, l1_table, i,
+                                                addend, addend);
+        if (ret < 0) {
+            goto fail;
+        }
+        if (l1_table[i] != old_l1_entry) {
+            l1_modified = 1;
         }
     }
 
     ret = bdrv_flush(bs);
 fail:
-    if (l2_slice) {
-        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
-    }
-
     s->cache_discards = false;
     qcow2_process_discards(bs, ret);
 
@@ -1516,41 +1826,53 @@ static int realloc_refcount_array(BDRVQcow2State *s, void **array,
 }
 
 /*
- * Increases the refcount for a range of clusters in a given refcount table.
- * This is used to construct a temporary refcount table out of L1 and L2 tables
- * which can be compared to the refcount table saved in the image.
- *
- * Modifies the number of errors in res.
+ * Print a problem found by the check to stderr, or append it to @report if it
+ * is not NULL.  The L2 tables are checked concurrently, so check_refcounts_l1()
+ * collects the messages for each table and prints them in L1 order.
  */
-int coroutine_fn GRAPH_RDLOCK
-qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
-                         void **refcount_table,
-                         int64_t *refcount_table_size,
-                         int64_t offset, int64_t size)
+static void G_GNUC_PRINTF(2, 3)
+check_report(GString *report, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (report) {
+        g_string_append_vprintf(report, fmt, ap);
+    } else {
+        vfprintf(stderr, fmt, ap);
+    }
+    va_end(ap);
+}
+
+/*
+ * Like qcow2_inc_refcounts_imrt(), but takes the length of the image file
+ * from @file_len, so that callers that count many ranges can query it once,
+ * and reports problems to @report, see check_report().
+ */
+static int inc_refcounts_imrt_in_file(BlockDriverState *bs,
+                                      BdrvCheckResult *res,
+                                      void **refcount_table,
+                                      int64_t *refcount_table_size,
+                                      int64_t offset, int64_t size,
+                                      int64_t file_len, GString *report)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t start, last, cluster_offset, k, refcount;
-    int64_t file_len;
     int ret;
 
     if (size <= 0) {
         return 0;
     }
 
-    file_len = bdrv_co_getlength(bs->file->bs);
-    if (file_len < 0) {
-        return file_len;
-    }
-
     /*
      * Last cluster of qcow2 image may be semi-allocated, so it may be OK to
      * reference some space after file end but it should be less than one
      * cluster.
      */
     if (offset + size - file_len >= s->cluster_size) {
-        fprintf(stderr, "ERROR: counting reference for region exceeding the "
-                "end of the file by one cluster or more: offset 0x%" PRIx64
-                " size 0x%" PRIx64 "\n", offset, size);
+        check_report(report, "ERROR: counting reference for region exceeding "
+                     "the end of the file by one cluster or more: offset 0x%"
+                     PRIx64 " size 0x%" PRIx64 "\n", offset, size);
         res->corruptions++;
         return 0;
     }
@@ -1571,11 +1893,11 @@ qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
 
         refcount = s->get_refcount(*refcount_table, k);
         if (refcount == s->refcount_max) {
-            fprintf(stderr, "ERROR: overflow cluster offset=0x%" PRIx64
-                    "\n", cluster_offset);
-            fprintf(stderr, "Use qemu-img amend to increase the refcount entry "
-                    "width or qemu-img convert to create a clean copy if the "
-                    "image cannot be opened for writing\n");
+            check_report(report, "ERROR: overflow cluster offset=0x%" PRIx64
+                         "\n", cluster_offset);
+            check_report(report, "Use qemu-img amend to increase the refcount "
+                         "entry width or qemu-img convert to create a clean "
+                         "copy if the image cannot be opened for writing\n");
             res->corruptions++;
             continue;
         }
@@ -1585,6 +1907,35 @@ qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
     return 0;
 }
 
+/*
+ * Increases the refcount for a range of clusters in a given refcount table.
+ * This is used to construct a temporary refcount table out of L1 and L2 tables
+ * which can be compared to the refcount table saved in the image.
+ *
+ * Modifies the number of errors in res.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_inc_refcounts_imrt(BlockDriverState *bs, BdrvCheckResult *res,
+                         void **refcount_table,
+                         int64_t *refcount_table_size,
+                         int64_t offset, int64_t size)
+{
+    int64_t file_len;
+
+    if (size <= 0) {
+        return 0;
+    }
+
+    file_len = bdrv_co_getlength(bs->file->bs);
+    if (file_len < 0) {
+        return file_len;
+    }
+
+    return inc_refcounts_imrt_in_file(bs, res, refcount_table,
+                                      refcount_table_size, offset, size,
+                                      file_len, NULL);
+}
+
 /* Flags for check_refcounts_l1() and check_refcounts_l2() */
 enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
@@ -1603,7 +1954,7 @@ static int coroutine_fn GRAPH_RDLOCK
 fix_l2_entry_by_zero(BlockDriverState *bs, BdrvCheckResult *res,
                      uint64_t l2_offset, uint64_t *l2_table,
                      int l2_index, bool active,
-                     bool *metadata_overlap)
+                     bool *metadata_overlap, GString *report)
 {
     BDRVQcow2State *s = bs->opaque;
     int ret;
@@ -1630,15 +1981,15 @@ fix_l2_entry_by_zero(BlockDriverState *bs, BdrvCheckResult *res,
         *metadata_overlap = ret < 0;
     }
     if (ret < 0) {
-        fprintf(stderr, "ERROR: Overlap check failed\n");
+        check_report(report, "ERROR: Overlap check failed\n");
         goto fail;
     }
 
     ret = bdrv_co_pwrite_sync(bs->file, l2e_offset, l2_entry_size(s),
                               &l2_table[idx], 0);
     if (ret < 0) {
-        fprintf(stderr, "ERROR: Failed to overwrite L2 "
-                "table entry: %s\n", strerror(-ret));
+        check_report(report, "ERROR: Failed to overwrite L2 "
+                     "table entry: %s\n", strerror(-ret));
         goto fail;
     }
 
@@ -1654,7 +2005,7 @@ fail:
 /*
  * Increases the refcount in the given refcount table for the all clusters
  * referenced in the L2 table. While doing so, performs some checks on L2
- * entries.
+ * entries, whose problems are reported to @report.
  *
  * Returns the number of errors found by the checks or -errno if an internal
  * error occurred.
@@ -1663,11 +2014,13 @@ static int coroutine_fn GRAPH_RDLOCK
 check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                    void **refcount_table,
                    int64_t *refcount_table_size, int64_t l2_offset,
-                   int flags, BdrvCheckMode fix, bool active)
+                   int flags, BdrvCheckMode fix, bool active,
+                   GString *report)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
+    int64_t file_len;
     int i, ret;
     size_t l2_size_bytes = s->l2_size * l2_entry_size(s);
     g_autofree uint64_t *l2_table = g_malloc(l2_size_bytes);
@@ -1676,11 +2029,16 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     /* Read L2 table from disk */
     ret = bdrv_co_pread(bs->file, l2_offset, l2_size_bytes, l2_table, 0);
     if (ret < 0) {
-        fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
+        check_report(report, "ERROR: I/O error in check_refcounts_l2\n");
         res->check_errors++;
         return ret;
     }
 
+    file_len = bdrv_co_getlength(bs->file->bs);
+    if (file_len < 0) {
+        return file_len;
+    }
+
     /* Do the actual checks */
     for (i = 0; i < s->l2_size; i++) {
         uint64_t coffset;
@@ -1694,8 +2052,8 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         if (type != QCOW2_CLUSTER_COMPRESSED) {
             /* Check reserved bits of Standard Cluster Descriptor */
             if (l2_entry & L2E_STD_RESERVED_MASK) {
-                fprintf(stderr, "ERROR found l2 entry with reserved bits set: "
-                        "%" PRIx64 "\n", l2_entry);
+                check_report(report, "ERROR found l2 entry with reserved bits "
+                             "set: %" PRIx64 "\n", l2_entry);
                 res->corruptions++;
             }
         }
@@ -1704,32 +2062,33 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         case QCOW2_CLUSTER_COMPRESSED:
             /* Compressed clusters don't have QCOW_OFLAG_COPIED */
             if (l2_entry & QCOW_OFLAG_COPIED) {
-                fprintf(stderr, "ERROR: coffset=0x%" PRIx64 ": "
-                    "copied flag must never be set for compressed "
-                    "clusters\n", l2_entry & s->cluster_offset_mask);
+                check_report(report, "ERROR: coffset=0x%" PRIx64 ": "
+                             "copied flag must never be set for compressed "
+                             "clusters\n", l2_entry & s->cluster_offset_mask);
                 l2_entry &= ~QCOW_OFLAG_COPIED;
                 res->corruptions++;
             }
 
             if (has_data_file(bs)) {
-                fprintf(stderr, "ERROR compressed cluster %d with data file, "
-                        "entry=0x%" PRIx64 "\n", i, l2_entry);
+                check_report(report, "ERROR compressed cluster %d with data "
+                             "file, entry=0x%" PRIx64 "\n", i, l2_entry);
                 res->corruptions++;
                 break;
             }
 
             if (l2_bitmap) {
-                fprintf(stderr, "ERROR compressed cluster %d with non-zero "
-                        "subcluster allocation bitmap, entry=0x%" PRIx64 "\n",
-                        i, l2_entry);
+                check_report(report, "ERROR compressed cluster %d with "
+                             "non-zero subcluster allocation bitmap, "
+                             "entry=0x%" PRIx64 "\n", i, l2_entry);
                 res->corruptions++;
                 break;
             }
 
             /* Mark cluster as used */
             qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
-            ret = qcow2_inc_refcounts_imrt(
-                bs, res, refcount_table, refcount_table_size, coffset, csize);
+            ret = inc_refcounts_imrt_in_file(bs, res, refcount_table,
+                                             refcount_table_size, coffset,
+                                             csize, file_len, report);
             if (ret < 0) {
                 return ret;
             }
@@ -1755,9 +2114,9 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
             if ((l2_bitmap >> 32) & l2_bitmap) {
                 res->corruptions++;
-                fprintf(stderr, "ERROR offset=%" PRIx64 ": Allocated "
-                        "cluster has corrupted subcluster allocation bitmap\n",
-                        offset);
+                check_report(report, "ERROR offset=%" PRIx64 ": Allocated "
+                             "cluster has corrupted subcluster allocation "
+                             "bitmap\n", offset);
             }
 
             /* Correct offsets are cluster aligned */
@@ -1772,15 +2131,15 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                 }
 
                 if (!contains_data) {
-                    fprintf(stderr, "%s offset=%" PRIx64 ": Preallocated "
-                            "cluster is not properly aligned; L2 entry "
-                            "corrupted.\n",
-                            fix & BDRV_FIX_ERRORS ? "Repairing" : "ERROR",
-                            offset);
+                    check_report(report, "%s offset=%" PRIx64 ": Preallocated "
+                                 "cluster is not properly aligned; L2 entry "
+                                 "corrupted.\n",
+                                 fix & BDRV_FIX_ERRORS ? "Repairing" : "ERROR",
+                                 offset);
                     if (fix & BDRV_FIX_ERRORS) {
                         ret = fix_l2_entry_by_zero(bs, res, l2_offset,
                                                    l2_table, i, active,
-                                                   &metadata_overlap);
+                                                   &metadata_overlap, report);
                         if (metadata_overlap) {
                             /*
                              * Something is seriously wrong, so abort checking
@@ -1804,8 +2163,9 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                          */
                     }
                 } else {
-                    fprintf(stderr, "ERROR offset=%" PRIx64 ": Data cluster is "
-                        "not properly aligned; L2 entry corrupted.\n", offset);
+                    check_report(report, "ERROR offset=%" PRIx64 ": Data "
+                                 "cluster is not properly aligned; L2 entry "
+                                 "corrupted.\n", offset);
                 }
             }
 
@@ -1820,9 +2180,10 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
             /* Mark cluster as used */
             if (!has_data_file(bs)) {
-                ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table,
-                                               refcount_table_size,
-                                               offset, s->cluster_size);
+                ret = inc_refcounts_imrt_in_file(bs, res, refcount_table,
+                                                 refcount_table_size, offset,
+                                                 s->cluster_size, file_len,
+                                                 report);
                 if (ret < 0) {
                     return ret;
                 }
@@ -1838,8 +2199,8 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
         case QCOW2_CLUSTER_UNALLOCATED:
             if (l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) {
                 res->corruptions++;
-                fprintf(stderr, "ERROR: Unallocated "
-                        "cluster has non-zero subcluster allocation map\n");
+                check_report(report, "ERROR: Unallocated cluster has "
+                             "non-zero subcluster allocation map\n");
             }
             break;
 
@@ -1851,6 +2212,84 @@ check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     return 0;
 }
 
+/*
+ * check_refcounts_l1() checks up to QCOW2_CHECK_MAX_WORKERS L2 tables
+ * concurrently, so that the check is not bound by the latency of reading one
+ * L2 table after the other.  The tasks all run in the AioContext of the
+ * image and only yield for I/O, so they can share the refcount table, @res
+ * and the reports without locking.
+ */
+#define QCOW2_CHECK_MAX_WORKERS 16
+
+/*
+ * Messages of the checks of each L2 table, so that they can be printed in L1
+ * order even though the tables are checked concurrently
+ */
+typedef struct Qcow2CheckL2Reports {
+    /* Indexed by L2 table, set when the check of the table is done */
+    GString **tables;
+    int nb_tables;
+    /* Reports up to this table have been printed */
+    int nb_printed;
+} Qcow2CheckL2Reports;
+
+/*
+ * Store @report as the report of L2 table @index and print all reports that
+ * are complete up to the first table whose check is still in progress.
+ */
+static void check_l2_report_done(Qcow2CheckL2Reports *r, int index,
+                                 GString *report)
+{
+    assert(index < r->nb_tables && !r->tables[index]);
+    r->tables[index] = report;
+
+    while (r->nb_printed < r->nb_tables && r->tables[r->nb_printed]) {
+        fputs(r->tables[r->nb_printed]->str, stderr);
+        g_string_free(r->tables[r->nb_printed], true);
+        r->nb_printed++;
+    }
+}
+
+typedef struct Qcow2CheckL2Task {
+    AioTask task;
+
+    BlockDriverState *bs;
+    BdrvCheckResult *res;
+    void **refcount_table;
+    int64_t *refcount_table_size;
+    int64_t l2_offset;
+    int flags;
+    BdrvCheckMode fix;
+    bool active;
+
+    Qcow2CheckL2Reports *reports;
+    GString *report;
+    int index;
+
+    int *nb_done;
+    int nb_l2_tables;
+} Qcow2CheckL2Task;
+
+/*
+ * This function can count as GRAPH_RDLOCK because check_refcounts_l1() holds
+ * the graph lock and keeps it until this coroutine has terminated.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+check_refcounts_l2_task_entry(AioTask *task)
+{
+    Qcow2CheckL2Task *t = container_of(task, Qcow2CheckL2Task, task);
+    int ret;
+
+    ret = check_refcounts_l2(t->bs, t->res, t->refcount_table,
+                             t->refcount_table_size, t->l2_offset, t->flags,
+                             t->fix, t->active, t->report);
+    check_l2_report_done(t->reports, t->index, t->report);
+
+    trace_qcow2_check_l2_done(t->bs, t->l2_offset, ++*t->nb_done,
+                              t->nb_l2_tables);
+    return ret;
+}
+
 /*
  * Increases the refcount for the L1 table, its L2 tables and all referenced
  * clusters in the given refcount table. While doing so, performs some checks
@@ -1869,6 +2308,12 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
     size_t l1_size_bytes = l1_size * L1E_SIZE;
     g_autofree uint64_t *l1_table = NULL;
     uint64_t l2_offset;
+    int64_t start_time, file_len;
+    int nb_l2_tables = 0, nb_done = 0, nb_started = 0;
+    Qcow2CheckL2Reports reports = { 0 };
+    GString *report;
+    AioTaskPool *pool;
+    Qcow2CheckL2Task *t;
     int i, ret;
 
     if (!l1_size) {
@@ -1898,47 +2343,94 @@ check_refcounts_l1(BlockDriverState *bs, BdrvCheckResult *res,
 
     for (i = 0; i < l1_size; i++) {
         be64_to_cpus(&l1_table[i]);
+        if (l1_table[i]) {
+            nb_l2_tables++;
+        }
     }
 
+    file_len = bdrv_co_getlength(bs->file->bs);
+    if (file_len < 0) {
+        return file_len;
+    }
+
+    reports.tables = g_new0(GString *, nb_l2_tables);
+    reports.nb_tables = nb_l2_tables;
+
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    pool = aio_task_pool_new(QCOW2_CHECK_MAX_WORKERS);
+
     /* Do the actual checks */
-    for (i = 0; i < l1_size; i++) {
+    for (i = 0; i < l1_size && aio_task_pool_status(pool) == 0; i++) {
         if (!l1_table[i]) {
             continue;
         }
 
+        /* Problems with the L1 entry are reported along with its L2 table */
+        report = g_string_new(NULL);
+
         if (l1_table[i] & L1E_RESERVED_MASK) {
-            fprintf(stderr, "ERROR found L1 entry with reserved bits set: "
-                    "%" PRIx64 "\n", l1_table[i]);
+            check_report(report, "ERROR found L1 entry with reserved bits set: "
+                         "%" PRIx64 "\n", l1_table[i]);
             res->corruptions++;
         }
 
         l2_offset = l1_table[i] & L1E_OFFSET_MASK;
 
         /* Mark L2 table as used */
-        ret = qcow2_inc_refcounts_imrt(bs, res,
-                                       refcount_table, refcount_table_size,
-                                       l2_offset, s->cluster_size);
+        ret = inc_refcounts_imrt_in_file(bs, res,
+                                         refcount_table, refcount_table_size,
+                                         l2_offset, s->cluster_size, file_len,
+                                         report);
         if (ret < 0) {
-            return ret;
+            check_l2_report_done(&reports, nb_started, report);
+            goto out;
         }
 
         /* L2 tables are cluster aligned */
         if (offset_into_cluster(s, l2_offset)) {
-            fprintf(stderr, "ERROR l2_offset=%" PRIx64 ": Table is not "
-                "cluster aligned; L1 entry corrupted\n", l2_offset);
+            check_report(report, "ERROR l2_offset=%" PRIx64 ": Table is not "
+                         "cluster aligned; L1 entry corrupted\n", l2_offset);
             res->corruptions++;
         }
 
         /* Process and check L2 entries */
-        ret = check_refcounts_l2(bs, res, refcount_table,
-                                 refcount_table_size, l2_offset, flags,
-                                 fix, active);
-        if (ret < 0) {
-            return ret;
-        }
+        t = g_new(Qcow2CheckL2Task, 1);
+        *t = (Qcow2CheckL2Task) {
+            .task.func = check_refcounts_l2_task_entry,
+            .bs = bs,
+            .res = res,
+            .refcount_table = refcount_table,
+            .refcount_table_size = refcount_table_size,
+            .l2_offset = l2_offset,
+            .flags = flags,
+            .fix = fix,
+            .active = active,
+            .reports = &reports,
+            .report = report,
+            .index = nb_started++,
+            .nb_done = &nb_done,
+            .nb_l2_tables = nb_l2_tables,
+        };
+        aio_task_pool_start_task(pool, &t->task);
     }
+    ret = 0;
 
-    return 0;
+out:
+    aio_task_pool_wait_all(pool);
+    if (ret == 0) {
+        ret = aio_task_pool_status(pool);
+    }
+    aio_task_pool_free(pool);
+
+    /* The reports of all tables that were started have been printed */
+    g_free(reports.tables);
+
+    trace_qcow2_check_l1_done(bs, l1_table_offset, nb_done,
+                              (uint64_t)nb_done * s->l2_size *
+                              l2_entry_size(s),
+                              (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) -
+                               start_time) / SCALE_US);
+    return ret;
 }
 
 /*
@@ -3610,7 +4102,7 @@ qcow2_discard_refcount_block(BlockDriverState *bs, uint64_t discard_block_offs)
     qcow2_cache_put(s->refcount_block_cache, &refblock);
 
     if (cluster_index < s->free_cluster_index) {
-        s->free_cluster_index = cluster_index;
+        free_extents_add(s, cluster_index, 1);
     }
 
     refblock = qcow2_cache_is_table_offset(s->refcount_block_cache,
@@ -26,6 +26,7 @@
 #include "system/block-backend.h"
 #include "qapi/error.h"
 #include "qcow2.h"
+#include "qemu/bitmap.h"
 #include "qemu/bswap.h"
 #include "qemu/error-report.h"
 #include "qemu/cutils.h"
@@ -633,6 +634,325 @@ static int find_snapshot_by_id_or_name(BlockDriverState *bs,
     return find_snapshot_by_id_and_name(bs, NULL, id_or_name);
 }
 
+/*
+ * Deferred snapshot refcount updates
+ *
+ * Creating or deleting an internal snapshot has to update the refcounts of
+ * all clusters of the image.  With lazy refcounts, this is mostly deferred
+ * so that it does not take time proportional to the image size:
+ *
+ * - Creating a snapshot only increases the refcounts of the active L2 tables
+ *   and clears the COPIED flags in the active L1 table.  The refcounts of
+ *   the clusters referenced by these L2 tables are increased later, either
+ *   in the background or right before the L2 table is copied because it is
+ *   written to (see get_cluster_table()).  Until then, in-place writes are
+ *   impossible even where the L2 entries still have the COPIED flag.
+ *
+ * - Deleting a snapshot removes it from the snapshot table and queues the
+ *   refcount decrease for its clusters.  Once that is done, the COPIED flags
+ *   of the active tables are recomputed, again in the background.
+ *
+ * In the meantime, the refcounts on disk are too low for clusters shared
+ * with a new snapshot.  The image is kept dirty until all updates are done,
+ * so after a crash, the refcounts are rebuilt by the repair on open like
+ * for any other lazy refcount update.  Everything that relies on complete
+ * refcounts finishes the deferred updates first.
+ */
+
+bool qcow2_snapshot_refcount_pending(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return s->nb_snapshot_l2_pending || !QSIMPLEQ_EMPTY(&s->snapshot_unrefs);
+}
+
+static void snapshot_unref_free(Qcow2SnapshotUnref *unref)
+{
+    g_free(unref->l1_table);
+    g_free(unref);
+}
+
+void qcow2_snapshot_refcount_cleanup(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2SnapshotUnref *unref;
+
+    while ((unref = QSIMPLEQ_FIRST(&s->snapshot_unrefs))) {
+        QSIMPLEQ_REMOVE_HEAD(&s->snapshot_unrefs, next);
+        snapshot_unref_free(unref);
+    }
+
+    g_free(s->snapshot_l2_pending);
+    s->snapshot_l2_pending = NULL;
+    s->nb_snapshot_l2_pending = 0;
+}
+
+/* Recompute the COPIED flags of all active tables */
+static void snapshot_l2_pending_set_all(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->l1_size) {
+        return;
+    }
+
+    assert(!s->snapshot_l2_pending || s->snapshot_l2_addend == 0);
+    if (!s->snapshot_l2_pending) {
+        s->snapshot_l2_pending = bitmap_new(s->l1_size);
+    }
+    bitmap_set(s->snapshot_l2_pending, 0, s->l1_size);
+    s->nb_snapshot_l2_pending = s->l1_size;
+    s->snapshot_l2_addend = 0;
+}
+
+/*
+ * Apply the pending update to the active L2 table at @l1_index.  After an
+ * error, the update stays pending; retrying it may leave refcounts too high,
+ * which only leaks clusters, but never too low.
+ */
+static int GRAPH_RDLOCK
+snapshot_update_active_l2(BlockDriverState *bs, int l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t old_l1_entry = s->l1_table[l1_index];
+    int ret;
+
+    ret = qcow2_update_snapshot_refcount_l2(bs, s->l1_table, l1_index,
+                                            s->snapshot_l2_addend, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (s->l1_table[l1_index] != old_l1_entry) {
+        /* The refcount must be stable before the L1 entry claims COPIED */
+        ret = qcow2_flush_caches(bs);
+        if (ret == 0) {
+            ret = qcow2_write_l1_entry(bs, l1_index);
+        }
+        if (ret < 0) {
+            s->l1_table[l1_index] = old_l1_entry;
+            return ret;
+        }
+    }
+
+    clear_bit(l1_index, s->snapshot_l2_pending);
+    if (--s->nb_snapshot_l2_pending == 0) {
+        g_free(s->snapshot_l2_pending);
+        s->snapshot_l2_pending = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Must be called before the active L2 table at @l1_index is copied, so that
+ * the copy does not mark clusters as unshared that a new snapshot still has
+ * to take a reference to.
+ */
+int qcow2_snapshot_update_l2(BlockDriverState *bs, int l1_index)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (!s->snapshot_l2_pending ||
+        !test_bit(l1_index, s->snapshot_l2_pending)) {
+        return 0;
+    }
+    return snapshot_update_active_l2(bs, l1_index);
+}
+
+/*
+ * Process the deferred refcount updates of up to @max L2 tables.  Returns 1
+ * if there is more to do, 0 if all updates are done and -errno on failure.
+ */
+int qcow2_snapshot_refcount_step(BlockDriverState *bs, int max)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2SnapshotUnref *unref;
+    int i, ret;
+
+    while (max > 0 && (unref = QSIMPLEQ_FIRST(&s->snapshot_unrefs))) {
+        if (unref->l1_index < unref->l1_size) {
+            /*
+             * Never retry a decrease that failed halfway through, leaking
+             * clusters is better than freeing them while still in use.
+             */
+            i = unref->l1_index++;
+            if (!unref->l1_table[i]) {
+                continue;
+            }
+
+            s->cache_discards = true;
+            ret = qcow2_update_snapshot_refcount_l2(bs, unref->l1_table, i,
+                                                    -1, -1);
+            s->cache_discards = false;
+            qcow2_process_discards(bs, ret);
+            if (ret < 0) {
+                return ret;
+            }
+            max--;
+            continue;
+        }
+
+        qcow2_free_clusters(bs, unref->l1_table_offset,
+                            unref->l1_size * L1E_SIZE,
+                            QCOW2_DISCARD_SNAPSHOT);
+        QSIMPLEQ_REMOVE_HEAD(&s->snapshot_unrefs, next);
+        snapshot_unref_free(unref);
+
+        /* Clusters may not be shared any more */
+        snapshot_l2_pending_set_all(bs);
+    }
+
+    while (max > 0 && s->snapshot_l2_pending) {
+        i = find_first_bit(s->snapshot_l2_pending, s->l1_size);
+        assert(i < s->l1_size);
+        if (s->l1_table[i]) {
+            max--;
+        }
+
+        ret = snapshot_update_active_l2(bs, i);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return qcow2_snapshot_refcount_pending(bs);
+}
+
+int qcow2_snapshot_refcount_finish(BlockDriverState *bs)
+{
+    int ret;
+
+    do {
+        ret = qcow2_snapshot_refcount_step(bs, INT_MAX);
+    } while (ret > 0);
+
+    return ret;
+}
+
+/*
+ * Take the references of a new snapshot to the active L2 tables, but defer
+ * those to the clusters referenced by the L2 tables.  Clearing the COPIED
+ * flags in the active L1 table makes sure that these L2 tables are copied,
+ * and thus updated first, before anything modifies them.
+ */
+static int GRAPH_RDLOCK snapshot_defer_refcount_increase(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree uint64_t *l1_table = NULL;
+    unsigned long *pending;
+    unsigned nb_pending = 0;
+    int i, ret;
+
+    assert(!qcow2_snapshot_refcount_pending(bs));
+
+    ret = qcow2_mark_dirty(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    l1_table = g_try_new(uint64_t, s->l1_size);
+    if (s->l1_size && l1_table == NULL) {
+        return -ENOMEM;
+    }
+
+    pending = bitmap_new(s->l1_size);
+    for (i = 0; i < s->l1_size; i++) {
+        uint64_t l2_offset = s->l1_table[i] & L1E_OFFSET_MASK;
+
+        l1_table[i] = cpu_to_be64(s->l1_table[i] & ~QCOW_OFLAG_COPIED);
+        if (!l2_offset) {
+            continue;
+        }
+
+        if (offset_into_cluster(s, l2_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "L2 table offset 0x%"
+                                    PRIx64 " unaligned (L1 index: 0x%x)",
+                                    l2_offset, i);
+            ret = -EIO;
+            goto fail;
+        }
+
+        ret = qcow2_update_cluster_refcount(bs, l2_offset >> s->cluster_bits,
+                                            1, false, QCOW2_DISCARD_NEVER);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        set_bit(i, pending);
+        nb_pending++;
+    }
+
+    ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L1,
+                                        s->l1_table_offset,
+                                        s->l1_size * L1E_SIZE, false);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = bdrv_pwrite_sync(bs->file, s->l1_table_offset,
+                           s->l1_size * L1E_SIZE, l1_table, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < s->l1_size; i++) {
+        s->l1_table[i] &= ~QCOW_OFLAG_COPIED;
+    }
+
+    if (nb_pending) {
+        s->snapshot_l2_pending = pending;
+        s->nb_snapshot_l2_pending = nb_pending;
+        s->snapshot_l2_addend = 1;
+    } else {
+        g_free(pending);
+    }
+    return 0;
+
+fail:
+    g_free(pending);
+    return ret;
+}
+
+/* Read the L1 table of a snapshot that is about to be deleted */
+static int GRAPH_RDLOCK
+snapshot_unref_new(BlockDriverState *bs, QCowSnapshot *sn,
+                   Qcow2SnapshotUnref **punref)
+{
+    Qcow2SnapshotUnref *unref;
+    int i, ret;
+
+    ret = qcow2_mark_dirty(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    unref = g_new0(Qcow2SnapshotUnref, 1);
+    unref->l1_table_offset = sn->l1_table_offset;
+    unref->l1_size = sn->l1_size;
+    unref->l1_table = g_try_new(uint64_t, sn->l1_size);
+    if (sn->l1_size && unref->l1_table == NULL) {
+        ret = -ENOMEM;
+        goto fail;
+    }
+
+    ret = bdrv_pread(bs->file, sn->l1_table_offset, sn->l1_size * L1E_SIZE,
+                     unref->l1_table, 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    for (i = 0; i < sn->l1_size; i++) {
+        be64_to_cpus(&unref->l1_table[i]);
+    }
+
+    *punref = unref;
+    return 0;
+
+fail:
+    snapshot_unref_free(unref);
+    return ret;
+}
+
 /* if no id is provided, a new one is constructed */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 {
@@ -652,6 +972,12 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
         return -ENOTSUP;
     }
 
+    /* Earlier snapshots must hold all their references first */
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     memset(sn, 0, sizeof(*sn));
 
     /* Generate an ID */
@@ -707,9 +1033,16 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     /*
      * Increase the refcounts of all clusters and make sure everything is
      * stable on disk before updating the snapshot table to contain a pointer
-     * to the new L1 table.
+     * to the new L1 table.  With lazy refcounts, only the L2 tables get their
+     * refcounts increased here and the image stays dirty until the rest is
+     * done.
      */
-    ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset, s->l1_size, 1);
+    if (s->use_lazy_refcounts) {
+        ret = snapshot_defer_refcount_increase(bs);
+    } else {
+        ret = qcow2_update_snapshot_refcount(bs, s->l1_table_offset,
+                                             s->l1_size, 1);
+    }
     if (ret < 0) {
         goto fail;
     }
@@ -740,6 +1073,8 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
                           ROUND_UP(sn->vm_state_size, s->cluster_size),
                           QCOW2_DISCARD_NEVER, false);
 
+    qcow2_snapshot_refcount_schedule(bs);
+
 #ifdef DEBUG_ALLOC
     {
       BdrvCheckResult result = {0};
@@ -771,6 +1106,11 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
         return -ENOTSUP;
     }
 
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     /* Search the snapshot */
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0) {
@@ -876,6 +1216,7 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     for(i = 0;i < s->l1_size; i++) {
         s->l1_table[i] = be64_to_cpu(sn_l1_table[i]);
     }
+    qcow2_data_extents_drop(s);
 
     if (ret < 0) {
         goto fail;
@@ -913,6 +1254,7 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
 {
     BDRVQcow2State *s = bs->opaque;
     QCowSnapshot sn;
+    Qcow2SnapshotUnref *unref = NULL;
     int snapshot_index, ret;
 
     if (has_data_file(bs)) {
@@ -934,6 +1276,24 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
         return ret;
     }
 
+    /* Never drop references that a new snapshot has yet to take */
+    if (s->nb_snapshot_l2_pending && s->snapshot_l2_addend > 0) {
+        ret = qcow2_snapshot_refcount_finish(bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to update snapshot refcounts");
+            return ret;
+        }
+    }
+
+    if (s->use_lazy_refcounts) {
+        ret = snapshot_unref_new(bs, &sn, &unref);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret,
+                             "Failed to read the snapshot L1 table");
+            return ret;
+        }
+    }
+
     /* Remove it from the snapshot list */
     memmove(s->snapshots + snapshot_index,
             s->snapshots + snapshot_index + 1,
@@ -943,6 +1303,9 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
     if (ret < 0) {
         error_setg_errno(errp, -ret,
                          "Failed to remove snapshot from snapshot list");
+        if (unref) {
+            snapshot_unref_free(unref);
+        }
         return ret;
     }
 
@@ -954,6 +1317,13 @@ int qcow2_snapshot_delete(BlockDriverState *bs,
     g_free(sn.id_str);
     g_free(sn.name);
 
+    /* With lazy refcounts, the image stays dirty until this is done */
+    if (unref) {
+        QSIMPLEQ_INSERT_TAIL(&s->snapshot_unrefs, unref, next);
+        qcow2_snapshot_refcount_schedule(bs);
+        return 0;
+    }
+
     /*
      * Now decrease the refcounts of clusters referenced by the snapshot and
      * free the L1 table.
@@ -1071,6 +1441,7 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs,
     for(i = 0;i < s->l1_size; i++) {
         be64_to_cpus(&s->l1_table[i]);
     }
+    qcow2_data_extents_drop(s);
 
     return 0;
 }
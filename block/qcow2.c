@@ -544,6 +544,12 @@ static int GRAPH_RDLOCK qcow2_mark_clean(BlockDriverState *bs)
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         int ret;
 
+        /* Deferred snapshot refcount updates rely on the dirty bit */
+        ret = qcow2_snapshot_refcount_finish(bs);
+        if (ret < 0) {
+            return ret;
+        }
+
         s->incompatible_features &= ~QCOW2_INCOMPAT_DIRTY;
 
         ret = qcow2_flush_caches(bs);
@@ -614,6 +620,12 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
 
     memset(result, 0, sizeof(*result));
 
+    /* Repairing would count references that are still to be dropped */
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     ret = qcow2_check_read_snapshot_table(bs, &snapshot_res, fix);
     if (ret < 0) {
         qcow2_add_check_result(result, &snapshot_res, false);
@@ -701,6 +713,7 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_COMPRESSED_CACHE_SIZE,
     NULL
 };
 
@@ -817,6 +830,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the decompressed cluster cache",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -867,15 +885,99 @@ static void cache_clean_timer_del(BlockDriverState *bs)
     }
 }
 
+static void coroutine_fn snapshot_refcount_timer_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcow2State *s = bs->opaque;
+    int ret;
+
+    GRAPH_RDLOCK_GUARD();
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = qcow2_snapshot_refcount_step(bs, QCOW2_SNAPSHOT_REFCOUNT_BATCH);
+    qemu_co_mutex_unlock(&s->lock);
+
+    /* After an error, the rest is left to qcow2_mark_clean() */
+    if (ret > 0) {
+        qcow2_snapshot_refcount_schedule(bs);
+    }
+    bdrv_dec_in_flight(bs);
+}
+
+static void snapshot_refcount_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    Coroutine *co = qemu_coroutine_create(snapshot_refcount_timer_entry, bs);
+
+    bdrv_inc_in_flight(bs);
+    qemu_coroutine_enter(co);
+}
+
+static void snapshot_refcount_timer_init(BlockDriverState *bs,
+                                         AioContext *context)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    /*
+     * Use QEMU_CLOCK_VIRTUAL so that the image is not modified while the VM
+     * is stopped, e.g. right after taking a snapshot for savevm.
+     */
+    s->snapshot_refcount_timer = aio_timer_new(context, QEMU_CLOCK_VIRTUAL,
+                                               SCALE_MS,
+                                               snapshot_refcount_timer_cb, bs);
+}
+
+static void snapshot_refcount_timer_del(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    if (s->snapshot_refcount_timer) {
+        timer_free(s->snapshot_refcount_timer);
+        s->snapshot_refcount_timer = NULL;
+    }
+}
+
+/*
+ * Arm the timer that processes deferred snapshot refcount updates in the
+ * background, unless the node is drained.  qcow2_drain_end() calls this
+ * again once the drained section is over.
+ */
+void qcow2_snapshot_refcount_schedule(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->snapshot_refcount_timer && !qatomic_read(&bs->quiesce_counter) &&
+        qcow2_snapshot_refcount_pending(bs)) {
+        timer_mod(s->snapshot_refcount_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  QCOW2_SNAPSHOT_REFCOUNT_DELAY_MS);
+    }
+}
+
+static void qcow2_drain_begin(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->snapshot_refcount_timer) {
+        timer_del(s->snapshot_refcount_timer);
+    }
+}
+
+static void qcow2_drain_end(BlockDriverState *bs)
+{
+    qcow2_snapshot_refcount_schedule(bs);
+}
+
 static void qcow2_detach_aio_context(BlockDriverState *bs)
 {
     cache_clean_timer_del(bs);
+    snapshot_refcount_timer_del(bs);
 }
 
 static void qcow2_attach_aio_context(BlockDriverState *bs,
                                      AioContext *new_context)
 {
     cache_clean_timer_init(bs, new_context);
+    snapshot_refcount_timer_init(bs, new_context);
 }
 
 static bool read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
@@ -973,6 +1075,7 @@ static bool read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    Qcow2CompressedCache *compressed_cache;
     int l2_slice_size; /* Number of entries in a slice of the L2 table */
     bool use_lazy_refcounts;
     int overlap_check;
@@ -1060,6 +1163,13 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         ret = -ENOMEM;
         goto fail;
     }
+    qcow2_cache_set_update_func(r->l2_table_cache,
+                                qcow2_data_extents_l2_update, s);
+
+    r->compressed_cache = qcow2_compressed_cache_create(
+        qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+                          DEFAULT_COMPRESSED_CACHE_SIZE),
+        s->cluster_size);
 
     /* New interval for cache cleanup timer */
     r->cache_clean_interval =
@@ -1226,8 +1336,13 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_destroy(s->compressed_cache);
+    }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->compressed_cache = r->compressed_cache;
+    qcow2_data_extents_drop(s);
     s->l2_slice_size = r->l2_slice_size;
 
     s->overlap_check = r->overlap_check;
@@ -1258,6 +1373,9 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
     if (r->refcount_block_cache) {
         qcow2_cache_destroy(r->refcount_block_cache);
     }
+    if (r->compressed_cache) {
+        qcow2_compressed_cache_destroy(r->compressed_cache);
+    }
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
 
@@ -1626,8 +1744,10 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    QLIST_INIT(&s->cluster_allocs);
+    s->cluster_allocs = (IntervalTreeRoot) { };
+    s->data_extents = (IntervalTreeRoot) { };
     QTAILQ_INIT(&s->discards);
+    QSIMPLEQ_INIT(&s->snapshot_unrefs);
 
     /* read qcow2 extensions */
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
@@ -1888,6 +2008,7 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    snapshot_refcount_timer_init(bs, bdrv_get_aio_context(bs));
 
     return ret;
 
@@ -1915,6 +2036,11 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    if (s->compressed_cache) {
+        qcow2_compressed_cache_destroy(s->compressed_cache);
+        s->compressed_cache = NULL;
+    }
+    qcow2_data_extents_drop(s);
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -2198,6 +2324,7 @@ qcow2_co_block_status(BlockDriverState *bs, unsigned int mode,
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_handle_l2meta(BlockDriverState *bs, QCowL2Meta **pl2meta, bool link_l2)
 {
+    BDRVQcow2State *s = bs->opaque;
     int ret = 0;
     QCowL2Meta *l2meta = *pl2meta;
 
@@ -2214,7 +2341,7 @@ qcow2_handle_l2meta(BlockDriverState *bs, QCowL2Meta **pl2meta, bool link_l2)
         }
 
         /* Take the request off the list of running requests */
-        QLIST_REMOVE(l2meta, next_in_flight);
+        interval_tree_remove(&l2meta->in_flight, &s->cluster_allocs);
 
         qemu_co_queue_restart_all(&l2meta->dependent_requests);
 
@@ -2797,17 +2924,24 @@ static void coroutine_mixed_fn GRAPH_RDLOCK
 qcow2_do_close(BlockDriverState *bs, bool close_data_file)
 {
     BDRVQcow2State *s = bs->opaque;
-    qemu_vfree(s->l1_table);
-    /* else pre-write overlap checks in cache_destroy may crash */
-    s->l1_table = NULL;
 
+    /* Deferred snapshot refcount updates still need the L1 table here */
     if (!(s->flags & BDRV_O_INACTIVE)) {
         qcow2_inactivate(bs);
     }
 
+    qemu_vfree(s->l1_table);
+    /* else pre-write overlap checks in cache_destroy may crash */
+    s->l1_table = NULL;
+
     cache_clean_timer_del(bs);
+    snapshot_refcount_timer_del(bs);
+    qcow2_snapshot_refcount_cleanup(bs);
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_compressed_cache_destroy(s->compressed_cache);
+    s->compressed_cache = NULL;
+    qcow2_data_extents_drop(s);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4325,6 +4459,13 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
 
     qemu_co_mutex_lock(&s->lock);
 
+    /* Shrinking must not free clusters that deleted snapshots still hold */
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update snapshot refcounts");
+        goto fail;
+    }
+
     /*
      * Even though we store snapshot size for all images, it was not
      * required until v3, so it is not safe to proceed for v2.
@@ -4728,6 +4869,8 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     BLKDBG_CO_EVENT(s->data_file, BLKDBG_WRITE_COMPRESSED);
     ret = bdrv_co_pwrite(s->data_file, cluster_offset, out_len, out_buf, 0);
+    qcow2_compressed_cache_invalidate(s->compressed_cache, cluster_offset,
+                                      out_len);
     if (ret < 0) {
         goto fail;
     }
@@ -4822,19 +4965,28 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
     return ret;
 }
 
+typedef struct Qcow2DecompressTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t l2_entry;
+    uint64_t generation;
+    uint8_t *out_buf;   /* cluster_size bytes, NULL to insert into the cache */
+} Qcow2DecompressTask;
+
+/*
+ * Read and decompress the compressed cluster described by @l2_entry into
+ * @out_buf, or into a new buffer that is inserted into the decompressed
+ * cluster cache if @out_buf is NULL.
+ */
 static int coroutine_fn GRAPH_RDLOCK
-qcow2_co_preadv_compressed(BlockDriverState *bs,
-                           uint64_t l2_entry,
-                           uint64_t offset,
-                           uint64_t bytes,
-                           QEMUIOVector *qiov,
-                           size_t qiov_offset)
+qcow2_co_decompress_cluster(BlockDriverState *bs, uint64_t l2_entry,
+                            uint64_t generation, uint8_t *out_buf)
 {
     BDRVQcow2State *s = bs->opaque;
-    int ret = 0, csize;
+    int ret, csize;
     uint64_t coffset;
-    uint8_t *buf, *out_buf;
-    int offset_in_cluster = offset_into_cluster(s, offset);
+    uint8_t *buf, *cluster_buf;
 
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
@@ -4843,7 +4995,7 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         return -ENOMEM;
     }
 
-    out_buf = qemu_blockalign(bs, s->cluster_size);
+    cluster_buf = out_buf ?: qemu_blockalign(bs, s->cluster_size);
 
     BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
     ret = bdrv_co_pread(bs->file, coffset, csize, buf, 0);
@@ -4851,20 +5003,176 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
         goto fail;
     }
 
-    if (qcow2_co_decompress(bs, out_buf, s->cluster_size, buf, csize) < 0) {
+    if (qcow2_co_decompress(bs, cluster_buf, s->cluster_size, buf, csize) < 0) {
         ret = -EIO;
         goto fail;
     }
 
-    qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
+    if (!qcow2_compressed_cache_enabled(s->compressed_cache)) {
+        goto fail;
+    }
+    if (out_buf) {
+        cluster_buf = qemu_blockalign(bs, s->cluster_size);
+        memcpy(cluster_buf, out_buf, s->cluster_size);
+    }
+    qcow2_compressed_cache_insert(s->compressed_cache, coffset, csize,
+                                  cluster_buf, generation);
+    cluster_buf = NULL;
 
 fail:
-    qemu_vfree(out_buf);
+    if (cluster_buf != out_buf) {
+        qemu_vfree(cluster_buf);
+    }
     g_free(buf);
 
     return ret;
 }
 
+/*
+ * This function can count as GRAPH_RDLOCK because qcow2_co_preadv_compressed()
+ * holds the graph lock and keeps it until this coroutine has terminated.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_decompress_task_entry(AioTask *task)
+{
+    Qcow2DecompressTask *t = container_of(task, Qcow2DecompressTask, task);
+
+    return qcow2_co_decompress_cluster(t->bs, t->l2_entry, t->generation,
+                                       t->out_buf);
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+qcow2_add_decompress_task(AioTaskPool *pool, BlockDriverState *bs,
+                          uint64_t l2_entry, uint64_t generation,
+                          uint8_t *out_buf)
+{
+    Qcow2DecompressTask *t = g_new(Qcow2DecompressTask, 1);
+
+    *t = (Qcow2DecompressTask) {
+        .task.func = qcow2_co_decompress_task_entry,
+        .bs = bs,
+        .l2_entry = l2_entry,
+        .generation = generation,
+        .out_buf = out_buf,
+    };
+
+    aio_task_pool_start_task(pool, &t->task);
+}
+
+/*
+ * Collect the L2 entries of up to @max compressed clusters that follow the
+ * cluster at @offset and are not cached yet.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_get_compressed_readahead(BlockDriverState *bs, uint64_t offset,
+                               uint64_t *l2_entries, int max)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t end = bs->total_sectors << BDRV_SECTOR_BITS;
+    int n = 0;
+
+    offset = start_of_cluster(s, offset) + s->cluster_size;
+
+    qemu_co_mutex_lock(&s->lock);
+    while (n < max && offset < end) {
+        unsigned int bytes = MIN(s->cluster_size, end - offset);
+        QCow2SubclusterType type;
+        uint64_t l2_entry, coffset;
+        int csize;
+
+        if (qcow2_get_host_offset(bs, offset, &bytes, &l2_entry, &type) < 0 ||
+            type != QCOW2_SUBCLUSTER_COMPRESSED) {
+            break;
+        }
+
+        qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+        if (qcow2_compressed_cache_contains(s->compressed_cache, coffset)) {
+            break;
+        }
+
+        l2_entries[n++] = l2_entry;
+        offset += s->cluster_size;
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return n;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_co_preadv_compressed(BlockDriverState *bs,
+                           uint64_t l2_entry,
+                           uint64_t offset,
+                           uint64_t bytes,
+                           QEMUIOVector *qiov,
+                           size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t readahead[QCOW2_COMPRESSED_READAHEAD];
+    uint64_t coffset, generation;
+    int ret, csize, i, nb_readahead;
+    int offset_in_cluster = offset_into_cluster(s, offset);
+    AioTaskPool *pool;
+    uint8_t *out_buf;
+
+    if (!qcow2_compressed_cache_enabled(s->compressed_cache)) {
+        out_buf = qemu_blockalign(bs, s->cluster_size);
+        ret = qcow2_co_decompress_cluster(bs, l2_entry, 0, out_buf);
+        if (ret == 0) {
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                out_buf + offset_in_cluster, bytes);
+        }
+        qemu_vfree(out_buf);
+        return ret;
+    }
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+    if (qcow2_compressed_cache_read(s->compressed_cache, coffset,
+                                    offset_in_cluster, bytes,
+                                    qiov, qiov_offset)) {
+        return 0;
+    }
+
+    /*
+     * Guests tend to read compressed images sequentially, so decompress the
+     * following compressed clusters in parallel with this one.
+     */
+    generation = qcow2_compressed_cache_generation(s->compressed_cache);
+    nb_readahead = 0;
+    if (bytes < s->cluster_size) {
+        nb_readahead = qcow2_get_compressed_readahead(bs, offset, readahead,
+                                                      ARRAY_SIZE(readahead));
+    }
+
+    out_buf = qemu_blockalign(bs, s->cluster_size);
+    if (!nb_readahead) {
+        ret = qcow2_co_decompress_cluster(bs, l2_entry, generation, out_buf);
+    } else {
+        trace_qcow2_compressed_readahead(bs, offset, nb_readahead);
+
+        /*
+         * Errors in the readahead tasks only mean that those clusters are
+         * not cached, so the result of the request is the status of its
+         * own cluster alone, which is decompressed in this coroutine.
+         */
+        pool = aio_task_pool_new(QCOW2_MAX_WORKERS);
+        for (i = 0; i < nb_readahead; i++) {
+            qcow2_add_decompress_task(pool, bs, readahead[i], generation,
+                                      NULL);
+        }
+        ret = qcow2_co_decompress_cluster(bs, l2_entry, generation, out_buf);
+        aio_task_pool_wait_all(pool);
+        g_free(pool);
+    }
+
+    if (ret == 0) {
+        qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster,
+                            bytes);
+    }
+    qemu_vfree(out_buf);
+
+    return ret;
+}
+
 static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -4883,6 +5191,7 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
     if (ret < 0) {
         goto fail;
     }
+    qcow2_compressed_cache_clear(s->compressed_cache);
 
     ret = qcow2_cache_empty(bs, s->refcount_block_cache);
     if (ret < 0) {
@@ -4975,7 +5284,7 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
     }
     s->refcount_table[0] = 2 * s->cluster_size;
 
-    s->free_cluster_index = 0;
+    qcow2_reset_free_cluster_index(bs);
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
     if (offset < 0) {
@@ -5025,6 +5334,12 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
 
     l1_clusters = DIV_ROUND_UP(s->l1_size, s->cluster_size / L1E_SIZE);
 
+    /* Deleted snapshots must not hold references to emptied clusters */
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
@@ -5331,6 +5646,21 @@ qcow2_get_specific_info(BlockDriverState *bs, Error **errp)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_QCOW2;
+    stats->u.qcow2.l2_cache = qcow2_cache_get_stats(s->l2_table_cache);
+    stats->u.qcow2.refcount_cache =
+        qcow2_cache_get_stats(s->refcount_block_cache);
+    stats->u.qcow2.compressed_cache =
+        qcow2_compressed_cache_get_stats(s->compressed_cache);
+
+    return stats;
+}
+
 static int coroutine_mixed_fn GRAPH_RDLOCK
 qcow2_has_zero_init(BlockDriverState *bs)
 {
@@ -5787,6 +6117,13 @@ qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                             (encryption_update == true)
     };
 
+    /* Downgrading and refcount order changes rely on correct refcounts */
+    ret = qcow2_snapshot_refcount_finish(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update snapshot refcounts");
+        return ret;
+    }
+
     /* Upgrade first (some features may require compat=1.1) */
     if (new_version > old_version) {
         helper_cb_info.current_operation = QCOW2_UPGRADING;
@@ -6180,6 +6517,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_measure                       = qcow2_measure,
     .bdrv_co_get_info                   = qcow2_co_get_info,
     .bdrv_get_specific_info             = qcow2_get_specific_info,
+    .bdrv_get_specific_stats            = qcow2_get_specific_stats,
 
     .bdrv_co_save_vmstate               = qcow2_co_save_vmstate,
     .bdrv_co_load_vmstate               = qcow2_co_load_vmstate,
@@ -6202,6 +6540,8 @@ BlockDriver bdrv_qcow2 = {
 
     .bdrv_detach_aio_context            = qcow2_detach_aio_context,
     .bdrv_attach_aio_context            = qcow2_attach_aio_context,
+    .bdrv_drain_begin                   = qcow2_drain_begin,
+    .bdrv_drain_end                     = qcow2_drain_end,
 
     .bdrv_supports_persistent_dirty_bitmap =
             qcow2_supports_persistent_dirty_bitmap,
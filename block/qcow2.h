@@ -27,6 +27,7 @@
 
 #include "crypto/block.h"
 #include "qemu/coroutine.h"
+#include "qemu/interval-tree.h"
 #include "qemu/units.h"
 #include "block/block_int.h"
 
@@ -128,6 +129,15 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+#define DEFAULT_COMPRESSED_CACHE_SIZE (1 * MiB)
+
+/* L2 tables processed per run of the deferred snapshot refcount updates */
+#define QCOW2_SNAPSHOT_REFCOUNT_BATCH 16
+#define QCOW2_SNAPSHOT_REFCOUNT_DELAY_MS 10
+
+/* Compressed clusters decompressed ahead of a compressed cache miss */
+#define QCOW2_COMPRESSED_READAHEAD (QCOW2_MAX_THREADS - 1)
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -150,6 +160,7 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -228,8 +239,19 @@ typedef struct QCowSnapshot {
     void *unknown_extra_data;
 } QCowSnapshot;
 
+/* Deleted snapshot whose clusters are still to be unreferenced */
+typedef struct Qcow2SnapshotUnref {
+    uint64_t l1_table_offset;
+    uint64_t *l1_table;
+    int l1_size;
+    int l1_index; /* next L1 entry to process */
+    QSIMPLEQ_ENTRY(Qcow2SnapshotUnref) next;
+} Qcow2SnapshotUnref;
+
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef void Qcow2CacheUpdateFunc(void *opaque, int64_t offset);
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
@@ -345,10 +367,30 @@ typedef struct BDRVQcow2State {
 
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    Qcow2CompressedCache *compressed_cache;
     QEMUTimer *cache_clean_timer;
     unsigned cache_clean_interval;
 
-    QLIST_HEAD(, QCowL2Meta) cluster_allocs;
+    /* Deferred snapshot refcount updates, see qcow2-snapshot.c */
+    QEMUTimer *snapshot_refcount_timer;
+    unsigned long *snapshot_l2_pending;
+    unsigned nb_snapshot_l2_pending;
+    int snapshot_l2_addend;
+    QSIMPLEQ_HEAD(, Qcow2SnapshotUnref) snapshot_unrefs;
+
+    /*
+     * In-flight cluster allocations (QCowL2Meta.in_flight), keyed by the
+     * guest range their COW areas touch, rounded out to cluster boundaries
+     */
+    IntervalTreeRoot cluster_allocs;
+
+    /*
+     * Runs of contiguously allocated data clusters, and the L2 slices that
+     * they were found in, see qcow2-cluster.c
+     */
+    IntervalTreeRoot data_extents;
+    unsigned nb_data_extents;
+    GHashTable *data_extent_slices;
 
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
@@ -357,6 +399,11 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* Free clusters below free_cluster_index, see qcow2-refcount.c */
+    IntervalTreeRoot free_extents;
+    GTree *free_extents_by_size;
+    unsigned nb_free_extents;
+
     CoMutex lock;
 
     Qcow2CryptoHeaderExtension crypto_header; /* QCow2 header extension */
@@ -499,7 +546,11 @@ typedef struct QCowL2Meta
     /** Pointer to next L2Meta of the same write request */
     struct QCowL2Meta *next;
 
-    QLIST_ENTRY(QCowL2Meta) next_in_flight;
+    /**
+     * Node in BDRVQcow2State.cluster_allocs, covering the clusters from
+     * l2meta_cow_start() to l2meta_cow_end()
+     */
+    IntervalTreeNode in_flight;
 } QCowL2Meta;
 
 /*
@@ -837,6 +888,7 @@ int64_t qcow2_refcount_metadata_size(int64_t clusters, size_t cluster_size,
 int GRAPH_RDLOCK qcow2_mark_dirty(BlockDriverState *bs);
 int GRAPH_RDLOCK qcow2_mark_corrupt(BlockDriverState *bs);
 int GRAPH_RDLOCK qcow2_update_header(BlockDriverState *bs);
+void qcow2_snapshot_refcount_schedule(BlockDriverState *bs);
 
 void GRAPH_RDLOCK
 qcow2_signal_corruption(BlockDriverState *bs, bool fatal, int64_t offset,
@@ -851,6 +903,7 @@ int qcow2_validate_table(BlockDriverState *bs, uint64_t offset,
 /* qcow2-refcount.c functions */
 int coroutine_fn GRAPH_RDLOCK qcow2_refcount_init(BlockDriverState *bs);
 void qcow2_refcount_close(BlockDriverState *bs);
+void qcow2_reset_free_cluster_index(BlockDriverState *bs);
 
 int GRAPH_RDLOCK qcow2_get_refcount(BlockDriverState *bs, int64_t cluster_index,
                                     uint64_t *refcount);
@@ -882,6 +935,9 @@ qcow2_free_any_cluster(BlockDriverState *bs, uint64_t l2_entry,
                        enum qcow2_discard_type type);
 
 int GRAPH_RDLOCK
+qcow2_update_snapshot_refcount_l2(BlockDriverState *bs, uint64_t *l1_table,
+                                  int l1_index, int addend, int l2_addend);
+int GRAPH_RDLOCK
 qcow2_update_snapshot_refcount(BlockDriverState *bs, int64_t l1_table_offset,
                                int l1_size, int addend);
 
@@ -927,6 +983,11 @@ int GRAPH_RDLOCK qcow2_write_l1_entry(BlockDriverState *bs, int l1_index);
 int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
                           uint8_t *buf, int nb_sectors, bool enc, Error **errp);
 
+void qcow2_data_extents_drop(BDRVQcow2State *s);
+void qcow2_data_extents_drop_range(BDRVQcow2State *s, uint64_t start,
+                                  uint64_t length);
+void qcow2_data_extents_l2_update(void *opaque, int64_t offset);
+
 int GRAPH_RDLOCK
 qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                       unsigned int *bytes, uint64_t *host_offset,
@@ -994,6 +1055,12 @@ int coroutine_fn GRAPH_RDLOCK
 qcow2_check_fix_snapshot_table(BlockDriverState *bs, BdrvCheckResult *result,
                                BdrvCheckMode fix);
 
+bool qcow2_snapshot_refcount_pending(BlockDriverState *bs);
+int GRAPH_RDLOCK qcow2_snapshot_update_l2(BlockDriverState *bs, int l1_index);
+int GRAPH_RDLOCK qcow2_snapshot_refcount_step(BlockDriverState *bs, int max);
+int GRAPH_RDLOCK qcow2_snapshot_refcount_finish(BlockDriverState *bs);
+void qcow2_snapshot_refcount_cleanup(BlockDriverState *bs);
+
 /* qcow2-cache.c functions */
 Qcow2Cache * GRAPH_RDLOCK
 qcow2_cache_create(BlockDriverState *bs, int num_tables, unsigned table_size);
@@ -1021,6 +1088,28 @@ qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
+void qcow2_cache_set_update_func(Qcow2Cache *c, Qcow2CacheUpdateFunc *func,
+                                 void *opaque);
+Qcow2CacheStats *qcow2_cache_get_stats(Qcow2Cache *c);
+
+/* qcow2-compressed-cache.c functions */
+Qcow2CompressedCache *qcow2_compressed_cache_create(uint64_t size,
+                                                    int cluster_size);
+void qcow2_compressed_cache_destroy(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_clear(Qcow2CompressedCache *c);
+bool qcow2_compressed_cache_enabled(Qcow2CompressedCache *c);
+bool qcow2_compressed_cache_read(Qcow2CompressedCache *c, uint64_t coffset,
+                                 int offset_in_cluster, uint64_t bytes,
+                                 QEMUIOVector *qiov, size_t qiov_offset);
+bool qcow2_compressed_cache_contains(Qcow2CompressedCache *c,
+                                     uint64_t coffset);
+uint64_t qcow2_compressed_cache_generation(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_insert(Qcow2CompressedCache *c, uint64_t coffset,
+                                   int csize, uint8_t *data,
+                                   uint64_t generation);
+void qcow2_compressed_cache_invalidate(Qcow2CompressedCache *c,
+                                       uint64_t offset, uint64_t bytes);
+Qcow2CacheStats *qcow2_compressed_cache_get_stats(Qcow2CompressedCache *c);
 
 /* qcow2-bitmap.c functions */
 int coroutine_fn GRAPH_RDLOCK
@@ -0,0 +1,873 @@
+/*
+ * Shared in-memory read cache filter driver
+ *
+ * Copyright (c) 2025 The QEMU Project Developers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A read-cache object holds up to @size bytes of image data in blocks of
+ * @block-size bytes.  Any number of read-cache filter nodes can attach to
+ * the same object, e.g. one per VM disk on top of a common base image.  Data
+ * is shared between nodes whose child has the same driver and file name, so
+ * a block that one node has read is served from memory for all of them.
+ * A format node and its protocol node have the same file name, but present
+ * different data, which is why the driver is part of the key.
+ *
+ * Replacement uses ARC (Megiddo and Modha, "ARC: A Self-Tuning, Low Overhead
+ * Replacement Cache", FAST 2003): T1 holds blocks that were read once, T2
+ * blocks that were read again, and the ghost lists B1 and B2 remember the
+ * keys recently evicted from T1 and T2 to adapt the target size of T1.
+ *
+ * A block is much larger than a typical guest request, so a sequential
+ * stream hits the block it has just inserted many times.  These hits are not
+ * re-references: a block only moves to T2 when a read covers sectors that
+ * the block has already served, and does not simply continue where the
+ * previous read of the block ended.
+ *
+ * Writes through a filter node are passed through and invalidate the blocks
+ * they touch.  Modifications that do not go through any read-cache node are
+ * not noticed, so the cache should only be put on top of images that
+ * nothing else writes to.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "qemu/bitmap.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qom/object_interfaces.h"
+#include "trace.h"
+
+#define TYPE_READ_CACHE "read-cache"
+OBJECT_DECLARE_SIMPLE_TYPE(ReadCache, READ_CACHE)
+
+#define READ_CACHE_DEFAULT_SIZE (256 * MiB)
+#define READ_CACHE_DEFAULT_BLOCK_SIZE (64 * KiB)
+#define READ_CACHE_MAX_BLOCK_SIZE (2 * MiB)
+
+/* Maximum number of missing blocks read from the child in one request */
+#define READ_CACHE_MAX_MISS_RUN 16
+
+/* Block keys are (image id, block index) pairs packed into 64 bits */
+#define READ_CACHE_BLOCK_BITS 44
+#define READ_CACHE_KEY(image, block) \
+    (((uint64_t)(image) << READ_CACHE_BLOCK_BITS) | (block))
+#define READ_CACHE_KEY_IMAGE(key) ((key) >> READ_CACHE_BLOCK_BITS)
+
+typedef enum ReadCacheList {
+    READ_CACHE_T1,      /* resident, seen once */
+    READ_CACHE_T2,      /* resident, seen at least twice */
+    READ_CACHE_B1,      /* ghost, evicted from T1 */
+    READ_CACHE_B2,      /* ghost, evicted from T2 */
+    READ_CACHE_LIST__MAX,
+} ReadCacheList;
+
+typedef struct ReadCacheEntry {
+    uint64_t key;
+    ReadCacheList list;
+    uint8_t *data;      /* NULL for ghost entries */
+
+    /* The head of each list is the most recently used entry */
+    QTAILQ_ENTRY(ReadCacheEntry) next;
+
+    /* Where the last read of the block ended, and the sectors it served */
+    size_t next_offset;
+    unsigned long served[];
+} ReadCacheEntry;
+
+/*
+ * Images sharing cached data, identified by the driver and file name of the
+ * child
+ */
+typedef struct ReadCacheImage {
+    char *name;
+    uint32_t id;
+    unsigned int refcnt;
+
+    /*
+     * Incremented after each write.  Data read from the child is only
+     * inserted if no write completed meanwhile; otherwise it may be stale.
+     */
+    uint64_t generation;
+} ReadCacheImage;
+
+struct ReadCache {
+    Object parent_obj;
+
+    /* Set before user_creatable_complete(), constant afterwards */
+    uint64_t size;
+    uint64_t block_size;
+    uint64_t capacity;              /* in blocks */
+
+    QemuMutex lock;
+
+    /* Everything below is protected by lock */
+    GHashTable *entries;            /* key -> ReadCacheEntry */
+    QTAILQ_HEAD(, ReadCacheEntry) lists[READ_CACHE_LIST__MAX];
+    uint64_t list_len[READ_CACHE_LIST__MAX];
+    uint64_t target_t1;             /* ARC's adaptation parameter p */
+
+    GHashTable *images;             /* name -> ReadCacheImage */
+    uint32_t next_image_id;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+
+typedef struct BDRVReadCacheState {
+    ReadCache *cache;
+    ReadCacheImage *image;
+} BDRVReadCacheState;
+
+static void read_cache_list_move(ReadCache *cache, ReadCacheEntry *e,
+                                 ReadCacheList list)
+{
+    QTAILQ_REMOVE(&cache->lists[e->list], e, next);
+    cache->list_len[e->list]--;
+    e->list = list;
+    QTAILQ_INSERT_HEAD(&cache->lists[list], e, next);
+    cache->list_len[list]++;
+}
+
+static void read_cache_entry_drop(ReadCache *cache, ReadCacheEntry *e)
+{
+    QTAILQ_REMOVE(&cache->lists[e->list], e, next);
+    cache->list_len[e->list]--;
+    g_hash_table_remove(cache->entries, &e->key);
+    g_free(e->data);
+    g_free(e);
+}
+
+/*
+ * Record that @e served [@offset, @offset + @bytes) and return whether that
+ * re-references data it served before.
+ */
+static bool read_cache_entry_serve(ReadCacheEntry *e, size_t offset,
+                                   size_t bytes)
+{
+    unsigned long first = offset / BDRV_SECTOR_SIZE;
+    unsigned long end = DIV_ROUND_UP(offset + bytes, BDRV_SECTOR_SIZE);
+    bool again = offset != e->next_offset &&
+                 find_next_bit(e->served, end, first) < end;
+
+    bitmap_set(e->served, first, end - first);
+    e->next_offset = offset + bytes;
+    return again;
+}
+
+/* Turn the LRU entry of @from into a ghost on @to */
+static void read_cache_evict(ReadCache *cache, ReadCacheList from,
+                             ReadCacheList to)
+{
+    ReadCacheEntry *e = QTAILQ_LAST(&cache->lists[from]);
+
+    g_free(e->data);
+    e->data = NULL;
+    read_cache_list_move(cache, e, to);
+    cache->evictions++;
+}
+
+/* ARC's REPLACE(x, p): make room for one resident block */
+static void read_cache_replace(ReadCache *cache, bool in_b2)
+{
+    uint64_t t1 = cache->list_len[READ_CACHE_T1];
+
+    /* Invalidation can leave free space even though there are ghosts */
+    if (t1 + cache->list_len[READ_CACHE_T2] < cache->capacity) {
+        return;
+    }
+
+    if (t1 && ((in_b2 && t1 == cache->target_t1) || t1 > cache->target_t1)) {
+        read_cache_evict(cache, READ_CACHE_T1, READ_CACHE_B1);
+    } else if (cache->list_len[READ_CACHE_T2]) {
+        read_cache_evict(cache, READ_CACHE_T2, READ_CACHE_B2);
+    } else {
+        read_cache_evict(cache, READ_CACHE_T1, READ_CACHE_B1);
+    }
+}
+
+/* Size of a ReadCacheEntry including the served bitmap */
+static size_t read_cache_entry_size(ReadCache *cache)
+{
+    return sizeof(ReadCacheEntry) +
+           BITS_TO_LONGS(cache->block_size / BDRV_SECTOR_SIZE) *
+           sizeof(unsigned long);
+}
+
+/* Make ghost @e resident again with @data */
+static void read_cache_entry_revive(ReadCache *cache, ReadCacheEntry *e,
+                                    uint8_t *data)
+{
+    e->data = data;
+    e->next_offset = 0;
+    bitmap_zero(e->served, cache->block_size / BDRV_SECTOR_SIZE);
+    read_cache_list_move(cache, e, READ_CACHE_T2);
+}
+
+/*
+ * Insert block @key, whose contents are in @data (a block_size buffer that
+ * the cache takes ownership of), after it served [@offset, @offset +
+ * @bytes) of a request.  Called with cache->lock held.
+ */
+static void read_cache_insert_locked(ReadCache *cache, uint64_t key,
+                                     uint8_t *data, size_t offset,
+                                     size_t bytes)
+{
+    ReadCacheEntry *e = g_hash_table_lookup(cache->entries, &key);
+    uint64_t b1 = cache->list_len[READ_CACHE_B1];
+    uint64_t b2 = cache->list_len[READ_CACHE_B2];
+    uint64_t t1 = cache->list_len[READ_CACHE_T1];
+    uint64_t total;
+
+    if (e && e->data) {
+        /* Somebody else was faster */
+        g_free(data);
+        if (read_cache_entry_serve(e, offset, bytes)) {
+            read_cache_list_move(cache, e, READ_CACHE_T2);
+        }
+        return;
+    }
+
+    if (e && e->list == READ_CACHE_B1) {
+        /* Recently evicted from T1: T1 should have been larger */
+        cache->target_t1 = MIN(cache->capacity,
+                               cache->target_t1 + MAX(b2 / b1, 1));
+        read_cache_replace(cache, false);
+        read_cache_entry_revive(cache, e, data);
+        read_cache_entry_serve(e, offset, bytes);
+        return;
+    }
+
+    if (e && e->list == READ_CACHE_B2) {
+        /* Recently evicted from T2: T2 should have been larger */
+        uint64_t delta = MAX(b1 / b2, 1);
+
+        cache->target_t1 = cache->target_t1 > delta ?
+                           cache->target_t1 - delta : 0;
+        read_cache_replace(cache, true);
+        read_cache_entry_revive(cache, e, data);
+        read_cache_entry_serve(e, offset, bytes);
+        return;
+    }
+
+    total = t1 + cache->list_len[READ_CACHE_T2] + b1 + b2;
+    if (t1 + b1 == cache->capacity) {
+        if (t1 < cache->capacity) {
+            read_cache_entry_drop(cache, QTAILQ_LAST(&cache->lists[
+                                                     READ_CACHE_B1]));
+            read_cache_replace(cache, false);
+        } else {
+            read_cache_entry_drop(cache, QTAILQ_LAST(&cache->lists[
+                                                     READ_CACHE_T1]));
+            cache->evictions++;
+        }
+    } else if (total >= cache->capacity) {
+        if (total == 2 * cache->capacity) {
+            read_cache_entry_drop(cache, QTAILQ_LAST(&cache->lists[
+                                                     READ_CACHE_B2]));
+        }
+        read_cache_replace(cache, false);
+    }
+
+    e = g_malloc0(read_cache_entry_size(cache));
+    e->key = key;
+    e->list = READ_CACHE_T1;
+    e->data = data;
+    read_cache_entry_serve(e, offset, bytes);
+    QTAILQ_INSERT_HEAD(&cache->lists[READ_CACHE_T1], e, next);
+    cache->list_len[READ_CACHE_T1]++;
+    g_hash_table_insert(cache->entries, &e->key, e);
+}
+
+/*
+ * Copy @bytes at @offset_in_block of block @key to @qiov at @qiov_offset if
+ * the block is resident.  Returns whether it was.
+ */
+static bool read_cache_lookup(ReadCache *cache, uint64_t key,
+                              size_t offset_in_block, size_t bytes,
+                              QEMUIOVector *qiov, size_t qiov_offset)
+{
+    ReadCacheEntry *e;
+
+    QEMU_LOCK_GUARD(&cache->lock);
+
+    e = g_hash_table_lookup(cache->entries, &key);
+    if (!e || !e->data) {
+        cache->misses++;
+        return false;
+    }
+
+    cache->hits++;
+    if (read_cache_entry_serve(e, offset_in_block, bytes) ||
+        e->list == READ_CACHE_T2) {
+        read_cache_list_move(cache, e, READ_CACHE_T2);
+    }
+    qemu_iovec_from_buf(qiov, qiov_offset, e->data + offset_in_block, bytes);
+    return true;
+}
+
+static bool read_cache_is_resident(ReadCache *cache, uint64_t key)
+{
+    ReadCacheEntry *e;
+
+    QEMU_LOCK_GUARD(&cache->lock);
+
+    e = g_hash_table_lookup(cache->entries, &key);
+    return e && e->data;
+}
+
+/* Drop the resident blocks of @image in [@first, @last] */
+static void read_cache_invalidate(ReadCache *cache, ReadCacheImage *image,
+                                  uint64_t first, uint64_t last)
+{
+    uint64_t block;
+
+    QEMU_LOCK_GUARD(&cache->lock);
+
+    image->generation++;
+    if (last - first >= g_hash_table_size(cache->entries)) {
+        GHashTableIter iter;
+        ReadCacheEntry *e;
+
+        g_hash_table_iter_init(&iter, cache->entries);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&e)) {
+            uint64_t b = e->key & MAKE_64BIT_MASK(0, READ_CACHE_BLOCK_BITS);
+
+            if (READ_CACHE_KEY_IMAGE(e->key) == image->id &&
+                b >= first && b <= last) {
+                QTAILQ_REMOVE(&cache->lists[e->list], e, next);
+                cache->list_len[e->list]--;
+                g_hash_table_iter_remove(&iter);
+                g_free(e->data);
+                g_free(e);
+            }
+        }
+        return;
+    }
+
+    for (block = first; block <= last; block++) {
+        uint64_t key = READ_CACHE_KEY(image->id, block);
+        ReadCacheEntry *e = g_hash_table_lookup(cache->entries, &key);
+
+        if (e) {
+            read_cache_entry_drop(cache, e);
+        }
+    }
+}
+
+static ReadCacheImage *read_cache_image_get(ReadCache *cache,
+                                            const char *name)
+{
+    ReadCacheImage *image;
+
+    QEMU_LOCK_GUARD(&cache->lock);
+
+    image = g_hash_table_lookup(cache->images, name);
+    if (!image) {
+        image = g_new0(ReadCacheImage, 1);
+        image->name = g_strdup(name);
+        image->id = cache->next_image_id++;
+        g_hash_table_insert(cache->images, image->name, image);
+    }
+    image->refcnt++;
+    return image;
+}
+
+static void read_cache_image_put(ReadCache *cache, ReadCacheImage *image)
+{
+    bool last;
+
+    WITH_QEMU_LOCK_GUARD(&cache->lock) {
+        last = --image->refcnt == 0;
+        if (last) {
+            g_hash_table_remove(cache->images, image->name);
+        }
+    }
+
+    if (last) {
+        read_cache_invalidate(cache, image, 0,
+                              MAKE_64BIT_MASK(0, READ_CACHE_BLOCK_BITS));
+        g_free(image->name);
+        g_free(image);
+    }
+}
+
+/*
+ * Filter driver
+ */
+
+static QemuOptsList read_cache_runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(read_cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = "read-cache",
+            .type = QEMU_OPT_STRING,
+            .help = "ID of the read-cache object to use",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int read_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                           Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    g_autofree char *image_name = NULL;
+    BlockDriverState *child;
+    QemuOpts *opts;
+    const char *id;
+    Object *obj;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&read_cache_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    id = qemu_opt_get(opts, "read-cache");
+    if (!id) {
+        error_setg(errp, "Please specify a read-cache object");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    obj = object_resolve_path_component(object_get_objects_root(), id);
+    if (!obj || !object_dynamic_cast(obj, TYPE_READ_CACHE)) {
+        error_setg(errp, "read-cache object '%s' does not exist", id);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    child = bs->file->bs;
+    image_name = g_strdup_printf("%s:%s", child->drv->format_name,
+                                 child->filename[0] ? child->filename :
+                                 bdrv_get_node_name(child));
+
+    s->cache = READ_CACHE(object_ref(obj));
+    s->image = read_cache_image_get(s->cache, image_name);
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (s->cache) {
+        read_cache_image_put(s->cache, s->image);
+        object_unref(OBJECT(s->cache));
+    }
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+read_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+/*
+ * Read the @nb_blocks missing blocks starting at @block from the child,
+ * insert them into the cache and copy the part of them that overlaps the
+ * request [@offset, @offset + @bytes) into @qiov.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_fill(BlockDriverState *bs, uint64_t block, uint64_t nb_blocks,
+                   int64_t offset, int64_t bytes, QEMUIOVector *qiov)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *cache = s->cache;
+    uint64_t block_size = cache->block_size;
+    int64_t start = block * block_size;
+    int64_t end = start + nb_blocks * block_size;
+    int64_t copy_start = MAX(start, offset);
+    int64_t copy_end = MIN(end, offset + bytes);
+    uint64_t generation;
+    uint8_t *buf;
+    uint64_t i;
+    int ret;
+
+    buf = qemu_try_blockalign(bs->file->bs, end - start);
+    if (!buf) {
+        return -ENOMEM;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&cache->lock) {
+        generation = s->image->generation;
+    }
+
+    /* Reads beyond the end of the child are filled with zeroes */
+    ret = bdrv_co_pread(bs->file, start, end - start, buf, 0);
+    if (ret < 0) {
+        qemu_vfree(buf);
+        return ret;
+    }
+
+    qemu_iovec_from_buf(qiov, copy_start - offset, buf + copy_start - start,
+                        copy_end - copy_start);
+
+    trace_read_cache_fill(cache, s->image->id, block, nb_blocks);
+
+    WITH_QEMU_LOCK_GUARD(&cache->lock) {
+        if (s->image->generation == generation) {
+            for (i = 0; i < nb_blocks; i++) {
+                uint64_t key = READ_CACHE_KEY(s->image->id, block + i);
+                int64_t block_start = start + i * block_size;
+                int64_t served_start = MAX(copy_start, block_start);
+                int64_t served_end = MIN(copy_end, block_start + block_size);
+
+                read_cache_insert_locked(cache, key,
+                                         g_memdup2(buf + i * block_size,
+                                                   block_size),
+                                         served_start - block_start,
+                                         served_end - served_start);
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_preadv(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                     QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCache *cache = s->cache;
+    uint64_t block_size = cache->block_size;
+    uint64_t block = offset / block_size;
+    uint64_t last;
+    int ret;
+
+    if (flags & ~BDRV_REQ_REGISTERED_BUF) {
+        return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+    }
+    if (bytes == 0) {
+        return 0;
+    }
+
+    last = (offset + bytes - 1) / block_size;
+
+    while (block <= last) {
+        int64_t start = MAX(offset, block * block_size);
+        int64_t end = MIN(offset + bytes, (block + 1) * block_size);
+        uint64_t run;
+
+        if (read_cache_lookup(cache, READ_CACHE_KEY(s->image->id, block),
+                              start - block * block_size, end - start,
+                              qiov, start - offset)) {
+            block++;
+            continue;
+        }
+
+        /* Read consecutive missing blocks with a single request */
+        run = 1;
+        while (block + run <= last && run < READ_CACHE_MAX_MISS_RUN &&
+               !read_cache_is_resident(cache,
+                                       READ_CACHE_KEY(s->image->id,
+                                                      block + run))) {
+            run++;
+        }
+
+        ret = read_cache_co_fill(bs, block, run, offset, bytes, qiov);
+        if (ret < 0) {
+            return ret;
+        }
+        block += run;
+    }
+
+    return 0;
+}
+
+static void read_cache_invalidate_range(BlockDriverState *bs, int64_t offset,
+                                        int64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t block_size = s->cache->block_size;
+
+    if (bytes) {
+        read_cache_invalidate(s->cache, s->image, offset / block_size,
+                              (offset + bytes - 1) / block_size);
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwritev(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                      QEMUIOVector *qiov, BdrvRequestFlags flags)
+{
+    int ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+
+    read_cache_invalidate_range(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, BdrvRequestFlags flags)
+{
+    int ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+
+    read_cache_invalidate_range(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    int ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+
+    read_cache_invalidate_range(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwritev_compressed(BlockDriverState *bs, int64_t offset,
+                                 int64_t bytes, QEMUIOVector *qiov)
+{
+    return read_cache_co_pwritev(bs, offset, bytes, qiov,
+                                 BDRV_REQ_WRITE_COMPRESSED);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                       PreallocMode prealloc, BdrvRequestFlags flags,
+                       Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+
+    /* The block containing the old end of the image is partially zeroes */
+    read_cache_invalidate(s->cache, s->image, 0,
+                          MAKE_64BIT_MASK(0, READ_CACHE_BLOCK_BITS));
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK read_cache_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    "read-cache",
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                        = "read-cache",
+    .instance_size                      = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                          = read_cache_open,
+    .bdrv_close                         = read_cache_close,
+    .bdrv_child_perm                    = bdrv_default_perms,
+
+    .bdrv_co_getlength                  = read_cache_co_getlength,
+    .bdrv_co_truncate                   = read_cache_co_truncate,
+    .bdrv_co_flush                      = read_cache_co_flush,
+
+    .bdrv_co_preadv                     = read_cache_co_preadv,
+    .bdrv_co_pwritev                    = read_cache_co_pwritev,
+    .bdrv_co_pwrite_zeroes              = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard                   = read_cache_co_pdiscard,
+    .bdrv_co_pwritev_compressed         = read_cache_co_pwritev_compressed,
+
+    .is_filter                          = true,
+    .strong_runtime_opts                = read_cache_strong_runtime_opts,
+};
+
+/*
+ * read-cache object
+ */
+
+static void read_cache_get_size(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    uint64_t *field = (void *)obj + (ptrdiff_t)opaque;
+
+    visit_type_size(v, name, field, errp);
+}
+
+static void read_cache_set_size(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    ReadCache *cache = READ_CACHE(obj);
+    uint64_t *field = (void *)obj + (ptrdiff_t)opaque;
+    uint64_t value;
+
+    if (cache->entries) {
+        error_setg(errp, "Cannot change property '%s' of an active cache",
+                   name);
+        return;
+    }
+    if (!visit_type_size(v, name, &value, errp)) {
+        return;
+    }
+    *field = value;
+}
+
+static void read_cache_get_stat(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    ReadCache *cache = READ_CACHE(obj);
+    uint64_t *field = (void *)obj + (ptrdiff_t)opaque;
+    uint64_t value;
+
+    WITH_QEMU_LOCK_GUARD(&cache->lock) {
+        value = *field;
+    }
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void read_cache_get_used(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    ReadCache *cache = READ_CACHE(obj);
+    uint64_t value;
+
+    WITH_QEMU_LOCK_GUARD(&cache->lock) {
+        value = (cache->list_len[READ_CACHE_T1] +
+                 cache->list_len[READ_CACHE_T2]) * cache->block_size;
+    }
+    visit_type_uint64(v, name, &value, errp);
+}
+
+static void read_cache_complete(UserCreatable *uc, Error **errp)
+{
+    ReadCache *cache = READ_CACHE(uc);
+    int i;
+
+    if (cache->block_size < BDRV_SECTOR_SIZE ||
+        cache->block_size > READ_CACHE_MAX_BLOCK_SIZE ||
+        !is_power_of_2(cache->block_size)) {
+        error_setg(errp, "block-size must be a power of two between %d and "
+                   "%d", BDRV_SECTOR_SIZE, READ_CACHE_MAX_BLOCK_SIZE);
+        return;
+    }
+    if (cache->size < cache->block_size) {
+        error_setg(errp, "size must be at least block-size");
+        return;
+    }
+
+    cache->capacity = cache->size / cache->block_size;
+    cache->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    cache->images = g_hash_table_new(g_str_hash, g_str_equal);
+    for (i = 0; i < READ_CACHE_LIST__MAX; i++) {
+        QTAILQ_INIT(&cache->lists[i]);
+    }
+}
+
+static bool read_cache_can_be_deleted(UserCreatable *uc)
+{
+    return OBJECT(uc)->ref == 1;
+}
+
+static void read_cache_instance_init(Object *obj)
+{
+    ReadCache *cache = READ_CACHE(obj);
+
+    cache->size = READ_CACHE_DEFAULT_SIZE;
+    cache->block_size = READ_CACHE_DEFAULT_BLOCK_SIZE;
+    qemu_mutex_init(&cache->lock);
+}
+
+static void read_cache_instance_finalize(Object *obj)
+{
+    ReadCache *cache = READ_CACHE(obj);
+    ReadCacheEntry *e, *next;
+    int i;
+
+    for (i = 0; i < READ_CACHE_LIST__MAX; i++) {
+        QTAILQ_FOREACH_SAFE(e, &cache->lists[i], next, next) {
+            g_free(e->data);
+            g_free(e);
+        }
+    }
+    if (cache->entries) {
+        assert(g_hash_table_size(cache->images) == 0);
+        g_hash_table_destroy(cache->entries);
+        g_hash_table_destroy(cache->images);
+    }
+    qemu_mutex_destroy(&cache->lock);
+}
+
+static void read_cache_class_init(ObjectClass *oc, const void *class_data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
+
+    ucc->complete = read_cache_complete;
+    ucc->can_be_deleted = read_cache_can_be_deleted;
+
+    object_class_property_add(oc, "size", "size",
+                              read_cache_get_size, read_cache_set_size, NULL,
+                              (void *)offsetof(ReadCache, size));
+    object_class_property_add(oc, "block-size", "size",
+                              read_cache_get_size, read_cache_set_size, NULL,
+                              (void *)offsetof(ReadCache, block_size));
+    object_class_property_add(oc, "hits", "uint64",
+                              read_cache_get_stat, NULL, NULL,
+                              (void *)offsetof(ReadCache, hits));
+    object_class_property_add(oc, "misses", "uint64",
+                              read_cache_get_stat, NULL, NULL,
+                              (void *)offsetof(ReadCache, misses));
+    object_class_property_add(oc, "evictions", "uint64",
+                              read_cache_get_stat, NULL, NULL,
+                              (void *)offsetof(ReadCache, evictions));
+    object_class_property_add(oc, "used", "uint64",
+                              read_cache_get_used, NULL, NULL, NULL);
+}
+
+static const TypeInfo read_cache_info = {
+    .name = TYPE_READ_CACHE,
+    .parent = TYPE_OBJECT,
+    .class_init = read_cache_class_init,
+    .instance_size = sizeof(ReadCache),
+    .instance_init = read_cache_instance_init,
+    .instance_finalize = read_cache_instance_finalize,
+    .interfaces = (const InterfaceInfo[]) {
+        { TYPE_USER_CREATABLE },
+        { }
+    },
+};
+
+static void read_cache_register_types(void)
+{
+    type_register_static(&read_cache_info);
+}
+
+type_init(read_cache_register_types);
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
@@ -62,6 +62,16 @@ static void timer_cb(ThrottleGroupMember *tgm, ThrottleDirection direction);
  * blk_set_aio_context()). Therefore in this file a thread will
  * access some other ThrottleGroupMember's timers only after verifying that
  * that ThrottleGroupMember has throttled requests in the queue.
+ *
+ * Taking the lock for every request does not scale when the members of a
+ * group run in many iothreads, so as long as no request of the group is
+ * throttled, each ThrottleGroupMember gets some credit that is accounted in
+ * the ThrottleState in advance: enough for THROTTLE_GROUP_CREDIT_NS of I/O
+ * at the average rate of the group, and never more than what can be done
+ * without waiting.  Its next requests consume that credit with atomic
+ * operations and without taking the lock.  As soon as the group runs out
+ * of budget the unused credit of all members is returned, and requests go
+ * through the round-robin scheduling below again.
  */
 struct ThrottleGroup {
     Object parent_obj;
@@ -70,11 +80,14 @@ struct ThrottleGroup {
     bool is_initialized;
     char *name; /* This is constant during the lifetime of the group */
 
-    QemuMutex lock; /* This lock protects the following four fields */
+    QemuMutex lock; /* This lock protects the following fields */
     ThrottleState ts;
     QLIST_HEAD(, ThrottleGroupMember) head;
     ThrottleGroupMember *tokens[THROTTLE_MAX];
     bool any_timer_armed[THROTTLE_MAX];
+    bool credit_given[THROTTLE_MAX];
+    /* Also read without the lock, with atomic operations */
+    unsigned pending_reqs[THROTTLE_MAX];
     QEMUClockType clock_type;
 
     /* This field is protected by the global QEMU mutex */
@@ -85,6 +98,15 @@ struct ThrottleGroup {
 static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
     QTAILQ_HEAD_INITIALIZER(throttle_groups);
 
+/* How much I/O the credit of a ThrottleGroupMember may cover */
+#define THROTTLE_GROUP_CREDIT_NS        (1 * SCALE_MS)
+
+/* Once a request is throttled, wake it up this much later than necessary
+ * so that the following requests can go through in one batch instead of
+ * firing one timer each.  Not used with the virtual clock of qtest, whose
+ * users expect exact timings. */
+#define THROTTLE_GROUP_WAKEUP_SLACK_NS  (1 * SCALE_MS)
+
 
 /* This function reads throttle_groups and must be called under the global
  * mutex.
@@ -254,6 +276,125 @@ static ThrottleGroupMember *next_throttle_token(ThrottleGroupMember *tgm,
     return token;
 }
 
+/* Return the credit of a ThrottleGroupMember that has not been used yet to
+ * its group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @direction: the ThrottleDirection
+ */
+static void throttle_group_return_credit(ThrottleGroupMember *tgm,
+                                         ThrottleDirection direction)
+{
+    unsigned int units = qatomic_xchg(&tgm->credit_units[direction], 0);
+    unsigned int bytes = qatomic_xchg(&tgm->credit_bytes[direction], 0);
+
+    throttle_return_credit(tgm->throttle_state, direction, bytes, units);
+}
+
+/* Return the unused credit of all members of a group.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tg:        the ThrottleGroup
+ * @direction: the ThrottleDirection
+ */
+static void throttle_group_return_all_credit(ThrottleGroup *tg,
+                                             ThrottleDirection direction)
+{
+    ThrottleGroupMember *tgm;
+
+    QLIST_FOREACH(tgm, &tg->head, round_robin) {
+        throttle_group_return_credit(tgm, direction);
+    }
+    tg->credit_given[direction] = false;
+}
+
+/* Give credit to a ThrottleGroupMember for its next requests, unless some
+ * request of the group is throttled.  Any credit that the member still has
+ * is returned first.
+ *
+ * This assumes that tg->lock is held.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @direction: the ThrottleDirection
+ */
+static void throttle_group_give_credit(ThrottleGroupMember *tgm,
+                                       ThrottleDirection direction)
+{
+    ThrottleState *ts = tgm->throttle_state;
+    ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    uint64_t bytes, units;
+
+    /* Requests bigger than op_size count as several units, which the credit
+     * does not handle, so leave that case to throttle_account() */
+    if (tg->pending_reqs[direction] || ts->cfg.op_size ||
+        qatomic_read(&tgm->io_limits_disabled)) {
+        return;
+    }
+
+    throttle_group_return_credit(tgm, direction);
+
+    throttle_compute_credit(ts, direction, qemu_clock_get_ns(tg->clock_type),
+                            THROTTLE_GROUP_CREDIT_NS, &bytes, &units);
+    bytes = MIN(bytes, UINT_MAX);
+    units = MIN(units, UINT_MAX);
+    if (!bytes || !units) {
+        return;
+    }
+
+    throttle_account_credit(ts, direction, bytes, units);
+    qatomic_add(&tgm->credit_bytes[direction], bytes);
+    qatomic_add(&tgm->credit_units[direction], units);
+    tg->credit_given[direction] = true;
+}
+
+/* Try to start a request using the credit of its ThrottleGroupMember,
+ * without taking the group lock.  This is only possible as long as no
+ * request of the group is throttled, otherwise the request must take its
+ * turn in the round-robin sequence.
+ *
+ * @tgm:       the ThrottleGroupMember
+ * @bytes:     the number of bytes for this I/O
+ * @direction: the ThrottleDirection
+ * @ret:       whether the request can go through
+ */
+static bool throttle_group_take_credit(ThrottleGroupMember *tgm,
+                                       int64_t bytes,
+                                       ThrottleDirection direction)
+{
+    ThrottleGroup *tg = container_of(tgm->throttle_state, ThrottleGroup, ts);
+    unsigned int old, cur;
+
+    if (qatomic_read(&tg->pending_reqs[direction])) {
+        return false;
+    }
+
+    cur = qatomic_read(&tgm->credit_units[direction]);
+    do {
+        if (!cur) {
+            return false;
+        }
+        old = cur;
+        cur = qatomic_cmpxchg(&tgm->credit_units[direction], old, old - 1);
+    } while (cur != old);
+
+    cur = qatomic_read(&tgm->credit_bytes[direction]);
+    do {
+        if (cur < bytes) {
+            /* Keep the unit for a smaller request */
+            qatomic_inc(&tgm->credit_units[direction]);
+            return false;
+        }
+        old = cur;
+        cur = qatomic_cmpxchg(&tgm->credit_bytes[direction], old,
+                              old - bytes);
+    } while (cur != old);
+
+    return true;
+}
+
 /* Check if the next I/O request for a ThrottleGroupMember needs to be
  * throttled or not. If there's no timer set in this group, set one and update
  * the token accordingly.
@@ -270,6 +411,7 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
     ThrottleTimers *tt = &tgm->throttle_timers;
+    int64_t slack_ns;
     bool must_wait;
 
     if (qatomic_read(&tgm->io_limits_disabled)) {
@@ -281,7 +423,22 @@ static bool throttle_group_schedule_timer(ThrottleGroupMember *tgm,
         return true;
     }
 
-    must_wait = throttle_schedule_timer(ts, tt, direction);
+    /* If the group is running out of budget, the credit of the members
+     * must not make this request wait */
+    if (tg->credit_given[direction]) {
+        uint64_t bytes, units;
+
+        throttle_compute_credit(ts, direction,
+                                qemu_clock_get_ns(tg->clock_type),
+                                THROTTLE_GROUP_CREDIT_NS, &bytes, &units);
+        if (!bytes || !units) {
+            throttle_group_return_all_credit(tg, direction);
+        }
+    }
+
+    slack_ns = tg->clock_type == QEMU_CLOCK_REALTIME ?
+               THROTTLE_GROUP_WAKEUP_SLACK_NS : 0;
+    must_wait = throttle_schedule_timer_slack(ts, tt, direction, slack_ns);
 
     /* If a timer just got armed, set tgm as the current token */
     if (must_wait) {
@@ -369,6 +526,11 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     assert(bytes >= 0);
     assert(direction < THROTTLE_MAX);
 
+    /* The I/O has already been accounted if there is credit left */
+    if (throttle_group_take_credit(tgm, bytes, direction)) {
+        return;
+    }
+
     qemu_mutex_lock(&tg->lock);
 
     /* First we check if this I/O has to be throttled. */
@@ -378,6 +540,8 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
     /* Wait if there's a timer set or queued requests of this type */
     if (must_wait || tgm->pending_reqs[direction]) {
         tgm->pending_reqs[direction]++;
+        qatomic_set(&tg->pending_reqs[direction],
+                    tg->pending_reqs[direction] + 1);
         qemu_mutex_unlock(&tg->lock);
         qemu_co_mutex_lock(&tgm->throttled_reqs_lock);
         qemu_co_queue_wait(&tgm->throttled_reqs[direction],
@@ -385,11 +549,16 @@ void coroutine_fn throttle_group_co_io_limits_intercept(ThrottleGroupMember *tgm
         qemu_co_mutex_unlock(&tgm->throttled_reqs_lock);
         qemu_mutex_lock(&tg->lock);
         tgm->pending_reqs[direction]--;
+        qatomic_set(&tg->pending_reqs[direction],
+                    tg->pending_reqs[direction] - 1);
     }
 
     /* The I/O will be executed, so do the accounting */
     throttle_account(tgm->throttle_state, direction, bytes);
 
+    /* Let the next requests skip the lock if nothing is throttled */
+    throttle_group_give_credit(tgm, direction);
+
     /* Schedule the next request */
     schedule_next_request(tgm, direction);
 
@@ -476,8 +645,19 @@ void throttle_group_config(ThrottleGroupMember *tgm, ThrottleConfig *cfg)
 {
     ThrottleState *ts = tgm->throttle_state;
     ThrottleGroup *tg = container_of(ts, ThrottleGroup, ts);
+    ThrottleGroupMember *iter;
+    ThrottleDirection dir;
+
     qemu_mutex_lock(&tg->lock);
     throttle_config(ts, tg->clock_type, cfg);
+    /* The bucket levels have been reset, so simply drop all credit */
+    for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
+        QLIST_FOREACH(iter, &tg->head, round_robin) {
+            qatomic_set(&iter->credit_units[dir], 0);
+            qatomic_set(&iter->credit_bytes[dir], 0);
+        }
+        tg->credit_given[dir] = false;
+    }
     qemu_mutex_unlock(&tg->lock);
 
     throttle_group_restart_tgm(tgm);
@@ -551,6 +731,10 @@ void throttle_group_register_tgm(ThrottleGroupMember *tgm,
     tgm->throttle_state = ts;
     tgm->aio_context = ctx;
     qatomic_set(&tgm->restart_pending, 0);
+    for (dir = THROTTLE_READ; dir < THROTTLE_MAX; dir++) {
+        qatomic_set(&tgm->credit_units[dir], 0);
+        qatomic_set(&tgm->credit_bytes[dir], 0);
+    }
 
     QEMU_LOCK_GUARD(&tg->lock);
     /* If the ThrottleGroup is new set this ThrottleGroupMember as the token */
@@ -602,6 +786,7 @@ void throttle_group_unregister_tgm(ThrottleGroupMember *tgm)
             assert(tgm->pending_reqs[dir] == 0);
             assert(qemu_co_queue_empty(&tgm->throttled_reqs[dir]));
             assert(!timer_pending(tgm->throttle_timers.timers[dir]));
+            throttle_group_return_credit(tgm, dir);
             if (tg->tokens[dir] == tgm) {
                 token = throttle_group_next_tgm(tgm);
                 /* Take care of the case where this is the last tgm in the group */
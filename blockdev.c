@@ -2856,6 +2856,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    bool has_copy_mode, MirrorCopyMode copy_mode,
                                    bool has_auto_finalize, bool auto_finalize,
                                    bool has_auto_dismiss, bool auto_dismiss,
+                                   bool has_adaptive, bool adaptive,
                                    Error **errp)
 {
     BlockDriverState *unfiltered_bs;
@@ -2885,6 +2886,9 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     if (!has_copy_mode) {
         copy_mode = MIRROR_COPY_MODE_BACKGROUND;
     }
+    if (!has_adaptive) {
+        adaptive = false;
+    }
     if (has_auto_finalize && !auto_finalize) {
         job_flags |= JOB_MANUAL_FINALIZE;
     }
@@ -2953,7 +2957,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     mirror_start(job_id, bs, target, replaces, job_flags,
                  speed, granularity, buf_size, sync, backing_mode,
                  target_is_zero, on_source_error, on_target_error, unmap,
-                 filter_node_name, copy_mode, errp);
+                 filter_node_name, copy_mode, adaptive, errp);
 }
 
 void qmp_drive_mirror(DriveMirror *arg, Error **errp)
@@ -3105,6 +3109,7 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
                            arg->has_copy_mode, arg->copy_mode,
                            arg->has_auto_finalize, arg->auto_finalize,
                            arg->has_auto_dismiss, arg->auto_dismiss,
+                           arg->has_adaptive, arg->adaptive,
                            errp);
     bdrv_unref(target_bs);
 }
@@ -3125,6 +3130,7 @@ void qmp_blockdev_mirror(const char *job_id,
                          bool has_auto_finalize, bool auto_finalize,
                          bool has_auto_dismiss, bool auto_dismiss,
                          bool has_target_is_zero, bool target_is_zero,
+                         bool has_adaptive, bool adaptive,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3162,6 +3168,7 @@ void qmp_blockdev_mirror(const char *job_id,
                            has_copy_mode, copy_mode,
                            has_auto_finalize, auto_finalize,
                            has_auto_dismiss, auto_dismiss,
+                           has_adaptive, adaptive,
                            errp);
 }
 
@@ -4936,12 +4936,14 @@ struct nvme_stats {
 
 static void nvme_set_blk_stats(NvmeNamespace *ns, struct nvme_stats *stats)
 {
-    BlockAcctStats *s = blk_get_stats(ns->blkconf.blk);
+    BlockAcctCounters c;
 
-    stats->units_read += s->nr_bytes[BLOCK_ACCT_READ];
-    stats->units_written += s->nr_bytes[BLOCK_ACCT_WRITE];
-    stats->read_commands += s->nr_ops[BLOCK_ACCT_READ];
-    stats->write_commands += s->nr_ops[BLOCK_ACCT_WRITE];
+    block_acct_get_counters(blk_get_stats(ns->blkconf.blk), &c);
+
+    stats->units_read += c.nr_bytes[BLOCK_ACCT_READ];
+    stats->units_written += c.nr_bytes[BLOCK_ACCT_WRITE];
+    stats->read_commands += c.nr_ops[BLOCK_ACCT_READ];
+    stats->write_commands += c.nr_ops[BLOCK_ACCT_WRITE];
 }
 
 static uint16_t nvme_ocp_extended_smart_info(NvmeCtrl *n, uint8_t rae,
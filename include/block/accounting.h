@@ -27,6 +27,7 @@
 
 #include "qemu/timed-average.h"
 #include "qemu/thread.h"
+#include "qemu/stats64.h"
 #include "qapi/qapi-types-common.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
@@ -79,8 +80,42 @@ typedef struct BlockLatencyHistogram {
     uint64_t *bins;
 } BlockLatencyHistogram;
 
-struct BlockAcctStats {
-    QemuMutex lock;
+/*
+ * Every request is also accounted in a log-linear latency histogram, which
+ * is always enabled: each power of two between 2^BLOCK_ACCT_HIST_SUB_BITS
+ * and 2^BLOCK_ACCT_HIST_MAX_BITS nanoseconds is split into
+ * 2^BLOCK_ACCT_HIST_SUB_BITS buckets of equal width, so that the relative
+ * error of a bucket is at most 1/2^BLOCK_ACCT_HIST_SUB_BITS.  Smaller
+ * latencies have one bucket per nanosecond, larger ones end up in the last
+ * bucket.
+ */
+#define BLOCK_ACCT_HIST_SUB_BITS    3
+#define BLOCK_ACCT_HIST_MAX_BITS    36  /* about 69 seconds */
+#define BLOCK_ACCT_HIST_BUCKETS \
+    ((BLOCK_ACCT_HIST_MAX_BITS - BLOCK_ACCT_HIST_SUB_BITS + 1) << \
+     BLOCK_ACCT_HIST_SUB_BITS)
+
+/*
+ * Counters are sharded by thread so that iothreads that submit requests to
+ * the same BlockBackend do not contend on a lock or a cache line.  Threads
+ * are assigned to shards round-robin, and shards are allocated the first
+ * time a thread accounts a request.
+ */
+#define BLOCK_ACCT_MAX_SHARDS       16
+
+typedef struct BlockAcctShard {
+    Stat64 nr_bytes[BLOCK_MAX_IOTYPE];
+    Stat64 nr_ops[BLOCK_MAX_IOTYPE];
+    Stat64 invalid_ops[BLOCK_MAX_IOTYPE];
+    Stat64 failed_ops[BLOCK_MAX_IOTYPE];
+    Stat64 total_time_ns[BLOCK_MAX_IOTYPE];
+    Stat64 merged[BLOCK_MAX_IOTYPE];
+    Stat64 last_access_time_ns;
+    Stat64 latency[BLOCK_MAX_IOTYPE][BLOCK_ACCT_HIST_BUCKETS];
+} BlockAcctShard;
+
+/* A snapshot of the counters of all shards, see block_acct_get_counters() */
+typedef struct BlockAcctCounters {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t invalid_ops[BLOCK_MAX_IOTYPE];
@@ -88,6 +123,17 @@ struct BlockAcctStats {
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
+} BlockAcctCounters;
+
+struct BlockAcctStats {
+    BlockAcctShard *shards[BLOCK_ACCT_MAX_SHARDS]; /* atomic */
+
+    QemuMutex lock;
+    /*
+     * True if intervals or latency_histogram are in use, so that requests
+     * need to take the lock (atomic)
+     */
+    bool need_lock;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
     bool account_invalid;
     bool account_failed;
@@ -114,6 +160,11 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
+void block_acct_get_counters(BlockAcctStats *stats, BlockAcctCounters *c);
+void block_acct_get_latency_buckets(BlockAcctStats *stats,
+                                    enum BlockAcctType type,
+                                    uint64_t buckets[BLOCK_ACCT_HIST_BUCKETS]);
+uint64_t block_acct_latency_bucket_min(int bucket);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
@@ -239,6 +239,7 @@ struct AioContext {
 
     /* AIO engine parameters */
     int64_t aio_max_batch;  /* maximum number of requests in a batch */
+    int64_t io_uring_sqpoll_idle; /* SQPOLL idle time in ms, 0 = disabled */
 
     /*
      * List of handlers participating in userspace polling.  Protected by
@@ -724,4 +725,16 @@ void aio_context_set_aio_params(AioContext *ctx, int64_t max_batch);
  */
 void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
                                         int64_t max, Error **errp);
+
+/**
+ * aio_context_set_io_uring_params:
+ * @ctx: the aio context
+ * @sqpoll_idle: idle time in milliseconds of the kernel thread polling the
+ *               io_uring submission queue, 0 disables SQPOLL mode
+ *
+ * Only takes effect if the io_uring block I/O ring of @ctx has not been set
+ * up yet.
+ */
+void aio_context_set_io_uring_params(AioContext *ctx, int64_t sqpoll_idle,
+                                     Error **errp);
 #endif
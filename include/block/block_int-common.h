@@ -28,6 +28,7 @@
 #include "block/block-common.h"
 #include "block/block-global-state.h"
 #include "block/snapshot.h"
+#include "qemu/interval-tree.h"
 #include "qemu/iov.h"
 #include "qemu/rcu.h"
 #include "qemu/stats64.h"
@@ -84,6 +85,7 @@ typedef struct BdrvTrackedRequest {
     int64_t overlap_bytes;
 
     QLIST_ENTRY(BdrvTrackedRequest) list;
+    IntervalTreeNode overlap_node; /* in bs->tracked_overlaps */
     Coroutine *co; /* owner, used for deadlock detection */
     CoQueue wait_queue; /* coroutines blocked on this request */
 
@@ -1261,6 +1263,8 @@ struct BlockDriverState {
     /* Protected by reqs_lock.  */
     QemuMutex reqs_lock;
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
+    /* The same requests, indexed by their overlap_offset/overlap_bytes */
+    IntervalTreeRoot tracked_overlaps;
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
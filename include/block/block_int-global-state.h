@@ -147,6 +147,8 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
  * driver that the mirror job inserts into the graph above @bs. NULL means that
  * a node name should be autogenerated.
  * @copy_mode: When to trigger writes to the target.
+ * @adaptive: Whether to adapt the background copying to the latency of the
+ *            source and the target.
  * @errp: Error object.
  *
  * Start a mirroring operation on @bs.  Clusters that are allocated
@@ -163,7 +165,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp);
+                  MirrorCopyMode copy_mode, bool adaptive, Error **errp);
 
 /*
  * backup_job_create:
@@ -32,8 +32,23 @@ typedef struct BlockExportDriver {
     /* True if the export type supports running on an inactive node */
     bool supports_inactive;
 
-    /* Creates and starts a new block export */
-    int (*create)(BlockExport *, BlockExportOptions *, Error **);
+    /*
+     * True if the export type supports processing requests in multiple
+     * threads at once (see the @multithread parameter of .create())
+     */
+    bool supports_multithread;
+
+    /*
+     * Creates and starts a new block export.
+     *
+     * If the user asked for multi-threading, @multithread is an array of
+     * @mt_count (at least 1) AioContexts in which the export should process
+     * requests.  Otherwise, @multithread is NULL and @mt_count is 0.  The
+     * former can only happen if .supports_multithread is true.
+     */
+    int (*create)(BlockExport *, BlockExportOptions *,
+                  AioContext *const *multithread, size_t mt_count,
+                  Error **);
 
     /*
      * Frees a removed block export. This function is only called after all
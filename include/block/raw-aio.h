@@ -74,13 +74,60 @@ static inline bool laio_has_fua(void)
 #endif
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *luring_init(Error **errp);
+/*
+ * luring_init: create a ring; @sqpoll_idle is the idle time in milliseconds
+ * of the kernel submission queue polling thread, 0 disables SQPOLL mode.
+ */
+LuringState *luring_init(unsigned int sqpoll_idle, Error **errp);
 void luring_cleanup(LuringState *s);
 
-/* luring_co_submit: submit I/O requests in the thread's current AioContext. */
-int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd, uint64_t offset,
+/*
+ * luring_co_submit: submit I/O requests in the thread's current AioContext.
+ * @fixed_file is the slot returned by luring_register_file() for @fd, or -1.
+ */
+int coroutine_fn luring_co_submit(BlockDriverState *bs, int fd,
+                                  int fixed_file, uint64_t offset,
                                   QEMUIOVector *qiov, int type,
                                   BdrvRequestFlags flags);
+
+/*
+ * Registered files: luring_register_file() installs @fd in the registered
+ * file table of all rings and returns its slot, or -1 if no slot could be
+ * set up.  The slot must be unregistered (or replaced) before @fd is closed,
+ * and while no request using it is in flight.  luring_replace_file() returns
+ * false and frees the slot if @fd could not be installed.
+ */
+int luring_register_file(int fd);
+bool luring_replace_file(int fixed_file, int fd);
+void luring_unregister_file(int fixed_file);
+
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_SPARSE
+/*
+ * Registered buffers: luring_register_buffer() installs guest RAM in the
+ * registered buffer table of all rings.  Requests with the
+ * BDRV_REQ_REGISTERED_BUF flag and a single I/O vector inside a registered
+ * buffer are then submitted as IORING_OP_READ_FIXED/IORING_OP_WRITE_FIXED.
+ * Registration is only an optimization; if it fails, requests are submitted
+ * as usual.  Buffers must not overlap and are unregistered with the same
+ * <host, size> values, like for bdrv_register_buf().
+ */
+void luring_register_buffer(void *host, size_t size);
+void luring_unregister_buffer(void *host, size_t size);
+#endif
+
+#ifdef HAVE_IO_URING_NVME_CMD
+/*
+ * luring_co_submit_cmd: submit an IORING_OP_URING_CMD passthrough command
+ * (e.g. struct nvme_uring_cmd) in the thread's current AioContext.  @cmd must
+ * stay valid until the function returns.  Returns 0 on success, -EIO if the
+ * command completed with an error status, or a negative errno.
+ */
+int coroutine_fn luring_co_submit_cmd(BlockDriverState *bs, int fd,
+                                      int fixed_file, uint32_t cmd_op,
+                                      const void *cmd, size_t cmd_len);
+bool luring_has_cmd(void);
+#endif
+
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
 void luring_attach_aio_context(LuringState *s, AioContext *new_context);
 bool luring_has_fua(void);
@@ -49,6 +49,13 @@ typedef struct ThrottleGroupMember {
      */
     unsigned int restart_pending;
 
+    /* Credit that has already been accounted in the group's ThrottleState,
+     * so that requests can consume it without taking the ThrottleGroup
+     * lock.  Accessed with atomic operations.
+     */
+    unsigned int credit_units[THROTTLE_MAX];
+    unsigned int credit_bytes[THROTTLE_MAX];
+
     /* The following fields are protected by the ThrottleGroup lock.
      * See the ThrottleGroup documentation for details.
      * throttle_state tells us if I/O limits are configured. */
@@ -350,4 +350,13 @@ bool hbitmap_status(const HBitmap *hb, int64_t start, int64_t count,
  */
 int64_t hbitmap_iter_next(HBitmapIter *hbi);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Switch to the next slower implementation of the bulk bitmap operations
+ * that the host supports.  Returns false if the generic one is already in
+ * use.  Only for tests and benchmarks.
+ */
+bool test_hbitmap_next_accel(void);
+
 #endif
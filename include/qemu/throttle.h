@@ -156,8 +156,23 @@ bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              ThrottleDirection direction);
 
+bool throttle_schedule_timer_slack(ThrottleState *ts,
+                                   ThrottleTimers *tt,
+                                   ThrottleDirection direction,
+                                   int64_t slack_ns);
+
 void throttle_account(ThrottleState *ts, ThrottleDirection direction,
                       uint64_t size);
+
+/* credit that is accounted in advance */
+void throttle_compute_credit(ThrottleState *ts, ThrottleDirection direction,
+                             int64_t now, int64_t period_ns,
+                             uint64_t *bytes, uint64_t *units);
+void throttle_account_credit(ThrottleState *ts, ThrottleDirection direction,
+                             uint64_t bytes, uint64_t units);
+void throttle_return_credit(ThrottleState *ts, ThrottleDirection direction,
+                            uint64_t bytes, uint64_t units);
+
 void throttle_limits_to_config(ThrottleLimits *arg, ThrottleConfig *cfg,
                                Error **errp);
 void throttle_config_to_limits(ThrottleConfig *cfg, ThrottleLimits *var);
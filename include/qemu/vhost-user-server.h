@@ -31,21 +31,27 @@ typedef struct VuFdWatch {
  * VuServer:
  * A vhost-user server instance with user-defined VuDevIface callbacks.
  * Vhost-user device backends can be implemented using VuServer. VuDevIface
- * callbacks and virtqueue kicks run in the given AioContext.
+ * callbacks run in the given AioContext. Virtqueue kicks run in the same
+ * AioContext, unless a list of virtqueue AioContexts was given, in which
+ * case virtqueue n is processed in vq_ctxs[n % num_vq_ctxs].
  */
 typedef struct {
     QIONetListener *listener;
     QEMUBH *restart_listener_bh;
     AioContext *ctx;
+    AioContext **vq_ctxs;
+    size_t num_vq_ctxs;
     int max_queues;
     const VuDevIface *vu_iface;
 
     unsigned int in_flight; /* atomic */
+    bool wait_idle; /* atomic */
+    unsigned int vqs_pausing; /* atomic */
 
     /* Protected by ctx lock */
     bool in_qio_channel_yield;
-    bool wait_idle;
     bool quiescing;
+    bool vqs_paused;
     VuDev vu_dev;
     QIOChannel *ioc; /* The I/O channel with the client */
     QIOChannelSocket *sioc; /* The underlying data channel with the client */
@@ -57,6 +63,8 @@ typedef struct {
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *unix_socket,
                              AioContext *ctx,
+                             AioContext *const *vq_ctxs,
+                             size_t num_vq_ctxs,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp);
@@ -38,6 +38,9 @@ struct IOThread {
     int64_t poll_max_ns;
     int64_t poll_grow;
     int64_t poll_shrink;
+
+    /* io_uring SQPOLL idle time in milliseconds, 0 = disabled */
+    int64_t io_uring_sqpoll_idle;
 };
 typedef struct IOThread IOThread;
 
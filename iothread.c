@@ -174,6 +174,12 @@ static void iothread_set_aio_context_params(EventLoopBase *base, Error **errp)
 
     aio_context_set_thread_pool_params(iothread->ctx, base->thread_pool_min,
                                        base->thread_pool_max, errp);
+    if (*errp) {
+        return;
+    }
+
+    aio_context_set_io_uring_params(iothread->ctx,
+                                    iothread->io_uring_sqpoll_idle, errp);
 }
 
 
@@ -233,6 +239,9 @@ static IOThreadParamInfo poll_grow_info = {
 static IOThreadParamInfo poll_shrink_info = {
     "poll-shrink", offsetof(IOThread, poll_shrink),
 };
+static IOThreadParamInfo io_uring_sqpoll_idle_info = {
+    "io-uring-sqpoll-idle", offsetof(IOThread, io_uring_sqpoll_idle),
+};
 
 static void iothread_get_param(Object *obj, Visitor *v,
         const char *name, IOThreadParamInfo *info, Error **errp)
@@ -292,6 +301,30 @@ static void iothread_set_poll_param(Object *obj, Visitor *v,
     }
 }
 
+static void iothread_get_io_uring_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThreadParamInfo *info = opaque;
+
+    iothread_get_param(obj, v, name, info, errp);
+}
+
+static void iothread_set_io_uring_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    IOThreadParamInfo *info = opaque;
+
+    if (!iothread_set_param(obj, v, name, info, errp)) {
+        return;
+    }
+
+    if (iothread->ctx) {
+        aio_context_set_io_uring_params(iothread->ctx,
+                                        iothread->io_uring_sqpoll_idle, errp);
+    }
+}
+
 static void iothread_class_init(ObjectClass *klass, const void *class_data)
 {
     EventLoopBaseClass *bc = EVENT_LOOP_BASE_CLASS(klass);
@@ -311,6 +344,10 @@ static void iothread_class_init(ObjectClass *klass, const void *class_data)
                               iothread_get_poll_param,
                               iothread_set_poll_param,
                               NULL, &poll_shrink_info);
+    object_class_property_add(klass, "io-uring-sqpoll-idle", "int",
+                              iothread_get_io_uring_param,
+                              iothread_set_io_uring_param,
+                              NULL, &io_uring_sqpoll_idle_info);
 }
 
 static const TypeInfo iothread_info = {
@@ -48,6 +48,7 @@
 #include "system/block-backend.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/thread-pool.h"
 #include "block/dirty-bitmap.h"
 #include "block/qapi.h"
 #include "crypto/init.h"
@@ -1701,6 +1702,25 @@ typedef struct ImgConvertState {
     int ret;
 } ImgConvertState;
 
+/* A run of sectors of a BLK_DATA request that is either written or zeroed */
+typedef struct ImgConvertRun {
+    int nb_sectors;
+    bool is_data;
+} ImgConvertRun;
+
+/*
+ * Zero detection for one request. This is done in a worker thread before the
+ * request waits for its turn to be written, so that the CPU time spent on it
+ * is spread over several cores and overlaps with the I/O of other coroutines.
+ */
+typedef struct ImgConvertScan {
+    ImgConvertState *s;
+    const uint8_t *buf;
+    int64_t sector_num;
+    int nb_sectors;
+    ImgConvertRun *runs;
+} ImgConvertScan;
+
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
                                 int *src_cur, int64_t *src_cur_offset)
 {
@@ -1874,9 +1894,69 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+static int convert_scan_data(void *opaque)
+{
+    ImgConvertScan *scan = opaque;
+    ImgConvertState *s = scan->s;
+    const uint8_t *buf = scan->buf;
+    int64_t sector_num = scan->sector_num;
+    int nb_sectors = scan->nb_sectors;
+    ImgConvertRun *run = scan->runs;
+
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+
+        /* If we're told to keep the target fully allocated (-S 0) or there
+         * is real non-zero data, we must write it. Otherwise we can treat
+         * it as zero sectors.
+         * Compressed clusters need to be written as a whole, so in that
+         * case we can only save the write if the buffer is completely
+         * zeroed. */
+        run->is_data = !s->min_sparse ||
+            (!s->compressed &&
+             is_allocated_sectors_min(buf, n, &n, s->min_sparse,
+                                      sector_num, s->alignment)) ||
+            (s->compressed &&
+             !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE));
+        run->nb_sectors = n;
+        run++;
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn convert_co_scan(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, const uint8_t *buf,
+                                         ImgConvertRun *runs)
+{
+    ImgConvertScan scan = {
+        .s          = s,
+        .buf        = buf,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+        .runs       = runs,
+    };
+
+    if (!s->min_sparse) {
+        /* Everything is written, there is nothing to scan */
+        convert_scan_data(&scan);
+    } else {
+        thread_pool_submit_co(convert_scan_data, &scan);
+    }
+}
+
+/*
+ * @runs describes the data in @buf as returned by convert_co_scan() and is
+ * only used for BLK_DATA.
+ */
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
-                                         enum ImgConvertBlockStatus status)
+                                         enum ImgConvertBlockStatus status,
+                                         const ImgConvertRun *runs)
 {
     int ret;
 
@@ -1893,19 +1973,8 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
             break;
 
         case BLK_DATA:
-            /* If we're told to keep the target fully allocated (-S 0) or there
-             * is real non-zero data, we must write it. Otherwise we can treat
-             * it as zero sectors.
-             * Compressed clusters need to be written as a whole, so in that
-             * case we can only save the write if the buffer is completely
-             * zeroed. */
-            if (!s->min_sparse ||
-                (!s->compressed &&
-                 is_allocated_sectors_min(buf, n, &n, s->min_sparse,
-                                          sector_num, s->alignment)) ||
-                (s->compressed &&
-                 !buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)))
-            {
+            n = runs->nb_sectors;
+            if ((runs++)->is_data) {
                 ret = blk_co_pwrite(s->target, sector_num << BDRV_SECTOR_BITS,
                                     n << BDRV_SECTOR_BITS, buf, flags);
                 if (ret < 0) {
@@ -1973,6 +2042,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 {
     ImgConvertState *s = opaque;
     uint8_t *buf = NULL;
+    ImgConvertRun *runs;
     int ret, i;
     int index = -1;
 
@@ -1986,6 +2056,7 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 
     s->running_coroutines++;
     buf = blk_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+    runs = g_new(ImgConvertRun, s->buf_sectors);
 
     while (1) {
         int n;
@@ -2037,6 +2108,10 @@ retry:
             memset(buf, 0x00, n * BDRV_SECTOR_SIZE);
         }
 
+        if (status == BLK_DATA && !copy_range && s->ret == -EINPROGRESS) {
+            convert_co_scan(s, sector_num, n, buf, runs);
+        }
+
         if (s->wr_in_order) {
             /* keep writes in order */
             while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
@@ -2056,7 +2131,7 @@ retry:
                     goto retry;
                 }
             } else {
-                ret = convert_co_write(s, sector_num, n, buf, status);
+                ret = convert_co_write(s, sector_num, n, buf, status, runs);
             }
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
@@ -2084,6 +2159,7 @@ retry:
     }
 
     qemu_vfree(buf);
+    g_free(runs);
     s->co[index] = NULL;
     s->running_coroutines--;
     if (!s->running_coroutines && s->ret == -EINPROGRESS) {
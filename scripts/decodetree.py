@@ -46,6 +46,10 @@
 insntype = 'uint32_t'
 decode_function = 'decode'
 
+# Limits for gathering a non-contiguous switch mask into a dense index.
+max_switch_runs = 3
+max_switch_bits = 8
+
 # An identifier for C.
 re_C_ident = '[a-zA-Z][a-zA-Z0-9_]*'
 
@@ -245,6 +249,75 @@ def is_contiguous(bits):
         return -1
 
 
+def bit_runs(bits):
+    """Return the runs of contiguous set bits in BITS, as a list of
+       (shift, length) tuples starting from the least significant bit."""
+    runs = []
+    shift = 0
+    while bits != 0:
+        skip = ctz(bits)
+        bits >>= skip
+        shift += skip
+        length = ctz(~bits)
+        runs.append((shift, length))
+        bits >>= length
+        shift += length
+    return runs
+
+
+def switch_formatters(mask):
+    """Return the functions formatting the controlling expression and
+       the case labels of a switch statement on the bits of MASK."""
+
+    # Attempt to aid the compiler in producing compact switch statements.
+    # If the bits in the mask are contiguous, extract them.
+    sh = is_contiguous(mask)
+    if sh > 0:
+        # Propagate SH down into the local functions.
+        def str_switch(b, sh=sh):
+            return f'(insn >> {sh}) & {b >> sh:#x}'
+
+        def str_case(b, sh=sh):
+            return hex(b >> sh)
+        return str_switch, str_case
+
+    # If the mask is made of a few short runs of bits, gather them into
+    # a dense index.  A sparse set of case labels is compiled into a
+    # chain of compares, while a dense one becomes a jump table.
+    runs = bit_runs(mask)
+    if sh < 0 and len(runs) <= max_switch_runs \
+       and bin(mask).count('1') <= max_switch_bits:
+        def str_switch(b, runs=runs):
+            parts = []
+            pos = 0
+            for (shift, length) in runs:
+                part = f'(insn >> {shift})' if shift else 'insn'
+                part += f' & {(1 << length) - 1:#x}'
+                if pos:
+                    part = f'(({part}) << {pos})'
+                elif len(runs) > 1:
+                    part = f'({part})'
+                parts.append(part)
+                pos += length
+            return ' | '.join(parts)
+
+        def str_case(b, runs=runs):
+            r = 0
+            pos = 0
+            for (shift, length) in runs:
+                r |= ((b >> shift) & ((1 << length) - 1)) << pos
+                pos += length
+            return hex(r)
+        return str_switch, str_case
+
+    def str_switch(b):
+        return f'insn & {whexC(b)}'
+
+    def str_case(b):
+        return whexC(b)
+    return str_switch, str_case
+
+
 def eq_fields_for_args(flds_a, arg):
     if len(flds_a) != len(arg.fields):
         return False
@@ -745,22 +818,7 @@ def output_code(self, i, extracted, outerbits, outermask):
                    '(ctx, &u.f_', self.base.base.name, ', insn);\n')
             extracted = True
 
-        # Attempt to aid the compiler in producing compact switch statements.
-        # If the bits in the mask are contiguous, extract them.
-        sh = is_contiguous(self.thismask)
-        if sh > 0:
-            # Propagate SH down into the local functions.
-            def str_switch(b, sh=sh):
-                return f'(insn >> {sh}) & {b >> sh:#x}'
-
-            def str_case(b, sh=sh):
-                return hex(b >> sh)
-        else:
-            def str_switch(b):
-                return f'insn & {whexC(b)}'
-
-            def str_case(b):
-                return whexC(b)
+        str_switch, str_case = switch_formatters(self.thismask)
 
         output(ind, 'switch (', str_switch(self.thismask), ') {\n')
         for b, s in sorted(self.subs):
@@ -1369,22 +1427,7 @@ def output_code(self, i, extracted, outerbits, outermask):
                    f'(ctx, insn, {extracted // 8}, {self.width // 8});\n')
             extracted = self.width
 
-        # Attempt to aid the compiler in producing compact switch statements.
-        # If the bits in the mask are contiguous, extract them.
-        sh = is_contiguous(self.mask)
-        if sh > 0:
-            # Propagate SH down into the local functions.
-            def str_switch(b, sh=sh):
-                return f'(insn >> {sh}) & {b >> sh:#x}'
-
-            def str_case(b, sh=sh):
-                return hex(b >> sh)
-        else:
-            def str_switch(b):
-                return f'insn & {whexC(b)}'
-
-            def str_case(b):
-                return whexC(b)
+        str_switch, str_case = switch_formatters(self.mask)
 
         output(ind, 'switch (', str_switch(self.mask), ') {\n')
         for b, s in sorted(self.subs):
@@ -32,6 +32,7 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <sys/ioctl.h>
 #include <sys/eventfd.h>
@@ -115,11 +116,17 @@ typedef struct VduseIovaRegion {
     uint64_t iova;
     uint64_t size;
     uint64_t mmap_offset;
-    uint64_t mmap_addr;
+    uintptr_t mmap_addr; /* set last, read first */
 } VduseIovaRegion;
 
 struct VduseDev {
     VduseVirtq *vqs;
+    /*
+     * Virtqueues may be processed in different threads, which all look up
+     * and lazily add regions.  Lookups are lock-free; adding and removing
+     * regions takes regions_lock.
+     */
+    pthread_mutex_t regions_lock;
     VduseIovaRegion regions[MAX_IOVA_REGIONS];
     int num_regions;
     char *name;
@@ -320,19 +327,42 @@ static void vduse_iova_remove_region(VduseDev *dev, uint64_t start,
         return;
     }
 
+    pthread_mutex_lock(&dev->regions_lock);
     for (i = 0; i < MAX_IOVA_REGIONS; i++) {
-        if (!dev->regions[i].mmap_addr) {
+        uintptr_t mmap_addr = dev->regions[i].mmap_addr;
+
+        if (!mmap_addr) {
             continue;
         }
 
         if (start <= dev->regions[i].iova &&
             last >= (dev->regions[i].iova + dev->regions[i].size - 1)) {
-            munmap((void *)(uintptr_t)dev->regions[i].mmap_addr,
+            __atomic_store_n(&dev->regions[i].mmap_addr, 0, __ATOMIC_RELAXED);
+            munmap((void *)mmap_addr,
                    dev->regions[i].mmap_offset + dev->regions[i].size);
-            dev->regions[i].mmap_addr = 0;
             dev->num_regions--;
         }
     }
+    pthread_mutex_unlock(&dev->regions_lock);
+}
+
+static VduseIovaRegion *vduse_iova_find_region(VduseDev *dev, uint64_t iova)
+{
+    int i;
+
+    for (i = 0; i < MAX_IOVA_REGIONS; i++) {
+        VduseIovaRegion *r = &dev->regions[i];
+
+        if (!__atomic_load_n(&r->mmap_addr, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        if ((iova >= r->iova) && (iova < (r->iova + r->size))) {
+            return r;
+        }
+    }
+
+    return NULL;
 }
 
 static int vduse_iova_add_region(VduseDev *dev, int fd,
@@ -348,17 +378,28 @@ static int vduse_iova_add_region(VduseDev *dev, int fd,
         return -EINVAL;
     }
 
+    pthread_mutex_lock(&dev->regions_lock);
+    if (vduse_iova_find_region(dev, start)) {
+        /* Another thread added it in the meantime */
+        munmap(mmap_addr, size + offset);
+        pthread_mutex_unlock(&dev->regions_lock);
+        close(fd);
+        return 0;
+    }
+
     for (i = 0; i < MAX_IOVA_REGIONS; i++) {
         if (!dev->regions[i].mmap_addr) {
-            dev->regions[i].mmap_addr = (uint64_t)(uintptr_t)mmap_addr;
             dev->regions[i].mmap_offset = offset;
             dev->regions[i].iova = start;
             dev->regions[i].size = size;
+            __atomic_store_n(&dev->regions[i].mmap_addr,
+                             (uintptr_t)mmap_addr, __ATOMIC_RELEASE);
             dev->num_regions++;
             break;
         }
     }
     assert(i < MAX_IOVA_REGIONS);
+    pthread_mutex_unlock(&dev->regions_lock);
     close(fd);
 
     return 0;
@@ -387,23 +428,16 @@ static int perm_to_prot(uint8_t perm)
 
 static inline void *iova_to_va(VduseDev *dev, uint64_t *plen, uint64_t iova)
 {
-    int i, ret;
+    int ret;
     struct vduse_iotlb_entry entry;
+    VduseIovaRegion *r = vduse_iova_find_region(dev, iova);
 
-    for (i = 0; i < MAX_IOVA_REGIONS; i++) {
-        VduseIovaRegion *r = &dev->regions[i];
-
-        if (!r->mmap_addr) {
-            continue;
-        }
-
-        if ((iova >= r->iova) && (iova < (r->iova + r->size))) {
-            if ((iova + *plen) > (r->iova + r->size)) {
-                *plen = r->iova + r->size - iova;
-            }
-            return (void *)(uintptr_t)(iova - r->iova +
-                   r->mmap_addr + r->mmap_offset);
+    if (r) {
+        if ((iova + *plen) > (r->iova + r->size)) {
+            *plen = r->iova + r->size - iova;
         }
+        return (void *)(uintptr_t)(iova - r->iova +
+               r->mmap_addr + r->mmap_offset);
     }
 
     entry.start = iova;
@@ -1219,6 +1253,7 @@ VduseDev *vduse_dev_create_by_fd(int fd, uint16_t num_queues,
         fprintf(stderr, "Failed to allocate vduse device\n");
         return NULL;
     }
+    pthread_mutex_init(&dev->regions_lock, NULL);
 
     if (ioctl(fd, VDUSE_DEV_GET_FEATURES, &dev->features)) {
         fprintf(stderr, "Failed to get features: %s\n", strerror(errno));
@@ -1258,6 +1293,7 @@ VduseDev *vduse_dev_create_by_name(const char *name, uint16_t num_queues,
         fprintf(stderr, "Failed to allocate vduse device\n");
         return NULL;
     }
+    pthread_mutex_init(&dev->regions_lock, NULL);
 
     ret = vduse_dev_init(dev, name, num_queues, ops, priv);
     if (ret < 0) {
@@ -1293,6 +1329,7 @@ VduseDev *vduse_dev_create(const char *name, uint32_t device_id,
         fprintf(stderr, "Failed to allocate vduse device\n");
         return NULL;
     }
+    pthread_mutex_init(&dev->regions_lock, NULL);
 
     ctrl_fd = open("/dev/vduse/control", O_RDWR);
     if (ctrl_fd < 0) {
@@ -1375,6 +1412,7 @@ int vduse_dev_destroy(VduseDev *dev)
         dev->ctrl_fd = -1;
     }
     free(dev->name);
+    pthread_mutex_destroy(&dev->regions_lock);
     free(dev);
 
     return ret;
@@ -162,20 +162,41 @@ LOGICAL_PPPP(sve_nand_pppp, DO_NAND)
 #undef DO_SEL
 #undef LOGICAL_PPPP
 
+/*
+ * The bits of a 16-bit predicate chunk, covering 16 bytes of vector,
+ * that are significant for elements of SIZE bytes.
+ */
+#define PRED_ESZ_MASK16(SIZE) \
+    ((SIZE) == 1 ? 0xffff : (SIZE) == 2 ? 0x5555 : (SIZE) == 4 ? 0x1111 : 0x0101)
+
 /* Fully general three-operand expander, controlled by a predicate.
  * This is complicated by the host-endian storage of the register file.
- */
-/* ??? I don't expect the compiler could ever vectorize this itself.
- * With some tables we can convert bit masks to byte masks, and with
- * extra care wrt byte/word ordering we could use gcc generic vectors
- * and do 16 bytes at a time.
+ *
+ * Predicates are very often all-true (PTRUE) or all-false for a whole
+ * 16-byte segment, so test for those first: a fully active segment is
+ * processed without per-element predicate tests, which gives the compiler
+ * a straight loop it can vectorize, and a fully inactive one is skipped.
  */
 #define DO_ZPZZ(NAME, TYPE, H, OP)                                       \
 void HELPER(NAME)(void *vd, void *vn, void *vm, void *vg, uint32_t desc) \
 {                                                                       \
-    intptr_t i, opr_sz = simd_oprsz(desc);                              \
+    const uint16_t esz_mask = PRED_ESZ_MASK16(sizeof(TYPE));            \
+    intptr_t i, j, opr_sz = simd_oprsz(desc);                           \
     for (i = 0; i < opr_sz; ) {                                         \
         uint16_t pg = *(uint16_t *)(vg + H1_2(i >> 3));                 \
+        if ((pg & esz_mask) == esz_mask) {                              \
+            for (j = i; j < i + 16; j += sizeof(TYPE)) {                \
+                TYPE nn = *(TYPE *)(vn + H(j));                         \
+                TYPE mm = *(TYPE *)(vm + H(j));                         \
+                *(TYPE *)(vd + H(j)) = OP(nn, mm);                      \
+            }                                                           \
+            i += 16;                                                    \
+            continue;                                                   \
+        }                                                               \
+        if ((pg & esz_mask) == 0) {                                     \
+            i += 16;                                                    \
+            continue;                                                   \
+        }                                                               \
         do {                                                            \
             if (pg & 1) {                                               \
                 TYPE nn = *(TYPE *)(vn + H(i));                         \
@@ -821,9 +842,22 @@ DO_ZPZW(sve_lsl_zpzw_s, uint32_t, uint64_t, H1_4, DO_LSL)
 #define DO_ZPZ(NAME, TYPE, H, OP)                               \
 void HELPER(NAME)(void *vd, void *vn, void *vg, uint32_t desc)  \
 {                                                               \
-    intptr_t i, opr_sz = simd_oprsz(desc);                      \
+    const uint16_t esz_mask = PRED_ESZ_MASK16(sizeof(TYPE));    \
+    intptr_t i, j, opr_sz = simd_oprsz(desc);                   \
     for (i = 0; i < opr_sz; ) {                                 \
         uint16_t pg = *(uint16_t *)(vg + H1_2(i >> 3));         \
+        if ((pg & esz_mask) == esz_mask) {                      \
+            for (j = i; j < i + 16; j += sizeof(TYPE)) {        \
+                TYPE nn = *(TYPE *)(vn + H(j));                 \
+                *(TYPE *)(vd + H(j)) = OP(nn);                  \
+            }                                                   \
+            i += 16;                                            \
+            continue;                                           \
+        }                                                       \
+        if ((pg & esz_mask) == 0) {                             \
+            i += 16;                                            \
+            continue;                                           \
+        }                                                       \
         do {                                                    \
             if (pg & 1) {                                       \
                 TYPE nn = *(TYPE *)(vn + H(i));                 \
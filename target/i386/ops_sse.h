@@ -2420,6 +2420,64 @@ void glue(helper_vpgatherqq, SUFFIX)(CPUX86State *env,
         v->Q(i) = 0;
     }
 }
+
+/* AVX-VNNI */
+#if SHIFT == 1
+static inline int32_t vnni_satsd(int64_t x)
+{
+    return x > INT32_MAX ? INT32_MAX : x < INT32_MIN ? INT32_MIN : x;
+}
+
+static inline int32_t vnni_dpbusd(Reg *v, Reg *s, int i)
+{
+    return (uint8_t)v->B(4 * i + 0) * (int8_t)s->B(4 * i + 0) +
+        (uint8_t)v->B(4 * i + 1) * (int8_t)s->B(4 * i + 1) +
+        (uint8_t)v->B(4 * i + 2) * (int8_t)s->B(4 * i + 2) +
+        (uint8_t)v->B(4 * i + 3) * (int8_t)s->B(4 * i + 3);
+}
+
+static inline int64_t vnni_dpwssd(Reg *v, Reg *s, int i)
+{
+    return (int64_t)((int16_t)v->W(2 * i) * (int16_t)s->W(2 * i)) +
+        (int16_t)v->W(2 * i + 1) * (int16_t)s->W(2 * i + 1);
+}
+#endif
+
+void glue(helper_vpdpbusd, SUFFIX)(CPUX86State *env, Reg *d, Reg *v, Reg *s)
+{
+    int i;
+
+    for (i = 0; i < (2 << SHIFT); i++) {
+        d->L(i) += vnni_dpbusd(v, s, i);
+    }
+}
+
+void glue(helper_vpdpbusds, SUFFIX)(CPUX86State *env, Reg *d, Reg *v, Reg *s)
+{
+    int i;
+
+    for (i = 0; i < (2 << SHIFT); i++) {
+        d->L(i) = vnni_satsd((int64_t)(int32_t)d->L(i) + vnni_dpbusd(v, s, i));
+    }
+}
+
+void glue(helper_vpdpwssd, SUFFIX)(CPUX86State *env, Reg *d, Reg *v, Reg *s)
+{
+    int i;
+
+    for (i = 0; i < (2 << SHIFT); i++) {
+        d->L(i) += (uint32_t)vnni_dpwssd(v, s, i);
+    }
+}
+
+void glue(helper_vpdpwssds, SUFFIX)(CPUX86State *env, Reg *d, Reg *v, Reg *s)
+{
+    int i;
+
+    for (i = 0; i < (2 << SHIFT); i++) {
+        d->L(i) = vnni_satsd((int64_t)(int32_t)d->L(i) + vnni_dpwssd(v, s, i));
+    }
+}
 #endif
 
 #if SHIFT >= 2
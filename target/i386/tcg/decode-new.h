@@ -107,6 +107,7 @@ typedef enum X86CPUIDFeature {
     X86_FEAT_AES,
     X86_FEAT_AVX,
     X86_FEAT_AVX2,
+    X86_FEAT_AVX_VNNI,
     X86_FEAT_BMI1,
     X86_FEAT_BMI2,
     X86_FEAT_CLFLUSH,
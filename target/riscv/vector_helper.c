@@ -463,16 +463,67 @@ vext_ldst_us(void *vd, target_ulong base, CPURISCVState *env, uint32_t desc,
 
 /*
  * masked unit-stride load and store operation will be a special case of
- * stride, stride = NF * sizeof (ETYPE)
+ * stride, stride = NF * sizeof (ETYPE), unless all the elements lie in a
+ * single page that can be accessed directly: then only the mask needs to
+ * be checked for each element.
  */
+static inline QEMU_ALWAYS_INLINE void
+vext_ldst_us_mask(void *vd, void *v0, target_ulong base, CPURISCVState *env,
+                  uint32_t desc, vext_ldst_elem_fn_tlb *ldst_tlb,
+                  vext_ldst_elem_fn_host *ldst_host, uint32_t log2_esz,
+                  uintptr_t ra, bool is_load)
+{
+    uint32_t i, k;
+    uint32_t nf = vext_nf(desc);
+    uint32_t max_elems = vext_max_elems(desc, log2_esz);
+    uint32_t esz = 1 << log2_esz;
+    uint32_t msize = nf * esz;
+    uint32_t vma = vext_vma(desc);
+    target_ulong addr, size;
+    void *host;
+    int flags;
+
+    VSTART_CHECK_EARLY_EXIT(env, env->vl);
+
+    addr = base + env->vstart * msize;
+    size = (env->vl - env->vstart) * msize;
+    if (size <= -(addr | TARGET_PAGE_MASK)) {
+        /*
+         * Do not fault here: masked-off elements must not raise exceptions,
+         * so leave anything but plain RAM to the element-wise path.
+         */
+        probe_pages(env, addr, size, ra,
+                    is_load ? MMU_DATA_LOAD : MMU_DATA_STORE,
+                    riscv_env_mmu_index(env, false), &host, &flags, true);
+        if (flags == 0) {
+            for (i = env->vstart; i < env->vl; i++, host += msize) {
+                for (k = 0; k < nf; k++) {
+                    if (!vext_elem_mask(v0, i)) {
+                        /* set masked-off elements to 1s */
+                        vext_set_elems_1s(vd, vma, (i + k * max_elems) * esz,
+                                          (i + k * max_elems + 1) * esz);
+                        continue;
+                    }
+                    ldst_host(vd, i + k * max_elems, host + (k << log2_esz));
+                }
+            }
+            env->vstart = 0;
+            vext_set_tail_elems_1s(env->vl, vd, desc, nf, esz, max_elems);
+            return;
+        }
+    }
+
+    vext_ldst_stride(vd, v0, base, msize, env, desc, false, ldst_tlb,
+                     log2_esz, ra);
+}
 
 #define GEN_VEXT_LD_US(NAME, ETYPE, LOAD_FN_TLB, LOAD_FN_HOST)      \
 void HELPER(NAME##_mask)(void *vd, void *v0, target_ulong base,     \
                          CPURISCVState *env, uint32_t desc)         \
 {                                                                   \
-    uint32_t stride = vext_nf(desc) << ctzl(sizeof(ETYPE));         \
-    vext_ldst_stride(vd, v0, base, stride, env, desc, false,        \
-                     LOAD_FN_TLB, ctzl(sizeof(ETYPE)), GETPC());    \
+    vext_ldst_us_mask(vd, v0, base, env, desc, LOAD_FN_TLB,         \
+                      LOAD_FN_HOST, ctzl(sizeof(ETYPE)), GETPC(),   \
+                      true);                                        \
 }                                                                   \
                                                                     \
 void HELPER(NAME)(void *vd, void *v0, target_ulong base,            \
@@ -491,9 +542,9 @@ GEN_VEXT_LD_US(vle64_v, int64_t, lde_d_tlb, lde_d_host)
 void HELPER(NAME##_mask)(void *vd, void *v0, target_ulong base,          \
                          CPURISCVState *env, uint32_t desc)              \
 {                                                                        \
-    uint32_t stride = vext_nf(desc) << ctzl(sizeof(ETYPE));              \
-    vext_ldst_stride(vd, v0, base, stride, env, desc, false,             \
-                     STORE_FN_TLB, ctzl(sizeof(ETYPE)), GETPC());        \
+    vext_ldst_us_mask(vd, v0, base, env, desc, STORE_FN_TLB,             \
+                      STORE_FN_HOST, ctzl(sizeof(ETYPE)), GETPC(),       \
+                      false);                                            \
 }                                                                        \
                                                                          \
 void HELPER(NAME)(void *vd, void *v0, target_ulong base,                 \
@@ -0,0 +1,100 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * HBitmap bulk operation speed benchmark
+ *
+ * Each operation processes the whole bottom level of a bitmap, like merging
+ * or migrating a dirty bitmap of a large disk does.  All implementations
+ * that the host supports are measured, starting with the fastest one.
+ */
+#include "qemu/osdep.h"
+#include "qemu/hbitmap.h"
+#include "qemu/units.h"
+
+/* 16 MiB bottom level, e.g. an 8 TiB disk with a granularity of 64 KiB */
+#define BENCH_BITS  (128 * MiB)
+
+static HBitmap *dirty, *other, *full;
+static uint8_t *buf;
+
+static void bench_merge(void)
+{
+    hbitmap_merge(dirty, other, dirty);
+}
+
+static void bench_next_zero(void)
+{
+    g_assert_cmpint(hbitmap_next_zero(full, 0, INT64_MAX), ==, -1);
+}
+
+static void bench_serialize(void)
+{
+    hbitmap_serialize_part(dirty, buf, 0, BENCH_BITS);
+}
+
+static void bench_deserialize(void)
+{
+    hbitmap_deserialize_part(dirty, buf, 0, BENCH_BITS, true);
+}
+
+static const struct {
+    const char *name;
+    void (*fn)(void);
+} ops[] = {
+    { "merge", bench_merge },
+    { "next_zero", bench_next_zero },
+    { "serialize", bench_serialize },
+    { "deserialize", bench_deserialize },
+};
+
+static void test(const void *opaque)
+{
+    size_t len = BENCH_BITS / BITS_PER_BYTE;
+    int accel_index = 0;
+    uint64_t i;
+
+    dirty = hbitmap_alloc(BENCH_BITS, 0);
+    other = hbitmap_alloc(BENCH_BITS, 0);
+    full = hbitmap_alloc(BENCH_BITS, 0);
+    buf = g_malloc(hbitmap_serialization_size(dirty, 0, BENCH_BITS));
+
+    /* Dirty a few clusters in every word of the upper levels */
+    for (i = 0; i < BENCH_BITS; i += 4 * KiB) {
+        hbitmap_set(dirty, i + (i / KiB) % 64, 16);
+        hbitmap_set(other, i + 2 * KiB, 256);
+    }
+    hbitmap_set(full, 0, BENCH_BITS);
+
+    do {
+        if (accel_index != 0) {
+            g_test_message("%s", "");  /* gnu_printf Werror for simple "" */
+        }
+        for (i = 0; i < ARRAY_SIZE(ops); i++) {
+            double total = 0.0;
+
+            g_test_timer_start();
+            do {
+                ops[i].fn();
+                total += len;
+            } while (g_test_timer_elapsed() < 0.5);
+
+            total /= MiB;
+            g_test_message("hbitmap #%d: %-12s %8.0f MB/sec",
+                           accel_index, ops[i].name,
+                           total / g_test_timer_last());
+        }
+        accel_index++;
+    } while (test_hbitmap_next_accel());
+
+    g_free(buf);
+    hbitmap_free(full);
+    hbitmap_free(other);
+    hbitmap_free(dirty);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/hbitmap/speed", NULL, test);
+    return g_test_run();
+}
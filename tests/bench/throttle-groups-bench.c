@@ -0,0 +1,212 @@
+/*
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ *
+ * Throttle group scalability and fairness benchmark
+ *
+ * Every member of a throttle group runs in its own iothread and keeps a
+ * number of requests in flight.  Requests complete immediately, so the
+ * result shows the overhead of the throttling code when the limit is not
+ * reached, and how fairly the limit is shared among members when it is.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/main-loop.h"
+#include "qemu/module.h"
+#include "qemu/timer.h"
+#include "block/aio.h"
+#include "block/throttle-groups.h"
+#include "../unit/iothread.h"
+
+typedef struct Member {
+    ThrottleGroupMember tgm;
+    IOThread *iothread;
+    AioContext *ctx;
+    unsigned int depth;
+    uint64_t ops; /* only accessed from the iothread until it stops */
+} Member;
+
+static Member *members;
+static unsigned int n_members = 1;
+static unsigned int depth = 16;
+static bool uneven;
+static unsigned int duration = 1;
+static uint64_t iops_limit = 100000000;
+static uint64_t bps_limit;
+static unsigned int req_size = 4096;
+static bool test_stop;
+static unsigned int n_running;
+
+static const char commands_string[] =
+    " -n = number of group members, each in its own iothread\n"
+    " -q = number of requests in flight per member\n"
+    " -u = uneven load: member i has (i + 1) times more requests in flight\n"
+    " -d = duration in seconds\n"
+    " -i = iops limit of the group\n"
+    " -b = bps limit of the group (0 for none)\n"
+    " -s = request size in bytes";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+static void coroutine_fn request_loop(void *opaque)
+{
+    Member *m = opaque;
+
+    while (!qatomic_read(&test_stop)) {
+        throttle_group_co_io_limits_intercept(&m->tgm, req_size,
+                                              THROTTLE_READ);
+        m->ops++;
+
+        /* Complete the request from the event loop, like a real backend */
+        aio_co_schedule(m->ctx, qemu_coroutine_self());
+        qemu_coroutine_yield();
+    }
+
+    qatomic_dec(&n_running);
+}
+
+static void create_members(void)
+{
+    ThrottleConfig cfg;
+    unsigned int i;
+
+    members = g_new0(Member, n_members);
+    for (i = 0; i < n_members; i++) {
+        Member *m = &members[i];
+
+        m->iothread = iothread_new();
+        m->ctx = iothread_get_aio_context(m->iothread);
+        m->depth = uneven ? depth * (i + 1) : depth;
+        throttle_group_register_tgm(&m->tgm, "bench", m->ctx);
+    }
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = iops_limit;
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = bps_limit;
+    throttle_is_valid(&cfg, &error_fatal);
+    throttle_group_config(&members[0].tgm, &cfg);
+}
+
+static double run_test(void)
+{
+    int64_t start, end;
+    unsigned int i, j;
+
+    start = get_clock();
+    for (i = 0; i < n_members; i++) {
+        for (j = 0; j < members[i].depth; j++) {
+            Coroutine *co = qemu_coroutine_create(request_loop, &members[i]);
+
+            qatomic_inc(&n_running);
+            aio_co_enter(members[i].ctx, co);
+        }
+    }
+
+    g_usleep(duration * G_USEC_PER_SEC);
+    qatomic_set(&test_stop, true);
+    end = get_clock();
+
+    while (qatomic_read(&n_running)) {
+        g_usleep(1000);
+    }
+
+    return (double)(end - start) / NANOSECONDS_PER_SECOND;
+}
+
+static void pr_params(void)
+{
+    printf("Parameters:\n");
+    printf(" # of members:      %u\n", n_members);
+    printf(" requests/member:   %u%s\n", depth, uneven ? " (uneven)" : "");
+    printf(" duration:          %u\n", duration);
+    printf(" iops limit:        %" PRIu64 "\n", iops_limit);
+    printf(" bps limit:         %" PRIu64 "\n", bps_limit);
+    printf(" request size:      %u\n", req_size);
+}
+
+static void pr_stats(double secs)
+{
+    double total = 0, sum_sq = 0, min = 0, max = 0;
+    unsigned int i;
+
+    printf("Results:\n");
+    for (i = 0; i < n_members; i++) {
+        double iops = members[i].ops / secs;
+
+        printf(" member %-3u         %.2f Mops/s\n", i, iops / 1e6);
+        total += iops;
+        sum_sq += iops * iops;
+        min = i ? MIN(min, iops) : iops;
+        max = i ? MAX(max, iops) : iops;
+    }
+
+    printf(" Throughput:        %.2f Mops/s\n", total / 1e6);
+    printf(" Min/max member:    %.3f\n", max ? min / max : 0);
+    printf(" Fairness index:    %.3f\n",
+           sum_sq ? total * total / (n_members * sum_sq) : 0);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "hn:q:ud:i:b:s:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            exit(0);
+        case 'n':
+            n_members = atoi(optarg);
+            break;
+        case 'q':
+            depth = atoi(optarg);
+            break;
+        case 'u':
+            uneven = true;
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'i':
+            iops_limit = g_ascii_strtoull(optarg, NULL, 10);
+            break;
+        case 'b':
+            bps_limit = g_ascii_strtoull(optarg, NULL, 10);
+            break;
+        case 's':
+            req_size = atoi(optarg);
+            break;
+        default:
+            usage_complete(argv);
+            exit(1);
+        }
+    }
+
+    if (!n_members || !depth || !duration || (!iops_limit && !bps_limit)) {
+        usage_complete(argv);
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    double secs;
+
+    parse_args(argc, argv);
+    qemu_init_main_loop(&error_fatal);
+    module_call_init(MODULE_INIT_QOM);
+
+    pr_params();
+    create_members();
+    secs = run_test();
+    pr_stats(secs);
+    return 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * Test predicated SVE arithmetic with predicates whose 16-byte segments
+ * are fully active, fully inactive or mixed, for all vector lengths
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/prctl.h>
+
+#define MAX_VL 256
+
+enum {
+    PRED_ALL,           /* every predicate bit set */
+    PRED_NONE,          /* no predicate bit set */
+    PRED_SEGMENTS,      /* a different pattern in each segment */
+    PRED_FIRST_LAST,    /* first segment and last element only */
+    NB_PRED,
+};
+
+static uint8_t vn[MAX_VL], vm[MAX_VL], vd[MAX_VL], expect[MAX_VL];
+static uint8_t pred[MAX_VL / 8];
+
+static int pred_bit(int bit)
+{
+    return (pred[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void set_pred_bit(int bit)
+{
+    pred[bit / 8] |= 1 << (bit % 8);
+}
+
+/*
+ * Only the predicate bit of the first byte of each element is significant;
+ * the others are set in some segments to check that they are ignored.
+ */
+static void fill_pred(int pattern, int esz, int vl)
+{
+    int i, seg;
+
+    memset(pred, 0, sizeof(pred));
+
+    switch (pattern) {
+    case PRED_ALL:
+        memset(pred, 0xff, vl / 8);
+        break;
+    case PRED_NONE:
+        break;
+    case PRED_SEGMENTS:
+        for (seg = 0; seg < vl / 16; seg++) {
+            int first = seg * 16;
+
+            switch (seg % 4) {
+            case 0:
+                /* All elements active, ignored bits clear */
+                for (i = first; i < first + 16; i += esz) {
+                    set_pred_bit(i);
+                }
+                break;
+            case 1:
+                /* All elements inactive, ignored bits set */
+                for (i = first; i < first + 16; i++) {
+                    if (i % esz) {
+                        set_pred_bit(i);
+                    }
+                }
+                break;
+            case 2:
+                /* Only the last element active */
+                set_pred_bit(first + 16 - esz);
+                break;
+            case 3:
+                /* Only the first element active */
+                set_pred_bit(first);
+                break;
+            }
+        }
+        break;
+    case PRED_FIRST_LAST:
+        for (i = 0; i < 16; i += esz) {
+            set_pred_bit(i);
+        }
+        set_pred_bit(vl - esz);
+        break;
+    }
+}
+
+static void fill_vectors(int vl)
+{
+    for (int i = 0; i < vl; i++) {
+        vn[i] = i * 7 + 3;
+        vm[i] = i * 13 + 101;
+        vd[i] = 0xa5 ^ i;
+    }
+}
+
+/* Little-endian element access, like the guest register file */
+static uint64_t get_elem(const uint8_t *v, int esz, int i)
+{
+    uint64_t x = 0;
+
+    for (int b = esz - 1; b >= 0; b--) {
+        x = (x << 8) | v[i * esz + b];
+    }
+    return x;
+}
+
+static void set_elem(uint8_t *v, int esz, int i, uint64_t x)
+{
+    for (int b = 0; b < esz; b++) {
+        v[i * esz + b] = x >> (b * 8);
+    }
+}
+
+/* add zd, pg/m, zd, zm: inactive elements keep the value of zd */
+static void ref_add(int esz, int vl)
+{
+    for (int i = 0; i < vl / esz; i++) {
+        uint64_t d = get_elem(vd, esz, i);
+
+        if (pred_bit(i * esz)) {
+            d += get_elem(vm, esz, i);
+        }
+        set_elem(expect, esz, i, d);
+    }
+}
+
+/* neg zd, pg/m, zn: inactive elements keep the value of zd */
+static void ref_neg(int esz, int vl)
+{
+    for (int i = 0; i < vl / esz; i++) {
+        uint64_t d = get_elem(vd, esz, i);
+
+        if (pred_bit(i * esz)) {
+            d = -get_elem(vn, esz, i);
+        }
+        set_elem(expect, esz, i, d);
+    }
+}
+
+#define DO_ADD(T)                                               \
+    asm volatile("ldr z0, [%0]\n\t"                             \
+                 "ldr z1, [%1]\n\t"                             \
+                 "ldr p0, [%2]\n\t"                             \
+                 "add z0." T ", p0/m, z0." T ", z1." T "\n\t"   \
+                 "str z0, [%0]"                                 \
+                 : : "r" (vd), "r" (vm), "r" (pred)             \
+                 : "z0", "z1", "p0", "memory")
+
+#define DO_NEG(T)                                               \
+    asm volatile("ldr z0, [%0]\n\t"                             \
+                 "ldr z1, [%1]\n\t"                             \
+                 "ldr p0, [%2]\n\t"                             \
+                 "neg z0." T ", p0/m, z1." T "\n\t"             \
+                 "str z0, [%0]"                                 \
+                 : : "r" (vd), "r" (vn), "r" (pred)             \
+                 : "z0", "z1", "p0", "memory")
+
+static void do_add(int esz)
+{
+    switch (esz) {
+    case 1:
+        DO_ADD("b");
+        break;
+    case 2:
+        DO_ADD("h");
+        break;
+    case 4:
+        DO_ADD("s");
+        break;
+    case 8:
+        DO_ADD("d");
+        break;
+    }
+}
+
+static void do_neg(int esz)
+{
+    switch (esz) {
+    case 1:
+        DO_NEG("b");
+        break;
+    case 2:
+        DO_NEG("h");
+        break;
+    case 4:
+        DO_NEG("s");
+        break;
+    case 8:
+        DO_NEG("d");
+        break;
+    }
+}
+
+static int check(const char *op, int vl, int esz, int pattern)
+{
+    for (int i = 0; i < vl; i++) {
+        if (vd[i] != expect[i]) {
+            fprintf(stderr, "%s: vl %d, esz %d, pattern %d, byte %d: "
+                    "expected 0x%02x, got 0x%02x\n",
+                    op, vl, esz, pattern, i, expect[i], vd[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int test(int vl)
+{
+    int err = 0;
+
+    for (int esz = 1; esz <= 8; esz *= 2) {
+        for (int pattern = 0; pattern < NB_PRED; pattern++) {
+            fill_pred(pattern, esz, vl);
+
+            fill_vectors(vl);
+            ref_add(esz, vl);
+            do_add(esz);
+            err |= check("add", vl, esz, pattern);
+
+            fill_vectors(vl);
+            ref_neg(esz, vl);
+            do_neg(esz);
+            err |= check("neg", vl, esz, pattern);
+        }
+    }
+
+    return err;
+}
+
+int main(void)
+{
+    int err = 0;
+
+    for (int i = 16; i <= MAX_VL; i += 16) {
+        if (prctl(PR_SVE_SET_VL, i, 0, 0, 0, 0) == i) {
+            err |= test(i);
+        }
+    }
+    return err;
+}
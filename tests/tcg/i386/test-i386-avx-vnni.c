@@ -0,0 +1,166 @@
+/*
+ * Test the VEX-encoded AVX-VNNI instructions against known results,
+ * including overflow of the non-saturating forms and saturation of the
+ * saturating ones, in both vector lengths
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <cpuid.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef union {
+    uint8_t b[32];
+    int16_t w[16];
+    int32_t d[8];
+} Vec;
+
+/* One dword lane of VPDPBUSD(S): unsigned bytes of a times signed bytes of b */
+static const struct {
+    uint8_t a[4];
+    int8_t b[4];
+    int32_t acc, res, res_sat;
+} bus_tests[8] = {
+    { { 1, 2, 3, 4 }, { 5, 6, 7, 8 }, 0, 70, 70 },
+    { { 255, 255, 255, 255 }, { -128, -128, -128, -128 }, 0,
+      -130560, -130560 },
+    { { 255, 255, 255, 255 }, { 127, 127, 127, 127 }, INT32_MAX,
+      (int32_t)0x8001fa03, INT32_MAX },
+    { { 0, 0, 0, 0 }, { -1, -1, -1, -1 }, -5, -5, -5 },
+    { { 128, 1, 0, 255 }, { -1, 127, -128, 2 }, 100, 609, 609 },
+    { { 255, 255, 255, 255 }, { -128, -128, -128, -128 }, INT32_MIN,
+      0x7ffe0200, INT32_MIN },
+    { { 10, 20, 30, 40 }, { -10, -20, -30, -40 }, 3000, 0, 0 },
+    { { 200, 100, 50, 25 }, { 3, -3, 3, -3 }, -1, 374, 374 },
+};
+
+/* One dword lane of VPDPWSSD(S): signed words of a times signed words of b */
+static const struct {
+    int16_t a[2];
+    int16_t b[2];
+    int32_t acc, res, res_sat;
+} wss_tests[8] = {
+    { { 1, 2 }, { 3, 4 }, 10, 21, 21 },
+    /* The sum of the two products does not fit in 32 bits */
+    { { -32768, -32768 }, { -32768, -32768 }, 0, INT32_MIN, INT32_MAX },
+    { { 32767, -32768 }, { -32768, -32768 }, 0, 32768, 32768 },
+    { { -32768, -32768 }, { 32767, 32767 }, INT32_MIN, 0x10000, INT32_MIN },
+    { { 100, -100 }, { 100, 100 }, -7, -7, -7 },
+    { { -1, -1 }, { -1, -1 }, INT32_MAX - 1, INT32_MIN, INT32_MAX },
+    { { 12345, -2 }, { 2, 12345 }, 1, 1, 1 },
+    { { -32768, 0 }, { 1, 0 }, 32768, 0, 0 },
+};
+
+/*
+ * The instructions are encoded by hand so that the assembler cannot pick
+ * the EVEX forms: VEX.{128,256}.66.0F38.W0 with ymm0 as destination and
+ * accumulator, ymm1 as first and ymm2 as second source.
+ */
+#define VEX_128 "0x71"
+#define VEX_256 "0x75"
+
+#define VNNI(OPC, VEX_L, d, a, b)                                   \
+    asm volatile("vmovdqu %0, %%ymm0\n\t"                           \
+                 "vmovdqu %1, %%ymm1\n\t"                           \
+                 "vmovdqu %2, %%ymm2\n\t"                           \
+                 ".byte 0xc4, 0xe2, " VEX_L ", " OPC ", 0xc2\n\t"   \
+                 "vmovdqu %%ymm0, %0"                               \
+                 : "+m" (*(d)) : "m" (*(a)), "m" (*(b))             \
+                 : "xmm0", "xmm1", "xmm2")
+
+enum { VPDPBUSD, VPDPBUSDS, VPDPWSSD, VPDPWSSDS };
+
+static const char *const names[] = {
+    "vpdpbusd", "vpdpbusds", "vpdpwssd", "vpdpwssds",
+};
+
+static void run(int op, int ymm, Vec *d, const Vec *a, const Vec *b)
+{
+    switch (op * 2 + ymm) {
+    case VPDPBUSD * 2:
+        VNNI("0x50", VEX_128, d, a, b);
+        break;
+    case VPDPBUSD * 2 + 1:
+        VNNI("0x50", VEX_256, d, a, b);
+        break;
+    case VPDPBUSDS * 2:
+        VNNI("0x51", VEX_128, d, a, b);
+        break;
+    case VPDPBUSDS * 2 + 1:
+        VNNI("0x51", VEX_256, d, a, b);
+        break;
+    case VPDPWSSD * 2:
+        VNNI("0x52", VEX_128, d, a, b);
+        break;
+    case VPDPWSSD * 2 + 1:
+        VNNI("0x52", VEX_256, d, a, b);
+        break;
+    case VPDPWSSDS * 2:
+        VNNI("0x53", VEX_128, d, a, b);
+        break;
+    case VPDPWSSDS * 2 + 1:
+        VNNI("0x53", VEX_256, d, a, b);
+        break;
+    }
+}
+
+static int test(int op, int ymm)
+{
+    int nb_lanes = ymm ? 8 : 4;
+    bool sat = op == VPDPBUSDS || op == VPDPWSSDS;
+    int32_t expect[8];
+    Vec d, a, b;
+    int i, err = 0;
+
+    /* The 128-bit forms clear the upper half of the destination */
+    memset(&d, 0x11, sizeof(d));
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    memset(expect, 0, sizeof(expect));
+
+    for (i = 0; i < nb_lanes; i++) {
+        if (op == VPDPBUSD || op == VPDPBUSDS) {
+            memcpy(&a.b[i * 4], bus_tests[i].a, 4);
+            memcpy(&b.b[i * 4], bus_tests[i].b, 4);
+            d.d[i] = bus_tests[i].acc;
+            expect[i] = sat ? bus_tests[i].res_sat : bus_tests[i].res;
+        } else {
+            memcpy(&a.w[i * 2], wss_tests[i].a, 4);
+            memcpy(&b.w[i * 2], wss_tests[i].b, 4);
+            d.d[i] = wss_tests[i].acc;
+            expect[i] = sat ? wss_tests[i].res_sat : wss_tests[i].res;
+        }
+    }
+
+    run(op, ymm, &d, &a, &b);
+
+    for (i = 0; i < 8; i++) {
+        if (d.d[i] != expect[i]) {
+            printf("%s %s lane %d: expected 0x%08x, got 0x%08x\n",
+                   names[op], ymm ? "ymm" : "xmm", i,
+                   (uint32_t)expect[i], (uint32_t)d.d[i]);
+            err = 1;
+        }
+    }
+    return err;
+}
+
+int main(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    int op, err = 0;
+
+    if (!__get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx) ||
+        !(eax & (1 << 4))) {
+        printf("SKIP: AVX-VNNI not supported\n");
+        return 0;
+    }
+
+    for (op = VPDPBUSD; op <= VPDPWSSDS; op++) {
+        err |= test(op, 0);
+        err |= test(op, 1);
+    }
+    return err;
+}
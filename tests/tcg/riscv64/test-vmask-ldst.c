@@ -0,0 +1,267 @@
+/*
+ * Test masked unit-stride and segment vector loads and stores, with
+ * accesses inside a page, ending at its end, crossing it, and with
+ * masked-off or prestart elements on inaccessible pages
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define MAX_VLENB 256
+#define REG_BYTES (8 * MAX_VLENB)
+
+enum {
+    POS_MID,            /* inside the first page */
+    POS_END,            /* the last element ends with the first page */
+    POS_CROSS,          /* the last element is on the second page */
+    POS_GUARD,          /* the last two elements are inaccessible */
+    POS_VSTART,         /* the elements before vstart are inaccessible */
+    NB_POS,
+};
+
+enum {
+    MASK_ALL,
+    MASK_NONE,
+    MASK_SPARSE,
+    NB_MASK,
+};
+
+/* guard page, two accessible pages, guard page */
+static uint8_t *mem;
+static long page_size;
+static unsigned long vlenb;
+
+static uint8_t mask[MAX_VLENB];
+static uint8_t reg[REG_BYTES], expect_reg[REG_BYTES];
+static uint8_t *expect_mem;
+
+static int mask_bit(int i)
+{
+    return (mask[i / 8] >> (i % 8)) & 1;
+}
+
+static void fill_mask(int pattern, int nb_elems)
+{
+    memset(mask, 0, sizeof(mask));
+    for (int i = 0; i < nb_elems; i++) {
+        if (pattern == MASK_ALL || (pattern == MASK_SPARSE && i % 3 == 1)) {
+            mask[i / 8] |= 1 << (i % 8);
+        }
+    }
+}
+
+/* Masked-off elements must not fault, so keep them on the guard page */
+static void clear_guard_mask(uint8_t *base, int msize, int vl)
+{
+    for (int i = 0; i < vl; i++) {
+        if (base + (i + 1) * msize > mem + 2 * page_size) {
+            mask[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+}
+
+static uint8_t *get_base(int pos, int msize, int vl, int vstart)
+{
+    switch (pos) {
+    case POS_MID:
+        return mem + 64;
+    case POS_END:
+        return mem + page_size - vl * msize;
+    case POS_CROSS:
+        return mem + page_size - (vl - 1) * msize;
+    case POS_GUARD:
+        return mem + 2 * page_size - (vl - 2) * msize;
+    case POS_VSTART:
+        return mem - vstart * msize;
+    }
+    return NULL;
+}
+
+static void fill(void)
+{
+    for (int i = 0; i < REG_BYTES; i++) {
+        reg[i] = 0xa5 ^ i;
+    }
+    for (int i = 0; i < 2 * page_size; i++) {
+        mem[i] = i * 7 + 3;
+    }
+    memcpy(expect_reg, reg, REG_BYTES);
+    memcpy(expect_mem, mem, 2 * page_size);
+}
+
+/*
+ * Field k of element i is at offset (i * nf + k) * esz in memory, and
+ * in register group k, whose size is 8 / nf registers, in the register file.
+ */
+static void ref_ldst(int is_load, uint8_t *base, int esz, int nf,
+                     int vl, int vstart)
+{
+    int group = 8 / nf * vlenb;
+
+    for (int i = vstart; i < vl; i++) {
+        if (!mask_bit(i)) {
+            continue;
+        }
+        for (int k = 0; k < nf; k++) {
+            uint8_t *r = expect_reg + k * group + i * esz;
+            long m = base - mem + (i * nf + k) * esz;
+
+            if (is_load) {
+                memcpy(r, mem + m, esz);
+            } else {
+                memcpy(expect_mem + m, r, esz);
+            }
+        }
+    }
+}
+
+#define LDST(INSN, SEW, LMUL)                                           \
+    asm volatile("vsetvli t0, x0, e8, m1, tu, mu\n\t"                   \
+                 "vl1re8.v v0, (%[mask])\n\t"                           \
+                 "vl8re8.v v8, (%[reg])\n\t"                            \
+                 "vsetvli t0, %[vl], e" SEW ", m" LMUL ", tu, mu\n\t"   \
+                 "csrw vstart, %[vstart]\n\t"                           \
+                 INSN " v8, (%[base]), v0.t\n\t"                        \
+                 "vs8r.v v8, (%[reg])"                                  \
+                 : : [mask] "r" (mask), [reg] "r" (reg), [vl] "r" (vl), \
+                     [vstart] "r" (vstart), [base] "r" (base)           \
+                 : "t0", "v0", "v8", "v9", "v10", "v11", "v12", "v13",  \
+                   "v14", "v15", "memory")
+
+#define LDST_SEW(SEW)                                                   \
+    do {                                                                \
+        if (nf == 1) {                                                  \
+            if (is_load) {                                              \
+                LDST("vle" SEW ".v", SEW, "8");                         \
+            } else {                                                    \
+                LDST("vse" SEW ".v", SEW, "8");                         \
+            }                                                           \
+        } else {                                                        \
+            if (is_load) {                                              \
+                LDST("vlseg2e" SEW ".v", SEW, "4");                     \
+            } else {                                                    \
+                LDST("vsseg2e" SEW ".v", SEW, "4");                     \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
+static void do_ldst(int is_load, uint8_t *base, int esz, int nf,
+                    unsigned long vl, unsigned long vstart)
+{
+    switch (esz) {
+    case 1:
+        LDST_SEW("8");
+        break;
+    case 2:
+        LDST_SEW("16");
+        break;
+    case 4:
+        LDST_SEW("32");
+        break;
+    case 8:
+        LDST_SEW("64");
+        break;
+    }
+}
+
+static int check(int is_load, int esz, int nf, int vl, int vstart,
+                 int pos, int pattern)
+{
+    const char *what = NULL;
+    int offset = 0;
+
+    for (int i = 0; i < REG_BYTES; i++) {
+        if (reg[i] != expect_reg[i]) {
+            what = "register byte";
+            offset = i;
+            break;
+        }
+    }
+    for (int i = 0; !what && i < 2 * page_size; i++) {
+        if (mem[i] != expect_mem[i]) {
+            what = "memory byte";
+            offset = i;
+        }
+    }
+    if (what) {
+        fprintf(stderr, "%s: esz %d, nf %d, vl %d, vstart %d, pos %d, "
+                "mask %d: wrong %s %d\n", is_load ? "load" : "store",
+                esz, nf, vl, vstart, pos, pattern, what, offset);
+        return 1;
+    }
+    return 0;
+}
+
+static int test(int is_load, int esz, int nf)
+{
+    int vlmax = 8 / nf * vlenb / esz;
+    int msize = nf * esz;
+    /* full and partial vl, and vstart at the start, one in and halfway */
+    const int vls[][2] = {
+        { vlmax, 0 }, { vlmax - 1, 0 }, { vlmax, 1 }, { vlmax - 1, vlmax / 2 },
+    };
+    int err = 0;
+
+    for (int v = 0; v < sizeof(vls) / sizeof(vls[0]); v++) {
+        int vl = vls[v][0], vstart = vls[v][1];
+
+        for (int pos = 0; pos < NB_POS; pos++) {
+            uint8_t *base = get_base(pos, msize, vl, vstart);
+
+            for (int pattern = 0; pattern < NB_MASK; pattern++) {
+                fill_mask(pattern, vlmax);
+                if (pos == POS_GUARD) {
+                    clear_guard_mask(base, msize, vl);
+                }
+
+                fill();
+                ref_ldst(is_load, base, esz, nf, vl, vstart);
+                do_ldst(is_load, base, esz, nf, vl, vstart);
+                err |= check(is_load, esz, nf, vl, vstart, pos, pattern);
+            }
+        }
+    }
+    return err;
+}
+
+int main(void)
+{
+    uint8_t *map;
+    int err = 0;
+
+    asm("csrr %0, vlenb" : "=r" (vlenb));
+    if (vlenb > MAX_VLENB) {
+        printf("SKIP: vlenb %lu is too large\n", vlenb);
+        return 0;
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+    map = mmap(NULL, 4 * page_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    mprotect(map, page_size, PROT_NONE);
+    mprotect(map + 3 * page_size, page_size, PROT_NONE);
+    mem = map + page_size;
+
+    expect_mem = mmap(NULL, 2 * page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (expect_mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    for (int esz = 1; esz <= 8; esz *= 2) {
+        for (int nf = 1; nf <= 2; nf++) {
+            err |= test(1, esz, nf);
+            err |= test(0, esz, nf);
+        }
+    }
+    return err;
+}
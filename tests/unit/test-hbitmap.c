@@ -1042,6 +1042,79 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+/*
+ * Merge, scan and deserialize a bitmap with all implementations of the bulk
+ * operations that the host supports.
+ */
+static void test_hbitmap_accel(TestHBitmapData *data, const void *unused)
+{
+    const uint64_t size = L3 + 5;
+    const uint64_t ranges[][2] = {
+        { 0, 1 },
+        { L1 - 1, 2 },
+        { L2 - 3, L1 * 5 },
+        { L2 + 7, 3 },
+        { L2 * 3, L2 * 2 + 9 },
+        { L2 * 4, L1 },
+        { L3 - L1 * 9, L1 * 9 + 5 },
+    };
+    uint64_t start, end;
+    size_t buf_size, i;
+    uint8_t *buf;
+    HBitmap *b;
+
+    do {
+        hbitmap_test_init(data, size, 0);
+        b = hbitmap_alloc(size, 0);
+
+        /* Split the ranges between the two bitmaps */
+        for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+            start = ranges[i][0];
+            if (i & 1) {
+                hbitmap_set(b, start, ranges[i][1]);
+                bitmap_set(data->bits, start, ranges[i][1]);
+            } else {
+                hbitmap_test_set(data, start, ranges[i][1]);
+            }
+        }
+
+        hbitmap_merge(data->hb, b, data->hb);
+        hbitmap_test_check(data, 0);
+
+        for (i = 0; i < ARRAY_SIZE(ranges); i++) {
+            start = ranges[i][0];
+            end = start + ranges[i][1];
+            if (start > 0) {
+                test_hbitmap_next_x_check(data, start - 1);
+            }
+            test_hbitmap_next_x_check(data, start);
+            test_hbitmap_next_x_check(data, end - 1);
+            if (end < size) {
+                test_hbitmap_next_x_check(data, end);
+            }
+        }
+
+        buf_size = hbitmap_serialization_size(data->hb, 0, size);
+        buf = g_malloc(buf_size);
+        hbitmap_serialize_part(data->hb, buf, 0, size);
+        hbitmap_reset_all(data->hb);
+        hbitmap_deserialize_part(data->hb, buf, 0, size, true);
+        hbitmap_test_check(data, 0);
+        g_free(buf);
+
+        /* This also sets the bits of the last word past the end */
+        hbitmap_deserialize_ones(data->hb, 0, size, true);
+        bitmap_set(data->bits, 0, size);
+        hbitmap_test_check(data, 0);
+
+        hbitmap_merge(data->hb, b, data->hb);
+        hbitmap_test_check(data, 0);
+
+        hbitmap_free(b);
+        hbitmap_test_teardown(data, NULL);
+    } while (test_hbitmap_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1186,9 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    /* Must come last, it switches to the slowest implementation at the end */
+    hbitmap_test_add("/hbitmap/accel", test_hbitmap_accel);
+
     g_test_run();
 
     return 0;
@@ -22,6 +22,8 @@
 #include "qemu/module.h"
 #include "block/throttle-groups.h"
 #include "system/block-backend.h"
+#include "system/cpu-timers.h"
+#include "system/qtest.h"
 
 static AioContext     *ctx;
 static LeakyBucket    bkt;
@@ -30,6 +32,14 @@ static ThrottleGroupMember tgm;
 static ThrottleState  ts;
 static ThrottleTimers *tt;
 
+/* This is the clock for QEMU_CLOCK_VIRTUAL */
+static int64_t my_clock_value;
+
+int64_t cpu_get_clock(void)
+{
+    return my_clock_value;
+}
+
 /* useful function */
 static bool double_cmp(double x, double y)
 {
@@ -734,6 +744,51 @@ static void test_accounting(void)
                                 (64.0 / 13)));
 }
 
+static void test_credit(void)
+{
+    uint64_t bytes, units;
+    int64_t now;
+
+    throttle_config_init(&cfg);
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 10000;
+    cfg.buckets[THROTTLE_BPS_READ].avg = 1000000;
+
+    throttle_init(&ts);
+    throttle_config(&ts, QEMU_CLOCK_VIRTUAL, &cfg);
+    now = ts.previous_leak;
+
+    /* the credit covers the given period at the average rate */
+    throttle_compute_credit(&ts, THROTTLE_READ, now, SCALE_MS, &bytes, &units);
+    g_assert_cmpuint(bytes, ==, 1000);
+    g_assert_cmpuint(units, ==, 10);
+
+    /* writes have no bps limit */
+    throttle_compute_credit(&ts, THROTTLE_WRITE, now, SCALE_MS, &bytes, &units);
+    g_assert_cmpuint(bytes, ==, UINT64_MAX);
+    g_assert_cmpuint(units, ==, 10);
+
+    /* only the buckets with a limit are filled */
+    throttle_account_credit(&ts, THROTTLE_READ, 1000, 10);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 10));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_READ].level, 1000));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_READ].level, 0));
+
+    /* the credit never exceeds what can be done without waiting */
+    ts.cfg.buckets[THROTTLE_OPS_TOTAL].level = 995;
+    throttle_compute_credit(&ts, THROTTLE_READ, now, SCALE_MS, &bytes, &units);
+    g_assert_cmpuint(bytes, ==, 1000);
+    g_assert_cmpuint(units, ==, 5);
+
+    ts.cfg.buckets[THROTTLE_OPS_TOTAL].level = 1000;
+    throttle_compute_credit(&ts, THROTTLE_READ, now, SCALE_MS, &bytes, &units);
+    g_assert_cmpuint(units, ==, 0);
+
+    /* returning credit empties the buckets at most */
+    throttle_return_credit(&ts, THROTTLE_READ, 2000, 2000);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 0));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_READ].level, 0));
+}
+
 static void test_groups(void)
 {
     ThrottleConfig cfg1, cfg2;
@@ -801,6 +856,126 @@ static void test_groups(void)
     g_assert(tgm3->throttle_state == NULL);
 }
 
+typedef struct {
+    ThrottleGroupMember *tgm;
+    bool done;
+} CreditRequest;
+
+static void coroutine_fn credit_request_entry(void *opaque)
+{
+    CreditRequest *req = opaque;
+
+    throttle_group_co_io_limits_intercept(req->tgm, 512, THROTTLE_READ);
+    req->done = true;
+}
+
+/* Start a read request, return whether it went through without waiting */
+static bool credit_request(CreditRequest *req, ThrottleGroupMember *tgm)
+{
+    Coroutine *co = qemu_coroutine_create(credit_request_entry, req);
+
+    req->tgm = tgm;
+    req->done = false;
+    qemu_coroutine_enter(co);
+    return req->done;
+}
+
+/* Let the throttled request @req complete */
+static void credit_request_wait(CreditRequest *req)
+{
+    my_clock_value += SCALE_MS;
+    while (!req->done) {
+        aio_poll(ctx, true);
+    }
+}
+
+static double credit_ops_level(ThrottleGroupMember *tgm)
+{
+    ThrottleConfig cfg_level;
+
+    throttle_group_get_config(tgm, &cfg_level);
+    return cfg_level.buckets[THROTTLE_OPS_TOTAL].level;
+}
+
+static void test_groups_credit(void)
+{
+    ThrottleConfig cfg1;
+    BlockBackend *blk1, *blk2;
+    ThrottleGroupMember *tgm1, *tgm2;
+    CreditRequest req;
+    unsigned started;
+    int i;
+
+    /* The clock does not move unless the test advances it */
+    my_clock_value = NANOSECONDS_PER_SECOND;
+    qemu_clock_enable(QEMU_CLOCK_VIRTUAL, true);
+    qtest_allowed = true;
+
+    blk1 = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+    blk2 = blk_new(qemu_get_aio_context(), 0, BLK_PERM_ALL);
+    tgm1 = &blk_get_public(blk1)->throttle_group_member;
+    tgm2 = &blk_get_public(blk2)->throttle_group_member;
+    throttle_group_register_tgm(tgm1, "credit", blk_get_aio_context(blk1));
+    throttle_group_register_tgm(tgm2, "credit", blk_get_aio_context(blk2));
+    qtest_allowed = false;
+
+    /*
+     * 1000 requests can go through without waiting, and the credit of a
+     * member covers 1 ms, i.e. 10 requests.
+     */
+    throttle_config_init(&cfg1);
+    cfg1.buckets[THROTTLE_OPS_TOTAL].avg = 10000;
+    throttle_group_config(tgm1, &cfg1);
+
+    /* The first request takes the lock and gives credit to the member */
+    g_assert(credit_request(&req, tgm2));
+    g_assert_cmpuint(tgm2->credit_units[THROTTLE_READ], ==, 10);
+    g_assert(double_cmp(credit_ops_level(tgm2), 11));
+
+    /*
+     * The next one consumes the credit without going through
+     * throttle_group_co_io_limits_intercept() under the lock, which
+     * would account it again and hand out new credit.
+     */
+    g_assert(credit_request(&req, tgm2));
+    g_assert_cmpuint(tgm2->credit_units[THROTTLE_READ], ==, 9);
+    g_assert(double_cmp(credit_ops_level(tgm2), 11));
+
+    /*
+     * tgm1 uses up the budget of the group, and needs the credit that
+     * tgm2 holds in order to do so.  That credit is returned when the
+     * group reaches its limit, and the limit still holds for both
+     * members together.
+     */
+    started = 2;
+    for (i = 0; i < 2000 && credit_request(&req, tgm1); i++) {
+        started++;
+    }
+    g_assert_cmpuint(tgm2->credit_units[THROTTLE_READ], ==, 0);
+    g_assert_cmpuint(started, ==, 1001);
+    credit_request_wait(&req);
+
+    /*
+     * Starting again with empty buckets and no credit, the limit also holds
+     * when both members issue requests in turn.
+     */
+    throttle_group_config(tgm1, &cfg1);
+    started = 0;
+    for (i = 0; i < 2000 && credit_request(&req, i & 1 ? tgm1 : tgm2); i++) {
+        started++;
+    }
+    g_assert_cmpuint(tgm1->credit_units[THROTTLE_READ], ==, 0);
+    g_assert_cmpuint(tgm2->credit_units[THROTTLE_READ], ==, 0);
+    g_assert_cmpuint(started, ==, 1001);
+    credit_request_wait(&req);
+
+    throttle_group_unregister_tgm(tgm1);
+    throttle_group_unregister_tgm(tgm2);
+    blk_unref(blk1);
+    blk_unref(blk2);
+    qemu_clock_enable(QEMU_CLOCK_VIRTUAL, false);
+}
+
 int main(int argc, char **argv)
 {
     qemu_init_main_loop(&error_fatal);
@@ -829,7 +1004,9 @@ int main(int argc, char **argv)
                     test_iops_size_is_missing_limit);
     g_test_add_func("/throttle/config_functions",   test_config_functions);
     g_test_add_func("/throttle/accounting",         test_accounting);
+    g_test_add_func("/throttle/credit",             test_credit);
     g_test_add_func("/throttle/groups",             test_groups);
+    g_test_add_func("/throttle/groups/credit",      test_groups_credit);
     return g_test_run();
 }
 
@@ -469,7 +469,7 @@ LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
         return ctx->linux_io_uring;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
+    ctx->linux_io_uring = luring_init(ctx->io_uring_sqpoll_idle, errp);
     if (!ctx->linux_io_uring) {
         return NULL;
     }
@@ -614,6 +614,7 @@ AioContext *aio_context_new(Error **errp)
     ctx->poll_shrink = 0;
 
     ctx->aio_max_batch = 0;
+    ctx->io_uring_sqpoll_idle = 0;
 
     ctx->thread_pool_min = 0;
     ctx->thread_pool_max = THREAD_POOL_MAX_THREADS_DEFAULT;
@@ -758,3 +759,14 @@ void aio_context_set_thread_pool_params(AioContext *ctx, int64_t min,
         thread_pool_update_params(ctx->thread_pool, ctx);
     }
 }
+
+void aio_context_set_io_uring_params(AioContext *ctx, int64_t sqpoll_idle,
+                                     Error **errp)
+{
+    if (sqpoll_idle < 0 || sqpoll_idle > UINT32_MAX) {
+        error_setg(errp, "bad io-uring-sqpoll-idle value");
+        return;
+    }
+
+    ctx->io_uring_sqpoll_idle = sqpoll_idle;
+}
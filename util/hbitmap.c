@@ -14,6 +14,7 @@
 #include "qemu/host-utils.h"
 #include "trace.h"
 #include "crypto/hash.h"
+#include "host/cpuinfo.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
  * array of unsigned longs, but HBitmap is also optimized to provide fast
@@ -101,6 +102,84 @@ struct HBitmap {
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+/*
+ * Operations on whole arrays of words, used when a bitmap is scanned or
+ * merged in bulk.  Hosts can provide vectorized versions of these, which
+ * are picked at startup depending on the CPU.
+ */
+typedef struct HBitmapAccel {
+    /* Return the number of set bits in p[0..n-1].  */
+    uint64_t (*count)(const unsigned long *p, size_t n);
+
+    /*
+     * Set dst[i] = a[i] | b[i] for i < n and return the number of set bits
+     * in the result.  @dst may be the same array as @a or @b.
+     */
+    uint64_t (*merge)(unsigned long *dst, const unsigned long *a,
+                      const unsigned long *b, size_t n);
+
+    /*
+     * Return the number of leading words of p[0..n-1] that are equal to
+     * @fill, which must be either 0 or ~0UL.
+     */
+    size_t (*skip)(const unsigned long *p, size_t n, unsigned long fill);
+} HBitmapAccel;
+
+static uint64_t hb_count_int(const unsigned long *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(p[i]);
+    }
+    return count;
+}
+
+static uint64_t hb_merge_int(unsigned long *dst, const unsigned long *a,
+                             const unsigned long *b, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] | b[i];
+        count += ctpopl(dst[i]);
+    }
+    return count;
+}
+
+static size_t hb_skip_int(const unsigned long *p, size_t n,
+                          unsigned long fill)
+{
+    size_t i = 0;
+
+    while (i < n && p[i] == fill) {
+        i++;
+    }
+    return i;
+}
+
+#include "host/hbitmap.c.inc"
+
+static const HBitmapAccel *hb_accel;
+static unsigned accel_index;
+
+bool test_hbitmap_next_accel(void)
+{
+    if (accel_index != 0) {
+        hb_accel = &accel_table[--accel_index];
+        return true;
+    }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    hb_accel = &accel_table[accel_index];
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -245,9 +324,8 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        pos++;
+        pos += hb_accel->skip(&last_lev[pos], sz - pos, (unsigned long)-1);
 
         if (pos >= sz) {
             return -1;
@@ -408,6 +486,32 @@ static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
     return count;
 }
 
+/*
+ * Count the set bits in the last word of the bottom level that are past the
+ * end of the bitmap.  Deserializing ones can set them, and they are included
+ * when the bottom level is processed as a whole.
+ */
+static uint64_t hb_count_past_end(const HBitmap *hb)
+{
+    unsigned bit = hb->size & (BITS_PER_LONG - 1);
+    unsigned long last;
+
+    if (bit == 0) {
+        return 0;
+    }
+
+    last = hb->levels[HBITMAP_LEVELS - 1][hb->size >> BITS_PER_LEVEL];
+    return ctpopl(last & ~((1UL << bit) - 1));
+}
+
+/* Count the number of set bits in the whole bitmap */
+static uint64_t hb_count_all(const HBitmap *hb)
+{
+    return hb_accel->count(hb->levels[HBITMAP_LEVELS - 1],
+                           hb->sizes[HBITMAP_LEVELS - 1]) -
+           hb_count_past_end(hb);
+}
+
 /* Setting starts at the last layer and propagates up if an element
  * changes.
  */
@@ -680,8 +784,14 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
         return;
     }
     serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
 
+    /* The serialized format matches the in-memory one on little endian */
+    if (!HOST_BIG_ENDIAN) {
+        memcpy(buf, cur, el_count * sizeof(unsigned long));
+        return;
+    }
+
+    end = cur + el_count;
     while (cur != end) {
         unsigned long el =
             (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
@@ -703,8 +813,13 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
         return;
     }
     serialization_chunk(hb, start, count, &cur, &el_count);
-    end = cur + el_count;
 
+    if (!HOST_BIG_ENDIAN) {
+        memcpy(cur, buf, el_count * sizeof(unsigned long));
+        goto out;
+    }
+
+    end = cur + el_count;
     while (cur != end) {
         memcpy(cur, buf, sizeof(*cur));
 
@@ -717,6 +832,8 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
         buf += sizeof(unsigned long);
         cur++;
     }
+
+out:
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -759,6 +876,7 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
     int64_t i, size, prev_size;
+    unsigned long *next;
     int lev;
 
     /* restore levels starting from penultimate to zero level, assuming
@@ -769,16 +887,18 @@ void hbitmap_deserialize_finish(HBitmap *bitmap)
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
 
-        for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
-                bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
-                    1UL << (i & (BITS_PER_LONG - 1));
-            }
+        next = bitmap->levels[lev + 1];
+        i = hb_accel->skip(next, prev_size, 0);
+        while (i < prev_size) {
+            bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
+                1UL << (i & (BITS_PER_LONG - 1));
+            i++;
+            i += hb_accel->skip(&next[i], prev_size - i, 0);
         }
     }
 
     bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
-    bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
+    bitmap->count = hb_count_all(bitmap);
 }
 
 void hbitmap_free(HBitmap *hb)
@@ -901,7 +1021,7 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
-    uint64_t j;
+    uint64_t count;
 
     assert(a->orig_size == result->orig_size);
     assert(b->orig_size == result->orig_size);
@@ -935,13 +1055,13 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
      */
     assert(a->size == b->size);
     for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
+        count = hb_accel->merge(result->levels[i], a->levels[i], b->levels[i],
+                                a->sizes[i]);
+        if (i == HBITMAP_LEVELS - 1) {
+            /* Recompute the dirty count */
+            result->count = count - hb_count_past_end(result);
         }
     }
-
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
@@ -87,6 +87,29 @@ static int64_t throttle_do_compute_wait(double limit, double extra)
     return wait;
 }
 
+/* Compute the capacity of a leaky bucket
+ *
+ * @bkt:               the leaky bucket we operate on
+ * @bucket_size:       I/O before throttling to bkt->avg
+ * @burst_bucket_size: I/O before throttling to bkt->max
+ */
+static void throttle_bucket_sizes(LeakyBucket *bkt, double *bucket_size,
+                                  double *burst_bucket_size)
+{
+    if (!bkt->max) {
+        /* If bkt->max is 0 we still want to allow short bursts of I/O
+         * from the guest, otherwise every other request will be throttled
+         * and performance will suffer considerably. */
+        *bucket_size = (double) bkt->avg / 10;
+        *burst_bucket_size = 0;
+    } else {
+        /* If we have a burst limit then we have to wait until all I/O
+         * at burst rate has finished before throttling to bkt->avg */
+        *bucket_size = bkt->max * bkt->burst_length;
+        *burst_bucket_size = (double) bkt->max / 10;
+    }
+}
+
 /* This function compute the wait time in ns that a leaky bucket should trigger
  *
  * @bkt: the leaky bucket we operate on
@@ -102,18 +125,7 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
         return 0;
     }
 
-    if (!bkt->max) {
-        /* If bkt->max is 0 we still want to allow short bursts of I/O
-         * from the guest, otherwise every other request will be throttled
-         * and performance will suffer considerably. */
-        bucket_size = (double) bkt->avg / 10;
-        burst_bucket_size = 0;
-    } else {
-        /* If we have a burst limit then we have to wait until all I/O
-         * at burst rate has finished before throttling to bkt->avg */
-        bucket_size = bkt->max * bkt->burst_length;
-        burst_bucket_size = (double) bkt->max / 10;
-    }
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
 
     /* If the main bucket is full then we have to wait */
     extra = bkt->level - bucket_size;
@@ -134,6 +146,16 @@ int64_t throttle_compute_wait(LeakyBucket *bkt)
     return 0;
 }
 
+/* The buckets that count bytes and units for each direction */
+static const BucketType bucket_types_size[THROTTLE_MAX][2] = {
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
+    { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
+};
+static const BucketType bucket_types_units[THROTTLE_MAX][2] = {
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
+    { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
+};
+
 /* This function compute the time that must be waited while this IO
  *
  * @direction:  throttle direction
@@ -432,6 +454,24 @@ void throttle_get_config(ThrottleState *ts, ThrottleConfig *cfg)
 bool throttle_schedule_timer(ThrottleState *ts,
                              ThrottleTimers *tt,
                              ThrottleDirection direction)
+{
+    return throttle_schedule_timer_slack(ts, tt, direction, 0);
+}
+
+/* Same as throttle_schedule_timer(), but let the timer fire @slack_ns
+ * after the first request could go through.  Since the buckets keep
+ * leaking in the meantime, this lets a batch of requests go through at
+ * once without changing the average rate.
+ *
+ * @tt:        the timers structure
+ * @direction: throttle direction
+ * @slack_ns:  additional delay for the timer
+ * @ret:       true if the timer has been scheduled else false
+ */
+bool throttle_schedule_timer_slack(ThrottleState *ts,
+                                   ThrottleTimers *tt,
+                                   ThrottleDirection direction,
+                                   int64_t slack_ns)
 {
     int64_t now = qemu_clock_get_ns(tt->clock_type);
     int64_t next_timestamp;
@@ -458,7 +498,7 @@ bool throttle_schedule_timer(ThrottleState *ts,
     }
 
     /* request throttled and timer not pending -> arm timer */
-    timer_mod(timer, next_timestamp);
+    timer_mod(timer, next_timestamp + slack_ns);
     return true;
 }
 
@@ -470,14 +510,6 @@ bool throttle_schedule_timer(ThrottleState *ts,
 void throttle_account(ThrottleState *ts, ThrottleDirection direction,
                       uint64_t size)
 {
-    static const BucketType bucket_types_size[THROTTLE_MAX][2] = {
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_READ },
-        { THROTTLE_BPS_TOTAL, THROTTLE_BPS_WRITE }
-    };
-    static const BucketType bucket_types_units[THROTTLE_MAX][2] = {
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_READ },
-        { THROTTLE_OPS_TOTAL, THROTTLE_OPS_WRITE }
-    };
     double units = 1.0;
     unsigned i;
 
@@ -504,6 +536,128 @@ void throttle_account(ThrottleState *ts, ThrottleDirection direction,
     }
 }
 
+/* Compute how much of a leaky bucket can still be filled before a request
+ * has to wait, but no more than what leaks from it in @period_ns
+ *
+ * @bkt:       the leaky bucket we operate on
+ * @period_ns: the period of time that the credit should cover
+ * @ret:       the credit in units of the bucket, UINT64_MAX if unlimited
+ */
+static uint64_t throttle_bucket_credit(LeakyBucket *bkt, int64_t period_ns)
+{
+    double bucket_size, burst_bucket_size;
+    double credit;
+
+    if (!bkt->avg) {
+        return UINT64_MAX;
+    }
+
+    throttle_bucket_sizes(bkt, &bucket_size, &burst_bucket_size);
+
+    credit = (bkt->avg * (double) period_ns) / NANOSECONDS_PER_SECOND;
+    credit = MIN(credit, bucket_size - bkt->level);
+    if (bkt->burst_length > 1) {
+        credit = MIN(credit, burst_bucket_size - bkt->burst_level);
+    }
+
+    return credit > 0 ? credit : 0;
+}
+
+/* Compute the credit that can be handed out for future I/O in one
+ * direction, i.e. the I/O that can be accounted with
+ * throttle_account_credit() without making any request wait.  It is limited
+ * to what the configured average rates allow in @period_ns, so that it never
+ * lets the I/O rate exceed the limits by more than that.
+ *
+ * @direction: throttle direction
+ * @now:       the current clock timestamp
+ * @period_ns: the period of time that the credit should cover
+ * @bytes:     the resulting credit in bytes, UINT64_MAX if unlimited
+ * @units:     the resulting credit in units, UINT64_MAX if unlimited
+ */
+void throttle_compute_credit(ThrottleState *ts, ThrottleDirection direction,
+                             int64_t now, int64_t period_ns,
+                             uint64_t *bytes, uint64_t *units)
+{
+    unsigned i;
+
+    assert(direction < THROTTLE_MAX);
+
+    /* leak proportionally to the time elapsed */
+    throttle_do_leak(ts, now);
+
+    *bytes = UINT64_MAX;
+    *units = UINT64_MAX;
+    for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
+        LeakyBucket *bkt;
+
+        bkt = &ts->cfg.buckets[bucket_types_size[direction][i]];
+        *bytes = MIN(*bytes, throttle_bucket_credit(bkt, period_ns));
+
+        bkt = &ts->cfg.buckets[bucket_types_units[direction][i]];
+        *units = MIN(*units, throttle_bucket_credit(bkt, period_ns));
+    }
+}
+
+/* Add @delta to the level of a leaky bucket that has a limit
+ *
+ * @bkt:   the leaky bucket we operate on
+ * @delta: the number of units to add, can be negative
+ */
+static void throttle_fill_bucket(LeakyBucket *bkt, double delta)
+{
+    if (!bkt->avg) {
+        return;
+    }
+
+    bkt->level = MAX(bkt->level + delta, 0);
+    if (bkt->burst_length > 1) {
+        bkt->burst_level = MAX(bkt->burst_level + delta, 0);
+    }
+}
+
+/* Account credit as computed by throttle_compute_credit() in advance.
+ * Unlike throttle_account(), @units is the number of units rather than a
+ * request size, and buckets without a limit are left alone.
+ *
+ * @direction: throttle direction
+ * @bytes:     the number of bytes to account
+ * @units:     the number of units to account
+ */
+void throttle_account_credit(ThrottleState *ts, ThrottleDirection direction,
+                             uint64_t bytes, uint64_t units)
+{
+    unsigned i;
+
+    assert(direction < THROTTLE_MAX);
+    for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
+        throttle_fill_bucket(&ts->cfg.buckets[bucket_types_size[direction][i]],
+                             bytes);
+        throttle_fill_bucket(&ts->cfg.buckets[bucket_types_units[direction][i]],
+                             units);
+    }
+}
+
+/* Undo the accounting of credit that has not been used
+ *
+ * @direction: throttle direction
+ * @bytes:     the number of unused bytes
+ * @units:     the number of unused units
+ */
+void throttle_return_credit(ThrottleState *ts, ThrottleDirection direction,
+                            uint64_t bytes, uint64_t units)
+{
+    unsigned i;
+
+    assert(direction < THROTTLE_MAX);
+    for (i = 0; i < ARRAY_SIZE(bucket_types_size[THROTTLE_READ]); i++) {
+        throttle_fill_bucket(&ts->cfg.buckets[bucket_types_size[direction][i]],
+                             -(double) bytes);
+        throttle_fill_bucket(&ts->cfg.buckets[bucket_types_units[direction][i]],
+                             -(double) units);
+    }
+}
+
 /* return a ThrottleConfig based on the options in a ThrottleLimits
  *
  * @arg:    the ThrottleLimits object to read from
@@ -27,7 +27,19 @@
  * protocol messages over the UNIX domain socket.
  *
  * When virtqueues are set up libvhost-user calls set_watch() to monitor kick
- * fds. These fds are also handled in the VuServer->ctx AioContext.
+ * fds. These fds are also handled in the VuServer->ctx AioContext, unless
+ * the server was started with a list of virtqueue AioContexts. In that case
+ * the kick fd of virtqueue n is handled in VuServer->vq_ctxs[n % num_vq_ctxs]
+ * and virtqueues are processed in parallel by multiple threads.
+ *
+ * libvhost-user is not thread-safe with respect to its control path: a
+ * vhost-user message may remap guest memory or change virtqueue state that
+ * is in use by the kick handlers. Therefore, with multiple virtqueue
+ * AioContexts, vu_client_trip() pauses all virtqueues after receiving a
+ * message and resumes them once the message has been processed. Pausing
+ * removes each kick fd handler from a BH in its own AioContext, so that it
+ * is known not to be running anymore, and then waits for in-flight requests
+ * to complete.
  *
  * Both vu_client_trip() and kick fd monitoring can be stopped by shutting down
  * the socket connection. Shutting down the socket connection causes
@@ -89,14 +101,18 @@ static void panic_cb(VuDev *vu_dev, const char *buf)
 
 void vhost_user_server_inc_in_flight(VuServer *server)
 {
-    assert(!server->wait_idle);
+    assert(!qatomic_read(&server->wait_idle));
     qatomic_inc(&server->in_flight);
 }
 
 void vhost_user_server_dec_in_flight(VuServer *server)
 {
+    /*
+     * Requests may complete in any virtqueue AioContext, so whoever clears
+     * wait_idle owns the wakeup of vu_wait_idle().
+     */
     if (qatomic_fetch_dec(&server->in_flight) == 1) {
-        if (server->wait_idle) {
+        if (qatomic_xchg(&server->wait_idle, false)) {
             aio_co_wake(server->co_trip);
         }
     }
@@ -107,6 +123,100 @@ bool vhost_user_server_has_in_flight(VuServer *server)
     return qatomic_load_acquire(&server->in_flight) > 0;
 }
 
+/* Wait for in-flight requests to complete. Called from server->co_trip. */
+static void coroutine_fn vu_wait_idle(VuServer *server)
+{
+    qatomic_set(&server->wait_idle, true);
+    smp_mb(); /* pairs with qatomic_fetch_dec() in dec_in_flight() */
+
+    /*
+     * If a request completed concurrently and already took wait_idle, the
+     * wakeup is on its way and must be consumed by yielding.
+     */
+    if (vhost_user_server_has_in_flight(server) ||
+        !qatomic_xchg(&server->wait_idle, false)) {
+        qemu_coroutine_yield();
+    }
+    assert(!vhost_user_server_has_in_flight(server));
+}
+
+static AioContext *vu_fd_watch_ctx(VuServer *server, VuFdWatch *vu_fd_watch)
+{
+    if (server->num_vq_ctxs) {
+        uintptr_t qidx = (uintptr_t)vu_fd_watch->pvt;
+
+        return server->vq_ctxs[qidx % server->num_vq_ctxs];
+    }
+    return server->ctx;
+}
+
+static void kick_handler(void *opaque);
+
+static void vu_fd_watch_pause_bh(void *opaque)
+{
+    VuFdWatch *vu_fd_watch = opaque;
+    VuServer *server = container_of(vu_fd_watch->vu_dev, VuServer, vu_dev);
+
+    aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), vu_fd_watch->fd,
+                       NULL, NULL, NULL, NULL, NULL);
+
+    if (qatomic_fetch_dec(&server->vqs_pausing) == 1) {
+        aio_co_wake(server->co_trip);
+    }
+}
+
+/*
+ * Stop processing virtqueues in their AioContexts and wait until no kick
+ * handler or request is running anymore. Only needed when virtqueues are
+ * processed outside server->ctx. Called from server->co_trip.
+ */
+static void coroutine_fn vu_pause_vqs(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+    unsigned int n = 0;
+
+    if (!server->num_vq_ctxs || server->vqs_paused) {
+        return;
+    }
+    server->vqs_paused = true;
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        n++;
+    }
+
+    if (n) {
+        /*
+         * The last BH wakes us up. Wakeups from other threads are deferred
+         * until we have yielded, and a BH in our own AioContext cannot run
+         * before that anyway.
+         */
+        qatomic_set(&server->vqs_pausing, n);
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            aio_bh_schedule_oneshot(vu_fd_watch_ctx(server, vu_fd_watch),
+                                    vu_fd_watch_pause_bh, vu_fd_watch);
+        }
+        qemu_coroutine_yield();
+    }
+
+    vu_wait_idle(server);
+}
+
+static void vu_resume_vqs(VuServer *server)
+{
+    VuFdWatch *vu_fd_watch;
+
+    if (!server->vqs_paused) {
+        return;
+    }
+    server->vqs_paused = false;
+
+    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                           vu_fd_watch->fd, kick_handler, NULL, NULL, NULL,
+                           vu_fd_watch);
+    }
+}
+
 static bool coroutine_fn
 vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
 {
@@ -199,6 +309,15 @@ vu_message_read(VuDev *vu_dev, int conn_fd, VhostUserMsg *vmsg)
         }
     }
 
+    /*
+     * Processing the message may change state that the virtqueue threads
+     * use. Replies to backend requests are read from other coroutines and
+     * must not pause anything.
+     */
+    if (qemu_coroutine_self() == server->co_trip) {
+        vu_pause_vqs(server);
+    }
+
     return true;
 
 fail:
@@ -222,15 +341,14 @@ static coroutine_fn void vu_client_trip(void *opaque)
         if (!vu_dispatch(vu_dev) && server->ctx) {
             break;
         }
+        if (!server->quiescing) {
+            vu_resume_vqs(server);
+        }
     }
 
-    if (vhost_user_server_has_in_flight(server)) {
-        /* Wait for requests to complete before we can unmap the memory */
-        server->wait_idle = true;
-        qemu_coroutine_yield();
-        server->wait_idle = false;
-    }
-    assert(!vhost_user_server_has_in_flight(server));
+    /* Wait for requests to complete before we can unmap the memory */
+    vu_pause_vqs(server);
+    vu_wait_idle(server);
 
     vu_deinit(vu_dev);
 
@@ -303,11 +421,15 @@ set_watch(VuDev *vu_dev, int fd, int vu_evt,
 
         vu_fd_watch->fd = fd;
         vu_fd_watch->cb = cb;
-        qemu_socket_set_nonblock(fd);
-        aio_set_fd_handler(server->ctx, fd, kick_handler,
-                           NULL, NULL, NULL, vu_fd_watch);
         vu_fd_watch->vu_dev = vu_dev;
         vu_fd_watch->pvt = pvt;
+        qemu_socket_set_nonblock(fd);
+
+        /* vu_resume_vqs() installs the handler */
+        if (!server->vqs_paused) {
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd,
+                               kick_handler, NULL, NULL, NULL, vu_fd_watch);
+        }
     }
 }
 
@@ -325,7 +447,10 @@ static void remove_watch(VuDev *vu_dev, int fd)
     if (!vu_fd_watch) {
         return;
     }
-    aio_set_fd_handler(server->ctx, fd, NULL, NULL, NULL, NULL, NULL);
+    if (!server->vqs_paused) {
+        aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch), fd,
+                           NULL, NULL, NULL, NULL, NULL);
+    }
 
     QTAILQ_REMOVE(&server->vu_fd_watches, vu_fd_watch, next);
     g_free(vu_fd_watch);
@@ -385,8 +510,9 @@ void vhost_user_server_stop(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, NULL, NULL, NULL, NULL,
+                               vu_fd_watch);
         }
 
         qio_channel_shutdown(server->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
@@ -398,6 +524,10 @@ void vhost_user_server_stop(VuServer *server)
         qio_net_listener_disconnect(server->listener);
         object_unref(OBJECT(server->listener));
     }
+
+    g_free(server->vq_ctxs);
+    server->vq_ctxs = NULL;
+    server->num_vq_ctxs = 0;
 }
 
 /*
@@ -423,9 +553,20 @@ void vhost_user_server_attach_aio_context(VuServer *server, AioContext *ctx)
         return;
     }
 
-    QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-        aio_set_fd_handler(ctx, vu_fd_watch->fd, kick_handler, NULL,
-                           NULL, NULL, vu_fd_watch);
+    /*
+     * A client trip that terminated because of quiescing left the virtqueues
+     * paused after its last message.
+     */
+    if (!server->co_trip) {
+        server->vqs_paused = false;
+    }
+
+    if (!server->vqs_paused) {
+        QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, kick_handler, NULL,
+                               NULL, NULL, vu_fd_watch);
+        }
     }
 
     if (server->co_trip) {
@@ -456,8 +597,9 @@ void vhost_user_server_detach_aio_context(VuServer *server)
         VuFdWatch *vu_fd_watch;
 
         QTAILQ_FOREACH(vu_fd_watch, &server->vu_fd_watches, next) {
-            aio_set_fd_handler(server->ctx, vu_fd_watch->fd,
-                               NULL, NULL, NULL, NULL, vu_fd_watch);
+            aio_set_fd_handler(vu_fd_watch_ctx(server, vu_fd_watch),
+                               vu_fd_watch->fd, NULL, NULL, NULL, NULL,
+                               vu_fd_watch);
         }
     }
 
@@ -474,6 +616,8 @@ void vhost_user_server_detach_aio_context(VuServer *server)
 bool vhost_user_server_start(VuServer *server,
                              SocketAddress *socket_addr,
                              AioContext *ctx,
+                             AioContext *const *vq_ctxs,
+                             size_t num_vq_ctxs,
                              uint16_t max_queues,
                              const VuDevIface *vu_iface,
                              Error **errp)
@@ -503,6 +647,9 @@ bool vhost_user_server_start(VuServer *server,
         .vu_iface              = vu_iface,
         .max_queues            = max_queues,
         .ctx                   = ctx,
+        .vq_ctxs               = g_memdup2(vq_ctxs,
+                                           num_vq_ctxs * sizeof(vq_ctxs[0])),
+        .num_vq_ctxs           = num_vq_ctxs,
     };
 
     qio_net_listener_set_name(server->listener, "vhost-user-backend-listener");